@@ -0,0 +1,926 @@
+/*
+ * Throughput benchmarks for sqlite_protobuf and proto_table.
+ *
+ * We generate synthetic corpora of `bench.proto` messages, load each
+ * corpus in a proto table, and time the usual operations on it.  Each
+ * measurement is printed on stdout as one JSON object per line, e.g.,
+ *
+ *     {"corpus": "flat", "benchmark": "scan_extract", "rows": 100000,
+ *      "bytes": 5230214, "seconds": 0.081512, "rows_per_second": ...,
+ *      "bytes_per_second": ...}
+ *
+ * so results can be collected and compared across versions.  `bytes`
+ * is the size of the input to the benchmark: encoded messages, except
+ * for `of_json` and `of_text`.  `bulk_insert_rebuild_indexes` adds a
+ * second copy of the corpus to the indexed table, then checks that a
+ * load failing on its last row is rolled back with the indexes intact.
+ *
+ * The "varint" corpus compares the wire-format reader's varint kernel
+ * with protobuf's `CodedInputStream` on packed runs.
+ *
+ * The "scaling" corpus runs scans from 1 to `--threads` worker threads
+ * (the number of cores by default), each with its own connection, to
+ * catch contention and false sharing in the extension's per-thread
+ * caches and protobuf's generated pool.  Workers either all scan the
+ * same message type ("scaling_shared"), or different ones
+ * ("scaling_distinct"), optionally while a loader thread keeps
+ * invalidating every thread's caches.  These reports add the number of
+ * `threads`, `rows_per_second_per_thread` and `efficiency`: the average
+ * worker throughput over that of a lone worker on the same corpus, so
+ * 1.0 means perfect scaling.
+ *
+ * Usage: sqlite_protobuf_bench [--rows N] [--corpus NAME] [--threads N]
+ */
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <sqlite3.h>
+
+extern "C" {
+#include "proto_table.h"
+}
+#include "sqlite_protobuf.h"
+#include "utilities.h"
+#include "varint.h"
+
+#include "bench.pb.h"
+
+namespace {
+
+namespace bench = sqlite_protobuf::bench;
+
+/*
+ * Read-only benchmarks are repeated this many times, and we report the
+ * fastest run.
+ */
+const int READ_ITERATIONS = 3;
+
+const size_t DEFAULT_ROWS = 100000;
+
+const size_t NESTED_DEPTH = 5;
+const size_t NESTED_PAYLOAD_SIZE = 3072;
+const size_t REPEATED_VALUES = 256;
+const size_t REPEATED_TAGS = 32;
+const size_t REPEATED_ITEMS = 16;
+
+/*
+ * The varint microbenchmarks decode `rows` packed runs of this many
+ * values.
+ */
+const size_t VARINT_RUN_VALUES = 256;
+
+/*
+ * Each scaling worker scans its own table of up to this many rows
+ * `SCALING_PASSES` times: every worker has a copy of its corpus, so we
+ * keep the tables small.
+ */
+const size_t SCALING_MAX_ROWS = 5000;
+const int SCALING_PASSES = 20;
+
+/*
+ * The scaling loader thread invalidates all caches this often.
+ */
+const std::chrono::microseconds INVALIDATE_INTERVAL(1000);
+
+const char *const WORDS[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+    "hotel", "india", "juliett", "kilo", "lima", "mike", "november",
+};
+
+std::string random_word(std::mt19937_64 &rng)
+{
+    return WORDS[rng() % (sizeof(WORDS) / sizeof(WORDS[0]))];
+}
+
+void fill_flat(std::mt19937_64 &rng, int64_t id, bench::Flat *flat)
+{
+    flat->set_id(id);
+    flat->set_count(rng() % 1000);
+    flat->set_score((rng() % 1000000) / 1000.0);
+    flat->set_flag(rng() % 2 == 0);
+    flat->set_kind(static_cast<bench::Kind>(rng() % 4));
+    flat->set_name(random_word(rng) + "-" + std::to_string(id));
+    flat->set_timestamp(1500000000000ULL + rng() % 100000000);
+}
+
+void fill_node(std::mt19937_64 &rng, size_t depth, bench::Node *node)
+{
+    node->set_value(rng() % 100000);
+    node->set_label(random_word(rng));
+    if (depth == 0)
+        return;
+
+    fill_node(rng, depth - 1, node->mutable_child());
+    for (size_t i = 0; depth >= 2 && i < 2; i++)
+        fill_node(rng, depth - 2, node->add_kids());
+}
+
+std::string generate_flat(std::mt19937_64 &rng, int64_t id)
+{
+    bench::Flat flat;
+
+    fill_flat(rng, id, &flat);
+    return flat.SerializeAsString();
+}
+
+std::string generate_nested(std::mt19937_64 &rng, int64_t id)
+{
+    bench::Nested nested;
+    std::string payload(NESTED_PAYLOAD_SIZE, '\0');
+
+    for (char &c : payload)
+        c = static_cast<char>(rng());
+
+    nested.set_id(id);
+    fill_flat(rng, id, nested.mutable_header());
+    fill_node(rng, NESTED_DEPTH, nested.mutable_root());
+    nested.set_payload(payload);
+    nested.set_name(random_word(rng));
+    return nested.SerializeAsString();
+}
+
+std::string generate_repeated(std::mt19937_64 &rng, int64_t id)
+{
+    bench::Repeated repeated;
+
+    repeated.set_id(id);
+    for (size_t i = 0; i < REPEATED_VALUES; i++)
+        repeated.add_values(rng() % 100000);
+    for (size_t i = 0; i < REPEATED_TAGS; i++)
+        repeated.add_tags(random_word(rng));
+    for (size_t i = 0; i < REPEATED_ITEMS; i++)
+        fill_flat(rng, id * REPEATED_ITEMS + i, repeated.add_items());
+    repeated.set_kind(static_cast<bench::Kind>(rng() % 4));
+    return repeated.SerializeAsString();
+}
+
+const struct proto_column flat_columns[] = {
+    { .name = "id", .type = "INTEGER", .path = "$.id" },
+    { .name = "count", .type = "INTEGER", .path = "$.count" },
+    { .name = "score", .type = "REAL", .path = "$.score" },
+    { .name = "kind", .type = "TEXT", .path = "$.kind.name" },
+    { .name = "name", .type = "TEXT", .path = "$.name" },
+    {},
+};
+
+const struct proto_column nested_columns[] = {
+    { .name = "id", .type = "INTEGER", .path = "$.id" },
+    { .name = "header_name", .type = "TEXT", .path = "$.header.name" },
+    { .name = "root_value", .type = "INTEGER", .path = "$.root.value" },
+    { .name = "deep_value", .type = "INTEGER",
+        .path = "$.root.child.child.child.value" },
+    { .name = "kid_label", .type = "TEXT", .path = "$.root.kids[1].label" },
+    {},
+};
+
+const struct proto_column repeated_columns[] = {
+    { .name = "id", .type = "INTEGER", .path = "$.id" },
+    { .name = "first_value", .type = "INTEGER", .path = "$.values[0]" },
+    { .name = "last_value", .type = "INTEGER", .path = "$.values[-1]" },
+    { .name = "last_tag", .type = "TEXT", .path = "$.tags[-1]" },
+    { .name = "item_count", .type = "INTEGER", .path = "$.items[3].count" },
+    {},
+};
+
+struct corpus {
+    const char *name;
+    const char *message_name;
+    const struct proto_column *columns;
+    std::string (*generate)(std::mt19937_64 &, int64_t id);
+};
+
+const struct corpus corpora[] = {
+    { "flat", "sqlite_protobuf.bench.Flat", flat_columns, generate_flat },
+    { "nested", "sqlite_protobuf.bench.Nested", nested_columns,
+        generate_nested },
+    { "repeated", "sqlite_protobuf.bench.Repeated", repeated_columns,
+        generate_repeated },
+};
+
+void check(sqlite3 *db, int rc, const char *what)
+{
+    if (rc == SQLITE_OK || rc == SQLITE_DONE)
+        return;
+
+    fprintf(stderr, "%s failed: %s (%d)\n", what, sqlite3_errmsg(db), rc);
+    exit(1);
+}
+
+void check_values(bool ok, const char *what)
+{
+    if (ok)
+        return;
+
+    fprintf(stderr, "%s decoded the wrong values\n", what);
+    exit(1);
+}
+
+double now(void)
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void report(const char *corpus, const char *benchmark, size_t rows,
+    size_t bytes, double seconds)
+{
+    printf("{\"corpus\": \"%s\", \"benchmark\": \"%s\", \"rows\": %zu, "
+        "\"bytes\": %zu, \"seconds\": %.6f, \"rows_per_second\": %.1f, "
+        "\"bytes_per_second\": %.1f}\n",
+        corpus, benchmark, rows, bytes, seconds, rows / seconds,
+        bytes / seconds);
+    fflush(stdout);
+}
+
+void report(const struct corpus &corpus, const char *benchmark, size_t rows,
+    size_t bytes, double seconds)
+{
+    report(corpus.name, benchmark, rows, bytes, seconds);
+}
+
+/*
+ * Sets up the proto table for `corpus` with all its columns as
+ * `selector`s, and returns the time it took.
+ */
+double setup_table(sqlite3 *db, const struct corpus &corpus,
+    decltype(proto_column::index) selector, bool use_protobuf_fields)
+{
+    std::vector<struct proto_column> columns;
+    char *command_cache = NULL;
+    double begin;
+    int rc;
+
+    for (size_t i = 0; corpus.columns[i].name != NULL; i++) {
+        columns.push_back(corpus.columns[i]);
+        columns.back().index = selector;
+    }
+
+    columns.push_back(proto_column());
+
+    const struct proto_table spec = {
+        .name = corpus.name,
+        .message_name = corpus.message_name,
+        .columns = columns.data(),
+        .use_protobuf_fields = use_protobuf_fields,
+    };
+
+    begin = now();
+    rc = proto_table_setup(&command_cache, db, &spec);
+    check(db, rc, "proto_table_setup");
+    free(command_cache);
+    return now() - begin;
+}
+
+/*
+ * Runs `sql` to completion `READ_ITERATIONS` times, and returns the
+ * fastest time.
+ */
+double time_query(sqlite3 *db, const std::string &sql)
+{
+    sqlite3_stmt *stmt;
+    double best = HUGE_VAL;
+    int rc;
+
+    check(db, proto_prepare(db, &stmt, sql.c_str()), sql.c_str());
+    for (int i = 0; i < READ_ITERATIONS; i++) {
+        double begin = now();
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            ;
+        check(db, rc, sql.c_str());
+        best = std::min(best, now() - begin);
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    return best;
+}
+
+/*
+ * Returns the single integer result of `sql`.
+ */
+int64_t query_int(sqlite3 *db, const std::string &sql)
+{
+    sqlite3_stmt *stmt;
+    int64_t ret;
+
+    check(db, proto_prepare(db, &stmt, sql.c_str()), sql.c_str());
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+        check(db, SQLITE_ERROR, sql.c_str());
+
+    ret = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+struct proto_db proto_db_init(sqlite3 *db)
+{
+    struct proto_db ret = {};
+
+    ret.db = db;
+    return ret;
+}
+
+void exec(sqlite3 *db, const std::string &sql)
+{
+    check(db, sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL),
+        sql.c_str());
+}
+
+/*
+ * Inserts `messages` in the proto table for `corpus`, in one
+ * transaction, and returns the time it took.  Inserts go through the
+ * view's INSTEAD OF trigger.
+ */
+double insert_messages(sqlite3 *db, const struct corpus &corpus,
+    const std::vector<std::string> &messages)
+{
+    const std::string sql =
+        std::string("INSERT INTO ") + corpus.name + "(proto) VALUES (?);";
+    sqlite3_stmt *stmt;
+    double begin = now();
+
+    exec(db, "BEGIN TRANSACTION;");
+    check(db, proto_prepare(db, &stmt, sql.c_str()), sql.c_str());
+    for (const std::string &message : messages) {
+        sqlite3_bind_blob(stmt, 1, message.data(), message.size(),
+            SQLITE_STATIC);
+        check(db, sqlite3_step(stmt), sql.c_str());
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    exec(db, "COMMIT TRANSACTION;");
+    return now() - begin;
+}
+
+/*
+ * Returns the comma-separated names of the columns for `corpus`.
+ */
+std::string column_list(const struct corpus &corpus)
+{
+    std::string ret;
+
+    for (size_t i = 0; corpus.columns[i].name != NULL; i++) {
+        ret += (i == 0) ? "" : ", ";
+        ret += corpus.columns[i].name;
+    }
+
+    return ret;
+}
+
+void run_corpus(const struct corpus &corpus, size_t rows)
+{
+    std::mt19937_64 rng(rows);
+    std::vector<std::string> messages;
+    const std::string table = corpus.name;
+    const std::string raw_table = table + "_raw";
+    const std::string type = std::string("'") + corpus.message_name + "'";
+    const std::string columns = column_list(corpus);
+    size_t total_bytes = 0;
+    sqlite3 *db;
+
+    for (size_t i = 0; i < rows; i++) {
+        messages.push_back(corpus.generate(rng, i));
+        total_bytes += messages.back().size();
+    }
+
+    check(NULL, sqlite3_open(":memory:", &db), "sqlite3_open");
+    setup_table(db, corpus, proto_column::PROTO_SELECTOR_TYPE_WEAK, false);
+
+    report(corpus, "insert", rows, total_bytes,
+        insert_messages(db, corpus, messages));
+
+    report(corpus, "scan_extract", rows, total_bytes,
+        time_query(db, "SELECT " + columns + " FROM " + table + ";"));
+
+    // protobuf_sum must agree with SUM, even on text fields.
+    for (const char *sql_type : { "INTEGER", "TEXT" }) {
+        const struct proto_column *column = corpus.columns;
+
+        while (column->name != NULL && strcmp(column->type, sql_type) != 0)
+            column++;
+        if (column->name == NULL)
+            continue;
+
+        const std::string args = "proto, " + type + ", '" +
+            column->path + "'";
+        check_values(query_int(db, "SELECT typeof(lhs) = typeof(rhs) AND"
+            " lhs = rhs FROM (SELECT protobuf_sum(" + args + ") AS lhs,"
+            " SUM(protobuf_extract(" + args + ")) AS rhs FROM " +
+            raw_table + ");") == 1, "protobuf_sum");
+    }
+
+    setup_table(db, corpus, proto_column::PROTO_SELECTOR_TYPE_WEAK, true);
+    report(corpus, "scan_fields", rows, total_bytes,
+        time_query(db, "SELECT " + columns + " FROM " + table + ";"));
+
+    report(corpus, "create_index", rows, total_bytes,
+        setup_table(db, corpus, proto_column::PROTO_SELECTOR_TYPE_STRONG,
+        false));
+
+    report(corpus, "to_json", rows, total_bytes,
+        time_query(db, "SELECT protobuf_to_json(proto, " + type +
+        ") FROM " + raw_table + ";"));
+    report(corpus, "to_text", rows, total_bytes,
+        time_query(db, "SELECT protobuf_to_text(proto, " + type +
+        ") FROM " + raw_table + ";"));
+
+    exec(db, "CREATE TEMP TABLE converted AS SELECT"
+        " protobuf_to_json(proto, " + type + ") AS json,"
+        " protobuf_to_text(proto, " + type + ") AS text"
+        " FROM " + raw_table + ";");
+    report(corpus, "of_json", rows,
+        query_int(db, "SELECT SUM(LENGTH(json)) FROM converted;"),
+        time_query(db, "SELECT protobuf_of_json(json, " + type +
+        ") FROM converted;"));
+    report(corpus, "of_text", rows,
+        query_int(db, "SELECT SUM(LENGTH(text)) FROM converted;"),
+        time_query(db, "SELECT protobuf_of_text(text, " + type +
+        ") FROM converted;"));
+
+    // Bulk load another copy of the corpus, rebuilding the indexes once.
+    {
+        std::vector<struct proto_bind_blob> blobs;
+        struct proto_db proto_db = proto_db_init(db);
+        double begin;
+
+        for (const std::string &message : messages)
+            blobs.push_back({ message.data(), message.size() });
+
+        begin = now();
+        check(db, proto_db_bulk_insert(&proto_db, corpus.name, blobs.data(),
+            blobs.size(), true), "proto_db_bulk_insert");
+        report(corpus, "bulk_insert_rebuild_indexes", rows, total_bytes,
+            now() - begin);
+
+        /*
+         * A load that fails halfway must roll back, and leave the
+         * dropped indexes in place.
+         */
+        const std::string count_rows = "SELECT COUNT(*) FROM " + raw_table +
+            ";";
+        const std::string count_indexes = "SELECT COUNT(*) FROM sqlite_master"
+            " WHERE type = 'index' AND name GLOB 'proto_*index__*';";
+        int64_t n_rows = query_int(db, count_rows);
+        int64_t n_indexes = query_int(db, count_indexes);
+
+        exec(db, "CREATE TEMP TRIGGER bench_reject_empty BEFORE INSERT ON"
+            " main." + raw_table + " WHEN LENGTH(NEW.proto) = 0"
+            " BEGIN SELECT RAISE(ABORT, 'empty message'); END;");
+        blobs.push_back({ "", 0 });
+        if (proto_db_bulk_insert(&proto_db, corpus.name, blobs.data(),
+            blobs.size(), true) != SQLITE_CONSTRAINT ||
+            query_int(db, count_rows) != n_rows ||
+            query_int(db, count_indexes) != n_indexes ||
+            sqlite3_get_autocommit(db) == 0) {
+            fprintf(stderr, "failed proto_db_bulk_insert wasn't rolled back\n");
+            exit(1);
+        }
+
+        exec(db, "DROP TRIGGER bench_reject_empty;");
+        proto_db_finalize_statements(&proto_db);
+    }
+
+    sqlite3_close(db);
+}
+
+/*
+ * Runs `fn` `READ_ITERATIONS` times, and returns the fastest time.
+ */
+template <typename Fn>
+double time_best(Fn &&fn)
+{
+    double best = HUGE_VAL;
+
+    for (int i = 0; i < READ_ITERATIONS; i++) {
+        double begin = now();
+
+        fn();
+        best = std::min(best, now() - begin);
+    }
+
+    return best;
+}
+
+void encode_varint(uint64_t value, std::string *out)
+{
+    while (value >= 0x80) {
+        out->push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+
+    out->push_back(static_cast<char>(value));
+}
+
+/*
+ * Compares the SIMD varint kernel used by the wire-format reader with
+ * protobuf's `CodedInputStream` on packed runs of varints.  The
+ * "small" corpus only has single-byte values, and "mixed" values of
+ * all lengths.  We decode `rows` runs, and report the number of
+ * varints as `rows`.
+ */
+void run_varint(const char *name, uint64_t (*generate)(std::mt19937_64 &),
+    size_t rows)
+{
+    std::mt19937_64 rng(rows);
+    std::vector<std::string> runs(rows);
+    std::vector<uint64_t> values;
+    size_t n_values = rows * VARINT_RUN_VALUES;
+    size_t total_bytes = 0;
+    uint64_t checksum = 0, expected = 0;
+    char benchmark[64];
+
+    for (std::string &run : runs) {
+        for (size_t i = 0; i < VARINT_RUN_VALUES; i++) {
+            uint64_t value = generate(rng);
+
+            expected += value;
+            encode_varint(value, &run);
+        }
+
+        total_bytes += run.size();
+    }
+
+    double coded = time_best([&] {
+        checksum = 0;
+        for (const std::string &run : runs) {
+            google::protobuf::io::CodedInputStream input(
+                reinterpret_cast<const uint8_t *>(run.data()), run.size());
+            uint64_t value;
+
+            values.clear();
+            while (input.ReadVarint64(&value))
+                values.push_back(value);
+            for (uint64_t v : values)
+                checksum += v;
+        }
+    });
+    check_values(checksum == expected, "CodedInputStream::ReadVarint64");
+    report(name, "varint_decode_coded_input_stream", n_values, total_bytes,
+        coded);
+
+    double kernel = time_best([&] {
+        checksum = 0;
+        for (const std::string &run : runs) {
+            const uint8_t *begin =
+                reinterpret_cast<const uint8_t *>(run.data());
+
+            values.clear();
+            sqlite_protobuf::varint_decode(begin, begin + run.size(),
+                &values);
+            for (uint64_t v : values)
+                checksum += v;
+        }
+    });
+    check_values(checksum == expected, "varint_decode");
+    snprintf(benchmark, sizeof(benchmark), "varint_decode_%s",
+        sqlite_protobuf::varint_kernel_name());
+    report(name, benchmark, n_values, total_bytes, kernel);
+
+    /* Counting elements is how we index into packed fields. */
+    double count = time_best([&] {
+        checksum = 0;
+        for (const std::string &run : runs) {
+            const uint8_t *begin =
+                reinterpret_cast<const uint8_t *>(run.data());
+
+            checksum += sqlite_protobuf::varint_count(begin,
+                begin + run.size());
+        }
+    });
+    check_values(checksum == n_values, "varint_count");
+    snprintf(benchmark, sizeof(benchmark), "varint_count_%s",
+        sqlite_protobuf::varint_kernel_name());
+    report(name, benchmark, n_values, total_bytes, count);
+
+    double coded_count = time_best([&] {
+        checksum = 0;
+        for (const std::string &run : runs) {
+            google::protobuf::io::CodedInputStream input(
+                reinterpret_cast<const uint8_t *>(run.data()), run.size());
+            uint64_t value;
+
+            while (input.ReadVarint64(&value))
+                checksum++;
+        }
+    });
+    check_values(checksum == n_values, "CodedInputStream::ReadVarint64");
+    report(name, "varint_count_coded_input_stream", n_values, total_bytes,
+        coded_count);
+}
+
+uint64_t generate_small_varint(std::mt19937_64 &rng)
+{
+    return rng() % 128;
+}
+
+uint64_t generate_mixed_varint(std::mt19937_64 &rng)
+{
+    return rng() >> (rng() % 64);
+}
+
+struct scaling_worker {
+    const struct corpus *corpus;
+    /* Index of `corpus` in `corpora`. */
+    size_t corpus_index;
+    sqlite3 *db;
+    size_t rows;
+    size_t bytes;
+    /* Time for this worker's scans in the last run. */
+    double seconds;
+};
+
+/*
+ * Returns a worker with its own connection and a proto table for
+ * `corpora[corpus_index]`, filled with `messages`.
+ */
+struct scaling_worker scaling_worker_init(size_t corpus_index,
+    const std::vector<std::string> &messages)
+{
+    struct scaling_worker ret = {};
+
+    ret.corpus = &corpora[corpus_index];
+    ret.corpus_index = corpus_index;
+    ret.rows = messages.size();
+    for (const std::string &message : messages)
+        ret.bytes += message.size();
+
+    check(NULL, sqlite3_open(":memory:", &ret.db), "sqlite3_open");
+    setup_table(ret.db, *ret.corpus, proto_column::PROTO_SELECTOR_TYPE_WEAK,
+        false);
+    insert_messages(ret.db, *ret.corpus, messages);
+    return ret;
+}
+
+void scaling_scan(struct scaling_worker *worker)
+{
+    const std::string sql = "SELECT " + column_list(*worker->corpus) +
+        " FROM " + worker->corpus->name + ";";
+    sqlite3_stmt *stmt;
+    double begin = now();
+    int rc;
+
+    check(worker->db, proto_prepare(worker->db, &stmt, sql.c_str()),
+        sql.c_str());
+    for (int i = 0; i < SCALING_PASSES; i++) {
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            ;
+        check(worker->db, rc, sql.c_str());
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    worker->seconds = now() - begin;
+}
+
+/*
+ * Stands in for a stream of `protobuf_load` calls: we can't load new
+ * libraries forever, so each iteration reloads a descriptor set that
+ * we already have, which looks up the generated pool, and then flushes
+ * every thread's caches like loading a new library does.  Returns the
+ * number of invalidations.
+ */
+uint64_t scaling_invalidate(const std::atomic<bool> *done)
+{
+    google::protobuf::FileDescriptorSet set;
+    std::string blob;
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
+    uint64_t ret = 0;
+
+    bench::Flat::descriptor()->file()->CopyTo(set.add_file());
+    blob = set.SerializeAsString();
+
+    check(NULL, sqlite3_open(":memory:", &db), "sqlite3_open");
+    check(db, proto_prepare(db, &stmt,
+        "SELECT protobuf_load_descriptor_set(?);"),
+        "protobuf_load_descriptor_set");
+    sqlite3_bind_blob(stmt, 1, blob.data(), blob.size(), SQLITE_STATIC);
+    while (!done->load(std::memory_order_acquire)) {
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+            check(db, SQLITE_ERROR, "protobuf_load_descriptor_set");
+        sqlite3_reset(stmt);
+
+        sqlite_protobuf::invalidate_all_caches();
+        ret++;
+        std::this_thread::sleep_for(INVALIDATE_INTERVAL);
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return ret;
+}
+
+/*
+ * Runs every worker's scans at once, in one thread per worker.
+ * Returns the wall-clock time for the run.
+ */
+double scaling_run(std::vector<struct scaling_worker> &workers,
+    bool invalidate, uint64_t *OUT_invalidations)
+{
+    std::vector<std::thread> threads;
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> start(false), done(false);
+    std::thread loader;
+    double begin;
+
+    *OUT_invalidations = 0;
+    for (struct scaling_worker &worker : workers) {
+        threads.emplace_back([&ready, &start, &worker] {
+            ready.fetch_add(1, std::memory_order_acq_rel);
+            while (!start.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+            scaling_scan(&worker);
+        });
+    }
+
+    while (ready.load(std::memory_order_acquire) < workers.size())
+        std::this_thread::yield();
+
+    if (invalidate) {
+        loader = std::thread([&done, OUT_invalidations] {
+            *OUT_invalidations = scaling_invalidate(&done);
+        });
+    }
+
+    begin = now();
+    start.store(true, std::memory_order_release);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    begin = now() - begin;
+    done.store(true, std::memory_order_release);
+    if (loader.joinable())
+        loader.join();
+
+    return begin;
+}
+
+/*
+ * Runs one scaling configuration, and reports its throughput and
+ * efficiency against `single`, the rows per second of a lone worker
+ * for each corpus.
+ */
+void scaling_report(const char *name,
+    std::vector<struct scaling_worker> &workers, bool invalidate,
+    const std::vector<double> &single)
+{
+    sqlite3 *db = workers[0].db;
+    size_t rows = 0, bytes = 0;
+    uint64_t invalidations;
+    double efficiency = 0;
+    double seconds;
+
+    exec(db, "SELECT protobuf_stats_reset();");
+    seconds = scaling_run(workers, invalidate, &invalidations);
+    for (const struct scaling_worker &worker : workers) {
+        rows += worker.rows * SCALING_PASSES;
+        bytes += worker.bytes * SCALING_PASSES;
+        efficiency += worker.rows * SCALING_PASSES / worker.seconds /
+            single[worker.corpus_index];
+    }
+
+    printf("{\"corpus\": \"%s\", \"benchmark\": \"%s\", \"rows\": %zu, "
+        "\"bytes\": %zu, \"seconds\": %.6f, \"rows_per_second\": %.1f, "
+        "\"bytes_per_second\": %.1f, \"threads\": %zu, "
+        "\"rows_per_second_per_thread\": %.1f, \"efficiency\": %.3f, "
+        "\"invalidations\": %" PRIu64 ", "
+        "\"prototype_cache_misses\": %" PRId64 ", "
+        "\"message_cache_misses\": %" PRId64 "}\n",
+        name, invalidate ? "scan_extract_invalidate" : "scan_extract",
+        rows, bytes, seconds, rows / seconds, bytes / seconds,
+        workers.size(), rows / seconds / workers.size(),
+        efficiency / workers.size(), invalidations,
+        query_int(db, "SELECT value FROM protobuf_stats"
+            " WHERE name = 'prototype_cache_misses';"),
+        query_int(db, "SELECT value FROM protobuf_stats"
+            " WHERE name = 'message_cache_misses';"));
+    fflush(stdout);
+}
+
+/*
+ * Scans from 1 to `max_threads` threads, doubling each time, with
+ * workers that share the "flat" corpus's message type, or cycle
+ * through all the corpora, with and without invalidations.
+ */
+void run_scaling(size_t rows, size_t max_threads)
+{
+    const size_t n_corpora = sizeof(corpora) / sizeof(corpora[0]);
+    std::vector<std::vector<std::string>> messages(n_corpora);
+    std::vector<double> single(n_corpora);
+    std::vector<size_t> counts;
+
+    rows = std::min(rows, SCALING_MAX_ROWS);
+    for (size_t i = 0; i < n_corpora; i++) {
+        std::mt19937_64 rng(rows + i);
+
+        for (size_t j = 0; j < rows; j++)
+            messages[i].push_back(corpora[i].generate(rng, j));
+    }
+
+    for (size_t n = 1; n < max_threads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(max_threads);
+
+    /* Baselines: one worker alone, for each corpus. */
+    for (size_t i = 0; i < n_corpora; i++) {
+        std::vector<struct scaling_worker> workers = {
+            scaling_worker_init(i, messages[i]),
+        };
+        uint64_t invalidations;
+
+        single[i] = HUGE_VAL;
+        for (int j = 0; j < READ_ITERATIONS; j++) {
+            scaling_run(workers, false, &invalidations);
+            single[i] = std::min(single[i], workers[0].seconds);
+        }
+
+        single[i] = rows * SCALING_PASSES / single[i];
+        sqlite3_close(workers[0].db);
+    }
+
+    for (bool distinct : { false, true }) {
+        for (size_t n : counts) {
+            std::vector<struct scaling_worker> workers;
+
+            for (size_t i = 0; i < n; i++) {
+                size_t corpus = distinct ? i % n_corpora : 0;
+
+                workers.push_back(scaling_worker_init(corpus,
+                    messages[corpus]));
+            }
+
+            for (bool invalidate : { false, true }) {
+                scaling_report(distinct ? "scaling_distinct" :
+                    "scaling_shared", workers, invalidate, single);
+            }
+
+            for (struct scaling_worker &worker : workers)
+                sqlite3_close(worker.db);
+        }
+    }
+}
+
+void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--rows N] [--corpus NAME] [--threads N]\n",
+        argv0);
+    exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+    size_t rows = DEFAULT_ROWS;
+    size_t max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+    const char *only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            rows = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = strtoull(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (rows == 0 || max_threads == 0)
+        usage(argv[0]);
+
+    sqlite3_auto_extension(reinterpret_cast<void (*)(void)>(
+        sqlite_protobuf::sqlite3_sqliteprotobuf_init));
+
+    for (const struct corpus &corpus : corpora) {
+        if (only == NULL || strcmp(only, corpus.name) == 0)
+            run_corpus(corpus, rows);
+    }
+
+    if (only == NULL || strcmp(only, "varint") == 0) {
+        run_varint("varint_small", generate_small_varint, rows);
+        run_varint("varint_mixed", generate_mixed_varint, rows);
+    }
+
+    if (only == NULL || strcmp(only, "scaling") == 0)
+        run_scaling(rows, max_threads);
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <google/protobuf/message.h>
+
+// Specialised accessors let `protobuf_extract` evaluate protopaths on
+// generated C++ message classes with plain member function calls,
+// instead of walking the path with reflection.
+//
+// A library loaded with `protobuf_load` registers its accessors by
+// defining `sqlite_protobuf_accessors`, e.g.,
+//
+//     sqlite_protobuf::accessor_status
+//     person_zip(const Person& person, sqlite_protobuf::accessor_value *out)
+//     {
+//         if (!person.has_address())
+//             return out->missing(0);
+//         if (!person.address().has_zip())
+//             return out->missing(1);
+//         return out->found(person.address().zip());
+//     }
+//
+//     extern "C" void
+//     sqlite_protobuf_accessors(sqlite_protobuf::add_accessor_fn *add)
+//     {
+//         sqlite_protobuf::add_accessor<Person, person_zip>(add,
+//             "$.address.zip");
+//     }
+//
+// Programs that link the extension statically may instead pass
+// `sqlite_protobuf_add_accessor` to `add_accessor` directly.
+//
+// An accessor must return exactly what reflection would find: the
+// extension still handles default values, enum ".name" suffixes and
+// SQLite type conversions, based on the field descriptors.  Messages
+// that are not instances of the generated class (e.g., dynamic
+// messages built from a descriptor set) always use reflection.
+
+namespace sqlite_protobuf {
+
+enum class accessor_status {
+    // The accessor can't handle this message: use reflection.
+    FALLBACK,
+    // The last field in the path is set; its value is in the
+    // `accessor_value`.
+    FOUND,
+    // The optional field at `accessor_value::step` is not set.
+    MISSING,
+    // An index into a repeated field is out of range.
+    OUT_OF_RANGE,
+};
+
+struct accessor_value {
+    enum class value_kind { INTEGER, REAL, BOOL, STRING };
+
+    value_kind kind;
+    int64_t integer;
+    double real;
+    // Strings point into the message.
+    const char *data;
+    size_t size;
+    // Index of the missing step in the path.
+    size_t step;
+
+    accessor_status found(bool value)
+    {
+        kind = value_kind::BOOL;
+        integer = value;
+        return accessor_status::FOUND;
+    }
+
+    // Also takes enum values.
+    accessor_status found(int32_t value) { return found_integer(value); }
+    accessor_status found(int64_t value) { return found_integer(value); }
+    accessor_status found(uint32_t value) { return found_integer(value); }
+    accessor_status found(uint64_t value)
+    {
+        return found_integer(static_cast<int64_t>(value));
+    }
+
+    accessor_status found(double value)
+    {
+        kind = value_kind::REAL;
+        real = value;
+        return accessor_status::FOUND;
+    }
+
+    accessor_status found(float value) { return found(double(value)); }
+
+    accessor_status found(const std::string& value)
+    {
+        kind = value_kind::STRING;
+        data = value.data();
+        size = value.size();
+        return accessor_status::FOUND;
+    }
+
+    accessor_status missing(size_t i)
+    {
+        step = i;
+        return accessor_status::MISSING;
+    }
+
+    accessor_status out_of_range() { return accessor_status::OUT_OF_RANGE; }
+
+private:
+    accessor_status found_integer(int64_t value)
+    {
+        kind = value_kind::INTEGER;
+        integer = value;
+        return accessor_status::FOUND;
+    }
+};
+
+typedef accessor_status accessor_fn(const google::protobuf::Message& message,
+                                    accessor_value *out);
+
+// Registers `fn` for the protopath `path`, spelled exactly like in
+// queries, on messages of type `message_name`.
+typedef void add_accessor_fn(const char *message_name, const char *path,
+                             accessor_fn *fn);
+
+// Calls `Fn` on instances of the generated class `M`, and falls back
+// to reflection for any other message.
+template <typename M, accessor_status (*Fn)(const M&, accessor_value *)>
+accessor_status message_accessor(const google::protobuf::Message& message,
+                                 accessor_value *out)
+{
+    if (message.GetReflection() != M::default_instance().GetReflection())
+        return accessor_status::FALLBACK;
+
+    return Fn(static_cast<const M&>(message), out);
+}
+
+// Registers `Fn` for `path` on messages of type `M` with `add`.
+template <typename M, accessor_status (*Fn)(const M&, accessor_value *)>
+void add_accessor(add_accessor_fn *add, const char *path)
+{
+    add(M::descriptor()->full_name().c_str(), path,
+        &message_accessor<M, Fn>);
+}
+
+extern "C" {
+
+// Defined by libraries that register accessors.
+void sqlite_protobuf_accessors(add_accessor_fn *add);
+
+// Defined by the extension.
+void sqlite_protobuf_add_accessor(const char *message_name, const char *path,
+                                  accessor_fn *fn);
+
+}
+
+}  // namespace sqlite_protobuf
@@ -2,10 +2,14 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <umash.h>
+#include <unistd.h>
 
 /*
  * Try to autocommit every `AUTOCOMMIT_BATCH_SIZE` write operation by
@@ -18,6 +22,14 @@
  */
 #define AUTOCOMMIT_BATCH_SIZE 20000
 
+/*
+ * With a `target_hold_us`, batch sizes stay within these bounds, and
+ * at most double or halve after each commit, so one slow fsync
+ * doesn't collapse the batch size.
+ */
+#define ADAPTIVE_BATCH_MIN 16
+#define ADAPTIVE_BATCH_MAX (AUTOCOMMIT_BATCH_SIZE * 64)
+
 static struct umash_params index_fp_params;
 
 extern int proto_prepare(sqlite3 *, sqlite3_stmt **, const char *);
@@ -29,9 +41,33 @@ extern int proto_prepare(sqlite3 *, sqlite3_stmt **, const char *);
 struct view_column {
 	const char *column_name;
 	char *expression;
+	/*
+	 * The expression in the view itself, if it differs from
+	 * `expression`, or NULL.
+	 */
+	char *view_expression;
+	/*
+	 * The raw table column for stored columns, or the shadow
+	 * table column when the view reads from a shadow table, or
+	 * NULL.
+	 */
+	char *stored_name;
 	bool auto_index;
+	/* Whether the column appears in any index. */
+	bool indexed;
 };
 
+/*
+ * `protobuf_fields` extracts at most this many paths in one call.
+ */
+#define PROTOBUF_FIELDS_MAX_PATHS 63
+
+/*
+ * Only join with `protobuf_fields` when it saves at least this many
+ * calls to `protobuf_extract` per row.
+ */
+#define PROTOBUF_FIELDS_MIN_PATHS 2
+
 __attribute__((__constructor__)) static void
 populate_fp_params(void)
 {
@@ -41,29 +77,322 @@ populate_fp_params(void)
 	return;
 }
 
+#define CREATE_RAW_TABLE_FORMAT                                                     \
+	"CREATE TABLE IF NOT EXISTS %s_raw (\n"                                    \
+	"  id INTEGER PRIMARY KEY ASC NOT NULL,\n"                                 \
+	"  proto BLOB NOT NULL"                                                    \
+	");"
+
+/*
+ * Deferred backfills (`defer_index_builds`) fill the raw column
+ * `column_name` of `table_name`_raw for ids in (`next_id`,
+ * `last_id`]; rows written after setup are computed by the stored
+ * column triggers.
+ */
+#define CREATE_INDEX_BUILDS_TABLE                                                   \
+	"CREATE TABLE IF NOT EXISTS proto_index_builds (\n"                        \
+	"  table_name TEXT NOT NULL,\n"                                            \
+	"  column_name TEXT NOT NULL,\n"                                           \
+	"  next_id INTEGER NOT NULL,\n"                                            \
+	"  last_id INTEGER NOT NULL,\n"                                            \
+	"  rows_done INTEGER NOT NULL DEFAULT 0,\n"                                \
+	"  PRIMARY KEY (table_name, column_name)\n"                                \
+	");"
+
+/*
+ * Compression dictionaries for `compress_protos` tables, as expected
+ * by the extension's `protobuf_compress` and decompression: `id` is
+ * the zstd dictionary id, and each table compresses with its latest
+ * dictionary, whose expression is LATEST_DICTIONARY_FORMAT for the
+ * table name as positional argument 1.
+ */
+#define CREATE_DICTIONARIES_TABLE                                                   \
+	"CREATE TABLE IF NOT EXISTS proto_dictionaries (\n"                        \
+	"  id INTEGER PRIMARY KEY NOT NULL,\n"                                     \
+	"  table_name TEXT NOT NULL,\n"                                            \
+	"  dictionary BLOB NOT NULL\n"                                             \
+	");"
+
+#define LATEST_DICTIONARY_FORMAT                                                    \
+	"(SELECT MAX(id) FROM proto_dictionaries WHERE table_name = '%1$s')"
+
+/*
+ * The zstd format reserves smaller dictionary ids.
+ */
+#define FIRST_DICTIONARY_ID 32768
+
+/*
+ * `proto_table_setup` records a fingerprint of the last setup SQL it
+ * ran to completion for each table, and of the schema it left behind
+ * for that table.  Setup is skipped entirely when it would run the
+ * exact same SQL again, on the same schema.  `compressed` tells
+ * `proto_db` writes whether to compress blobs for that table.
+ */
+#define CREATE_TABLE_SETUPS_TABLE                                                   \
+	"CREATE TABLE IF NOT EXISTS proto_table_setups (\n"                        \
+	"  table_name TEXT PRIMARY KEY NOT NULL,\n"                                \
+	"  fingerprint TEXT NOT NULL,\n"                                           \
+	"  schema_fingerprint TEXT NOT NULL,\n"                                    \
+	"  compressed INTEGER NOT NULL DEFAULT 0\n"                                \
+	");"
+
 /**
- * Generates a statement that will create an index on demand for
- * `index`, given the view column definitions in `columns`.
+ * Returns the expression that extracts `column` from the `proto` blob
+ * expression (e.g., "proto" or "NEW.proto").
  */
 static char *
-create_index(char **OUT_index_name, const char *table_name,
-    const struct view_column *columns, size_t num_columns,
-    const struct proto_index *index, bool auto_index)
+column_expression(const struct proto_table *table,
+    const struct proto_column *column, const char *proto)
 {
-	char *index_name = NULL;
-	char *index_expr;
 	char *ret;
 
-	*OUT_index_name = NULL;
+	if (asprintf(&ret,
+	    "CAST(protobuf_extract(%s, '%s', '%s', NULL) AS %s)",
+	    proto, table->message_name, column->path, column->type) < 0)
+		return NULL;
 
-	/* Construct the index expression. */
-	index_expr = strdup("");
-	if (index_expr == NULL)
-		goto fail;
+	return ret;
+}
+
+/**
+ * Returns the name of `table`'s shadow table, with a fingerprint of
+ * the message type and column definitions: the shadow table is
+ * rebuilt from scratch whenever they change.
+ */
+static char *
+shadow_table_name(const struct proto_table *table)
+{
+	struct umash_fp fp;
+	char *definition;
+	char *ret;
+
+	definition = strdup(table->message_name);
+	if (definition == NULL)
+		return NULL;
+
+	for (size_t i = 0; table->columns != NULL && table->columns[i].name != NULL;
+	     i++) {
+		const struct proto_column *column = &table->columns[i];
+		char *update;
+
+		if (asprintf(&update, "%s\n%s %s %s", definition, column->name,
+		    column->type, column->path) < 0) {
+			free(definition);
+			return NULL;
+		}
+
+		free(definition);
+		definition = update;
+	}
+
+	fp = umash_fprint(&index_fp_params, 0, definition, strlen(definition));
+	free(definition);
+	if (asprintf(&ret, "proto_shadow__%s__%016" PRIx64 "%016" PRIx64,
+	    table->name, fp.hash[0], fp.hash[1]) < 0)
+		return NULL;
+
+	return ret;
+}
+
+/**
+ * Returns the name of the raw table column for the stored `column`,
+ * with a fingerprint of its `expression`.
+ */
+static char *
+stored_column_name(const struct proto_column *column, const char *expression)
+{
+	struct umash_fp fp;
+	char *ret;
+
+	fp = umash_fprint(&index_fp_params, 0, expression, strlen(expression));
+	if (asprintf(&ret, "proto_stored__%s__%016" PRIx64, column->name,
+	    fp.hash[0]) < 0)
+		return NULL;
+
+	return ret;
+}
+
+/**
+ * Returns the `protobuf_presence` expression for the `proto` blob
+ * expression, if the table uses a presence summary.
+ */
+static char *
+presence_expression(const struct proto_table *table, const char *proto)
+{
+	char *paths = strdup("");
+	char *update;
+	char *ret;
+
+	for (size_t i = 0; table->presence_paths != NULL &&
+	     table->presence_paths[i] != NULL && paths != NULL; i++) {
+		if (asprintf(&update, "%s, '%s'", paths,
+		    table->presence_paths[i]) < 0)
+			update = NULL;
+		free(paths);
+		paths = update;
+	}
+
+	if (paths == NULL)
+		return NULL;
+
+	if (asprintf(&ret, "protobuf_presence(%s, '%s'%s)", proto,
+	    table->message_name, paths) < 0)
+		ret = NULL;
+
+	free(paths);
+	return ret;
+}
+
+/**
+ * Returns the name of the raw table column for the presence summary,
+ * with a fingerprint of its `expression`.
+ */
+static char *
+presence_column_name(const char *expression)
+{
+	struct umash_fp fp;
+	char *ret;
+
+	fp = umash_fprint(&index_fp_params, 0, expression, strlen(expression));
+	if (asprintf(&ret, "proto_presence__%016" PRIx64, fp.hash[0]) < 0)
+		return NULL;
+
+	return ret;
+}
+
+/**
+ * Appends `name = expression` to the `SET` clause `*assignments`,
+ * which may be NULL if empty.
+ */
+static bool
+append_assignment(char **assignments, const char *name, const char *expression)
+{
+	char *update;
+	int r;
+
+	if (*assignments == NULL) {
+		r = asprintf(&update, "\n    %s = %s", name, expression);
+	} else {
+		r = asprintf(&update, "%s,\n    %s = %s", *assignments, name,
+		    expression);
+	}
+
+	if (r < 0)
+		return false;
+
+	free(*assignments);
+	*assignments = update;
+	return true;
+}
+
+/**
+ * Returns the SQL to (re)create the triggers that compute the stored
+ * columns and the presence summary of the `spec`ced raw table.
+ *
+ * Stored columns are updated after each write to the raw table,
+ * whether it goes through the view or not.  The triggers' own updates
+ * don't touch `proto`, so they don't fire the update trigger.
+ */
+static char *
+stored_triggers(const struct proto_table *table)
+{
+	char *assignments = NULL;
+	char *ret = NULL;
+
+	/* Shadow tables hold all the columns, but not the summary. */
+	for (size_t i = 0; table->columns != NULL &&
+	     table->columns[i].name != NULL && table->use_shadow_table == false;
+	     i++) {
+		const struct proto_column *column = &table->columns[i];
+		char *expression;
+		char *name;
+		bool ok;
+
+		if (column->stored == false)
+			continue;
+
+		expression = column_expression(table, column, "proto");
+		name = (expression != NULL) ?
+		    stored_column_name(column, expression) : NULL;
+		ok = (name != NULL) &&
+		    append_assignment(&assignments, name, expression);
+		free(expression);
+		free(name);
+		if (ok == false)
+			goto out;
+	}
+
+	if (table->use_presence_summary) {
+		char *expression;
+		char *name;
+		bool ok;
+
+		expression = presence_expression(table, "proto");
+		name = (expression != NULL) ?
+		    presence_column_name(expression) : NULL;
+		ok = (name != NULL) &&
+		    append_assignment(&assignments, name, expression);
+		free(expression);
+		free(name);
+		if (ok == false)
+			goto out;
+	}
+
+	if (assignments == NULL) {
+		if (asprintf(&ret,
+		    "DROP TRIGGER IF EXISTS %1$s_raw_stored_insert;\n"
+		    "DROP TRIGGER IF EXISTS %1$s_raw_stored_update;",
+		    table->name) < 0)
+			ret = NULL;
+	} else if (asprintf(&ret,
+	    "DROP TRIGGER IF EXISTS %1$s_raw_stored_insert;\n"
+	    "DROP TRIGGER IF EXISTS %1$s_raw_stored_update;\n"
+	    "CREATE TRIGGER %1$s_raw_stored_insert AFTER INSERT ON %1$s_raw\n"
+	    "BEGIN\n"
+	    "  UPDATE %1$s_raw SET%2$s\n"
+	    "  WHERE id = NEW.id;\n"
+	    "END;\n"
+	    "CREATE TRIGGER %1$s_raw_stored_update AFTER UPDATE OF proto ON %1$s_raw\n"
+	    "BEGIN\n"
+	    "  UPDATE %1$s_raw SET%2$s\n"
+	    "  WHERE id = NEW.id;\n"
+	    "END;",
+	    table->name, assignments) < 0) {
+		ret = NULL;
+	}
 
-	for (size_t i = 0; index->components[i] != NULL; i++) {
-		const char *component = index->components[i];
-		const char *prefix = (i == 0) ? "\n  " : ",\n  ";
+out:
+	free(assignments);
+	return ret;
+}
+
+/**
+ * Returns whether `name` is one of the `count` `names`.
+ */
+static bool
+name_in_list(char *const *names, size_t count, const char *name)
+{
+
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(names[i], name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Appends the index expression for each column name in `components`
+ * to `*index_expr`.
+ */
+static bool
+append_index_components(char **index_expr, const struct view_column *columns,
+    size_t num_columns, const char *const *components)
+{
+
+	for (size_t i = 0; components != NULL && components[i] != NULL; i++) {
+		const char *component = components[i];
+		const char *prefix = ((*index_expr)[0] == '\0') ? "\n  " : ",\n  ";
 		char *update;
 
 		/*
@@ -72,24 +401,64 @@ create_index(char **OUT_index_name, const char *table_name,
 		 */
 		for (size_t j = 0; j < num_columns; j++) {
 			if (strcmp(component, columns[j].column_name) == 0) {
-				component = columns[j].expression;
+				component = (columns[j].stored_name != NULL) ?
+				    columns[j].stored_name : columns[j].expression;
 				break;
 			}
 		}
 
-		if (asprintf(&update, "%s%s%s", index_expr, prefix, component) < 0)
-			goto fail;
+		if (asprintf(&update, "%s%s%s", *index_expr, prefix, component) < 0)
+			return false;
 
-		free(index_expr);
-		index_expr = update;
+		free(*index_expr);
+		*index_expr = update;
 	}
 
-	/* Compute the index's name based on the index expression. */
+	return true;
+}
+
+/**
+ * Generates a statement that will create an index on demand for
+ * `index`, given the view column definitions in `columns`.  The index
+ * is on the raw table, or on `shadow_name` if non-NULL.
+ */
+static char *
+create_index(char **OUT_index_name, const char *table_name,
+    const char *shadow_name, const struct view_column *columns,
+    size_t num_columns, const struct proto_index *index, bool auto_index)
+{
+	char *index_name = NULL;
+	char *index_expr;
+	char *ret;
+
+	*OUT_index_name = NULL;
+
+	/* Construct the index expression. */
+	index_expr = strdup("");
+	if (index_expr == NULL)
+		goto fail;
+
+	if (append_index_components(&index_expr, columns, num_columns,
+	    index->components) == false ||
+	    append_index_components(&index_expr, columns, num_columns,
+	    index->include) == false)
+		goto fail;
+
+	/*
+	 * Compute the index's name based on the index expression.
+	 * Shadow table indexes refer to plain column names, and index
+	 * names are global, so also fingerprint the shadow table.
+	 */
 	{
 		struct umash_fp fp;
 
 		fp = umash_fprint(
 		    &index_fp_params, 0, index_expr, strlen(index_expr));
+		if (shadow_name != NULL) {
+			fp = umash_fprint(&index_fp_params, fp.hash[0],
+			    shadow_name, strlen(shadow_name));
+		}
+
 		if (asprintf(&index_name,
 		    "proto_%sindex__%s__%s__%016" PRIx64 "%016" PRIx64,
 		    (auto_index ? "auto" : ""), table_name, index->name_suffix,
@@ -103,7 +472,13 @@ create_index(char **OUT_index_name, const char *table_name,
 	 * Re-use the old index if it already exists: we don't want to
 	 * recreate it.
 	 */
-	if (asprintf(&ret,
+	if (shadow_name != NULL) {
+		if (asprintf(&ret,
+		    "CREATE INDEX IF NOT EXISTS %s\n"
+		    "ON %s(%s\n);",
+		    index_name, shadow_name, index_expr) < 0)
+			goto fail;
+	} else if (asprintf(&ret,
 	    "CREATE INDEX IF NOT EXISTS %s\n"
 	    "ON %s_raw(%s\n);",
 	    index_name, table_name, index_expr) < 0)
@@ -127,13 +502,41 @@ fail:
  * The last statement is a `SELECT` statement that will list the name
  * of all indexes attached to the raw table that aren't necessary
  * anymore.
+ *
+ * The view computes the `num_pending` raw columns in `pending`, which
+ * aren't backfilled yet, for rows where they are still NULL.
  */
 static char *
-generate_proto_table(const struct proto_table *table)
+generate_proto_table(const struct proto_table *table, char *const *pending,
+    size_t num_pending)
 {
 	char *create_raw = NULL;
 	char *create_view = NULL;
 	char *create_triggers = NULL;
+	/* The `protobuf_scan` table, if requested. */
+	char *create_scan = NULL;
+	/*
+	 * The presence summary's expression and raw column, if
+	 * enabled.
+	 */
+	char *presence = NULL;
+	char *presence_name = NULL;
+	/* The triggers that maintain stored columns. */
+	char *create_stored_triggers = NULL;
+	/*
+	 * The shadow table (or NULL), the SQL to create, backfill and
+	 * maintain it.
+	 */
+	char *shadow_name = NULL;
+	char *create_shadow = NULL;
+	char *create_shadow_triggers = NULL;
+	/*
+	 * The view's `id` and `proto` expressions, and the blob its
+	 * write triggers store.
+	 */
+	char *view_id = NULL;
+	char *view_proto = NULL;
+	char *write_proto = NULL;
 	/* A list of column names, with a comma before each one. */
 	char *column_names = NULL;
 	/*
@@ -148,6 +551,13 @@ generate_proto_table(const struct proto_table *table)
 	char *index_names = NULL;
 	char *create_indexes = NULL;
 	char *select_bad_indexes = NULL;
+	/*
+	 * The paths for `protobuf_fields`, with a comma before each
+	 * one, and the view's FROM clause.
+	 */
+	char *fields_paths = NULL;
+	char *view_source = NULL;
+	size_t num_fields_paths = 0;
 	struct view_column *view_columns = NULL;
 	size_t num_view_columns = 0;
 	char *ret = NULL;
@@ -156,16 +566,66 @@ generate_proto_table(const struct proto_table *table)
 	 * Make sure the raw table exists. No-op if there's already a
 	 * raw table: we don't want to drop all that data.
 	 */
-	if (asprintf(&create_raw,
-	    "CREATE TABLE IF NOT EXISTS %s_raw (\n"
-	    "  id INTEGER PRIMARY KEY ASC NOT NULL,\n"
-	    "  proto BLOB NOT NULL"
-	    ");",
-	    table->name) < 0) {
+	if (asprintf(&create_raw, CREATE_RAW_TABLE_FORMAT, table->name) < 0) {
 		create_raw = NULL;
 		goto fail;
 	}
 
+	if (table->use_shadow_table) {
+		shadow_name = shadow_table_name(table);
+		if (shadow_name == NULL)
+			goto fail;
+
+		if (asprintf(&view_id, "%s.id", shadow_name) < 0) {
+			view_id = NULL;
+			goto fail;
+		}
+
+		/* Only look up the raw row when the query needs `proto`. */
+		if (asprintf(&view_proto,
+		    "(SELECT proto FROM %1$s_raw WHERE %1$s_raw.id = %2$s.id)",
+		    table->name, shadow_name) < 0) {
+			view_proto = NULL;
+			goto fail;
+		}
+	} else {
+		if (asprintf(&view_id, "%s_raw.id", table->name) < 0) {
+			view_id = NULL;
+			goto fail;
+		}
+
+		if (asprintf(&view_proto, "%s_raw.proto", table->name) < 0) {
+			view_proto = NULL;
+			goto fail;
+		}
+	}
+
+	if (table->compress_protos) {
+		char *wrapped;
+
+		if (asprintf(&wrapped, "protobuf_decompress(%s)", view_proto) < 0)
+			goto fail;
+		free(view_proto);
+		view_proto = wrapped;
+
+		if (asprintf(&write_proto,
+		    "protobuf_compress(NEW.proto, " LATEST_DICTIONARY_FORMAT ")",
+		    table->name) < 0) {
+			write_proto = NULL;
+			goto fail;
+		}
+
+		if (asprintf(&wrapped, "%s\n%s", create_raw,
+		    CREATE_DICTIONARIES_TABLE) < 0)
+			goto fail;
+		free(create_raw);
+		create_raw = wrapped;
+	} else {
+		write_proto = strdup("NEW.proto");
+		if (write_proto == NULL)
+			goto fail;
+	}
+
 	for (num_view_columns = 0;
 	     table->columns != NULL && table->columns[num_view_columns].name != NULL;
 	     num_view_columns++)
@@ -181,14 +641,41 @@ generate_proto_table(const struct proto_table *table)
 	for (size_t i = 0; i < num_view_columns; i++) {
 		const struct proto_column *column = &table->columns[i];
 		struct view_column *view = &view_columns[i];
-		char *update;
 
 		view->column_name = column->name;
-		if (asprintf(&view->expression,
-		    "CAST(protobuf_extract(proto, '%s', '%s', NULL) AS %s)",
-		    table->message_name, column->path, column->type) < 0) {
-			view->expression = NULL;
+		view->expression = column_expression(table, column, "proto");
+		if (view->expression == NULL)
 			goto fail;
+
+		if (shadow_name != NULL) {
+			view->stored_name = strdup(column->name);
+			if (view->stored_name == NULL)
+				goto fail;
+
+			if (asprintf(&view->view_expression, "%s.%s",
+			    shadow_name, column->name) < 0) {
+				view->view_expression = NULL;
+				goto fail;
+			}
+		} else if (column->stored) {
+			view->stored_name =
+			    stored_column_name(column, view->expression);
+			if (view->stored_name == NULL)
+				goto fail;
+
+			if (name_in_list(pending, num_pending,
+			    view->stored_name) == true) {
+				if (asprintf(&view->view_expression,
+				    "COALESCE(%s_raw.%s, %s)", table->name,
+				    view->stored_name, view->expression) < 0)
+					view->view_expression = NULL;
+			} else if (asprintf(&view->view_expression, "%s_raw.%s",
+			    table->name, view->stored_name) < 0) {
+				view->view_expression = NULL;
+			}
+
+			if (view->view_expression == NULL)
+				goto fail;
 		}
 
 		/* Weak selectors don't get auto indexes. */
@@ -207,39 +694,170 @@ generate_proto_table(const struct proto_table *table)
 			break;
 		}
 
+		view->indexed = view->auto_index;
+	}
+
+	/*
+	 * Expression indexes only match the exact same expression, so
+	 * indexed columns must keep calling `protobuf_extract` in the
+	 * view.
+	 */
+	for (size_t i = 0;
+	     table->indexes != NULL && table->indexes[i].name_suffix != NULL; i++) {
+		const struct proto_index *index = &table->indexes[i];
+
+		for (size_t j = 0; index->components[j] != NULL; j++) {
+			for (size_t k = 0; k < num_view_columns; k++) {
+				if (strcmp(index->components[j],
+				    view_columns[k].column_name) == 0)
+					view_columns[k].indexed = true;
+			}
+		}
+
+		for (size_t j = 0;
+		     index->include != NULL && index->include[j] != NULL; j++) {
+			for (size_t k = 0; k < num_view_columns; k++) {
+				if (strcmp(index->include[j],
+				    view_columns[k].column_name) == 0)
+					view_columns[k].indexed = true;
+			}
+		}
+	}
+
+	/*
+	 * If enabled, everything else comes from a single call to
+	 * `protobuf_fields`, which parses each row at most once,
+	 * instead of one call to `protobuf_extract` per column.
+	 */
+	for (size_t i = 0; table->use_protobuf_fields && i < num_view_columns;
+	     i++) {
+		if (view_columns[i].indexed == false &&
+		    view_columns[i].stored_name == NULL &&
+		    num_fields_paths < PROTOBUF_FIELDS_MAX_PATHS)
+			num_fields_paths++;
+	}
+
+	fields_paths = strdup("");
+	if (fields_paths == NULL)
+		goto fail;
+
+	for (size_t i = 0, path_index = 0;
+	     i < num_view_columns && num_fields_paths >= PROTOBUF_FIELDS_MIN_PATHS;
+	     i++) {
+		const struct proto_column *column = &table->columns[i];
+		struct view_column *view = &view_columns[i];
+		char *update;
+
+		if (view->indexed || view->stored_name != NULL ||
+		    path_index >= PROTOBUF_FIELDS_MAX_PATHS)
+			continue;
+
+		if (asprintf(&view->view_expression,
+		    "CAST(proto_fields.value%zu AS %s)",
+		    path_index, column->type) < 0) {
+			view->view_expression = NULL;
+			goto fail;
+		}
+
+		if (asprintf(&update, "%s, '%s'", fields_paths, column->path) < 0)
+			goto fail;
+		free(fields_paths);
+		fields_paths = update;
+		path_index++;
+	}
+
+	for (size_t i = 0; i < num_view_columns; i++) {
+		const struct view_column *view = &view_columns[i];
+		char *update;
+
 		/*
 		 * The simple string concatenation here is
 		 * quadratic-time and involves a lot of heap allocation,
 		 * but you have bigger problems with your schemas if
 		 * that's an issue.
 		 */
-		if (asprintf(&update, "%s,\n  %s", column_names, column->name) < 0)
+		if (asprintf(&update, "%s,\n  %s", column_names,
+		    view->column_name) < 0)
 			goto fail;
 		free(column_names);
 		column_names = update;
 
 		if (asprintf(&update, "%s,\n  %s", column_expressions,
-		    view->expression) < 0)
+		    (view->view_expression != NULL) ?
+		    view->view_expression : view->expression) < 0)
 			goto fail;
 		free(column_expressions);
 		column_expressions = update;
 	}
 
-	/*
-	 * Re-recreate our view: it's ok to drop the old view if any,
-	 * since it doesn't hold any data.
-	 */
-	if (asprintf(&create_view,
+	/* The presence summary comes last, after the declared columns. */
+	if (table->use_presence_summary) {
+		char *update;
+
+		presence = presence_expression(table, "proto");
+		presence_name = (presence != NULL) ?
+		    presence_column_name(presence) : NULL;
+		if (presence_name == NULL)
+			goto fail;
+
+		if (asprintf(&update, "%s,\n  proto_presence", column_names) < 0)
+			goto fail;
+		free(column_names);
+		column_names = update;
+
+		if (shadow_name != NULL) {
+			if (asprintf(&update,
+			    "%1$s,\n  (SELECT %2$s FROM %3$s_raw WHERE %3$s_raw.id = %4$s.id)",
+			    column_expressions, presence_name, table->name,
+			    shadow_name) < 0)
+				goto fail;
+		} else if (name_in_list(pending, num_pending,
+		    presence_name) == true) {
+			if (asprintf(&update, "%s,\n  COALESCE(%s_raw.%s, %s)",
+			    column_expressions, table->name, presence_name,
+			    presence) < 0)
+				goto fail;
+		} else if (asprintf(&update, "%s,\n  %s_raw.%s", column_expressions,
+		    table->name, presence_name) < 0) {
+			goto fail;
+		}
+
+		free(column_expressions);
+		column_expressions = update;
+	}
+
+	if (shadow_name != NULL) {
+		view_source = strdup(shadow_name);
+		if (view_source == NULL)
+			goto fail;
+	} else if (num_fields_paths >= PROTOBUF_FIELDS_MIN_PATHS) {
+		if (asprintf(&view_source,
+		    "%1$s_raw,\n"
+		    "  protobuf_fields(%1$s_raw.proto, '%2$s'%3$s) AS proto_fields",
+		    table->name, table->message_name, fields_paths) < 0) {
+			view_source = NULL;
+			goto fail;
+		}
+	} else if (asprintf(&view_source, "%s_raw", table->name) < 0) {
+		view_source = NULL;
+		goto fail;
+	}
+
+	/*
+	 * Re-recreate our view: it's ok to drop the old view if any,
+	 * since it doesn't hold any data.
+	 */
+	if (asprintf(&create_view,
 	    "DROP VIEW IF EXISTS %s;\n"
 	    "CREATE VIEW %s (\n"
 	    "  id,\n"
 	    "  proto%s\n"
 	    ") AS SELECT\n"
-	    "  id,\n"
-	    "  proto%s\n"
-	    "FROM %s_raw;",
-	    table->name, table->name, column_names, column_expressions,
-	    table->name) < 0) {
+	    "  %s,\n"
+	    "  %s%s\n"
+	    "FROM %s;",
+	    table->name, table->name, column_names, view_id, view_proto,
+	    column_expressions, view_source) < 0) {
 		create_view = NULL;
 		goto fail;
 	}
@@ -252,23 +870,137 @@ generate_proto_table(const struct proto_table *table)
 	    "DROP TRIGGER IF EXISTS %1$s_insert;\n"
 	    "CREATE TRIGGER %1$s_insert INSTEAD OF INSERT ON %1$s\n"
 	    "BEGIN\n"
-	    "  INSERT INTO %1$s_raw(proto) VALUES(NEW.proto);\n"
+	    "  INSERT INTO %1$s_raw(proto) VALUES(%2$s);\n"
 	    "END;\n"
 	    "DROP TRIGGER IF EXISTS %1$s_update;\n"
 	    "CREATE TRIGGER %1$s_update INSTEAD OF UPDATE OF proto ON %1$s\n"
 	    "BEGIN\n"
-	    "  UPDATE %1$s_raw SET proto = NEW.proto WHERE id = OLD.id;\n"
+	    "  UPDATE %1$s_raw SET proto = %2$s WHERE id = OLD.id;\n"
 	    "END;\n"
 	    "DROP TRIGGER IF EXISTS %1$s_delete;\n"
 	    "CREATE TRIGGER %1$s_delete INSTEAD OF DELETE ON %1$s\n"
 	    "BEGIN\n"
 	    "  DELETE FROM %1$s_raw WHERE id = OLD.id;\n"
 	    "END;",
-	    table->name) < 0) {
+	    table->name, write_proto) < 0) {
 		create_triggers = NULL;
 		goto fail;
 	}
 
+	create_stored_triggers = stored_triggers(table);
+	if (create_stored_triggers == NULL)
+		goto fail;
+
+	/*
+	 * The shadow table holds one row of extracted values for each
+	 * raw row.  It's only empty when the raw table is, unless we
+	 * just created it: backfill it in that case.  Triggers on the
+	 * raw table then keep it in sync, like stored columns.
+	 */
+	if (asprintf(&create_shadow_triggers,
+	    "DROP TRIGGER IF EXISTS %1$s_raw_shadow_insert;\n"
+	    "DROP TRIGGER IF EXISTS %1$s_raw_shadow_update;\n"
+	    "DROP TRIGGER IF EXISTS %1$s_raw_shadow_delete;",
+	    table->name) < 0) {
+		create_shadow_triggers = NULL;
+		goto fail;
+	}
+
+	create_shadow = strdup("");
+	if (create_shadow == NULL)
+		goto fail;
+
+	if (shadow_name != NULL) {
+		/* With a comma before each entry. */
+		char *definitions = strdup("");
+		char *names = strdup("");
+		char *values = strdup("");
+		char *new_values = strdup("");
+		char *update;
+		int r = -1;
+
+		for (size_t i = 0; i < num_view_columns && new_values != NULL;
+		     i++) {
+			const struct proto_column *column = &table->columns[i];
+			char *expression;
+
+#define APPEND(LIST, ...)                                                           \
+	do {                                                                        \
+		if (LIST == NULL || asprintf(&update, __VA_ARGS__) < 0) {           \
+			update = NULL;                                              \
+		}                                                                   \
+                                                                                    \
+		free(LIST);                                                         \
+		LIST = update;                                                      \
+	} while (0)
+
+			APPEND(definitions, "%s,\n  %s %s", definitions,
+			    column->name, column->type);
+			APPEND(names, "%s, %s", names, column->name);
+			APPEND(values, "%s,\n    %s", values,
+			    view_columns[i].expression);
+
+			expression = column_expression(table, column, "NEW.proto");
+			if (expression == NULL) {
+				free(new_values);
+				new_values = NULL;
+				break;
+			}
+
+			APPEND(new_values, "%s,\n    %s", new_values, expression);
+			free(expression);
+#undef APPEND
+		}
+
+		if (definitions != NULL && names != NULL && values != NULL &&
+		    new_values != NULL) {
+			r = asprintf(&update,
+			    "CREATE TABLE IF NOT EXISTS %1$s (\n"
+			    "  id INTEGER PRIMARY KEY ASC NOT NULL%2$s\n"
+			    ");\n"
+			    "INSERT INTO %1$s(id%3$s)\n"
+			    "  SELECT id%4$s\n"
+			    "  FROM %5$s_raw\n"
+			    "  WHERE NOT EXISTS (SELECT 1 FROM %1$s);",
+			    shadow_name, definitions, names, values, table->name);
+			if (r >= 0) {
+				free(create_shadow);
+				create_shadow = update;
+				r = asprintf(&update,
+				    "%1$s\n"
+				    "CREATE TRIGGER %2$s_raw_shadow_insert AFTER INSERT ON %2$s_raw\n"
+				    "BEGIN\n"
+				    "  INSERT OR REPLACE INTO %3$s(id%4$s)\n"
+				    "  VALUES(NEW.id%5$s);\n"
+				    "END;\n"
+				    "CREATE TRIGGER %2$s_raw_shadow_update AFTER UPDATE OF id, proto ON %2$s_raw\n"
+				    "BEGIN\n"
+				    "  DELETE FROM %3$s WHERE id = OLD.id;\n"
+				    "  INSERT OR REPLACE INTO %3$s(id%4$s)\n"
+				    "  VALUES(NEW.id%5$s);\n"
+				    "END;\n"
+				    "CREATE TRIGGER %2$s_raw_shadow_delete AFTER DELETE ON %2$s_raw\n"
+				    "BEGIN\n"
+				    "  DELETE FROM %3$s WHERE id = OLD.id;\n"
+				    "END;",
+				    create_shadow_triggers, table->name, shadow_name,
+				    names, new_values);
+			}
+
+			if (r >= 0) {
+				free(create_shadow_triggers);
+				create_shadow_triggers = update;
+			}
+		}
+
+		free(definitions);
+		free(names);
+		free(values);
+		free(new_values);
+		if (r < 0)
+			goto fail;
+	}
+
 	/* Add an index for each view column. */
 	create_indexes = strdup("");
 	for (size_t i = 0; i < num_view_columns; i++) {
@@ -286,8 +1018,8 @@ generate_proto_table(const struct proto_table *table)
 		if (view_columns[i].auto_index == false)
 			continue;
 
-		stmt = create_index(&index_name, table->name, view_columns,
-		    num_view_columns, &index, /*auto_index=*/true);
+		stmt = create_index(&index_name, table->name, shadow_name,
+		    view_columns, num_view_columns, &index, /*auto_index=*/true);
 		if (stmt == NULL)
 			goto fail;
 
@@ -326,8 +1058,9 @@ generate_proto_table(const struct proto_table *table)
 		char *index_name, *stmt, *update;
 		int r;
 
-		stmt = create_index(&index_name, table->name, view_columns,
-		    num_view_columns, &table->indexes[i], /*auto_index=*/false);
+		stmt = create_index(&index_name, table->name, shadow_name,
+		    view_columns, num_view_columns, &table->indexes[i],
+		    /*auto_index=*/false);
 		if (stmt == NULL)
 			goto fail;
 
@@ -336,6 +1069,46 @@ generate_proto_table(const struct proto_table *table)
 #undef HANDLE_INDEX
 	}
 
+	/*
+	 * Like the view, the scan table holds no data: recreate it
+	 * with the current columns.
+	 */
+	create_scan = strdup("");
+	if (create_scan == NULL)
+		goto fail;
+
+	if (table->create_scan_table) {
+		char *columns = strdup("");
+		char *update;
+
+		for (size_t i = 0; i < num_view_columns && columns != NULL; i++) {
+			const struct proto_column *column = &table->columns[i];
+
+			if (asprintf(&update, "%s,\n  %s '%s'", columns,
+			    column->name, column->path) < 0)
+				update = NULL;
+			free(columns);
+			columns = update;
+		}
+
+		if (columns == NULL)
+			goto fail;
+
+		if (asprintf(&update,
+		    "DROP TABLE IF EXISTS %1$s_scan;\n"
+		    "CREATE VIRTUAL TABLE %1$s_scan USING protobuf_scan(\n"
+		    "  %1$s_raw, '%2$s'%3$s\n"
+		    ");",
+		    table->name, table->message_name, columns) < 0) {
+			free(columns);
+			goto fail;
+		}
+
+		free(columns);
+		free(create_scan);
+		create_scan = update;
+	}
+
 	/*
 	 * List all `proto_index__` and `proto_autoindex__` indexes
 	 * associated with the underlying raw table that we wouldn't
@@ -345,21 +1118,23 @@ generate_proto_table(const struct proto_table *table)
 	 */
 	if (asprintf(&select_bad_indexes,
 	    "SELECT name FROM sqlite_master WHERE\n"
-	    "  type = 'index' AND tbl_name = '%s_raw' AND\n"
+	    "  type = 'index' AND tbl_name IN ('%s_raw', '%s') AND\n"
 	    "  (name LIKE 'proto_index__%%' OR name LIKE 'proto_autoindex__%%') AND\n"
 	    "  name NOT IN (%s);",
-	    table->name, index_names) < 0) {
+	    table->name, (shadow_name != NULL) ? shadow_name : "",
+	    index_names) < 0) {
 		select_bad_indexes = NULL;
 		goto fail;
 	}
 
 	if (asprintf(&ret,
 	    "BEGIN EXCLUSIVE TRANSACTION;\n"
-	    "%s\n%s\n\n%s\n%s\n"
+	    "%s\n%s\n%s\n\n%s\n%s\n%s\n%s\n%s\n"
 	    "COMMIT TRANSACTION;\n"
 	    "\n%s",
-	    create_raw, create_view, create_triggers, create_indexes,
-	    select_bad_indexes) < 0) {
+	    create_raw, create_shadow, create_view, create_triggers,
+	    create_stored_triggers, create_shadow_triggers, create_indexes,
+	    create_scan, select_bad_indexes) < 0) {
 		ret = NULL;
 		goto fail;
 	}
@@ -368,13 +1143,27 @@ out:
 	free(create_raw);
 	free(create_view);
 	free(create_triggers);
+	free(create_scan);
+	free(presence);
+	free(presence_name);
+	free(create_stored_triggers);
+	free(shadow_name);
+	free(create_shadow);
+	free(create_shadow_triggers);
+	free(view_id);
+	free(view_proto);
+	free(write_proto);
 	free(column_names);
 	free(column_expressions);
+	free(fields_paths);
+	free(view_source);
 	free(index_names);
 	free(create_indexes);
 
 	for (size_t i = 0; i < num_view_columns; i++) {
 		free(view_columns[i].expression);
+		free(view_columns[i].view_expression);
+		free(view_columns[i].stored_name);
 	}
 
 	free(view_columns);
@@ -428,245 +1217,1876 @@ bad_indexes_callback(void *thunk, int nargs, char **values, char **columns)
 }
 
 /**
- * Ensures the `spec`ced table in `db` is in the expected state.
- *
- * If the `command_cache` pointee is NULL, the pointer will be
- * populated with a cached SQL string that corresponds to `spec`; if
- * its pointee is non-NULL, it must have been generated by a prior
- * call to `setup_proto_table` for the same `spec`.
+ * Returns whether the raw table column `name` exists, given a
+ * `PRAGMA table_info` statement for that table.
  */
-int
-proto_table_setup(char **command_cache, sqlite3 *db, const struct proto_table *spec)
+static bool
+raw_column_exists(sqlite3_stmt *table_info, const char *name)
 {
-	struct bad_indexes bad_indexes = {
-		.log_to_stderr = spec->log_sql_to_stderr,
-	};
-	char *error;
-	int rc;
+	bool ret = false;
 
-	if (*command_cache == NULL) {
-		*command_cache = generate_proto_table(spec);
-		if (*command_cache == NULL)
-			return SQLITE_NOMEM;
+	while (ret == false && sqlite3_step(table_info) == SQLITE_ROW) {
+		const char *column = (const char *)sqlite3_column_text(table_info, 1);
 
-		if (spec->log_sql_to_stderr == true) {
-			fprintf(stderr, "proto_index SQL for %s:\n%s\n", spec->name,
-			    *command_cache);
-		}
+		ret = (column != NULL && strcmp(column, name) == 0);
 	}
 
-	rc = sqlite3_exec(
-	    db, *command_cache, bad_indexes_callback, &bad_indexes, &error);
-	if (rc != SQLITE_OK)
-		goto fail_sqlite;
+	(void)sqlite3_reset(table_info);
+	return ret;
+}
 
-	for (size_t i = 0; i < bad_indexes.num_names; i++) {
-		char *remove_bad_index;
+/**
+ * Adds the raw column `name` of `type` to the `spec`ced raw table,
+ * unless it already exists, and sets it to `expression` for existing
+ * rows, or records a deferred backfill if the spec defers index
+ * builds.
+ */
+static int
+add_raw_column(sqlite3 *db, const struct proto_table *spec,
+    sqlite3_stmt *table_info, const char *name, const char *type,
+    const char *expression, char **error)
+{
+	char *sql;
+	int r, rc;
 
-		if (asprintf(&remove_bad_index, "DROP INDEX IF EXISTS \"%s\";",
-		    bad_indexes.names[i]) < 0) {
-			rc = SQLITE_NOMEM;
-			goto out;
-		}
+	if (raw_column_exists(table_info, name) == true)
+		return SQLITE_OK;
 
-		rc = sqlite3_exec(db, remove_bad_index, NULL, NULL, &error);
-		free(remove_bad_index);
-		if (rc != SQLITE_OK)
-			goto fail_sqlite;
+	if (spec->log_sql_to_stderr == true) {
+		fprintf(stderr, "Adding stored column %s to %s_raw%s\n",
+		    name, spec->name,
+		    spec->defer_index_builds ? ", deferring its backfill" : "");
 	}
 
-out:
-	for (size_t i = 0; i < bad_indexes.num_names; i++)
-		free(bad_indexes.names[i]);
-	free(bad_indexes.names);
-	return rc;
+	if (spec->defer_index_builds) {
+		/* Nothing to backfill in an empty table. */
+		r = asprintf(&sql,
+		    "ALTER TABLE %1$s_raw ADD COLUMN %2$s %3$s;\n"
+		    CREATE_INDEX_BUILDS_TABLE "\n"
+		    "INSERT OR REPLACE INTO proto_index_builds(\n"
+		    "  table_name, column_name, next_id, last_id)\n"
+		    "  SELECT '%1$s', '%2$s', MIN(id) - 1, MAX(id)\n"
+		    "  FROM %1$s_raw HAVING COUNT(*) > 0;",
+		    spec->name, name, type);
+	} else {
+		r = asprintf(&sql,
+		    "ALTER TABLE %1$s_raw ADD COLUMN %2$s %3$s;\n"
+		    "UPDATE %1$s_raw SET %2$s = %4$s;",
+		    spec->name, name, type, expression);
+	}
 
-fail_sqlite:
-	fprintf(stderr, "sqlite_exec failed for table %s: %s, rc=%i\n", spec->name,
-	    error ?: "unknown error", rc);
-	sqlite3_free(error);
-	goto out;
+	if (r < 0)
+		return SQLITE_NOMEM;
+
+	rc = sqlite3_exec(db, sql, NULL, NULL, error);
+	free(sql);
+	return rc;
 }
 
-int64_t
-proto_table_paginate(sqlite3 *db, const char *table, int64_t begin, size_t wanted)
+/**
+ * Adds any missing stored column (and presence summary column) to the
+ * `spec`ced raw table, computes their values for existing rows, and
+ * creates the triggers that maintain them, all in one transaction.
+ * The setup SQL's view and indexes refer to these columns, so this
+ * must run first.
+ */
+static int
+add_stored_columns(sqlite3 *db, const struct proto_table *spec, char **error)
 {
-	char *template;
-	sqlite3_stmt *stmt = NULL;
-	int64_t ret;
+	sqlite3_stmt *table_info = NULL;
+	char *sql = NULL;
+	bool any_stored = false;
 	int rc;
 
-	if (asprintf(&template,
-	    " SELECT COALESCE(MAX(id), :begin)"
-	    " FROM ("
-	    "   SELECT id"
-	    "   FROM `%s`"
-	    "   WHERE id > :begin"
-	    "   ORDER BY id ASC"
-	    "   LIMIT :wanted"
-	    " )",
-	    table) < 0) {
-		return -(int64_t)SQLITE_NOMEM;
-	}
+	/* Shadow tables hold all the columns. */
+	for (size_t i = 0; spec->columns != NULL && spec->columns[i].name != NULL &&
+	     spec->use_shadow_table == false; i++)
+		any_stored = any_stored || spec->columns[i].stored;
 
-	rc = proto_prepare(db, &stmt, template);
-	if (rc != SQLITE_OK) {
-		fprintf(
-		    stderr, "failed to prepare pagination statement. rc=%i\n", rc);
-		ret = -(int64_t)rc;
+	if (any_stored == false && spec->use_presence_summary == false)
+		return SQLITE_OK;
+
+	if (asprintf(&sql, "BEGIN EXCLUSIVE TRANSACTION;\n" CREATE_RAW_TABLE_FORMAT,
+	    spec->name) < 0)
+		return SQLITE_NOMEM;
+
+	rc = sqlite3_exec(db, sql, NULL, NULL, error);
+	free(sql);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	if (asprintf(&sql, "PRAGMA table_info(`%s_raw`);", spec->name) < 0) {
+		rc = SQLITE_NOMEM;
 		goto out;
 	}
 
-	if ((rc = PROTO_BIND(stmt, ":begin", begin)) != SQLITE_OK ||
-	    (rc = PROTO_BIND(stmt, ":wanted", wanted)) != SQLITE_OK) {
-		fprintf(stderr, "failed to bind pagination parameters. rc=%i\n", rc);
-		ret = -(int64_t)rc;
+	rc = proto_prepare(db, &table_info, sql);
+	free(sql);
+	if (rc != SQLITE_OK)
 		goto out;
-	}
 
-	rc = sqlite3_step(stmt);
-	switch (rc) {
-	case SQLITE_DONE:
-		ret = begin;
-		break;
+	for (size_t i = 0; any_stored && spec->columns[i].name != NULL; i++) {
+		const struct proto_column *column = &spec->columns[i];
+		char *expression;
+		char *name;
 
-	case SQLITE_ROW:
-		ret = sqlite3_column_int64(stmt, 0);
-		break;
+		if (column->stored == false)
+			continue;
 
-	default:
-		fprintf(stderr, "failed to execute pagination query. rc=%i\n", rc);
-		ret = -(int64_t)rc;
-		break;
+		expression = column_expression(spec, column, "proto");
+		name = (expression != NULL) ?
+		    stored_column_name(column, expression) : NULL;
+		rc = (name != NULL) ? add_raw_column(db, spec, table_info, name,
+		    column->type, expression, error) : SQLITE_NOMEM;
+		free(expression);
+		free(name);
+		if (rc != SQLITE_OK)
+			goto out;
 	}
 
-out:
-	(void)sqlite3_finalize(stmt);
-	free(template);
-	return ret;
-}
+	if (spec->use_presence_summary) {
+		char *expression;
+		char *name;
 
-int
-proto_db_transaction_begin(struct proto_db *db)
-{
-	char *err = NULL;
-	int rc;
+		expression = presence_expression(spec, "proto");
+		name = (expression != NULL) ?
+		    presence_column_name(expression) : NULL;
+		rc = (name != NULL) ? add_raw_column(db, spec, table_info, name,
+		    "BLOB", expression, error) : SQLITE_NOMEM;
+		free(expression);
+		free(name);
+		if (rc != SQLITE_OK)
+			goto out;
+	}
 
-	if (db->transaction_depth++ > 0) {
-		assert(db->transaction_depth > 0);
-		return SQLITE_OK;
+	/*
+	 * Create the triggers before anyone else can write to the raw
+	 * table, or their rows would never get their stored values.
+	 */
+	sql = stored_triggers(spec);
+	if (sql == NULL) {
+		rc = SQLITE_NOMEM;
+		goto out;
 	}
 
-	rc = sqlite3_exec(db->db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, &err);
-	if (rc != 0) {
-		db->transaction_depth--;
-		fprintf(stderr, "failed to open sqlite transaction, rc=%i: %s\n", rc,
-		    err ?: "unknown error");
+	rc = sqlite3_exec(db, sql, NULL, NULL, error);
+	free(sql);
+
+out:
+	sqlite3_finalize(table_info);
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, NULL, error);
+	} else {
+		(void)sqlite3_exec(db, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
 	}
 
-	sqlite3_free(err);
 	return rc;
 }
 
-void
-proto_db_transaction_end(struct proto_db *db)
+/**
+ * Finds the expression for the raw column `name` of the `spec`ced
+ * table, i.e., for a stored column or the presence summary.  Sets
+ * `*OUT_expression` to NULL if the spec has no such column.
+ *
+ * Returns SQLITE_OK on success, and SQLITE_NOMEM on failure.
+ */
+static int
+raw_column_expression(char **OUT_expression, const struct proto_table *spec,
+    const char *name)
 {
-	char *err = NULL;
-	int rc;
+	char *expression = NULL;
+	char *column_name = NULL;
 
-	assert(db->transaction_depth > 0);
-	if (--db->transaction_depth > 0) {
-		/* Cycle if we now can. */
-		proto_db_count_writes(db, 0);
-		return;
+	*OUT_expression = NULL;
+	for (size_t i = 0; spec->columns != NULL && spec->columns[i].name != NULL &&
+	     spec->use_shadow_table == false; i++) {
+		const struct proto_column *column = &spec->columns[i];
+
+		if (column->stored == false)
+			continue;
+
+		expression = column_expression(spec, column, "proto");
+		column_name = (expression != NULL) ?
+		    stored_column_name(column, expression) : NULL;
+		if (column_name == NULL)
+			goto fail;
+
+		if (strcmp(column_name, name) == 0)
+			goto found;
+
+		free(expression);
+		free(column_name);
 	}
 
-	db->write_count = 0;
-	rc = sqlite3_exec(db->db, "COMMIT TRANSACTION;", NULL, NULL, &err);
-	if (rc != 0) {
-		fprintf(stderr, "failed to commit sqlite transaction, rc=%i: %s\n",
-		    rc, err ?: "unknown error");
-		abort();
+	if (spec->use_presence_summary) {
+		expression = presence_expression(spec, "proto");
+		column_name = (expression != NULL) ?
+		    presence_column_name(expression) : NULL;
+		if (column_name == NULL)
+			goto fail;
+
+		if (strcmp(column_name, name) == 0)
+			goto found;
+
+		free(expression);
+		free(column_name);
 	}
 
-	sqlite3_free(err);
-	return;
-}
+	return SQLITE_OK;
 
-int
-proto_db_batch_begin(struct proto_db *db)
-{
+found:
+	free(column_name);
+	*OUT_expression = expression;
+	return SQLITE_OK;
 
-	db->autocommit_depth++;
-	assert(db->autocommit_depth > 0);
-	return proto_db_transaction_begin(db);
+fail:
+	free(expression);
+	return SQLITE_NOMEM;
 }
 
-void
-proto_db_batch_end(struct proto_db *db)
+/**
+ * Returns whether `db` has a `proto_index_builds` table, i.e., if
+ * any proto table ever deferred a backfill.
+ */
+static bool
+has_index_builds(sqlite3 *db)
 {
+	sqlite3_stmt *stmt;
+	bool ret;
 
-	proto_db_transaction_end(db);
-	assert(db->autocommit_depth > 0);
-	db->autocommit_depth--;
-	return;
+	if (proto_prepare(db, &stmt,
+	    "SELECT 1 FROM sqlite_master WHERE\n"
+	    "  type = 'table' AND name = 'proto_index_builds';") != SQLITE_OK)
+		return false;
+
+	ret = (sqlite3_step(stmt) == SQLITE_ROW);
+	sqlite3_finalize(stmt);
+	return ret;
 }
 
-void
-proto_db_count_writes(struct proto_db *db, size_t n)
+/**
+ * Collects the raw columns of the `spec`ced table whose deferred
+ * backfill is still pending in `pending`.  Forgets the backfills for
+ * columns the spec doesn't have anymore, and completes the others
+ * right away, unless the spec defers index builds.
+ */
+static int
+pending_index_builds(sqlite3 *db, const struct proto_table *spec,
+    struct bad_indexes *pending, char **error)
 {
-	char *err = NULL;
-	uint32_t batch_size = db->batch_size ?: AUTOCOMMIT_BATCH_SIZE;
+	struct bad_indexes builds = { 0 };
+	char *sql;
 	int rc;
 
-	if (db->transaction_depth == 0)
-		return;
+	if (has_index_builds(db) == false)
+		return SQLITE_OK;
 
-	if (db->write_count < batch_size && n < batch_size - db->write_count) {
-		db->write_count += n;
-		return;
-	}
+	rc = sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, error);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	if (asprintf(&sql,
+	    "SELECT column_name FROM proto_index_builds\n"
+	    "  WHERE table_name = '%s' ORDER BY rowid;", spec->name) < 0) {
+		rc = SQLITE_NOMEM;
+		goto out;
+	}
+
+	rc = sqlite3_exec(db, sql, bad_indexes_callback, &builds, error);
+	for (size_t i = 0; rc == SQLITE_OK && i < builds.num_names; i++) {
+		const char *name = builds.names[i];
+		char *expression;
+		char *update;
+		int r;
+
+		rc = raw_column_expression(&expression, spec, name);
+		if (rc != SQLITE_OK)
+			break;
+
+		if (expression != NULL && spec->defer_index_builds) {
+			free(expression);
+			continue;
+		}
+
+		if (spec->log_sql_to_stderr == true) {
+			fprintf(stderr, "%s the backfill of %s_raw.%s\n",
+			    (expression != NULL) ? "Completing" : "Forgetting",
+			    spec->name, name);
+		}
+
+		if (expression != NULL) {
+			r = asprintf(&update,
+			    "UPDATE %1$s_raw SET %2$s = %3$s WHERE id > (\n"
+			    "  SELECT next_id FROM proto_index_builds\n"
+			    "  WHERE table_name = '%1$s' AND column_name = '%2$s');\n"
+			    "DELETE FROM proto_index_builds\n"
+			    "  WHERE table_name = '%1$s' AND column_name = '%2$s';",
+			    spec->name, name, expression);
+		} else {
+			r = asprintf(&update,
+			    "DELETE FROM proto_index_builds\n"
+			    "  WHERE table_name = '%1$s' AND column_name = '%2$s';",
+			    spec->name, name);
+		}
+
+		free(expression);
+		if (r < 0) {
+			rc = SQLITE_NOMEM;
+			break;
+		}
+
+		rc = sqlite3_exec(db, update, NULL, NULL, error);
+		free(update);
+	}
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_exec(db, sql, bad_indexes_callback, pending, error);
+	free(sql);
+
+out:
+	for (size_t i = 0; i < builds.num_names; i++)
+		free(builds.names[i]);
+	free(builds.names);
+
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, NULL, error);
+	} else {
+		(void)sqlite3_exec(db, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+	}
+
+	return rc;
+}
+
+/**
+ * Drops the `spec`ced table's shadow tables for other column
+ * definitions, or all of them if the spec doesn't use a shadow table.
+ */
+static int
+drop_stale_shadow_tables(sqlite3 *db, const struct proto_table *spec,
+    char **error)
+{
+	struct bad_indexes stale = { 0 };
+	char *current = NULL;
+	char *sql;
+	int rc;
+
+	if (spec->use_shadow_table) {
+		current = shadow_table_name(spec);
+		if (current == NULL)
+			return SQLITE_NOMEM;
+	}
+
+	/* Match the exact shape of shadow names, not just a prefix. */
+	if (asprintf(&sql,
+	    "SELECT name FROM sqlite_master WHERE\n"
+	    "  type = 'table' AND name != '%s' AND\n"
+	    "  name GLOB 'proto_shadow__%s__'"
+	    " || replace(hex(zeroblob(32)), '00', '[0-9a-f]');",
+	    (current != NULL) ? current : "", spec->name) < 0) {
+		free(current);
+		return SQLITE_NOMEM;
+	}
+
+	free(current);
+	rc = sqlite3_exec(db, sql, bad_indexes_callback, &stale, error);
+	free(sql);
+
+	for (size_t i = 0; rc == SQLITE_OK && i < stale.num_names; i++) {
+		if (spec->log_sql_to_stderr == true)
+			fprintf(stderr, "Dropping stale shadow table: %s\n",
+			    stale.names[i]);
+
+		if (asprintf(&sql, "DROP TABLE IF EXISTS \"%s\";",
+		    stale.names[i]) < 0) {
+			rc = SQLITE_NOMEM;
+			break;
+		}
+
+		rc = sqlite3_exec(db, sql, NULL, NULL, error);
+		free(sql);
+	}
+
+	for (size_t i = 0; i < stale.num_names; i++)
+		free(stale.names[i]);
+	free(stale.names);
+	return rc;
+}
+
+/**
+ * Returns the fingerprint of the setup SQL `sql`, as a hex string.
+ */
+static char *
+setup_fingerprint(const char *sql)
+{
+	struct umash_fp fp;
+	char *ret;
+
+	fp = umash_fprint(&index_fp_params, 0, sql, strlen(sql));
+	if (asprintf(&ret, "%016" PRIx64 "%016" PRIx64, fp.hash[0],
+	    fp.hash[1]) < 0)
+		return NULL;
+
+	return ret;
+}
+
+/**
+ * Fingerprints the definition of every schema object for `table`:
+ * the view, the raw table, the scan table, shadow tables, and their
+ * triggers and indexes.  Anything that drops or redefines them, e.g.,
+ * a manual `DROP INDEX`, changes the fingerprint.
+ *
+ * Returns SQLITE_OK on success, and an sqlite error code on failure.
+ */
+static int
+schema_fingerprint(char **OUT_fingerprint, sqlite3 *db, const char *table)
+{
+	struct umash_fp fp = { 0 };
+	sqlite3_stmt *stmt;
+	int rc;
+
+	*OUT_fingerprint = NULL;
+	rc = proto_prepare(db, &stmt,
+	    "SELECT type || ' ' || name || ' ' || COALESCE(sql, '')\n"
+	    "FROM sqlite_master WHERE\n"
+	    "  tbl_name IN (:table, :table || '_raw', :table || '_scan') OR\n"
+	    "  tbl_name GLOB 'proto_shadow__' || :table || '__*'\n"
+	    "ORDER BY type, name;");
+	if (rc != SQLITE_OK)
+		return rc;
+
+	rc = PROTO_BIND(stmt, ":table", table);
+	while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *definition = (const char *)sqlite3_column_text(stmt, 0);
+
+		fp = umash_fprint(&index_fp_params, fp.hash[0], definition,
+		    (definition != NULL) ? strlen(definition) : 0);
+		rc = SQLITE_OK;
+	}
+
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE)
+		return rc;
+
+	if (asprintf(OUT_fingerprint, "%016" PRIx64 "%016" PRIx64, fp.hash[0],
+	    fp.hash[1]) < 0) {
+		*OUT_fingerprint = NULL;
+		return SQLITE_NOMEM;
+	}
+
+	return SQLITE_OK;
+}
+
+/**
+ * Returns whether the last complete setup of `table` in `db` ran the
+ * setup SQL with `fingerprint`, and nothing changed `table`'s schema
+ * since.  Only reads the database: the schema cookie doesn't change,
+ * so other connections' prepared statements stay valid.
+ */
+static bool
+setup_is_current(sqlite3 *db, const char *table, const char *fingerprint)
+{
+	sqlite3_stmt *stmt;
+	char *schema = NULL;
+	bool ret = false;
+
+	/* Fails if there's no `proto_table_setups` table yet. */
+	if (proto_prepare(db, &stmt,
+	    "SELECT schema_fingerprint FROM proto_table_setups\n"
+	    "  WHERE table_name = :table AND fingerprint = :fingerprint;") != SQLITE_OK)
+		return false;
+
+	if (PROTO_BIND(stmt, ":table", table) == SQLITE_OK &&
+	    PROTO_BIND(stmt, ":fingerprint", fingerprint) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW &&
+	    schema_fingerprint(&schema, db, table) == SQLITE_OK) {
+		const char *recorded = (const char *)sqlite3_column_text(stmt, 0);
+
+		ret = (recorded != NULL && strcmp(recorded, schema) == 0);
+	}
+
+	sqlite3_finalize(stmt);
+	free(schema);
+	return ret;
+}
+
+/**
+ * Records that the last complete setup of `spec` ran the setup SQL
+ * with `fingerprint`, along with the schema it left behind.
+ */
+static int
+record_setup(sqlite3 *db, const struct proto_table *spec,
+    const char *fingerprint, char **error)
+{
+	sqlite3_stmt *stmt;
+	char *schema;
+	int rc;
+
+	rc = sqlite3_exec(db, CREATE_TABLE_SETUPS_TABLE, NULL, NULL, error);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	rc = schema_fingerprint(&schema, db, spec->name);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	rc = proto_prepare(db, &stmt,
+	    "INSERT OR REPLACE INTO proto_table_setups(\n"
+	    "  table_name, fingerprint, schema_fingerprint, compressed)\n"
+	    "  VALUES(:table, :fingerprint, :schema, :compressed);");
+	if (rc != SQLITE_OK) {
+		free(schema);
+		return rc;
+	}
+
+	if ((rc = PROTO_BIND(stmt, ":table", spec->name)) == SQLITE_OK &&
+	    (rc = PROTO_BIND(stmt, ":fingerprint", fingerprint)) == SQLITE_OK &&
+	    (rc = PROTO_BIND(stmt, ":schema", schema)) == SQLITE_OK &&
+	    (rc = PROTO_BIND(stmt, ":compressed",
+	    (int64_t)spec->compress_protos)) == SQLITE_OK) {
+		rc = sqlite3_step(stmt);
+		rc = (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+	}
+
+	sqlite3_finalize(stmt);
+	free(schema);
+	return rc;
+}
+
+/**
+ * Ensures the `spec`ced table in `db` is in the expected state.
+ *
+ * If the `command_cache` pointee is NULL, the pointer will be
+ * populated with a cached SQL string that corresponds to `spec`; if
+ * its pointee is non-NULL, it must have been generated by a prior
+ * call to `setup_proto_table` for the same `spec`.
+ */
+int
+proto_table_setup(char **command_cache, sqlite3 *db, const struct proto_table *spec)
+{
+	struct bad_indexes bad_indexes = {
+		.log_to_stderr = spec->log_sql_to_stderr,
+	};
+	struct bad_indexes pending = { 0 };
+	/* Setup SQL for pending backfills, which isn't cached. */
+	char *pending_sql = NULL;
+	char *fingerprint;
+	char *error;
+	int rc;
+
+	if (*command_cache == NULL) {
+		*command_cache = generate_proto_table(spec, NULL, 0);
+		if (*command_cache == NULL)
+			return SQLITE_NOMEM;
+
+		if (spec->log_sql_to_stderr == true) {
+			fprintf(stderr, "proto_index SQL for %s:\n%s\n", spec->name,
+			    *command_cache);
+		}
+	}
+
+	/*
+	 * Nothing to do if the last setup ran the same SQL: it set up
+	 * the same raw columns, view, triggers and indexes.  While
+	 * backfills are pending, the last setup ran different SQL.
+	 */
+	fingerprint = setup_fingerprint(*command_cache);
+	if (fingerprint == NULL)
+		return SQLITE_NOMEM;
+
+	if (setup_is_current(db, spec->name, fingerprint) == true) {
+		free(fingerprint);
+		return SQLITE_OK;
+	}
+
+	error = NULL;
+	rc = add_stored_columns(db, spec, &error);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+	rc = pending_index_builds(db, spec, &pending, &error);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+	if (pending.num_names > 0) {
+		pending_sql = generate_proto_table(spec, pending.names,
+		    pending.num_names);
+		if (pending_sql == NULL) {
+			rc = SQLITE_NOMEM;
+			goto out;
+		}
+
+		if (spec->log_sql_to_stderr == true) {
+			fprintf(stderr, "proto_index SQL for %s, while backfilling:\n%s\n",
+			    spec->name, pending_sql);
+		}
+	}
+
+	rc = sqlite3_exec(db, (pending_sql != NULL) ? pending_sql : *command_cache,
+	    bad_indexes_callback, &bad_indexes, &error);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+	for (size_t i = 0; i < bad_indexes.num_names; i++) {
+		char *remove_bad_index;
+
+		if (asprintf(&remove_bad_index, "DROP INDEX IF EXISTS \"%s\";",
+		    bad_indexes.names[i]) < 0) {
+			rc = SQLITE_NOMEM;
+			goto out;
+		}
+
+		rc = sqlite3_exec(db, remove_bad_index, NULL, NULL, &error);
+		free(remove_bad_index);
+		if (rc != SQLITE_OK)
+			goto fail_sqlite;
+	}
+
+	rc = drop_stale_shadow_tables(db, spec, &error);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+	if (pending_sql != NULL) {
+		free(fingerprint);
+		fingerprint = setup_fingerprint(pending_sql);
+		if (fingerprint == NULL) {
+			rc = SQLITE_NOMEM;
+			goto out;
+		}
+	}
+
+	rc = record_setup(db, spec, fingerprint, &error);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+out:
+	for (size_t i = 0; i < bad_indexes.num_names; i++)
+		free(bad_indexes.names[i]);
+	free(bad_indexes.names);
+	for (size_t i = 0; i < pending.num_names; i++)
+		free(pending.names[i]);
+	free(pending.names);
+	free(pending_sql);
+	free(fingerprint);
+	return rc;
+
+fail_sqlite:
+	fprintf(stderr, "sqlite_exec failed for table %s: %s, rc=%i\n", spec->name,
+	    error ?: "unknown error", rc);
+	sqlite3_free(error);
+	goto out;
+}
+
+static int table_paginate(int64_t *OUT_end, sqlite3 *db, const char *table,
+    int64_t begin, size_t wanted);
+
+int
+proto_table_build_step(char **command_cache, sqlite3 *db,
+    const struct proto_table *spec, size_t max_rows,
+    struct proto_index_build_progress *OUT_progress)
+{
+	struct proto_index_build_progress progress = { 0 };
+	sqlite3_stmt *stmt = NULL;
+	char *raw_name = NULL;
+	char *name = NULL;
+	char *expression = NULL;
+	char *sql = NULL;
+	char *error = NULL;
+	bool complete = false;
+	int64_t end;
+	int rc;
+
+	if (OUT_progress != NULL)
+		*OUT_progress = progress;
+
+	if (has_index_builds(db) == false)
+		return SQLITE_DONE;
+
+	rc = sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, &error);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+	rc = proto_prepare(db, &stmt,
+	    "SELECT column_name, next_id, last_id, rows_done,\n"
+	    "  (SELECT COUNT(*) FROM proto_index_builds WHERE table_name = :table)\n"
+	    "FROM proto_index_builds WHERE table_name = :table\n"
+	    "ORDER BY rowid LIMIT 1;");
+	if (rc == SQLITE_OK)
+		rc = PROTO_BIND(stmt, ":table", spec->name);
+	if (rc != SQLITE_OK)
+		goto out;
+
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW) {
+		rc = (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+		goto out;
+	}
+
+	name = strdup((const char *)sqlite3_column_text(stmt, 0) ?: "");
+	progress.next_id = sqlite3_column_int64(stmt, 1);
+	progress.last_id = sqlite3_column_int64(stmt, 2);
+	progress.rows_done = sqlite3_column_int64(stmt, 3);
+	progress.pending_columns = (size_t)sqlite3_column_int64(stmt, 4);
+	rc = (name != NULL) ? raw_column_expression(&expression, spec, name) :
+	    SQLITE_NOMEM;
+	if (rc != SQLITE_OK)
+		goto out;
+
+	/* The next setup forgets columns that aren't in the spec anymore. */
+	if (expression == NULL) {
+		complete = true;
+		goto update;
+	}
+
+	if (asprintf(&raw_name, "%s_raw", spec->name) < 0) {
+		raw_name = NULL;
+		rc = SQLITE_NOMEM;
+		goto out;
+	}
+
+	/* Row ids may be negative, so we can't use proto_table_paginate. */
+	rc = table_paginate(&end, db, raw_name, progress.next_id,
+	    (max_rows > 0) ? max_rows : 1);
+	if (rc != SQLITE_OK)
+		goto out;
+
+	if (end > progress.last_id)
+		end = progress.last_id;
+
+	if (end > progress.next_id) {
+		if (asprintf(&sql,
+		    "UPDATE %s_raw SET %s = %s WHERE id > %" PRId64 " AND id <= %" PRId64 ";",
+		    spec->name, name, expression, progress.next_id, end) < 0) {
+			sql = NULL;
+			rc = SQLITE_NOMEM;
+			goto out;
+		}
+
+		rc = sqlite3_exec(db, sql, NULL, NULL, &error);
+		free(sql);
+		sql = NULL;
+		if (rc != SQLITE_OK)
+			goto fail_sqlite;
+
+		progress.rows = sqlite3_changes(db);
+		progress.rows_done += progress.rows;
+		progress.next_id = end;
+	}
+
+	complete = (end >= progress.last_id || progress.rows == 0);
+
+update:
+	if (complete == true) {
+		progress.pending_columns--;
+		if (spec->log_sql_to_stderr == true) {
+			fprintf(stderr, "Backfilled %s_raw.%s: %" PRId64 " rows\n",
+			    spec->name, name, progress.rows_done);
+		}
+
+		if (asprintf(&sql,
+		    "DELETE FROM proto_index_builds\n"
+		    "  WHERE table_name = '%s' AND column_name = '%s';",
+		    spec->name, name) < 0)
+			sql = NULL;
+	} else if (asprintf(&sql,
+	    "UPDATE proto_index_builds\n"
+	    "  SET next_id = %" PRId64 ", rows_done = %" PRId64 "\n"
+	    "  WHERE table_name = '%s' AND column_name = '%s';",
+	    progress.next_id, progress.rows_done, spec->name, name) < 0) {
+		sql = NULL;
+	}
+
+	if (sql == NULL) {
+		rc = SQLITE_NOMEM;
+		goto out;
+	}
+
+	rc = sqlite3_exec(db, sql, NULL, NULL, &error);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+out:
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, NULL, &error);
+		if (rc != SQLITE_OK)
+			goto fail_sqlite;
+	} else if (sqlite3_get_autocommit(db) == 0) {
+		(void)sqlite3_exec(db, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+	}
+
+	free(raw_name);
+	free(name);
+	free(expression);
+	free(sql);
+
+	/* Switch the view over to the columns we just completed. */
+	if (rc == SQLITE_OK && complete == true)
+		rc = proto_table_setup(command_cache, db, spec);
+
+	if (OUT_progress != NULL)
+		*OUT_progress = progress;
+
+	if (rc != SQLITE_OK)
+		return rc;
+
+	return (progress.pending_columns > 0) ? SQLITE_OK : SQLITE_DONE;
+
+fail_sqlite:
+	fprintf(stderr, "index build step failed for table %s: %s, rc=%i\n",
+	    spec->name, error ?: "unknown error", rc);
+	sqlite3_free(error);
+	error = NULL;
+	goto out;
+}
+
+int
+proto_table_train_dictionary(sqlite3 *db, const struct proto_table *spec,
+    size_t max_samples, size_t dictionary_size)
+{
+	char *size_arg = NULL;
+	char *sql = NULL;
+	char *error = NULL;
+	int rc;
+
+	if (dictionary_size > 0 &&
+	    asprintf(&size_arg, ", %zu", dictionary_size) < 0)
+		return SQLITE_NOMEM;
+
+	if (asprintf(&sql,
+	    "INSERT INTO proto_dictionaries(id, table_name, dictionary)\n"
+	    "  SELECT next.id, '%1$s',\n"
+	    "    protobuf_train_dictionary(%1$s_raw.proto, next.id%2$s)\n"
+	    "  FROM %1$s_raw, (\n"
+	    "    SELECT COALESCE(MAX(id), %3$d - 1) + 1 AS id\n"
+	    "    FROM proto_dictionaries\n"
+	    "  ) AS next\n"
+	    "  WHERE %1$s_raw.id IN (\n"
+	    "    SELECT id FROM %1$s_raw ORDER BY random() LIMIT %4$zu\n"
+	    "  );",
+	    spec->name, size_arg ?: "", FIRST_DICTIONARY_ID,
+	    max_samples) < 0) {
+		free(size_arg);
+		return SQLITE_NOMEM;
+	}
+
+	free(size_arg);
+	if (spec->log_sql_to_stderr == true)
+		fprintf(stderr, "%s\n", sql);
+
+	rc = sqlite3_exec(db, sql, NULL, NULL, &error);
+	free(sql);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "dictionary training failed for table %s: %s, rc=%i\n",
+		    spec->name, error ?: "unknown error", rc);
+		sqlite3_free(error);
+	}
+
+	return rc;
+}
+
+int
+proto_table_recompress(sqlite3 *db, const struct proto_table *spec,
+    int64_t begin, int64_t end)
+{
+	char *sql;
+	char *error = NULL;
+	int rc;
+
+	if (asprintf(&sql,
+	    "UPDATE %1$s_raw\n"
+	    "  SET proto = protobuf_compress(protobuf_decompress(proto),\n"
+	    "    " LATEST_DICTIONARY_FORMAT ")\n"
+	    "  WHERE id > %2$" PRId64 " AND id <= %3$" PRId64 ";",
+	    spec->name, begin, end) < 0)
+		return SQLITE_NOMEM;
+
+	rc = sqlite3_exec(db, sql, NULL, NULL, &error);
+	free(sql);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "recompression failed for table %s: %s, rc=%i\n",
+		    spec->name, error ?: "unknown error", rc);
+		sqlite3_free(error);
+	}
+
+	return rc;
+}
+
+/**
+ * Statements cached in a `proto_db` are identified by their kind and
+ * table name.
+ */
+enum proto_stmt_kind {
+	PROTO_STMT_PAGINATE,
+	PROTO_STMT_INSERT,
+	PROTO_STMT_UPDATE,
+	PROTO_STMT_DELETE,
+};
+
+/*
+ * SQL for each `proto_stmt_kind`, with the table name as the only
+ * format argument.
+ */
+static const char *const proto_stmt_templates[] = {
+	[PROTO_STMT_PAGINATE] =
+	    " SELECT COALESCE(MAX(id), :begin)"
+	    " FROM ("
+	    "   SELECT id"
+	    "   FROM `%s`"
+	    "   WHERE id > :begin"
+	    "   ORDER BY id ASC"
+	    "   LIMIT :wanted"
+	    " )",
+	[PROTO_STMT_INSERT] = "INSERT INTO `%s_raw`(proto) VALUES (:proto);",
+	[PROTO_STMT_UPDATE] = "UPDATE `%s_raw` SET proto = :proto WHERE id = :id;",
+	[PROTO_STMT_DELETE] = "DELETE FROM `%s_raw` WHERE id = :id;",
+};
+
+/*
+ * Writes to `compress_protos` tables compress like the view's triggers.
+ */
+static const char *const proto_stmt_compressed_templates[] = {
+	[PROTO_STMT_INSERT] =
+	    "INSERT INTO `%1$s_raw`(proto)"
+	    " VALUES (protobuf_compress(:proto, " LATEST_DICTIONARY_FORMAT "));",
+	[PROTO_STMT_UPDATE] =
+	    "UPDATE `%1$s_raw`"
+	    " SET proto = protobuf_compress(:proto, " LATEST_DICTIONARY_FORMAT ")"
+	    " WHERE id = :id;",
+};
+
+struct proto_stmt_cache_entry {
+	enum proto_stmt_kind kind;
+	char *table;
+	sqlite3_stmt *stmt;
+};
+
+/*
+ * There are only a few statements per table, so we look them up
+ * linearly.
+ */
+struct proto_stmt_cache {
+	size_t count;
+	size_t capacity;
+	struct proto_stmt_cache_entry *entries;
+};
+
+static bool
+stmt_cache_grow(struct proto_stmt_cache *cache)
+{
+	struct proto_stmt_cache_entry *grown;
+	size_t goal = 2 * cache->capacity;
+
+	if (goal < 8)
+		goal = 8;
+
+	if (goal < cache->capacity || goal > SIZE_MAX / sizeof(grown[0]))
+		return false;
+
+	grown = realloc(cache->entries, goal * sizeof(grown[0]));
+	if (grown == NULL)
+		return false;
+
+	cache->entries = grown;
+	cache->capacity = goal;
+	return true;
+}
+
+/**
+ * Returns whether the last setup of `table` had `compress_protos`.
+ */
+static bool
+table_compresses(sqlite3 *db, const char *table)
+{
+	sqlite3_stmt *stmt;
+	bool ret = false;
+
+	/* No setup table means no setup, so no compression. */
+	if (proto_prepare(db, &stmt,
+	    "SELECT compressed FROM proto_table_setups"
+	    " WHERE table_name = :table;") != SQLITE_OK)
+		return false;
+
+	if (PROTO_BIND(stmt, ":table", table) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int64(stmt, 0) != 0;
+
+	sqlite3_finalize(stmt);
+	return ret;
+}
+
+/**
+ * Finds or prepares the `kind` statement for `table` in `db`.  The
+ * statement must be reset before returning to the caller.
+ *
+ * Returns SQLITE_OK on success, and a sqlite error code on failure.
+ */
+static int
+proto_db_statement(sqlite3_stmt **OUT_stmt, struct proto_db *db,
+    enum proto_stmt_kind kind, const char *table)
+{
+	struct proto_stmt_cache *cache = db->statements;
+	struct proto_stmt_cache_entry *entry;
+	const char *template;
+	char *sql, *table_copy;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	*OUT_stmt = NULL;
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(*cache));
+		if (cache == NULL)
+			return SQLITE_NOMEM;
+
+		db->statements = cache;
+	}
+
+	for (size_t i = 0; i < cache->count; i++) {
+		entry = &cache->entries[i];
+		if (entry->kind != kind)
+			continue;
+
+		if (strcmp(entry->table, table) == 0) {
+			*OUT_stmt = entry->stmt;
+			return SQLITE_OK;
+		}
+	}
+
+	if (cache->count >= cache->capacity && stmt_cache_grow(cache) == false)
+		return SQLITE_NOMEM;
+
+	table_copy = strdup(table);
+	if (table_copy == NULL)
+		return SQLITE_NOMEM;
+
+	template = proto_stmt_templates[kind];
+	if ((kind == PROTO_STMT_INSERT || kind == PROTO_STMT_UPDATE) &&
+	    table_compresses(db->db, table))
+		template = proto_stmt_compressed_templates[kind];
+
+	if (asprintf(&sql, template, table) < 0) {
+		free(table_copy);
+		return SQLITE_NOMEM;
+	}
+
+	rc = proto_prepare(db->db, &stmt, sql);
+	free(sql);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "failed to prepare statement. rc=%i: %s\n", rc,
+		    sqlite3_errmsg(db->db));
+		free(table_copy);
+		return rc;
+	}
+
+	cache->entries[cache->count++] = (struct proto_stmt_cache_entry) {
+		.kind = kind,
+		.table = table_copy,
+		.stmt = stmt,
+	};
+
+	*OUT_stmt = stmt;
+	return SQLITE_OK;
+}
+
+void
+proto_db_finalize_statements(struct proto_db *db)
+{
+	struct proto_stmt_cache *cache = db->statements;
+
+	if (cache == NULL)
+		return;
+
+	for (size_t i = 0; i < cache->count; i++) {
+		(void)sqlite3_finalize(cache->entries[i].stmt);
+		free(cache->entries[i].table);
+	}
+
+	free(cache->entries);
+	free(cache);
+	db->statements = NULL;
+	return;
+}
+
+/**
+ * Runs the pagination statement `stmt` for `begin` and `wanted`,
+ * stores the last id in the page in `OUT_end`, and resets it.
+ *
+ * Returns SQLITE_OK on success, and a sqlite error code on failure.
+ */
+static int
+paginate(int64_t *OUT_end, sqlite3_stmt *stmt, int64_t begin, size_t wanted)
+{
+	int rc;
+
+	if ((rc = PROTO_BIND(stmt, ":begin", begin)) != SQLITE_OK ||
+	    (rc = PROTO_BIND(stmt, ":wanted", wanted)) != SQLITE_OK) {
+		fprintf(stderr, "failed to bind pagination parameters. rc=%i\n", rc);
+		goto out;
+	}
+
+	rc = sqlite3_step(stmt);
+	switch (rc) {
+	case SQLITE_DONE:
+		*OUT_end = begin;
+		rc = SQLITE_OK;
+		break;
+
+	case SQLITE_ROW:
+		*OUT_end = sqlite3_column_int64(stmt, 0);
+		rc = SQLITE_OK;
+		break;
+
+	default:
+		fprintf(stderr, "failed to execute pagination query. rc=%i\n", rc);
+		break;
+	}
+
+out:
+	(void)sqlite3_reset(stmt);
+	return rc;
+}
+
+/**
+ * Prepares the pagination statement for `table`, and runs it like
+ * `paginate`.
+ */
+static int
+table_paginate(int64_t *OUT_end, sqlite3 *db, const char *table,
+    int64_t begin, size_t wanted)
+{
+	char *template;
+	sqlite3_stmt *stmt = NULL;
+	int rc;
+
+	if (asprintf(&template, proto_stmt_templates[PROTO_STMT_PAGINATE],
+	    table) < 0) {
+		return SQLITE_NOMEM;
+	}
+
+	rc = proto_prepare(db, &stmt, template);
+	if (rc != SQLITE_OK) {
+		fprintf(
+		    stderr, "failed to prepare pagination statement. rc=%i\n", rc);
+		goto out;
+	}
+
+	rc = paginate(OUT_end, stmt, begin, wanted);
+
+out:
+	(void)sqlite3_finalize(stmt);
+	free(template);
+	return rc;
+}
+
+int64_t
+proto_table_paginate(sqlite3 *db, const char *table, int64_t begin, size_t wanted)
+{
+	int64_t ret;
+	int rc;
+
+	rc = table_paginate(&ret, db, table, begin, wanted);
+	if (rc != SQLITE_OK)
+		return -(int64_t)rc;
+
+	return ret;
+}
+
+int64_t
+proto_db_paginate(struct proto_db *db, const char *table, int64_t begin,
+    size_t wanted)
+{
+	sqlite3_stmt *stmt;
+	int64_t ret;
+	int rc;
+
+	rc = proto_db_statement(&stmt, db, PROTO_STMT_PAGINATE, table);
+	if (rc != SQLITE_OK)
+		return -(int64_t)rc;
+
+	rc = paginate(&ret, stmt, begin, wanted);
+	if (rc != SQLITE_OK)
+		return -(int64_t)rc;
+
+	return ret;
+}
+
+/**
+ * Runs the write statement `stmt`, after binding `:proto` to `bytes`
+ * if non-NULL and `:id` to `id` if non-negative, and resets it.
+ */
+static int
+run_write(struct proto_db *db, sqlite3_stmt *stmt, int64_t id,
+    const void *bytes, size_t n_bytes)
+{
+	int rc = SQLITE_OK;
+
+	if (bytes != NULL) {
+		rc = PROTO_BIND(stmt, ":proto",
+		    (struct proto_bind_blob) { .bytes = bytes, .count = n_bytes });
+	}
+
+	if (rc == SQLITE_OK && id >= 0)
+		rc = PROTO_BIND(stmt, ":id", id);
+
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_step(stmt);
+		if (rc == SQLITE_DONE)
+			rc = SQLITE_OK;
+	}
+
+	/* Don't keep pointers to the caller's bytes. */
+	(void)sqlite3_reset(stmt);
+	(void)sqlite3_clear_bindings(stmt);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "failed to write proto row. rc=%i: %s\n", rc,
+		    sqlite3_errmsg(db->db));
+		return rc;
+	}
+
+	if (db->transaction_depth > 0)
+		db->write_bytes += n_bytes;
+	proto_db_count_writes(db, 1);
+	return SQLITE_OK;
+}
+
+int
+proto_db_insert(struct proto_db *db, int64_t *OUT_id, const char *table,
+    const void *bytes, size_t n_bytes)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = proto_db_statement(&stmt, db, PROTO_STMT_INSERT, table);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	/* Bind an empty blob rather than NULL. */
+	rc = run_write(db, stmt, -1, (bytes != NULL) ? bytes : "", n_bytes);
+	if (rc == SQLITE_OK && OUT_id != NULL)
+		*OUT_id = sqlite3_last_insert_rowid(db->db);
+
+	return rc;
+}
+
+int
+proto_db_update(struct proto_db *db, const char *table, int64_t id,
+    const void *bytes, size_t n_bytes)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = proto_db_statement(&stmt, db, PROTO_STMT_UPDATE, table);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	return run_write(db, stmt, id, (bytes != NULL) ? bytes : "", n_bytes);
+}
+
+int
+proto_db_delete(struct proto_db *db, const char *table, int64_t id)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = proto_db_statement(&stmt, db, PROTO_STMT_DELETE, table);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	return run_write(db, stmt, id, NULL, 0);
+}
+
+/**
+ * `proto_db_bulk_insert` saves the indexes it drops in this struct.
+ */
+struct saved_indexes {
+	char **names;
+	char **definitions;
+	size_t count;
+	/* The first `dropped` indexes must be recreated. */
+	size_t dropped;
+};
+
+static int
+saved_indexes_callback(void *thunk, int nargs, char **values, char **columns)
+{
+	struct saved_indexes *saved = thunk;
+	char **new_names, **new_definitions;
+	char *name, *definition;
+
+	(void)columns;
+	if (nargs != 2 || values[0] == NULL || values[1] == NULL)
+		return 0;
+
+	name = strdup(values[0]);
+	definition = strdup(values[1]);
+	new_names = realloc(saved->names, (saved->count + 1) * sizeof(char *));
+	if (new_names != NULL)
+		saved->names = new_names;
+
+	new_definitions = realloc(
+	    saved->definitions, (saved->count + 1) * sizeof(char *));
+	if (new_definitions != NULL)
+		saved->definitions = new_definitions;
+
+	if (name == NULL || definition == NULL || new_names == NULL ||
+	    new_definitions == NULL) {
+		free(name);
+		free(definition);
+		return -1;
+	}
+
+	saved->names[saved->count] = name;
+	saved->definitions[saved->count] = definition;
+	saved->count++;
+	return 0;
+}
+
+/**
+ * Drops the `proto_table_setup` indexes on `table`'s raw table, after
+ * saving their definition in `saved`.
+ */
+static int
+drop_proto_indexes(struct saved_indexes *saved, sqlite3 *db, const char *table)
+{
+	char *select_indexes;
+	char *error = NULL;
+	int rc;
+
+	/*
+	 * Match the exact shape of `table`'s shadow names: LIKE would
+	 * also catch other tables' shadows.
+	 */
+	if (asprintf(&select_indexes,
+	    "SELECT name, sql FROM sqlite_master WHERE\n"
+	    "  type = 'index' AND\n"
+	    "  (tbl_name = '%1$s_raw' OR\n"
+	    "   tbl_name GLOB 'proto_shadow__%1$s__'"
+	    " || replace(hex(zeroblob(32)), '00', '[0-9a-f]')) AND\n"
+	    "  (name GLOB 'proto_index__*' OR name GLOB 'proto_autoindex__*');",
+	    table) < 0)
+		return SQLITE_NOMEM;
+
+	rc = sqlite3_exec(db, select_indexes, saved_indexes_callback, saved, &error);
+	free(select_indexes);
+	if (rc != SQLITE_OK)
+		goto fail_sqlite;
+
+	for (size_t i = 0; i < saved->count; i++) {
+		char *drop_index;
+
+		if (asprintf(&drop_index, "DROP INDEX IF EXISTS \"%s\";",
+		    saved->names[i]) < 0)
+			return SQLITE_NOMEM;
+
+		rc = sqlite3_exec(db, drop_index, NULL, NULL, &error);
+		free(drop_index);
+		if (rc != SQLITE_OK)
+			goto fail_sqlite;
+
+		saved->dropped++;
+	}
+
+	return SQLITE_OK;
+
+fail_sqlite:
+	fprintf(stderr, "failed to drop indexes for table %s: %s, rc=%i\n",
+	    table, error ?: "unknown error", rc);
+	sqlite3_free(error);
+	return rc;
+}
+
+/**
+ * Recreates the indexes in `saved`, and releases `saved`.  Returns the
+ * first error, but attempts to recreate all indexes regardless.
+ */
+static int
+restore_proto_indexes(struct saved_indexes *saved, sqlite3 *db)
+{
+	int ret = SQLITE_OK;
+
+	for (size_t i = 0; i < saved->count; i++) {
+		char *error = NULL;
+		int rc = SQLITE_OK;
+
+		if (i < saved->dropped)
+			rc = sqlite3_exec(db, saved->definitions[i], NULL, NULL, &error);
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "failed to recreate index %s: %s, rc=%i\n",
+			    saved->names[i], error ?: "unknown error", rc);
+			if (ret == SQLITE_OK)
+				ret = rc;
+		}
+
+		sqlite3_free(error);
+		free(saved->names[i]);
+		free(saved->definitions[i]);
+	}
+
+	free(saved->names);
+	free(saved->definitions);
+	*saved = (struct saved_indexes) { 0 };
+	return ret;
+}
+
+int
+proto_db_bulk_insert(struct proto_db *db, const char *table,
+    const struct proto_bind_blob *rows, size_t count, bool rebuild_indexes)
+{
+	struct saved_indexes saved = { 0 };
+	sqlite3_stmt *stmt;
+	uint32_t write_count;
+	uint64_t write_bytes;
+	int rc, restore_rc;
+
+	rc = proto_db_statement(&stmt, db, PROTO_STMT_INSERT, table);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	/*
+	 * Without indexes to rebuild, we commit every `batch_size`
+	 * rows as usual.  Otherwise, the indexes must be back
+	 * before anyone else can see the table, so everything
+	 * happens in one transaction.
+	 */
+	rc = (rebuild_indexes == true) ? proto_db_transaction_begin(db) :
+	    proto_db_batch_begin(db);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	write_count = db->write_count;
+	write_bytes = db->write_bytes;
+	if (rebuild_indexes == true) {
+		/*
+		 * A savepoint lets us undo the dropped indexes and
+		 * partial load on failure, without rolling back the
+		 * caller's own writes in an enclosing transaction.
+		 */
+		rc = sqlite3_exec(db->db, "SAVEPOINT proto_bulk_insert;",
+		    NULL, NULL, NULL);
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "failed to open savepoint, rc=%i: %s\n",
+			    rc, sqlite3_errmsg(db->db));
+			proto_db_transaction_end(db);
+			return rc;
+		}
+
+		rc = drop_proto_indexes(&saved, db->db, table);
+	}
+
+	for (size_t i = 0; i < count && rc == SQLITE_OK; i++) {
+		rc = run_write(db, stmt, -1,
+		    (rows[i].bytes != NULL) ? rows[i].bytes : "", rows[i].count);
+	}
+
+	/* No point in recreating indexes we're about to roll back. */
+	if (rc != SQLITE_OK)
+		saved.dropped = 0;
+
+	restore_rc = restore_proto_indexes(&saved, db->db);
+	if (rc == SQLITE_OK)
+		rc = restore_rc;
+
+	if (rebuild_indexes == false) {
+		proto_db_batch_end(db);
+		return rc;
+	}
+
+	/*
+	 * Sqlite may already have rolled back the whole transaction,
+	 * e.g., on SQLITE_FULL or SQLITE_IOERR; then there's no
+	 * savepoint left, and `proto_db_transaction_end` won't commit.
+	 */
+	if (sqlite3_get_autocommit(db->db) == 0) {
+		if (rc != SQLITE_OK) {
+			(void)sqlite3_exec(db->db,
+			    "ROLLBACK TRANSACTION TO SAVEPOINT proto_bulk_insert;",
+			    NULL, NULL, NULL);
+			db->write_count = write_count;
+			db->write_bytes = write_bytes;
+		}
+
+		(void)sqlite3_exec(db->db, "RELEASE SAVEPOINT proto_bulk_insert;",
+		    NULL, NULL, NULL);
+	}
+
+	proto_db_transaction_end(db);
+	return rc;
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static uint32_t
+current_batch_size(const struct proto_db *db)
+{
+
+	if (db->target_hold_us != 0 && db->batch_stats.batch_size != 0)
+		return db->batch_stats.batch_size;
+
+	return db->batch_size ?: AUTOCOMMIT_BATCH_SIZE;
+}
+
+/**
+ * Moves the adaptive batch size toward the number of writes the last
+ * transaction would have committed in `target_hold_us`.  Transactions
+ * that ended before filling their batch only tell us about the fixed
+ * cost of a commit, so they may only shrink the batch if they held
+ * the lock for too long.
+ */
+static void
+adapt_batch_size(struct proto_db *db, bool full)
+{
+	struct proto_db_batch_stats *stats = &db->batch_stats;
+	const uint64_t target_ns = (uint64_t)db->target_hold_us * 1000;
+	const uint32_t current = current_batch_size(db);
+	double goal;
+
+	if (stats->last_hold_ns == 0 ||
+	    (full == false && stats->last_hold_ns <= target_ns))
+		return;
+
+	goal = (double)stats->last_writes * (double)target_ns /
+	    (double)stats->last_hold_ns;
+	if (goal < current / 2)
+		goal = current / 2;
+	if (goal > (double)current * 2)
+		goal = (double)current * 2;
+	if (goal < ADAPTIVE_BATCH_MIN)
+		goal = ADAPTIVE_BATCH_MIN;
+	if (goal > ADAPTIVE_BATCH_MAX)
+		goal = ADAPTIVE_BATCH_MAX;
+
+	stats->batch_size = (uint32_t)goal;
+	return;
+}
+
+/**
+ * Commits the current sqlite transaction, and updates the batch
+ * stats.  `autocommit` is true if the transaction was only open for
+ * batching, and `full` if it reached its batch size.
+ *
+ * Returns SQLITE_OK on success, and a sqlite error code on failure.
+ */
+static int
+commit_transaction(struct proto_db *db, bool autocommit, bool full)
+{
+	struct proto_db_batch_stats *stats = &db->batch_stats;
+	uint64_t begin, end;
+	int rc;
+
+	begin = monotonic_ns();
+	rc = sqlite3_exec(db->db, "COMMIT TRANSACTION;", NULL, NULL, NULL);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	end = monotonic_ns();
+	if (db->write_count > 0) {
+		stats->commits++;
+		stats->writes += db->write_count;
+		stats->bytes += db->write_bytes;
+		stats->commit_ns += end - begin;
+		stats->last_commit_ns = end - begin;
+		if (end - begin > stats->max_commit_ns)
+			stats->max_commit_ns = end - begin;
+
+		stats->last_writes = db->write_count;
+		stats->last_bytes = db->write_bytes;
+		stats->last_hold_ns = end - db->transaction_begin_ns;
+		if (autocommit == true && db->target_hold_us != 0)
+			adapt_batch_size(db, full);
+	}
+
+	db->write_count = 0;
+	db->write_bytes = 0;
+	return SQLITE_OK;
+}
+
+/**
+ * Opens the sqlite write transaction.  The lock hold time only starts
+ * once we have the lock: time spent waiting for another writer is
+ * tracked separately, and must not shrink the adaptive batch size.
+ */
+static int
+begin_transaction(struct proto_db *db)
+{
+	struct proto_db_batch_stats *stats = &db->batch_stats;
+	uint64_t begin, end;
+	int rc;
+
+	begin = monotonic_ns();
+	rc = sqlite3_exec(db->db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL,
+	    NULL);
+	end = monotonic_ns();
+
+	stats->begin_wait_ns += end - begin;
+	if (end - begin > stats->max_begin_wait_ns)
+		stats->max_begin_wait_ns = end - begin;
+
+	db->transaction_begin_ns = end;
+	return rc;
+}
+
+int
+proto_db_transaction_begin(struct proto_db *db)
+{
+	int rc;
+
+	if (db->transaction_depth++ > 0) {
+		assert(db->transaction_depth > 0);
+		return SQLITE_OK;
+	}
+
+	rc = begin_transaction(db);
+	if (rc != 0) {
+		db->transaction_depth--;
+		fprintf(stderr, "failed to open sqlite transaction, rc=%i: %s\n", rc,
+		    sqlite3_errmsg(db->db));
+	}
+
+	return rc;
+}
+
+void
+proto_db_transaction_end(struct proto_db *db)
+{
+	int rc;
+
+	assert(db->transaction_depth > 0);
+
+	/*
+	 * Sqlite rolls back the transaction by itself after some
+	 * errors.  There's nothing left to commit or cycle: forget the
+	 * batch, and let the caller report the failed write.
+	 */
+	if (sqlite3_get_autocommit(db->db) != 0) {
+		fprintf(stderr, "sqlite transaction was rolled back\n");
+		db->transaction_depth--;
+		db->write_count = 0;
+		db->write_bytes = 0;
+		return;
+	}
+
+	if (--db->transaction_depth > 0) {
+		/* Cycle if we now can. */
+		proto_db_count_writes(db, 0);
+		return;
+	}
+
+	/* Only the batch is left if there's any autocommit depth. */
+	rc = commit_transaction(db, db->autocommit_depth > 0, false);
+	if (rc != 0) {
+		fprintf(stderr, "failed to commit sqlite transaction, rc=%i: %s\n",
+		    rc, sqlite3_errmsg(db->db));
+		abort();
+	}
+
+	return;
+}
+
+int
+proto_db_batch_begin(struct proto_db *db)
+{
+
+	db->autocommit_depth++;
+	assert(db->autocommit_depth > 0);
+	return proto_db_transaction_begin(db);
+}
+
+void
+proto_db_batch_end(struct proto_db *db)
+{
+
+	proto_db_transaction_end(db);
+	assert(db->autocommit_depth > 0);
+	db->autocommit_depth--;
+	return;
+}
+
+void
+proto_db_count_writes(struct proto_db *db, size_t n)
+{
+	uint32_t batch_size = current_batch_size(db);
+	int rc;
+
+	/* Nothing to cycle if sqlite already rolled back the transaction. */
+	if (db->transaction_depth == 0 || sqlite3_get_autocommit(db->db) != 0)
+		return;
+
+	/* Saturate, so the stats see the real count, if it fits. */
+	db->batch_stats.batch_size = batch_size;
+	db->write_count = (n < UINT32_MAX - db->write_count) ?
+	    db->write_count + (uint32_t)n : UINT32_MAX;
+	if (db->write_count < batch_size)
+		return;
+
+	if (db->autocommit_depth < db->transaction_depth)
+		return;
+
+	/*
+	 * We want to and can flush writes.  Close the current
+	 * transaction and immediately open a new one.
+	 */
+	rc = commit_transaction(db, true, true);
+	if (rc == 0)
+		rc = begin_transaction(db);
+	if (rc != 0) {
+		fprintf(stderr, "failed to cycle sqlite transaction rc=%i: %s\n", rc,
+		    sqlite3_errmsg(db->db));
+		/*
+		 * If we failed to cycle the transaction, it's really
+		 * not clear how the caller can recover.
+		 */
+		abort();
+	}
+
+	return;
+}
+
+/*
+ * Result list arenas start with a 64 KB chunk, and double the size of
+ * each new chunk up to 1 MB.  Allocations larger than a quarter of
+ * the maximum chunk size get a dedicated chunk, so they don't waste
+ * the tail of the current one.
+ */
+#define PROTO_ARENA_MIN_CHUNK ((size_t)64 << 10)
+#define PROTO_ARENA_MAX_CHUNK ((size_t)1 << 20)
+#define PROTO_ARENA_ALIGNMENT _Alignof(max_align_t)
+
+struct proto_arena_chunk {
+	struct proto_arena_chunk *next;
+	size_t used;
+	size_t capacity;
+	max_align_t data[];
+};
+
+static struct proto_arena_chunk *
+arena_chunk_create(size_t capacity)
+{
+	struct proto_arena_chunk *ret;
+
+	if (capacity > SIZE_MAX - sizeof(*ret))
+		return NULL;
+
+	ret = malloc(sizeof(*ret) + capacity);
+	if (ret == NULL)
+		return NULL;
+
+	*ret = (struct proto_arena_chunk) {
+		.capacity = capacity,
+	};
+
+	return ret;
+}
+
+static void *
+arena_alloc(struct proto_result_list *list, size_t size)
+{
+	struct proto_arena_chunk *chunk = list->arena;
+	size_t rounded;
 
-	db->write_count = batch_size;
-	if (db->autocommit_depth < db->transaction_depth)
-		return;
+	if (size > SIZE_MAX - PROTO_ARENA_ALIGNMENT)
+		return NULL;
 
-	/*
-	 * We want to and can flush writes.  Close the current
-	 * transaction and immediately open a new one.
-	 */
-	db->write_count = 0;
-	rc = sqlite3_exec(db->db, "COMMIT TRANSACTION; BEGIN IMMEDIATE TRANSACTION;",
-	    NULL, NULL, &err);
-	if (rc != 0) {
-		fprintf(stderr, "failed to cycle sqlite transaction rc=%i: %s\n", rc,
-		    err ?: "unknown error");
-		/*
-		 * If we failed to cycle the transaction, it's really
-		 * not clear how the caller can recover.
-		 */
-		abort();
+	rounded = (size + PROTO_ARENA_ALIGNMENT - 1) &
+	    ~(PROTO_ARENA_ALIGNMENT - 1);
+	if (chunk != NULL && chunk->capacity - chunk->used >= rounded) {
+		void *ret = (char *)chunk->data + chunk->used;
+
+		chunk->used += rounded;
+		return ret;
 	}
 
-	sqlite3_free(err);
+	if (rounded > PROTO_ARENA_MAX_CHUNK / 4) {
+		struct proto_arena_chunk *large;
+
+		large = arena_chunk_create(rounded);
+		if (large == NULL)
+			return NULL;
+
+		large->used = rounded;
+		/* Keep bump allocating from the current chunk. */
+		if (chunk != NULL) {
+			large->next = chunk->next;
+			chunk->next = large;
+		} else {
+			list->arena = large;
+		}
+
+		return large->data;
+	}
+
+	{
+		struct proto_arena_chunk *fresh;
+		size_t capacity = PROTO_ARENA_MIN_CHUNK;
+
+		if (chunk != NULL && chunk->capacity >= capacity)
+			capacity = 2 * chunk->capacity;
+		if (capacity > PROTO_ARENA_MAX_CHUNK)
+			capacity = PROTO_ARENA_MAX_CHUNK;
+
+		fresh = arena_chunk_create(capacity);
+		if (fresh == NULL)
+			return NULL;
+
+		fresh->next = chunk;
+		fresh->used = rounded;
+		list->arena = fresh;
+		return fresh->data;
+	}
+}
+
+static void *
+arena_allocator_alloc(void *allocator_data, size_t size)
+{
+
+	return arena_alloc(allocator_data, size);
+}
+
+static void
+arena_allocator_free(void *allocator_data, void *pointer)
+{
+
+	/* Everything is released at once, in `proto_result_list_reset`. */
+	(void)allocator_data;
+	(void)pointer;
 	return;
 }
 
 void
 proto_result_list_reset(struct proto_result_list *list)
 {
+	bool lazy_unpack = list->lazy_unpack;
+	bool use_arena = list->use_arena;
+
+	if (use_arena == false) {
+		for (size_t i = 0; i < list->count; i++) {
+			ProtobufCMessage *proto;
+
+			proto = list->rows[i].proto;
+			protobuf_c_message_free_unpacked(proto,
+			    /*allocator=*/NULL);
+			free(list->rows[i].bytes);
+		}
+	}
 
-	for (size_t i = 0; i < list->count; i++) {
-		ProtobufCMessage *proto;
+	for (struct proto_arena_chunk *chunk = list->arena; chunk != NULL;) {
+		struct proto_arena_chunk *next = chunk->next;
 
-		proto = list->rows[i].proto;
-		protobuf_c_message_free_unpacked(proto, /*allocator=*/NULL);
-		free(list->rows[i].bytes);
+		free(chunk);
+		chunk = next;
 	}
 
 	free(list->rows);
 
 	*list = PROTO_RESULT_LIST_INITIALIZER;
+	list->lazy_unpack = lazy_unpack;
+	list->use_arena = use_arena;
 	return;
 }
 
@@ -714,10 +3134,96 @@ result_list_push(struct proto_result_list *dst, int64_t row, void *proto,
 	return true;
 }
 
+/*
+ * Undoes the allocations for a row that could not be pushed to `dst`.
+ * Arena allocations are only released by `proto_result_list_reset`.
+ */
+static void
+result_row_discard(struct proto_result_list *dst, void *parsed, void *copy)
+{
+
+	if (dst->use_arena)
+		return;
+
+	protobuf_c_message_free_unpacked(parsed, /*allocator=*/NULL);
+	free(copy);
+	return;
+}
+
+/*
+ * Returns the allocator for messages owned by `list`: NULL (the
+ * default allocator) or `buf`, initialised to allocate from the
+ * list's arena.
+ */
+static ProtobufCAllocator *
+result_list_allocator(struct proto_result_list *list, ProtobufCAllocator *buf)
+{
+
+	if (list->use_arena == false)
+		return NULL;
+
+	*buf = (ProtobufCAllocator) {
+		.alloc = arena_allocator_alloc,
+		.free = arena_allocator_free,
+		.allocator_data = list,
+	};
+
+	return buf;
+}
+
+/*
+ * Steps `stmt` and reads the current row's id and blob.
+ *
+ * Returns SQLITE_ROW when a row was read, and any other sqlite code
+ * otherwise.  The blob is only valid until the next step.
+ */
+static int
+result_row_read(sqlite3 *db, sqlite3_stmt *stmt, int64_t *OUT_row_id,
+    const void **OUT_blob, size_t *OUT_blob_size)
+{
+	const void *blob;
+	size_t blob_size;
+	int rc;
+
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW)
+		return rc;
+
+	*OUT_row_id = sqlite3_column_int64(stmt, 0);
+	blob = sqlite3_column_blob(stmt, 1);
+	switch (sqlite3_errcode(db)) {
+	case SQLITE_OK:
+	case SQLITE_ROW:
+		blob_size = (size_t)sqlite3_column_bytes(stmt, 1);
+		break;
+
+	case SQLITE_RANGE:
+		blob = NULL;
+		blob_size = 0;
+		break;
+
+	default:
+		return sqlite3_errcode(db);
+	}
+
+	if (blob == NULL)
+		blob_size = 0;
+
+	*OUT_blob = blob;
+	*OUT_blob_size = blob_size;
+	return SQLITE_ROW;
+}
+
 int
 proto_result_list_populate(struct proto_result_list *dst,
     const ProtobufCMessageDescriptor *type, sqlite3 *db, sqlite3_stmt *stmt)
 {
+	ProtobufCAllocator arena_allocator;
+	ProtobufCAllocator *allocator;
+
+	allocator = result_list_allocator(dst, &arena_allocator);
+	if (dst->lazy_unpack)
+		dst->type = type;
 
 	while (true) {
 		int64_t row_id;
@@ -727,38 +3233,20 @@ proto_result_list_populate(struct proto_result_list *dst,
 		size_t blob_size;
 		int rc;
 
-		rc = sqlite3_step(stmt);
+		rc = result_row_read(db, stmt, &row_id, &blob, &blob_size);
 		if (rc == SQLITE_DONE)
 			return SQLITE_OK;
 
 		if (rc != SQLITE_ROW)
 			return rc;
 
-		row_id = sqlite3_column_int64(stmt, 0);
-		blob = sqlite3_column_blob(stmt, 1);
-		switch (sqlite3_errcode(db)) {
-		case SQLITE_OK:
-		case SQLITE_ROW:
-			blob_size = (size_t)sqlite3_column_bytes(stmt, 1);
-			break;
-
-		case SQLITE_RANGE:
-			blob = NULL;
-			blob_size = 0;
-			break;
-
-		default:
-			return sqlite3_errcode(db);
-		}
-
 		if (blob == NULL) {
 			parsed = NULL;
 			copy = NULL;
-			blob_size = 0;
 		} else {
-			if (type != NULL) {
+			if (type != NULL && dst->lazy_unpack == false) {
 				parsed = protobuf_c_message_unpack(type,
-				    /*allocator=*/NULL, blob_size, blob);
+				    allocator, blob_size, blob);
 				if (parsed == NULL)
 					return SQLITE_ROW;
 			} else {
@@ -767,12 +3255,14 @@ proto_result_list_populate(struct proto_result_list *dst,
 
 			copy = NULL;
 			/* Allocate one more to append a NUL terminator. */
-			if (blob_size < SIZE_MAX)
-				copy = malloc(blob_size + 1);
+			if (blob_size < SIZE_MAX) {
+				copy = (dst->use_arena) ?
+				    arena_alloc(dst, blob_size + 1) :
+				    malloc(blob_size + 1);
+			}
 
 			if (copy == NULL) {
-				protobuf_c_message_free_unpacked(
-				    parsed, /*allocator=*/NULL);
+				result_row_discard(dst, parsed, NULL);
 				return SQLITE_NOMEM;
 			}
 
@@ -782,9 +3272,382 @@ proto_result_list_populate(struct proto_result_list *dst,
 
 		if (result_list_push(dst, row_id, parsed, copy, blob_size) ==
 		    false) {
-			protobuf_c_message_free_unpacked(parsed, /*allocator=*/NULL);
-			free(copy);
+			result_row_discard(dst, parsed, copy);
 			return SQLITE_NOMEM;
 		}
 	}
 }
+
+ProtobufCMessage *
+proto_result_list_proto(struct proto_result_list *list, size_t index)
+{
+	ProtobufCAllocator arena_allocator;
+	struct proto_result_row *row;
+
+	assert(index < list->count);
+	row = &list->rows[index];
+	if (row->proto != NULL || row->bytes == NULL || list->type == NULL)
+		return row->proto;
+
+	row->proto = protobuf_c_message_unpack(list->type,
+	    result_list_allocator(list, &arena_allocator), row->n_bytes,
+	    row->bytes);
+	return row->proto;
+}
+
+int
+proto_result_stream(sqlite3 *db, sqlite3_stmt *stmt,
+    proto_result_row_cb *cb, void *ctx)
+{
+
+	while (true) {
+		int64_t row_id;
+		const void *blob;
+		size_t blob_size;
+		int rc;
+
+		rc = result_row_read(db, stmt, &row_id, &blob, &blob_size);
+		if (rc == SQLITE_DONE)
+			return SQLITE_OK;
+
+		if (rc != SQLITE_ROW)
+			return rc;
+
+		rc = cb(ctx, row_id, blob, blob_size);
+		if (rc != 0)
+			return rc;
+	}
+}
+
+#define PROTO_SCAN_DEFAULT_PAGE_SIZE 10000
+
+/*
+ * Inclusive range of ids, for `id BETWEEN :begin AND :end`.
+ */
+struct proto_scan_range {
+	int64_t begin;
+	int64_t end;
+};
+
+/*
+ * Each worker owns a contiguous slice of the ranges array.  The owner
+ * pops ranges from the front of its slice, and thieves from the back.
+ */
+struct proto_scan_queue {
+	pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+};
+
+struct proto_scan_state {
+	const struct proto_parallel_scan *scan;
+	const char *filename;
+	struct proto_scan_range *ranges;
+	struct proto_scan_queue *queues;
+	size_t n_workers;
+	/* The first non-zero result, and 0 while the scan goes on. */
+	atomic_int result;
+};
+
+struct proto_scan_worker {
+	struct proto_scan_state *state;
+	size_t index;
+};
+
+/*
+ * Splits the ids in `table` into ranges of up to `page_size` rows.
+ * The last range extends to INT64_MAX, to also cover rows inserted
+ * after pagination.
+ */
+static int
+scan_ranges(struct proto_scan_range **OUT_ranges, size_t *OUT_count,
+    sqlite3 *db, const char *table, size_t page_size)
+{
+	struct proto_scan_range *ranges = NULL;
+	sqlite3_stmt *stmt = NULL;
+	char *template;
+	size_t capacity = 0;
+	size_t count = 0;
+	int64_t begin = INT64_MIN;
+	/* The last id in the previous range. */
+	int64_t last = INT64_MIN;
+	int rc;
+
+	if (asprintf(&template, proto_stmt_templates[PROTO_STMT_PAGINATE],
+	    table) < 0) {
+		return SQLITE_NOMEM;
+	}
+
+	rc = proto_prepare(db, &stmt, template);
+	free(template);
+	if (rc != SQLITE_OK) {
+		fprintf(
+		    stderr, "failed to prepare pagination statement. rc=%i\n", rc);
+		goto fail;
+	}
+
+	while (true) {
+		int64_t end;
+
+		if (count >= capacity) {
+			struct proto_scan_range *grown;
+			size_t goal = (capacity < 8) ? 8 : 2 * capacity;
+
+			if (goal > SIZE_MAX / sizeof(grown[0])) {
+				rc = SQLITE_NOMEM;
+				goto fail;
+			}
+
+			grown = realloc(ranges, goal * sizeof(grown[0]));
+			if (grown == NULL) {
+				rc = SQLITE_NOMEM;
+				goto fail;
+			}
+
+			ranges = grown;
+			capacity = goal;
+		}
+
+		rc = paginate(&end, stmt, last, page_size);
+		if (rc != SQLITE_OK)
+			goto fail;
+
+		if (end == last || end == INT64_MAX) {
+			ranges[count++] = (struct proto_scan_range) {
+				.begin = begin,
+				.end = INT64_MAX,
+			};
+			break;
+		}
+
+		ranges[count++] = (struct proto_scan_range) {
+			.begin = begin,
+			.end = end,
+		};
+		last = end;
+		begin = end + 1;
+	}
+
+	sqlite3_finalize(stmt);
+	*OUT_ranges = ranges;
+	*OUT_count = count;
+	return SQLITE_OK;
+
+fail:
+	sqlite3_finalize(stmt);
+	free(ranges);
+	return rc;
+}
+
+/*
+ * Pops the next range for `worker`, from its own queue first, and
+ * then from the back of the others'.  Returns false once all queues
+ * are empty.
+ */
+static bool
+scan_next_range(struct proto_scan_range *OUT_range, struct proto_scan_state *state,
+    size_t worker)
+{
+
+	for (size_t i = 0; i < state->n_workers; i++) {
+		size_t victim = (worker + i) % state->n_workers;
+		struct proto_scan_queue *queue = &state->queues[victim];
+		bool found = false;
+
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail) {
+			size_t index = (i == 0) ? queue->head++ : --queue->tail;
+
+			*OUT_range = state->ranges[index];
+			found = true;
+		}
+
+		pthread_mutex_unlock(&queue->lock);
+		if (found)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Records `rc` as the scan's result if it's the first error.
+ */
+static void
+scan_fail(struct proto_scan_state *state, int rc)
+{
+	int expected = 0;
+
+	if (rc == 0)
+		return;
+
+	(void)atomic_compare_exchange_strong(&state->result, &expected, rc);
+	return;
+}
+
+static int
+scan_range(struct proto_scan_worker *worker, sqlite3_stmt *stmt,
+    struct proto_scan_range range)
+{
+	struct proto_scan_state *state = worker->state;
+	const struct proto_parallel_scan *scan = state->scan;
+	int rc;
+
+	if ((rc = PROTO_BIND(stmt, ":begin", range.begin)) != SQLITE_OK ||
+	    (rc = PROTO_BIND(stmt, ":end", range.end)) != SQLITE_OK) {
+		fprintf(stderr, "failed to bind scan range. rc=%i\n", rc);
+		goto out;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		rc = scan->cb(scan->ctx, worker->index, stmt);
+		if (rc != 0)
+			goto out;
+
+		if (atomic_load_explicit(&state->result, memory_order_relaxed) != 0)
+			goto out;
+	}
+
+	if (rc == SQLITE_DONE)
+		rc = SQLITE_OK;
+
+out:
+	(void)sqlite3_reset(stmt);
+	return rc;
+}
+
+static void *
+scan_worker(void *thunk)
+{
+	struct proto_scan_worker *worker = thunk;
+	struct proto_scan_state *state = worker->state;
+	const struct proto_parallel_scan *scan = state->scan;
+	struct proto_scan_range range;
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stmt = NULL;
+	int rc;
+
+	rc = sqlite3_open_v2(state->filename, &db,
+	    SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "failed to open scan connection. rc=%i\n", rc);
+		goto out;
+	}
+
+	if (scan->connection_init != NULL) {
+		rc = scan->connection_init(scan->ctx, db);
+		if (rc != 0)
+			goto out;
+	}
+
+	rc = proto_prepare(db, &stmt, scan->query);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "failed to prepare scan query. rc=%i: %s\n", rc,
+		    sqlite3_errmsg(db));
+		goto out;
+	}
+
+	while (atomic_load_explicit(&state->result, memory_order_relaxed) == 0 &&
+	    scan_next_range(&range, state, worker->index)) {
+		rc = scan_range(worker, stmt, range);
+		if (rc != 0)
+			goto out;
+	}
+
+out:
+	scan_fail(state, rc);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return NULL;
+}
+
+int
+proto_parallel_scan(sqlite3 *db, const struct proto_parallel_scan *scan)
+{
+	struct proto_scan_state state = {
+		.scan = scan,
+	};
+	struct proto_scan_worker *workers = NULL;
+	pthread_t *threads = NULL;
+	size_t n_ranges = 0;
+	size_t n_started = 0;
+	size_t page_size;
+	size_t n_workers;
+	int rc;
+
+	state.filename = sqlite3_db_filename(db, "main");
+	if (state.filename == NULL || state.filename[0] == '\0')
+		return SQLITE_MISUSE;
+
+	page_size = scan->page_size;
+	if (page_size == 0)
+		page_size = PROTO_SCAN_DEFAULT_PAGE_SIZE;
+
+	n_workers = scan->n_workers;
+	if (n_workers == 0) {
+		long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		n_workers = (n_cpus > 0) ? (size_t)n_cpus : 1;
+	}
+
+	rc = scan_ranges(&state.ranges, &n_ranges, db, scan->table, page_size);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	if (n_workers > n_ranges)
+		n_workers = n_ranges;
+
+	state.n_workers = n_workers;
+	atomic_init(&state.result, 0);
+	state.queues = calloc(n_workers, sizeof(state.queues[0]));
+	workers = calloc(n_workers, sizeof(workers[0]));
+	threads = calloc(n_workers, sizeof(threads[0]));
+	if (state.queues == NULL || workers == NULL || threads == NULL) {
+		rc = SQLITE_NOMEM;
+		goto out;
+	}
+
+	for (size_t i = 0; i < n_workers; i++) {
+		pthread_mutex_init(&state.queues[i].lock, NULL);
+		state.queues[i].head = (n_ranges * i) / n_workers;
+		state.queues[i].tail = (n_ranges * (i + 1)) / n_workers;
+		workers[i] = (struct proto_scan_worker) {
+			.state = &state,
+			.index = i,
+		};
+	}
+
+	for (; n_started < n_workers; n_started++) {
+		if (pthread_create(&threads[n_started], NULL, scan_worker,
+		    &workers[n_started]) != 0)
+			break;
+	}
+
+	/*
+	 * Workers that did start steal every range from the queues of
+	 * those that didn't, so the scan still covers the whole table;
+	 * it only fails if no thread started at all.
+	 */
+	if (n_started == 0) {
+		fprintf(stderr, "failed to start any scan thread\n");
+		rc = SQLITE_NOMEM;
+		goto out;
+	}
+
+	for (size_t i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
+
+	rc = atomic_load(&state.result);
+
+out:
+	if (state.queues != NULL) {
+		for (size_t i = 0; i < n_workers; i++)
+			pthread_mutex_destroy(&state.queues[i].lock);
+	}
+
+	free(threads);
+	free(workers);
+	free(state.queues);
+	free(state.ranges);
+	return rc;
+}
@@ -57,6 +57,20 @@ struct proto_column {
 		 */
 		PROTO_SELECTOR_TYPE_WEAK = 1,
 	} index;
+
+	/*
+	 * A stored column is extracted once, when rows are written,
+	 * into a real column of the raw table, instead of calling
+	 * `protobuf_extract` at every read.  Indexes on stored columns
+	 * are plain column indexes, so they can cover queries.
+	 *
+	 * Triggers on the raw table keep stored columns up to date,
+	 * which costs an extra row update per write.  The raw column's
+	 * name fingerprints the extraction expression; changing the
+	 * `path` or `type` of a stored column adds and backfills a new
+	 * raw column, and leaves the old one behind.
+	 */
+	bool stored;
 };
 
 /**
@@ -76,6 +90,16 @@ struct proto_index {
 	 * expression.
 	 */
 	const char *const *components;
+	/*
+	 * NULL terminated (or NULL) list of include-only columns,
+	 * appended to the index key after `components`, so that the
+	 * index covers queries that return these columns.
+	 *
+	 * Sqlite versions before 3.41 only answer queries from an
+	 * index's columns, not from its expressions, so this is
+	 * mostly useful with `stored` view columns.
+	 */
+	const char *const *include;
 };
 
 /**
@@ -120,6 +144,178 @@ struct proto_table {
 	 * a zero-filled struct.
 	 */
 	const struct proto_index *indexes;
+
+	/*
+	 * Whether the view should extract all the columns that don't
+	 * appear in any index with a single call to `protobuf_fields`
+	 * per row, instead of one call to `protobuf_extract` per
+	 * column.  Indexed columns still go through `protobuf_extract`,
+	 * so that queries keep matching the expression indexes.
+	 *
+	 * This makes scans of wide views much cheaper, but turns the
+	 * view into a join, and sqlite can't flatten a join on the
+	 * right-hand side of a LEFT JOIN: such queries will scan the
+	 * whole view.
+	 */
+	bool use_protobuf_fields;
+
+	/*
+	 * Whether to materialise all the columns in a shadow table,
+	 * keyed on the raw table's `id`, and let the view read from
+	 * that table instead of calling `protobuf_extract`.  Queries
+	 * that don't read `proto` never touch the raw table.
+	 *
+	 * Triggers on the raw table maintain the shadow table on
+	 * every write, and all indexes live on the shadow table:
+	 * verbatim index components must refer to view columns, not
+	 * to `proto`.  This supersedes `stored` columns and
+	 * `use_protobuf_fields`.  Changing the columns' definitions
+	 * rebuilds the shadow table from scratch.
+	 */
+	bool use_shadow_table;
+
+	/*
+	 * Whether to also create a `protobuf_scan` virtual table,
+	 * `${name}_scan`, over the raw table, with the same columns
+	 * as the view.  The scan table evaluates equality and range
+	 * comparisons with numbers directly on the encoded messages
+	 * as it reads rows, so selective queries on columns that
+	 * aren't indexed don't extract every column for every row.
+	 *
+	 * The scan table's columns have `protobuf_extract`'s own
+	 * types: they are not CAST to the column's `type`.
+	 */
+	bool create_scan_table;
+
+	/*
+	 * Whether to store a `protobuf_presence` summary of each row
+	 * in the raw table, and expose it as the view's last column,
+	 * `proto_presence`.  The summary records which top-level
+	 * fields occur in the message, and which fields occur in the
+	 * submessages listed in `presence_paths`, so that
+	 *
+	 *   protobuf_has(proto, 'Type', '$.rare.field', proto_presence)
+	 *
+	 * can rule out sparse fields without parsing the message.
+	 *
+	 * Like stored columns, the summary is computed by triggers
+	 * when rows are written; changing `presence_paths` adds and
+	 * backfills a new raw column.
+	 */
+	bool use_presence_summary;
+
+	/*
+	 * NULL terminated (or NULL) list of paths to submessages
+	 * (e.g., "$.address") whose fields the presence summary
+	 * covers, in addition to the top-level fields.
+	 */
+	const char *const *presence_paths;
+
+	/*
+	 * Whether to defer the backfill of new stored columns (and of
+	 * a new presence summary) to `proto_table_build_step`, instead
+	 * of computing them for every existing row in
+	 * `proto_table_setup`.
+	 *
+	 * Setup then only adds the raw column, which doesn't rewrite
+	 * the table, and creates its indexes while the column is
+	 * still NULL, which doesn't parse any message.  Until the
+	 * backfill completes, the view falls back to
+	 * `protobuf_extract` for rows that aren't backfilled yet, so
+	 * it's usable immediately; each build step then fills a range
+	 * of ids and updates the indexes along the way.  The last step
+	 * switches the view to the stored column and its indexes.
+	 *
+	 * Automatic indexes on columns that aren't stored are
+	 * expression indexes, which sqlite can only build in one go:
+	 * make new strong columns `stored` to build them in the
+	 * background.  Setup without this flag completes pending
+	 * backfills synchronously.
+	 */
+	bool defer_index_builds;
+
+	/*
+	 * Whether to store `proto` blobs compressed with zstd, via
+	 * `protobuf_compress`, with the table's latest dictionary in
+	 * `proto_dictionaries` (see `proto_table_train_dictionary`).
+	 * Requires an extension built with zstd support.
+	 *
+	 * The view's insert and update triggers, and `proto_db`
+	 * writes, compress new blobs; the view's `proto` column
+	 * decompresses them.  The extension's functions, and thus
+	 * columns and indexes, decompress transparently, so rows
+	 * written before (or after) toggling compression stay
+	 * readable.  Only the view hides compression: read `proto`
+	 * from the view, not from the raw table.
+	 */
+	bool compress_protos;
+};
+
+/**
+ * Progress of the deferred backfills for one proto table, as reported
+ * by `proto_table_build_step`.  The `proto_index_builds` table has
+ * the same information for every pending column:
+ *
+ *   SELECT table_name, column_name, next_id, last_id, rows_done
+ *   FROM proto_index_builds;
+ */
+struct proto_index_build_progress {
+	/* Raw columns that still need a backfill. */
+	size_t pending_columns;
+
+	/*
+	 * For the column the last step worked on: rows backfilled by
+	 * that step, and in total, the last id backfilled so far,
+	 * and the largest id to backfill.
+	 */
+	int64_t rows;
+	int64_t rows_done;
+	int64_t next_id;
+	int64_t last_id;
+};
+
+struct proto_bind_blob;
+struct proto_stmt_cache;
+
+/**
+ * Counters for the transactions a `proto_db` commits, whether they
+ * were cycled by `proto_db_count_writes` or closed by the caller.
+ * Only commits with at least one counted write are included.
+ */
+struct proto_db_batch_stats {
+	/* Number of commits, and the writes and bytes they flushed. */
+	uint64_t commits;
+	uint64_t writes;
+	uint64_t bytes;
+
+	/* Time spent in COMMIT, in total, for the last and the slowest. */
+	uint64_t commit_ns;
+	uint64_t last_commit_ns;
+	uint64_t max_commit_ns;
+
+	/*
+	 * Time spent in BEGIN IMMEDIATE, waiting for other writers to
+	 * release the write lock, in total and for the slowest.  This
+	 * covers every transaction we open, even those without writes.
+	 */
+	uint64_t begin_wait_ns;
+	uint64_t max_begin_wait_ns;
+
+	/*
+	 * The last transaction's writes and bytes, and how long it
+	 * held the write lock, from acquiring it in BEGIN to the end
+	 * of COMMIT.
+	 */
+	uint32_t last_writes;
+	uint64_t last_bytes;
+	uint64_t last_hold_ns;
+
+	/*
+	 * Autocommit batch size for the current transaction: the
+	 * adaptive size when `target_hold_us` is set, and the fixed
+	 * one otherwise.
+	 */
+	uint32_t batch_size;
 };
 
 /**
@@ -155,6 +351,27 @@ struct proto_db {
 	 */
 	uint32_t batch_size;
 
+	/*
+	 * When non-zero, adapt the autocommit batch size so that each
+	 * transaction holds the write lock for about this many
+	 * microseconds, including its commit.  The size starts at
+	 * `batch_size` (or the default), then follows the time per
+	 * write measured over the previous transactions: small rows
+	 * on fast disks get larger batches, and large blobs or slow
+	 * fsyncs smaller ones, so readers don't stall.
+	 */
+	uint32_t target_hold_us;
+
+	/*
+	 * Bytes counted by `run_write` since the last commit, and when
+	 * the current sqlite transaction got the write lock (monotonic
+	 * ns).
+	 */
+	uint64_t write_bytes;
+	uint64_t transaction_begin_ns;
+
+	struct proto_db_batch_stats batch_stats;
+
 	/*
 	 * Sqlite doesn't nest transactions, so we track the
 	 * depth on our end.
@@ -171,6 +388,19 @@ struct proto_db {
 	size_t autocommit_depth;
 
 	sqlite3 *db;
+
+	/*
+	 * Prepared statements for `proto_db_paginate` and the
+	 * `proto_db` write functions, created on demand for `db`.
+	 * Callers of these functions must release them with
+	 * `proto_db_finalize_statements` before closing `db`; the
+	 * transaction and batch functions don't prepare any.
+	 *
+	 * Sqlite transparently re-prepares these statements after
+	 * schema changes, e.g., when `proto_table_setup` recreates
+	 * a view.
+	 */
+	struct proto_stmt_cache *statements;
 };
 
 /**
@@ -184,15 +414,36 @@ struct proto_result_row {
 	size_t n_bytes;
 };
 
+struct proto_arena_chunk;
+
 struct proto_result_list {
 	size_t count;
 	size_t capacity;
 	struct proto_result_row *rows;
+	/*
+	 * When `use_arena` is true, `proto_result_list_populate`
+	 * bump-allocates the blob copies and unpacked messages in a
+	 * chain of large chunks owned by the list, and
+	 * `proto_result_list_reset` releases them all at once.  Rows
+	 * must then never be freed individually.
+	 */
+	bool use_arena;
+	/*
+	 * When `lazy_unpack` is true, `proto_result_list_populate`
+	 * only copies the blobs, and `proto_result_list_proto` unpacks
+	 * each row's message, as `type`, on first access.
+	 */
+	bool lazy_unpack;
+	struct proto_arena_chunk *arena;
+	const ProtobufCMessageDescriptor *type;
 };
 
 #define PROTO_RESULT_LIST_INITIALIZER                                               \
 	(struct proto_result_list) { .count = 0 }
 
+#define PROTO_RESULT_LIST_ARENA_INITIALIZER                                         \
+	(struct proto_result_list) { .use_arena = true }
+
 #define PROTO_RESULT_LIST(LIST_TYPE, PROTO_TYPE, ROW_TYPE)                          \
 	struct LIST_TYPE {                                                          \
 		union {                                                             \
@@ -222,12 +473,60 @@ struct proto_result_list {
  * function, and the message descriptors must be present in the C++
  * protobuf repository before accessing the view.
  *
+ * Each successful setup records a fingerprint of the setup SQL and
+ * of the table's resulting schema in `proto_table_setups`; when both
+ * still match, setup only reads that row and returns, without any
+ * DDL that would invalidate other connections' prepared statements.
+ *
  * Returns 0 (SQLITE_OK) on success, and an sqlite error code on
  * failure.
  */
 int proto_table_setup(
     char **command_cache, sqlite3 *db, const struct proto_table *spec);
 
+/**
+ * Backfills up to `max_rows` rows of the first pending stored column
+ * of the `spec`ced table (see `defer_index_builds`), in one short
+ * transaction.  When a column is complete, calls `proto_table_setup`
+ * with `command_cache` to switch the view to that column.
+ *
+ * Must not be called in a transaction.  Fills `OUT_progress` if
+ * non-NULL.
+ *
+ * Returns SQLITE_OK if there is more work left, SQLITE_DONE once
+ * every column is complete, and an sqlite error code on failure.
+ */
+int proto_table_build_step(char **command_cache, sqlite3 *db,
+    const struct proto_table *spec, size_t max_rows,
+    struct proto_index_build_progress *OUT_progress);
+
+/**
+ * Trains a new compression dictionary on a random sample of up to
+ * `max_samples` rows of the `spec`ced table, of at most
+ * `dictionary_size` bytes (the extension's default if 0), and adds it
+ * to `proto_dictionaries`: writes compress with the table's latest
+ * dictionary.  Existing rows keep their dictionary until they're
+ * rewritten, e.g., by `proto_table_recompress`.
+ *
+ * Training fails when there are too few samples to learn from.
+ *
+ * Returns SQLITE_OK on success, and an sqlite error code on failure.
+ */
+int proto_table_train_dictionary(sqlite3 *db, const struct proto_table *spec,
+    size_t max_samples, size_t dictionary_size);
+
+/**
+ * Recompresses the rows of the `spec`ced table with ids in
+ * `(begin, end]` with the table's latest dictionary, e.g., after
+ * `proto_table_train_dictionary`, with ranges from
+ * `proto_table_paginate`.  Rewriting `proto` also reruns the write
+ * triggers.
+ *
+ * Returns SQLITE_OK on success, and an sqlite error code on failure.
+ */
+int proto_table_recompress(sqlite3 *db, const struct proto_table *spec,
+    int64_t begin, int64_t end);
+
 /**
  * Find the end id for page of up to `wanted` rows in `table`,
  * starting at `id >= begin`.
@@ -238,6 +537,66 @@ int proto_table_setup(
 int64_t proto_table_paginate(
     sqlite3 *, const char *table, int64_t begin, size_t wanted);
 
+/**
+ * Same as `proto_table_paginate`, with a cached prepared statement.
+ */
+int64_t proto_db_paginate(
+    struct proto_db *, const char *table, int64_t begin, size_t wanted);
+
+/**
+ * Inserts a row with `n_bytes` of protobuf `bytes` in the raw table
+ * for proto table `table`, and counts one write.  Stores the new row
+ * id in `OUT_id` if non-NULL.
+ *
+ * Writes compress `bytes` if the table's last setup had
+ * `compress_protos` when the write statement was first prepared; call
+ * `proto_db_finalize_statements` after toggling compression.
+ *
+ * Returns SQLITE_OK on success, and a sqlite error code on failure.
+ */
+int proto_db_insert(struct proto_db *, int64_t *OUT_id, const char *table,
+    const void *bytes, size_t n_bytes);
+
+/**
+ * Replaces the protobuf bytes for row `id` of proto table `table`,
+ * and counts one write.  Compresses like `proto_db_insert`.
+ *
+ * Returns SQLITE_OK on success, and a sqlite error code on failure.
+ */
+int proto_db_update(struct proto_db *, const char *table, int64_t id,
+    const void *bytes, size_t n_bytes);
+
+/**
+ * Deletes row `id` of proto table `table`, and counts one write.
+ *
+ * Returns SQLITE_OK on success, and a sqlite error code on failure.
+ */
+int proto_db_delete(struct proto_db *, const char *table, int64_t id);
+
+/**
+ * Inserts `count` rows of protobuf bytes in the raw table for proto
+ * table `table`, without going through the view's trigger.
+ *
+ * Rows are written in autocommit batches, unless `rebuild_indexes`
+ * is true.  In that case, we first drop the proto table's indexes,
+ * and recreate them after the last insert, all in one transaction.
+ * Building each index once is much faster than updating it for
+ * every row when the load is large compared to the existing table.
+ *
+ * Returns SQLITE_OK on success, and a sqlite error code on failure.
+ * With `rebuild_indexes`, a failure rolls back the whole load and
+ * leaves the indexes in place; otherwise, rows inserted in batches
+ * before a failure are not rolled back.
+ */
+int proto_db_bulk_insert(struct proto_db *, const char *table,
+    const struct proto_bind_blob *rows, size_t count, bool rebuild_indexes);
+
+/**
+ * Finalizes all the prepared statements cached in the proto db.  The
+ * cache is repopulated on demand.
+ */
+void proto_db_finalize_statements(struct proto_db *);
+
 /**
  * Attempts to open a new transaction in the proto db.  This wrapper
  * counts recursive invocation, and only opens a sqlite transaction
@@ -254,7 +613,9 @@ int proto_db_transaction_begin(struct proto_db *);
  * recursive transactions (nested or otherwise), and only closes the
  * underlying sqlite transaction when the total count hits 0.
  *
- * Aborts on failure.
+ * If sqlite already rolled back the transaction (e.g., after
+ * SQLITE_FULL or SQLITE_IOERR), only drops the count.  Aborts if the
+ * commit fails.
  */
 void proto_db_transaction_end(struct proto_db *);
 
@@ -275,7 +636,8 @@ void proto_db_batch_end(struct proto_db *);
 
 /**
  * Updates the proto db for `count` new writes operations (rows added
- * or modified).
+ * or modified).  May commit the current autocommit transaction and
+ * open a new one, once the batch is full.
  *
  * Aborts on transaction flush failure.
  */
@@ -283,7 +645,8 @@ void proto_db_count_writes(struct proto_db *, size_t count);
 
 /**
  * Releases any resource owned by the list and reinitialises it to a
- * zero-filled struct.
+ * zero-filled struct.  Only `use_arena` and `lazy_unpack` are
+ * preserved.
  */
 void proto_result_list_reset(struct proto_result_list *);
 
@@ -302,6 +665,97 @@ void proto_result_list_reset(struct proto_result_list *);
 int proto_result_list_populate(struct proto_result_list *,
     const ProtobufCMessageDescriptor *, sqlite3 *, sqlite3_stmt *);
 
+/**
+ * Returns the parsed message for the `index`th row of `list`.
+ *
+ * Rows are only unpacked on demand in `lazy_unpack` mode; the parsed
+ * message is then cached in the row, and released with the list.
+ * Returns NULL for rows without a blob or a descriptor, and when the
+ * blob fails to parse.
+ */
+ProtobufCMessage *proto_result_list_proto(struct proto_result_list *,
+    size_t index);
+
+/**
+ * A `proto_result_row_cb` receives one result row from
+ * `proto_result_stream`.  `bytes` is NULL if the row has no blob, and
+ * is only valid until the callback returns.
+ *
+ * Returns 0 to keep going, and any other value to stop the stream.
+ */
+typedef int proto_result_row_cb(void *ctx, int64_t id, const void *bytes,
+    size_t n_bytes);
+
+/**
+ * Calls `cb` with each result row from the sqlite3 statement, with
+ * the same column layout as `proto_result_list_populate`, but without
+ * copying or parsing the blobs.
+ *
+ * Returns SQLITE_OK (0) once the statement is done, the callback's
+ * return value if it is not 0, and a sqlite error code on failure.
+ */
+int proto_result_stream(sqlite3 *, sqlite3_stmt *, proto_result_row_cb *cb,
+    void *ctx);
+
+/**
+ * A `proto_scan_row_cb` receives each result row of a parallel scan,
+ * as the current row of the `worker`'s statement.  It is called
+ * concurrently from every worker thread; `worker` is in
+ * `[0, n_workers)`, which makes it easy to accumulate results in
+ * per-worker slots without locking.
+ *
+ * Returns 0 to keep going, and any other value to stop the scan.
+ */
+typedef int proto_scan_row_cb(void *ctx, size_t worker, sqlite3_stmt *stmt);
+
+/**
+ * A `struct proto_parallel_scan` describes a read-only query to run
+ * over the id space of a proto table, in parallel.
+ */
+struct proto_parallel_scan {
+	/* The proto table (or its raw table) to split by id. */
+	const char *table;
+	/*
+	 * The query to run for each range of ids.  It must restrict
+	 * its results with `id BETWEEN :begin AND :end`.
+	 */
+	const char *query;
+	/* Ranges have up to this many rows; 0 means 10000. */
+	size_t page_size;
+	/* Number of worker threads; 0 means one per online CPU. */
+	size_t n_workers;
+	/*
+	 * If non-NULL, called with each worker connection before
+	 * preparing `query`, e.g., to load descriptors.  Returns 0 on
+	 * success, and an error that stops the scan otherwise.
+	 */
+	int (*connection_init)(void *ctx, sqlite3 *);
+	proto_scan_row_cb *cb;
+	void *ctx;
+};
+
+/**
+ * Runs `scan->query` for ranges of ids in `scan->table`, on
+ * `scan->n_workers` threads, and passes each result row to `scan->cb`.
+ *
+ * The ranges are computed with `proto_table_paginate` on `db`.  Each
+ * worker then opens its own read-only connection to `db`'s main
+ * database file, so `db` must not be an in-memory or temporary
+ * database, and should be in WAL mode for workers to read
+ * concurrently with writers.  Workers must have the sqlite_protobuf
+ * extension loaded, e.g., with `sqlite3_auto_extension` or
+ * `connection_init`; the extension's caches are thread-local, so
+ * workers never contend on them.
+ *
+ * Ranges are first split evenly between workers, and idle workers
+ * steal ranges from the others.  If some worker threads fail to
+ * start, the others still scan every range.
+ *
+ * Returns 0 (SQLITE_OK) on success, the first non-zero return value
+ * from `cb` or `connection_init`, and an sqlite error code on failure.
+ */
+int proto_parallel_scan(sqlite3 *db, const struct proto_parallel_scan *scan);
+
 /**
  * Prepares a statement for the sqlite handle `db`, and stores the
  * result in `stmt` on success.
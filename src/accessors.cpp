@@ -0,0 +1,110 @@
+#include "accessors.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <dlfcn.h>
+
+#include "protopath.h"
+
+namespace sqlite_protobuf {
+
+using google::protobuf::Descriptor;
+using google::protobuf::DescriptorPool;
+using google::protobuf::FieldDescriptor;
+
+namespace {
+
+/*
+ * Accessors are registered by `protobuf_load`, while other threads
+ * compile protopaths: every access to the map goes through `lock`,
+ * except for the `empty` check that keeps lookups free until the
+ * first registration.  Compiled protopaths keep the function pointer,
+ * and the libraries that define accessors are never unloaded.
+ */
+struct accessor_registry {
+    std::mutex lock;
+    std::atomic<bool> empty{true};
+    std::map<std::pair<const Descriptor *, std::string>, accessor_fn *> fns;
+};
+
+// Never destroyed, like the libraries that registered accessors.
+accessor_registry *get_accessor_registry()
+{
+    static accessor_registry *registry = new accessor_registry();
+    return registry;
+}
+
+/// Returns true if accessors can evaluate `path`: they can't return
+/// messages or whole repeated fields, and map entries have no stable
+/// order.
+bool accessor_path_supported(const protopath& path)
+{
+    if (path.error != nullptr || path.steps.empty() ||
+        path.tail == protopath_tail::INVALID)
+        return false;
+
+    for (const protopath_step& step : path.steps) {
+        if (step.field->is_map() ||
+            (step.field->is_repeated() && !step.has_index))
+            return false;
+    }
+
+    return path.steps.back().field->cpp_type() !=
+        FieldDescriptor::CppType::CPPTYPE_MESSAGE;
+}
+
+}  // namespace
+
+void add_accessor(const char *message_name, const char *path,
+                  accessor_fn *fn)
+{
+    // Only generated message types have generated classes.
+    const Descriptor *descriptor =
+        DescriptorPool::generated_pool()->FindMessageTypeByName(message_name);
+    if (descriptor == nullptr || fn == nullptr)
+        return;
+
+    // The registered text must match the compiled path exactly, so the
+    // accessor agrees with reflection about what the path means.
+    if (!accessor_path_supported(compile_protopath(descriptor, path)))
+        return;
+
+    accessor_registry *registry = get_accessor_registry();
+    std::lock_guard<std::mutex> guard(registry->lock);
+    registry->fns[std::make_pair(descriptor, std::string(path))] = fn;
+    registry->empty.store(false, std::memory_order_release);
+}
+
+accessor_fn *find_accessor(const protopath& compiled, const std::string& path)
+{
+    accessor_registry *registry = get_accessor_registry();
+    if (registry->empty.load(std::memory_order_acquire) ||
+        !accessor_path_supported(compiled))
+        return nullptr;
+
+    std::lock_guard<std::mutex> guard(registry->lock);
+    auto it = registry->fns.find(std::make_pair(compiled.descriptor, path));
+    return it == registry->fns.end() ? nullptr : it->second;
+}
+
+void load_accessors(void *handle)
+{
+    void *symbol = dlsym(handle, "sqlite_protobuf_accessors");
+    if (symbol == nullptr)
+        return;
+
+    reinterpret_cast<void (*)(add_accessor_fn *)>(symbol)(
+        sqlite_protobuf_add_accessor);
+}
+
+extern "C" void sqlite_protobuf_add_accessor(const char *message_name,
+                                             const char *path,
+                                             accessor_fn *fn)
+{
+    add_accessor(message_name, path, fn);
+}
+
+}  // namespace sqlite_protobuf
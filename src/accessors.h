@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+
+#include "sqlite_protobuf_accessor.h"
+
+namespace sqlite_protobuf {
+
+struct protopath;
+
+// Registers `fn` for `path` on messages of type `message_name`, like
+// `sqlite_protobuf_add_accessor`.  Accessors for unknown message types
+// or for paths that don't end with a singular scalar value (an indexed
+// element of a repeated field is fine) are ignored.  Registering a
+// path again replaces its accessor, for paths compiled from then on.
+void add_accessor(const char *message_name, const char *path,
+                  accessor_fn *fn);
+
+// Returns the accessor registered for `path`, the text of the
+// compiled protopath `compiled`, or nullptr.
+accessor_fn *find_accessor(const protopath& compiled,
+                           const std::string& path);
+
+// Calls the library's `sqlite_protobuf_accessors`, if it defines one.
+void load_accessors(void *handle);
+
+}  // namespace sqlite_protobuf
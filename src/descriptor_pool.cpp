@@ -0,0 +1,218 @@
+#include "descriptor_pool.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
+
+namespace sqlite_protobuf {
+
+using google::protobuf::Descriptor;
+using google::protobuf::DescriptorPool;
+using google::protobuf::DynamicMessageFactory;
+using google::protobuf::EnumDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::FileDescriptorSet;
+using google::protobuf::Message;
+using google::protobuf::MessageFactory;
+
+namespace {
+
+/*
+ * The dynamic pool uses the generated pool as an underlay, so loaded
+ * files may import generated ones, e.g., google/protobuf/timestamp.proto.
+ *
+ * `DescriptorPool` lookups are only safe while nothing builds files
+ * in the same pool, and the JSON and text format parsers look up
+ * names in the pool of the message they parse.  We thus never build
+ * files in a pool others can see: each load that adds files builds
+ * all of them in a new pool, and atomically publishes it.  Published
+ * pools are immutable, and never freed, so descriptors and prototypes
+ * stay valid, and may be used without any lock.
+ */
+struct dynamic_pool {
+    DescriptorPool pool;
+    // `GetPrototype` locks the factory, so it's safe to call on a
+    // published pool.
+    mutable DynamicMessageFactory factory;
+
+    // Serialized definition of each file in the pool, by name, and
+    // their names in the order we built them.
+    std::map<std::string, std::string> files;
+    std::vector<std::string> build_order;
+
+    dynamic_pool()
+        : pool(DescriptorPool::generated_pool()),
+          factory(&pool)
+    {
+        // Fields of generated message types use the generated classes.
+        factory.SetDelegateToGeneratedFactory(true);
+    }
+};
+
+// The latest published pool, or nullptr before the first load.  Never
+// destroyed, like the generated pool: other threads may still use its
+// prototypes while the process exits.
+std::atomic<const dynamic_pool *> current_pool;
+
+// Serialises loads, so none is lost.
+std::mutex load_lock;
+
+/// Remembers the first error reported by `BuildFileCollectingErrors`.
+class first_error_collector : public DescriptorPool::ErrorCollector {
+public:
+    void AddError(const std::string& filename,
+                  const std::string& element_name,
+                  const Message *descriptor,
+                  ErrorLocation location,
+                  const std::string& message) override
+    {
+        if (error.empty())
+            error = filename + ": " + element_name + ": " + message;
+    }
+
+    std::string error;
+};
+
+}  // namespace
+
+const Message *find_message_prototype(const std::string& message_name)
+{
+    const DescriptorPool *generated = DescriptorPool::generated_pool();
+    const Descriptor *descriptor = generated->FindMessageTypeByName(message_name);
+    if (descriptor) {
+        MessageFactory *factory = MessageFactory::generated_factory();
+        return factory->GetPrototype(descriptor);
+    }
+
+    const dynamic_pool *dynamic = current_pool.load(std::memory_order_acquire);
+    if (!dynamic)
+        return nullptr;
+
+    descriptor = dynamic->pool.FindMessageTypeByName(message_name);
+    if (!descriptor)
+        return nullptr;
+
+    return dynamic->factory.GetPrototype(descriptor);
+}
+
+const EnumDescriptor *find_enum_descriptor(const std::string& enum_name)
+{
+    const DescriptorPool *generated = DescriptorPool::generated_pool();
+    const EnumDescriptor *descriptor = generated->FindEnumTypeByName(enum_name);
+    if (descriptor)
+        return descriptor;
+
+    const dynamic_pool *dynamic = current_pool.load(std::memory_order_acquire);
+    if (!dynamic)
+        return nullptr;
+
+    return dynamic->pool.FindEnumTypeByName(enum_name);
+}
+
+int load_descriptor_set(const void *data, size_t size, std::string *error)
+{
+    FileDescriptorSet set;
+    if (!set.ParseFromArray(data, static_cast<int>(size))) {
+        *error = "Could not parse FileDescriptorSet";
+        return -1;
+    }
+
+    const DescriptorPool *generated = DescriptorPool::generated_pool();
+    std::lock_guard<std::mutex> guard(load_lock);
+    const dynamic_pool *old = current_pool.load(std::memory_order_acquire);
+
+    // Skip the files we already have
+    std::vector<const FileDescriptorProto *> pending;
+    for (const FileDescriptorProto& file : set.file()) {
+        if (generated->FindFileByName(file.name()))
+            continue;
+
+        if (!old || old->files.count(file.name()) == 0) {
+            pending.push_back(&file);
+        } else if (old->files.at(file.name()) != file.SerializeAsString()) {
+            *error = "Conflicting definition for " + file.name();
+            return -1;
+        }
+    }
+
+    if (pending.empty())
+        return 0;
+
+    // Rebuild the files we already published, in their original order,
+    // then add the new ones.
+    std::unique_ptr<dynamic_pool> fresh(new dynamic_pool());
+    for (const std::string& name : old ? old->build_order :
+             std::vector<std::string>()) {
+        const std::string& serialized = old->files.at(name);
+        FileDescriptorProto file;
+
+        if (!file.ParseFromString(serialized) || !fresh->pool.BuildFile(file)) {
+            *error = "Could not rebuild " + name;
+            return -1;
+        }
+
+        fresh->files[name] = serialized;
+        fresh->build_order.push_back(name);
+    }
+
+    // Build the remaining files once their dependencies are in the pool:
+    // descriptor sets are usually, but not necessarily, in dependency order.
+    int added = 0;
+    while (!pending.empty()) {
+        std::vector<const FileDescriptorProto *> blocked;
+
+        for (const FileDescriptorProto *file : pending) {
+            bool ready = true;
+            for (const std::string& dependency : file->dependency()) {
+                if (!fresh->pool.FindFileByName(dependency)) {
+                    ready = false;
+                    break;
+                }
+            }
+
+            if (!ready) {
+                blocked.push_back(file);
+                continue;
+            }
+
+            // The same file may appear twice in the set.
+            if (fresh->files.count(file->name()) != 0) {
+                if (fresh->files[file->name()] != file->SerializeAsString()) {
+                    *error = "Conflicting definition for " + file->name();
+                    return -1;
+                }
+
+                continue;
+            }
+
+            first_error_collector errors;
+            if (!fresh->pool.BuildFileCollectingErrors(*file, &errors)) {
+                *error = "Could not build " + errors.error;
+                return -1;
+            }
+
+            fresh->files[file->name()] = file->SerializeAsString();
+            fresh->build_order.push_back(file->name());
+            added++;
+        }
+
+        if (blocked.size() == pending.size()) {
+            *error = "Missing dependencies for " + blocked[0]->name();
+            return -1;
+        }
+
+        pending.swap(blocked);
+    }
+
+    // The old pool stays alive for the descriptors already handed out.
+    current_pool.store(fresh.release(), std::memory_order_release);
+    return added;
+}
+
+}  // namespace sqlite_protobuf
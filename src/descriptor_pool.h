@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+namespace sqlite_protobuf {
+
+// Message and enum types come from the generated pool, i.e., from the
+// code linked in the process or loaded with `protobuf_load`, and then
+// from the descriptor sets loaded with `protobuf_load_descriptor_set`.
+// The latter are instantiated with a `DynamicMessageFactory`.
+
+// Returns the prototype for `message_name`, or `nullptr` if there is no
+// such message type.
+const google::protobuf::Message *find_message_prototype(
+    const std::string& message_name);
+
+// Returns the descriptor for `enum_name`, or `nullptr` if there is no
+// such enum type.
+const google::protobuf::EnumDescriptor *find_enum_descriptor(
+    const std::string& enum_name);
+
+// Adds the files in the serialized `FileDescriptorSet` at `data` to
+// the dynamic pool.  Files that are already in the generated pool, or
+// that were already loaded with the exact same definition, are
+// skipped.  Returns the number of new files on success, and -1 after
+// storing a message in `*error` on failure; a failed load adds no
+// file.
+//
+// New files are built in a copy of the dynamic pool, which replaces
+// the current one once complete, so lookups never see a pool that is
+// being built.  Older pools are kept, and types are only ever added,
+// so loading a descriptor set never invalidates the prototypes we
+// already handed out.
+int load_descriptor_set(const void *data, size_t size, std::string *error);
+
+}  // namespace sqlite_protobuf
@@ -2,10 +2,19 @@
 
 #include "sqlite3ext.h"
 
+#include "protobuf_aggregate.h"
+#include "protobuf_compress.h"
+#include "protobuf_config.h"
+#include "protobuf_each.h"
 #include "protobuf_enum.h"
 #include "protobuf_extract.h"
+#include "protobuf_fields.h"
 #include "protobuf_json.h"
 #include "protobuf_load.h"
+#include "protobuf_presence.h"
+#include "protobuf_rows.h"
+#include "protobuf_scan.h"
+#include "protobuf_stats.h"
 #include "protobuf_text.h"
 
 namespace sqlite_protobuf {
@@ -28,10 +37,19 @@ int sqlite3_sqliteprotobuf_init(sqlite3 *db,
     
     // Run each register_* function and abort if any of them fails
     int (*register_fns[])(sqlite3 *, char **, const sqlite3_api_routines *) = {
+        register_protobuf_aggregate,
+        register_protobuf_compress,
+        register_protobuf_config,
+        register_protobuf_each,
         register_protobuf_enum,
         register_protobuf_extract,
+        register_protobuf_fields,
         register_protobuf_json,
         register_protobuf_load,
+        register_protobuf_presence,
+        register_protobuf_rows,
+        register_protobuf_scan,
+        register_protobuf_stats,
         register_protobuf_text,
     };
     
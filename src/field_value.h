@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3.h"
+
+#include "protopath.h"
+
+namespace sqlite_protobuf {
+
+// A value found by evaluating a protopath, with the SQLite type that
+// `protobuf_extract` would return for it.
+struct field_value {
+    // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or
+    // SQLITE_NULL.
+    int type;
+    int64_t integer;
+    double real;
+    // Text and blob values point into the encoded message, the
+    // parsed message or a descriptor, and only live until the next
+    // row.
+    const char *data;
+    size_t size;
+    // Whether the last field in the path is set.
+    bool present;
+};
+
+// Returns the error message for protopaths that `field_value`s can't
+// represent, or nullptr if `path` is valid and ends with a scalar
+// field (or with a submessage, if `allow_message`).
+const char *row_path_error(const protopath& path, bool allow_message);
+
+// Evaluates `path` (which must pass `row_path_error`) directly on the
+// encoded message `data` of `size` bytes, if the path is
+// `wire_supported`, and sets `out` to the value it finds.  Returns
+// false if the message must be parsed and passed to
+// `message_field_value` instead; otherwise, `*error` is the error
+// message, or nullptr on success.
+bool wire_field_value(const protopath& path, const void *data, size_t size,
+                      field_value *out, const char **error);
+
+// Walks `path` (which must pass `row_path_error`) on `root_message`
+// with reflection, like `extract_from_message`, and sets `out` to
+// the value it finds.  `scratch` may hold the value of string fields.
+// Returns an error message on failure, and nullptr on success.
+const char *message_field_value(const protopath& path,
+                                const google::protobuf::Message& root_message,
+                                std::string *scratch,
+                                field_value *out);
+
+// Sets the result of `context` to `value`, exactly like
+// `protobuf_extract` would.
+void result_field_value(sqlite3_context *context, const field_value& value);
+
+// Normalises a (possibly negative) `index` into a repeated field
+// with `size` elements.  Returns false if the index is out of range.
+bool normalize_index(int index, int size, int *out);
+
+}  // namespace sqlite_protobuf
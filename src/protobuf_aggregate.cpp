@@ -0,0 +1,740 @@
+#include "protobuf_aggregate.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3ext.h"
+
+#include "field_value.h"
+#include "protobuf_compress.h"
+#include "protopath.h"
+#include "utilities.h"
+#include "wire_format.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+
+/// Returns true if `value` holds exactly the bytes in `str`.
+bool value_equals(const std::string& str, sqlite3_value *value)
+{
+    const void *data = sqlite3_value_blob(value);
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(value));
+
+    return data != nullptr && size == str.size() &&
+        memcmp(data, str.data(), size) == 0;
+}
+
+
+// The state of one of the row aggregates, allocated on the first row.
+struct aggregate_state {
+    // The message type and protopath of the last row, and the
+    // compiled path.  They're normally the same for all rows.
+    std::string message_name;
+    std::string path_text;
+    protopath path;
+    bool compiled;
+
+    // Number of (non-NULL or present) values so far.
+    int64_t count;
+
+    // protobuf_sum: like SUM, the sum is exact until we see a
+    // float, and integer overflows are errors.
+    int64_t integer_sum;
+    double real_sum;
+    bool has_real;
+    bool overflow;
+
+    // protobuf_group_concat
+    std::string concat;
+
+    // Backing storage for string values found with reflection.
+    std::string scratch;
+};
+
+
+/// Returns the aggregate state for `context`, after allocating it if
+/// `create` is true.  Sets an error and returns nullptr on failure.
+aggregate_state *get_state(sqlite3_context *context, bool create)
+{
+    auto **slot = static_cast<aggregate_state **>(sqlite3_aggregate_context(
+        context, create ? sizeof(aggregate_state *) : 0));
+    if (slot == nullptr) {
+        if (create)
+            sqlite3_result_error_nomem(context);
+        return nullptr;
+    }
+
+    if (*slot == nullptr && create) {
+        *slot = new (std::nothrow) aggregate_state();
+        if (*slot == nullptr)
+            sqlite3_result_error_nomem(context);
+    }
+
+    return *slot;
+}
+
+
+/// Transfers ownership of the aggregate state for `context`, if any,
+/// to the caller.
+std::unique_ptr<aggregate_state> take_state(sqlite3_context *context)
+{
+    auto **slot = static_cast<aggregate_state **>(
+        sqlite3_aggregate_context(context, 0));
+    if (slot == nullptr)
+        return nullptr;
+
+    std::unique_ptr<aggregate_state> ret(*slot);
+    *slot = nullptr;
+    return ret;
+}
+
+
+/// Evaluates the protopath `argv[2]` for the message `argv[0]` of
+/// type `argv[1]`.  Returns the aggregate state on success, and sets
+/// an error and returns nullptr on failure.
+aggregate_state *step_value(sqlite3_context *context,
+                            sqlite3_value **argv,
+                            bool allow_message,
+                            field_value *out)
+{
+    aggregate_state *state = get_state(context, true);
+    if (state == nullptr)
+        return nullptr;
+
+    // Only compile the path once, unless the arguments change.
+    if (!state->compiled || !value_equals(state->message_name, argv[1]) ||
+        !value_equals(state->path_text, argv[2])) {
+        const char *text =
+            reinterpret_cast<const char *>(sqlite3_value_text(argv[2]));
+        size_t text_size = static_cast<size_t>(sqlite3_value_bytes(argv[2]));
+
+        state->compiled = false;
+        if (!protopath_has_root(text, text_size)) {
+            sqlite3_result_error(context, "Invalid path", -1);
+            return nullptr;
+        }
+
+        const Message *prototype = get_prototype(context, argv[1]);
+        if (prototype == nullptr)
+            return nullptr;
+
+        state->message_name = string_from_sqlite3_value(argv[1]);
+        state->path_text.assign(text, text_size);
+        state->path = compile_protopath(prototype->GetDescriptor(),
+            state->path_text);
+
+        const char *error = row_path_error(state->path, allow_message);
+        if (error != nullptr) {
+            sqlite3_result_error(context, error, -1);
+            return nullptr;
+        }
+
+        state->compiled = true;
+    }
+
+    const protopath& path = state->path;
+    const void *data;
+    size_t size;
+    if (!get_message_data(context, argv[0], &data, &size))
+        return nullptr;
+
+    const char *error = nullptr;
+
+    // Fast path: find scalar fields directly in the encoded message
+    if (!wire_field_value(path, data, size, out, &error)) {
+        const Message *message = parse_message(context, argv[0], argv[1]);
+        if (message == nullptr)
+            return nullptr;
+
+        error = message_field_value(path, *message, &state->scratch, out);
+    }
+
+    if (error != nullptr) {
+        sqlite3_result_error(context, error, -1);
+        return nullptr;
+    }
+
+    return state;
+}
+
+
+/// Converts the text or blob in `value` to a number, like SUM does
+/// with `sqlite3_value_numeric_type` and `sqlite3_value_double`: text
+/// that is exactly an integer that fits in 64 bits stays an integer,
+/// and anything else becomes the float value of its longest decimal
+/// prefix, 0 if none.
+void coerce_numeric(field_value *value)
+{
+    const char *text = value->data;
+    const char *end = text + value->size;
+    const char *digits;
+
+    while (text < end && isspace(static_cast<unsigned char>(*text)))
+        text++;
+    while (end > text && isspace(static_cast<unsigned char>(end[-1])))
+        end--;
+
+    // Only keep the sign, digits, decimal point and exponent that
+    // SQLite's parser accepts: strtod also knows about hex and
+    // infinities.
+    const char *prefix_end = text;
+    if (prefix_end < end && (*prefix_end == '+' || *prefix_end == '-'))
+        prefix_end++;
+    digits = prefix_end;
+    while (prefix_end < end && isdigit(static_cast<unsigned char>(*prefix_end)))
+        prefix_end++;
+
+    const bool is_integer = prefix_end == end && prefix_end > digits;
+    if (prefix_end < end && *prefix_end == '.') {
+        prefix_end++;
+        while (prefix_end < end &&
+               isdigit(static_cast<unsigned char>(*prefix_end)))
+            prefix_end++;
+    }
+
+    if (prefix_end < end && (*prefix_end == 'e' || *prefix_end == 'E')) {
+        const char *exponent = prefix_end + 1;
+        if (exponent < end && (*exponent == '+' || *exponent == '-'))
+            exponent++;
+        if (exponent < end && isdigit(static_cast<unsigned char>(*exponent))) {
+            while (exponent < end &&
+                   isdigit(static_cast<unsigned char>(*exponent)))
+                exponent++;
+            prefix_end = exponent;
+        }
+    }
+
+    const std::string prefix(text, prefix_end);
+    if (value->type == SQLITE_TEXT && is_integer) {
+        errno = 0;
+        long long integer = strtoll(prefix.c_str(), nullptr, 10);
+        if (errno == 0) {
+            value->type = SQLITE_INTEGER;
+            value->integer = integer;
+            return;
+        }
+    }
+
+    value->type = SQLITE_FLOAT;
+    value->real = strtod(prefix.c_str(), nullptr);
+}
+
+
+/// Sums a field over all rows
+///
+///     SELECT protobuf_sum(data, "Person", "$.age") FROM people;
+///
+/// @returns the same value as SUM(protobuf_extract(...)), but only
+///          compiles the path once.  Like SUM, text and blob values
+///          (e.g., strings or enum names) are converted to numbers.
+void protobuf_sum_step(sqlite3_context *context,
+                       int argc,
+                       sqlite3_value **argv)
+{
+    field_value value;
+    aggregate_state *state = step_value(context, argv, false, &value);
+    if (state == nullptr)
+        return;
+
+    if (value.type == SQLITE_TEXT || value.type == SQLITE_BLOB)
+        coerce_numeric(&value);
+
+    switch (value.type) {
+    case SQLITE_INTEGER:
+        state->count++;
+        state->real_sum += value.integer;
+        if (!state->overflow &&
+            __builtin_add_overflow(state->integer_sum, value.integer,
+                &state->integer_sum))
+            state->overflow = true;
+        break;
+    case SQLITE_FLOAT:
+        state->count++;
+        state->real_sum += value.real;
+        state->has_real = true;
+        break;
+    default:
+        break;
+    }
+}
+
+void protobuf_sum_final(sqlite3_context *context)
+{
+    std::unique_ptr<aggregate_state> state = take_state(context);
+
+    if (state == nullptr || state->count == 0) {
+        sqlite3_result_null(context);
+    } else if (state->has_real) {
+        sqlite3_result_double(context, state->real_sum);
+    } else if (state->overflow) {
+        sqlite3_result_error(context, "integer overflow", -1);
+    } else {
+        sqlite3_result_int64(context, state->integer_sum);
+    }
+}
+
+
+/// Counts the rows where a field is set
+///
+///     SELECT protobuf_count_present(data, "Person", "$.phones[0]")
+///     FROM people;
+///
+/// @returns the number of rows whose message has a value for the
+///          path, without defaults: absent proto3 scalars and out of
+///          range indexes don't count.
+void protobuf_count_present_step(sqlite3_context *context,
+                                 int argc,
+                                 sqlite3_value **argv)
+{
+    field_value value;
+    aggregate_state *state = step_value(context, argv, true, &value);
+    if (state == nullptr)
+        return;
+
+    if (value.present)
+        state->count++;
+}
+
+void protobuf_count_present_final(sqlite3_context *context)
+{
+    std::unique_ptr<aggregate_state> state = take_state(context);
+
+    sqlite3_result_int64(context, state != nullptr ? state->count : 0);
+}
+
+
+/// Concatenates a field over all rows
+///
+///     SELECT protobuf_group_concat(data, "Person", "$.name", separator?)
+///     FROM people;
+///
+/// @returns the same value as GROUP_CONCAT(protobuf_extract(...)):
+///          non-NULL values converted to text, separated by
+///          `separator` (a comma by default).
+void protobuf_group_concat_step(sqlite3_context *context,
+                                int argc,
+                                sqlite3_value **argv)
+{
+    field_value value;
+    aggregate_state *state = step_value(context, argv, false, &value);
+    if (state == nullptr)
+        return;
+
+    if (value.type == SQLITE_NULL)
+        return;
+
+    if (state->count++ > 0) {
+        if (argc < 4) {
+            state->concat += ',';
+        } else {
+            const char *separator =
+                reinterpret_cast<const char *>(sqlite3_value_text(argv[3]));
+            if (separator != nullptr)
+                state->concat.append(separator, sqlite3_value_bytes(argv[3]));
+        }
+    }
+
+    switch (value.type) {
+    case SQLITE_INTEGER:
+        state->concat += std::to_string(value.integer);
+        break;
+    case SQLITE_FLOAT:
+    {
+        // Same format as SQLite's own conversions to text.
+        char buf[64];
+        sqlite3_snprintf(sizeof(buf), buf, "%!.15g", value.real);
+        state->concat += buf;
+        break;
+    }
+    default:
+        state->concat.append(value.data, value.size);
+        break;
+    }
+}
+
+void protobuf_group_concat_final(sqlite3_context *context)
+{
+    std::unique_ptr<aggregate_state> state = take_state(context);
+
+    if (state == nullptr || state->count == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    sqlite3_result_text64(context, state->concat.data(), state->concat.size(),
+        SQLITE_TRANSIENT, SQLITE_UTF8);
+}
+
+
+enum class array_op {
+    COUNT,
+    SUM,
+    MIN,
+    MAX,
+    AVG,
+};
+
+// `sqlite3_user_data` for each of the protobuf_array_* functions.
+const array_op array_ops[] = {
+    array_op::COUNT,
+    array_op::SUM,
+    array_op::MIN,
+    array_op::MAX,
+    array_op::AVG,
+};
+
+const char *const array_op_names[] = {
+    "protobuf_array_count",
+    "protobuf_array_sum",
+    "protobuf_array_min",
+    "protobuf_array_max",
+    "protobuf_array_avg",
+};
+
+
+/// Returns the error message for protopaths that can't be summarised
+/// by the protobuf_array_* functions, or nullptr if `path` ends with
+/// a repeated field (a numeric one, if `numeric`).
+const char *array_path_error(const protopath& path, bool numeric)
+{
+    if (path.error != nullptr)
+        return path.error;
+
+    if (path.steps.empty() || path.tail != protopath_tail::NONE)
+        return "Path does not end with a repeated field";
+
+    for (size_t i = 0; i + 1 < path.steps.size(); i++) {
+        if (path.steps[i].field->is_repeated() && !path.steps[i].has_index)
+            return "Expected index into repeated field";
+    }
+
+    const protopath_step& last = path.steps.back();
+    if (!last.field->is_repeated() || last.has_index)
+        return "Path does not end with a repeated field";
+
+    if (!numeric)
+        return nullptr;
+
+    switch (last.field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        return "Path does not end with a repeated numeric field";
+    default:
+        return nullptr;
+    }
+}
+
+
+// Running summary of the elements of a repeated numeric field.
+struct array_summary {
+    int64_t count;
+    bool overflow;
+    int64_t integer_sum;
+    int64_t integer_min;
+    int64_t integer_max;
+    // Sum of all the elements, as doubles, even for integer fields.
+    double real_sum;
+    double real_min;
+    double real_max;
+
+    void add_integer(int64_t value) {
+        if (count == 0 || value < integer_min)
+            integer_min = value;
+        if (count == 0 || value > integer_max)
+            integer_max = value;
+        if (!overflow && __builtin_add_overflow(integer_sum, value,
+                &integer_sum))
+            overflow = true;
+        real_sum += value;
+        count++;
+    }
+
+    void add_real(double value) {
+        if (count == 0 || value < real_min)
+            real_min = value;
+        if (count == 0 || value > real_max)
+            real_max = value;
+        real_sum += value;
+        count++;
+    }
+};
+
+
+bool is_real_field(const FieldDescriptor *field)
+{
+    return field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_FLOAT ||
+        field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_DOUBLE;
+}
+
+
+/// Adds each element of the repeated numeric `field` in `message` to
+/// `summary`.
+void summarize_message(const Message& message, const FieldDescriptor *field,
+                       array_summary *summary)
+{
+    const Reflection *reflection = message.GetReflection();
+    const int size = reflection->FieldSize(message, field);
+
+    for (int i = 0; i < size; i++) {
+        switch (field->cpp_type()) {
+        case FieldDescriptor::CppType::CPPTYPE_INT32:
+            summary->add_integer(
+                reflection->GetRepeatedInt32(message, field, i));
+            break;
+        case FieldDescriptor::CppType::CPPTYPE_INT64:
+            summary->add_integer(
+                reflection->GetRepeatedInt64(message, field, i));
+            break;
+        case FieldDescriptor::CppType::CPPTYPE_UINT32:
+            summary->add_integer(
+                reflection->GetRepeatedUInt32(message, field, i));
+            break;
+        case FieldDescriptor::CppType::CPPTYPE_UINT64:
+            summary->add_integer(
+                reflection->GetRepeatedUInt64(message, field, i));
+            break;
+        case FieldDescriptor::CppType::CPPTYPE_ENUM:
+            summary->add_integer(
+                reflection->GetRepeatedEnumValue(message, field, i));
+            break;
+        case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+            summary->add_real(
+                reflection->GetRepeatedDouble(message, field, i));
+            break;
+        case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+            summary->add_real(
+                reflection->GetRepeatedFloat(message, field, i));
+            break;
+        default:
+            // Rejected by `array_path_error`
+            return;
+        }
+    }
+}
+
+
+void result_summary(sqlite3_context *context, array_op op,
+                    const FieldDescriptor *field,
+                    const array_summary& summary)
+{
+    const bool real = is_real_field(field);
+
+    if (op == array_op::COUNT) {
+        sqlite3_result_int64(context, summary.count);
+        return;
+    }
+
+    if (summary.count == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    switch (op) {
+    case array_op::COUNT:
+        break;
+    case array_op::SUM:
+        if (real) {
+            sqlite3_result_double(context, summary.real_sum);
+        } else if (summary.overflow) {
+            sqlite3_result_error(context, "integer overflow", -1);
+        } else {
+            sqlite3_result_int64(context, summary.integer_sum);
+        }
+        return;
+    case array_op::MIN:
+        if (real) {
+            sqlite3_result_double(context, summary.real_min);
+        } else {
+            sqlite3_result_int64(context, summary.integer_min);
+        }
+        return;
+    case array_op::MAX:
+        if (real) {
+            sqlite3_result_double(context, summary.real_max);
+        } else {
+            sqlite3_result_int64(context, summary.integer_max);
+        }
+        return;
+    case array_op::AVG:
+        sqlite3_result_double(context,
+            summary.real_sum / static_cast<double>(summary.count));
+        return;
+    }
+}
+
+
+/// Summarises a repeated field in a single message
+///
+///     SELECT protobuf_array_sum(data, "Series", "$.samples");
+///
+/// `protobuf_array_count` accepts any repeated field, and
+/// `protobuf_array_{sum,min,max,avg}` any repeated numeric field,
+/// including enums but not bools.
+///
+/// @returns the number of elements, or their sum, minimum, maximum or
+///          average, with the same types and NULLs as the SQL
+///          aggregates over the elements.  NULL if an index on the way
+///          to the field is out of range.
+void protobuf_array(sqlite3_context *context,
+                    int argc,
+                    sqlite3_value **argv)
+{
+    const array_op op = *static_cast<const array_op *>(
+        sqlite3_user_data(context));
+    sqlite3_value *message_data = argv[0];
+    sqlite3_value *message_name = argv[1];
+
+    if (!protopath_has_root(
+            reinterpret_cast<const char *>(sqlite3_value_text(argv[2])),
+            static_cast<size_t>(sqlite3_value_bytes(argv[2])))) {
+        sqlite3_result_error(context, "Invalid path", -1);
+        return;
+    }
+
+    const Message *prototype = get_prototype(context, message_name);
+    if (!prototype)
+        return;
+
+    const protopath *path = get_protopath(context, 2, argv[2],
+        prototype->GetDescriptor());
+    const char *error = array_path_error(*path, op != array_op::COUNT);
+    if (error != nullptr) {
+        sqlite3_result_error(context, error, -1);
+        return;
+    }
+
+    const FieldDescriptor *field = path->steps.back().field;
+    array_summary summary = {};
+
+    // Fast path: decode packed elements straight from the encoded
+    // message
+    if (path->wire_repeated_supported) {
+        static thread_local std::vector<uint64_t> elements;
+        const void *data;
+        size_t size;
+        if (!get_message_data(context, message_data, &data, &size))
+            return;
+
+        switch (wire_extract_repeated(*path, data, size, &elements)) {
+        case wire_status::FOUND:
+            if (op == array_op::COUNT) {
+                summary.count = static_cast<int64_t>(elements.size());
+            } else if (is_real_field(field)) {
+                for (uint64_t bits : elements)
+                    summary.add_real(wire_decode_double(field->type(), bits));
+            } else {
+                for (uint64_t bits : elements)
+                    summary.add_integer(wire_decode_int64(field->type(), bits));
+            }
+
+            result_summary(context, op, field, summary);
+            return;
+        case wire_status::MISSING:
+            result_summary(context, op, field, summary);
+            return;
+        case wire_status::OUT_OF_RANGE:
+            sqlite3_result_null(context);
+            return;
+        case wire_status::FALLBACK:
+            break;
+        }
+    }
+
+    const Message *message = parse_message(context, message_data,
+        message_name);
+    if (!message)
+        return;
+
+    // Missing submessages are empty default instances: only indexes
+    // into repeated submessages can fail.
+    for (size_t i = 0; i + 1 < path->steps.size(); i++) {
+        const protopath_step& step = path->steps[i];
+        const Reflection *reflection = message->GetReflection();
+        int index;
+
+        if (!step.field->is_repeated()) {
+            message = &reflection->GetMessage(*message, step.field);
+            continue;
+        }
+
+        if (!normalize_index(step.index,
+                reflection->FieldSize(*message, step.field), &index)) {
+            sqlite3_result_null(context);
+            return;
+        }
+
+        message = &reflection->GetRepeatedMessage(*message, step.field, index);
+    }
+
+    if (op == array_op::COUNT) {
+        summary.count = message->GetReflection()->FieldSize(*message, field);
+    } else {
+        summarize_message(*message, field, &summary);
+    }
+
+    result_summary(context, op, field, summary);
+}
+
+}  // namespace
+
+int
+register_protobuf_aggregate(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    static const struct {
+        const char *name;
+        int argc;
+        void (*step)(sqlite3_context *, int, sqlite3_value **);
+        void (*final)(sqlite3_context *);
+    } aggregates[] = {
+        { "protobuf_sum", 3, protobuf_sum_step, protobuf_sum_final },
+        { "protobuf_count_present", 3, protobuf_count_present_step,
+          protobuf_count_present_final },
+        { "protobuf_group_concat", 3, protobuf_group_concat_step,
+          protobuf_group_concat_final },
+        { "protobuf_group_concat", 4, protobuf_group_concat_step,
+          protobuf_group_concat_final },
+    };
+
+    for (const auto& aggregate : aggregates) {
+        int rc = sqlite3_create_function(db, aggregate.name, aggregate.argc,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, nullptr,
+            aggregate.step, aggregate.final);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    static_assert(sizeof(array_ops) / sizeof(array_ops[0]) ==
+                  sizeof(array_op_names) / sizeof(array_op_names[0]),
+                  "array_op_names must have one entry per array_op");
+
+    for (size_t i = 0; i < sizeof(array_ops) / sizeof(array_ops[0]); i++) {
+        int rc = sqlite3_create_function(db, array_op_names[i], 3,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            const_cast<array_op *>(&array_ops[i]), protobuf_array,
+            nullptr, nullptr);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+}  // namespace sqlite_protobuf
@@ -0,0 +1,609 @@
+#include "protobuf_compress.h"
+
+#include <string.h>
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <umash.h>
+#ifdef SQLITE_PROTOBUF_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+#include "sqlite3ext.h"
+
+#include "protobuf_config.h"
+#include "protobuf_stats.h"
+#include "utilities.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+
+#ifdef SQLITE_PROTOBUF_ZSTD
+
+// Trained dictionaries are this large, unless the caller asks for
+// another size between MIN_DICTIONARY_SIZE and MAX_DICTIONARY_SIZE.
+const size_t DEFAULT_DICTIONARY_SIZE = 64 << 10;
+const size_t MIN_DICTIONARY_SIZE = 1 << 10;
+const size_t MAX_DICTIONARY_SIZE = 1 << 20;
+
+// The zstd format reserves dictionary ids below 32768 for a
+// registrar, and at or above 2^31.
+const int64_t MIN_DICTIONARY_ID = 32768;
+const int64_t MAX_DICTIONARY_ID = (int64_t(1) << 31) - 1;
+
+// Offset of the little-endian dictionary id in a zstd dictionary,
+// after the magic number.
+const size_t DICTIONARY_ID_OFFSET = 4;
+
+struct cctx_deleter {
+    void operator()(ZSTD_CCtx *cctx) const { ZSTD_freeCCtx(cctx); }
+};
+
+struct dctx_deleter {
+    void operator()(ZSTD_DCtx *dctx) const { ZSTD_freeDCtx(dctx); }
+};
+
+struct cdict_deleter {
+    void operator()(ZSTD_CDict *cdict) const { ZSTD_freeCDict(cdict); }
+};
+
+struct ddict_deleter {
+    void operator()(ZSTD_DDict *ddict) const { ZSTD_freeDDict(ddict); }
+};
+
+// Digested dictionaries for one connection, by id.  SQLite never runs
+// functions for the same connection concurrently, so only the registry
+// needs a lock.
+struct dictionary_cache {
+    struct cdict {
+        // Compression dictionaries are digested for one level.
+        int level;
+        std::unique_ptr<ZSTD_CDict, cdict_deleter> dict;
+    };
+
+    std::unordered_map<int64_t, cdict> cdicts;
+    std::unordered_map<int64_t, std::unique_ptr<ZSTD_DDict, ddict_deleter>>
+        ddicts;
+};
+
+// Every connection's `dictionary_cache` is registered here, until the
+// connection closes and destroys the `protobuf_compress` function.
+struct cache_registry {
+    std::mutex lock;
+    std::unordered_map<sqlite3 *, dictionary_cache *> caches;
+};
+
+cache_registry *get_registry()
+{
+    // Never destroyed, like the stats registry.
+    static cache_registry *registry = new cache_registry();
+    return registry;
+}
+
+dictionary_cache *find_cache(sqlite3 *db)
+{
+    cache_registry *registry = get_registry();
+    std::lock_guard<std::mutex> guard(registry->lock);
+
+    auto it = registry->caches.find(db);
+    return (it != registry->caches.end()) ? it->second : nullptr;
+}
+
+void destroy_cache(void *arg)
+{
+    dictionary_cache *cache = static_cast<dictionary_cache *>(arg);
+    cache_registry *registry = get_registry();
+
+    {
+        std::lock_guard<std::mutex> guard(registry->lock);
+
+        // Loading the extension again replaces the functions, and
+        // destroys the previous cache after registering the new one.
+        for (auto it = registry->caches.begin(); it != registry->caches.end();
+             ++it) {
+            if (it->second == cache) {
+                registry->caches.erase(it);
+                break;
+            }
+        }
+    }
+
+    delete cache;
+}
+
+ZSTD_CCtx *get_cctx()
+{
+    static thread_local std::unique_ptr<ZSTD_CCtx, cctx_deleter> cctx(
+        ZSTD_createCCtx());
+    return cctx.get();
+}
+
+ZSTD_DCtx *get_dctx()
+{
+    static thread_local std::unique_ptr<ZSTD_DCtx, dctx_deleter> dctx(
+        ZSTD_createDCtx());
+    return dctx.get();
+}
+
+/// Reads the dictionary `id` from `db` into `*out`.  Returns nullptr on
+/// success, and an error message on failure.
+const char *load_dictionary(sqlite3 *db, int64_t id, std::string *out)
+{
+    const char *error = "Unknown compression dictionary";
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db,
+            "SELECT dictionary FROM " PROTOBUF_DICTIONARIES_TABLE
+            " WHERE id = ?;", -1, &stmt, nullptr) != SQLITE_OK)
+        return error;
+
+    if (sqlite3_bind_int64(stmt, 1, id) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *data =
+            static_cast<const char *>(sqlite3_column_blob(stmt, 0));
+        size_t size = static_cast<size_t>(sqlite3_column_bytes(stmt, 0));
+
+        out->assign(data ? data : "", size);
+        if (ZSTD_getDictID_fromDict(out->data(), out->size()) == id)
+            error = nullptr;
+    }
+
+    sqlite3_finalize(stmt);
+    return error;
+}
+
+/// Sets `*out` to the compression dictionary `id` in `db`, for `level`.
+/// Returns nullptr on success, and an error message on failure.
+const char *find_cdict(sqlite3 *db, int64_t id, int level,
+                       const ZSTD_CDict **out)
+{
+    dictionary_cache *cache = find_cache(db);
+    if (cache == nullptr)
+        return "Unknown compression dictionary";
+
+    auto it = cache->cdicts.find(id);
+    if (it == cache->cdicts.end() || it->second.level != level) {
+        std::string dictionary;
+
+        const char *error = load_dictionary(db, id, &dictionary);
+        if (error != nullptr)
+            return error;
+
+        dictionary_cache::cdict entry;
+        entry.level = level;
+        entry.dict.reset(ZSTD_createCDict(dictionary.data(),
+            dictionary.size(), level));
+        if (!entry.dict)
+            return "Failed to load compression dictionary";
+
+        it = cache->cdicts.insert_or_assign(id, std::move(entry)).first;
+    }
+
+    *out = it->second.dict.get();
+    return nullptr;
+}
+
+/// Sets `*out` to the decompression dictionary `id` in `db`.  Returns
+/// nullptr on success, and an error message on failure.
+const char *find_ddict(sqlite3 *db, int64_t id, const ZSTD_DDict **out)
+{
+    dictionary_cache *cache = find_cache(db);
+    if (cache == nullptr)
+        return "Unknown compression dictionary";
+
+    auto it = cache->ddicts.find(id);
+    if (it == cache->ddicts.end()) {
+        std::string dictionary;
+
+        const char *error = load_dictionary(db, id, &dictionary);
+        if (error != nullptr)
+            return error;
+
+        std::unique_ptr<ZSTD_DDict, ddict_deleter> ddict(
+            ZSTD_createDDict(dictionary.data(), dictionary.size()));
+        if (!ddict)
+            return "Failed to load compression dictionary";
+
+        it = cache->ddicts.emplace(id, std::move(ddict)).first;
+    }
+
+    *out = it->second.get();
+    return nullptr;
+}
+
+// The last message each thread decompressed, identified like in
+// `parse_message`: callers often decompress the same message a few
+// times in a row, e.g., for the wire fast path, then to parse it.
+struct decompressed_message {
+    bool valid;
+    size_t source_size;
+    struct umash_fp source_fp;
+    std::string data;
+};
+
+decompressed_message *get_decompressed()
+{
+    static thread_local decompressed_message decompressed;
+    return &decompressed;
+}
+
+#endif  // SQLITE_PROTOBUF_ZSTD
+
+const char *const NO_ZSTD_ERROR =
+    "sqlite_protobuf was built without zstd support";
+
+
+/// Compresses an encoded message
+///
+///     UPDATE people_raw SET proto = protobuf_compress(proto, 32768);
+///
+/// @returns a compressed BLOB, or the message itself if compression
+///          doesn't make it smaller.  Compressed messages are returned
+///          as is.  The optional second argument is the id of a
+///          dictionary in `proto_dictionaries`; NULL means none.
+///
+/// The "compression_level" setting is the zstd compression level.
+void protobuf_compress(sqlite3_context *context,
+                       int argc,
+                       sqlite3_value **argv)
+{
+    if (argc < 1 || argc > 2) {
+        sqlite3_result_error(
+            context,
+            "wrong number of arguments to function protobuf_compress (expected 1 or 2)",
+            -1);
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    const void *data = sqlite3_value_blob(argv[0]);
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+
+    if (size == 0 || is_compressed_message(data, size)) {
+        sqlite3_result_blob64(context, data ? data : "", size,
+            SQLITE_TRANSIENT);
+        return;
+    }
+
+#ifdef SQLITE_PROTOBUF_ZSTD
+    int level = static_cast<int>(get_config(config_setting::COMPRESSION_LEVEL));
+    const ZSTD_CDict *cdict = nullptr;
+
+    if (argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+        const char *error = find_cdict(sqlite3_context_db_handle(context),
+            sqlite3_value_int64(argv[1]), level, &cdict);
+        if (error != nullptr) {
+            sqlite3_result_error(context, error, -1);
+            return;
+        }
+    }
+
+    size_t bound = ZSTD_compressBound(size);
+    uint8_t *buf = static_cast<uint8_t *>(sqlite3_malloc64(bound + 1));
+    if (!buf) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    buf[0] = COMPRESSED_MESSAGE_MARKER;
+    size_t compressed = (cdict != nullptr)
+        ? ZSTD_compress_usingCDict(get_cctx(), buf + 1, bound, data, size,
+              cdict)
+        : ZSTD_compressCCtx(get_cctx(), buf + 1, bound, data, size, level);
+    if (ZSTD_isError(compressed)) {
+        sqlite3_free(buf);
+        sqlite3_result_error(context, "Failed to compress message", -1);
+        return;
+    }
+
+    count_stat(stat::BYTES_COMPRESSED, size);
+    if (compressed + 1 >= size) {
+        sqlite3_free(buf);
+        sqlite3_result_blob64(context, data, size, SQLITE_TRANSIENT);
+        return;
+    }
+
+    sqlite3_result_blob64(context, buf, compressed + 1, sqlite3_free);
+#else
+    sqlite3_result_error(context, NO_ZSTD_ERROR, -1);
+#endif
+}
+
+
+/// Decompresses a message compressed by `protobuf_compress`
+///
+///     SELECT protobuf_decompress(proto) FROM people_raw;
+///
+/// @returns the encoded message as a BLOB.  Messages that aren't
+///          compressed are returned as is.
+void protobuf_decompress(sqlite3_context *context,
+                         int argc,
+                         sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    const void *data;
+    size_t size;
+    if (!get_message_data(context, argv[0], &data, &size))
+        return;
+
+    sqlite3_result_blob64(context, data ? data : "", size, SQLITE_TRANSIENT);
+}
+
+
+#ifdef SQLITE_PROTOBUF_ZSTD
+struct training_state {
+    // The samples, back to back, and their sizes.
+    std::string samples;
+    std::vector<size_t> sizes;
+
+    int64_t id;
+    size_t dictionary_size;
+    const char *error;
+};
+
+
+/// Returns the training state for `context`, after allocating it if
+/// `create` is true.  Sets an error and returns nullptr on failure.
+training_state *get_training_state(sqlite3_context *context, bool create)
+{
+    auto **slot = static_cast<training_state **>(sqlite3_aggregate_context(
+        context, create ? sizeof(training_state *) : 0));
+    if (slot == nullptr) {
+        if (create)
+            sqlite3_result_error_nomem(context);
+        return nullptr;
+    }
+
+    if (*slot == nullptr && create) {
+        *slot = new (std::nothrow) training_state();
+        if (*slot == nullptr)
+            sqlite3_result_error_nomem(context);
+    }
+
+    return *slot;
+}
+#endif
+
+
+/// Trains a compression dictionary on sample messages
+///
+///     INSERT INTO proto_dictionaries(id, table_name, dictionary)
+///         SELECT 32768, 'people', protobuf_train_dictionary(proto, 32768)
+///         FROM (SELECT proto FROM people_raw LIMIT 10000);
+///
+/// @returns the dictionary as a BLOB, with the id given as the second
+///          argument, of at most the optional third argument's size in
+///          bytes (64 KB by default).  Compressed samples are
+///          decompressed first, and NULL samples ignored.
+void protobuf_train_dictionary_step(sqlite3_context *context,
+                                    int argc,
+                                    sqlite3_value **argv)
+{
+#ifdef SQLITE_PROTOBUF_ZSTD
+    training_state *state = get_training_state(context, true);
+    if (state == nullptr || state->error != nullptr)
+        return;
+
+    // The id and size come from the first row.
+    if (state->dictionary_size == 0) {
+        state->id = sqlite3_value_int64(argv[1]);
+        state->dictionary_size = DEFAULT_DICTIONARY_SIZE;
+        if (argc > 2)
+            state->dictionary_size =
+                static_cast<size_t>(sqlite3_value_int64(argv[2]));
+
+        if (state->id < MIN_DICTIONARY_ID || state->id > MAX_DICTIONARY_ID) {
+            state->error = "Dictionary id out of range";
+            return;
+        }
+
+        if (state->dictionary_size < MIN_DICTIONARY_SIZE ||
+            state->dictionary_size > MAX_DICTIONARY_SIZE) {
+            state->error = "Dictionary size out of range";
+            return;
+        }
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    const void *data;
+    size_t size;
+    if (!get_message_data(context, argv[0], &data, &size))
+        return;
+
+    state->samples.append(static_cast<const char *>(data ? data : ""), size);
+    state->sizes.push_back(size);
+#else
+    sqlite3_result_error(context, NO_ZSTD_ERROR, -1);
+#endif
+}
+
+void protobuf_train_dictionary_final(sqlite3_context *context)
+{
+#ifdef SQLITE_PROTOBUF_ZSTD
+    std::unique_ptr<training_state> state(get_training_state(context, false));
+    if (state == nullptr) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    if (state->error != nullptr) {
+        sqlite3_result_error(context, state->error, -1);
+        return;
+    }
+
+    std::string dictionary(state->dictionary_size, '\0');
+    size_t size = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(),
+        state->samples.data(), state->sizes.data(),
+        static_cast<unsigned>(state->sizes.size()));
+    if (ZDICT_isError(size)) {
+        sqlite3_result_error(context, ZDICT_getErrorName(size), -1);
+        return;
+    }
+
+    // Overwrite the random id zstd picked.
+    dictionary.resize(size);
+    for (size_t i = 0; i < 4; i++) {
+        dictionary[DICTIONARY_ID_OFFSET + i] =
+            static_cast<char>(state->id >> (8 * i));
+    }
+
+    sqlite3_result_blob64(context, dictionary.data(), dictionary.size(),
+        SQLITE_TRANSIENT);
+#else
+    sqlite3_result_error(context, NO_ZSTD_ERROR, -1);
+#endif
+}
+
+}  // namespace
+
+const char *decompress_message(sqlite3 *db, const void **data, size_t *size)
+{
+    if (!is_compressed_message(*data, *size))
+        return nullptr;
+
+#ifdef SQLITE_PROTOBUF_ZSTD
+    const char *const error = "Failed to decompress message";
+    decompressed_message *last = get_decompressed();
+    const char *frame = static_cast<const char *>(*data) + 1;
+    size_t frame_size = *size - 1;
+
+    // Decompressed messages are never compressed again.
+    if (*data == last->data.data())
+        return error;
+
+    struct umash_fp fp = umash_fprint(get_message_fp_params(), 0, *data,
+        *size);
+    if (!last->valid || last->source_size != *size ||
+        last->source_fp.hash[0] != fp.hash[0] ||
+        last->source_fp.hash[1] != fp.hash[1]) {
+        unsigned long long content_size =
+            ZSTD_getFrameContentSize(frame, frame_size);
+        if (content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+            content_size == ZSTD_CONTENTSIZE_ERROR ||
+            content_size > static_cast<unsigned long long>(
+                sqlite3_limit(db, SQLITE_LIMIT_LENGTH, -1)))
+            return error;
+
+        const ZSTD_DDict *ddict = nullptr;
+        unsigned id = ZSTD_getDictID_fromFrame(frame, frame_size);
+        if (id != 0) {
+            const char *dict_error = find_ddict(db, id, &ddict);
+            if (dict_error != nullptr)
+                return dict_error;
+        }
+
+        last->valid = false;
+        last->data.resize(content_size);
+
+        size_t ret;
+        {
+            stat_timer timer(stat::DECOMPRESS_NS);
+            ret = (ddict != nullptr)
+                ? ZSTD_decompress_usingDDict(get_dctx(), &last->data[0],
+                      last->data.size(), frame, frame_size, ddict)
+                : ZSTD_decompressDCtx(get_dctx(), &last->data[0],
+                      last->data.size(), frame, frame_size);
+        }
+
+        if (ZSTD_isError(ret) || ret != content_size)
+            return error;
+
+        count_stat(stat::BYTES_DECOMPRESSED, ret);
+        last->valid = true;
+        last->source_size = *size;
+        last->source_fp = fp;
+    }
+
+    *data = last->data.data();
+    *size = last->data.size();
+    return nullptr;
+#else
+    (void)db;
+    return NO_ZSTD_ERROR;
+#endif
+}
+
+bool get_message_data(sqlite3_context *context, sqlite3_value *value,
+                      const void **data, size_t *size)
+{
+    *data = sqlite3_value_blob(value);
+    *size = static_cast<size_t>(sqlite3_value_bytes(value));
+
+    const char *error = decompress_message(sqlite3_context_db_handle(context),
+        data, size);
+    if (error != nullptr) {
+        sqlite3_result_error(context, error, -1);
+        return false;
+    }
+
+    return true;
+}
+
+int
+register_protobuf_compress(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    void *cache = nullptr;
+    void (*destroy)(void *) = nullptr;
+
+#ifdef SQLITE_PROTOBUF_ZSTD
+    dictionary_cache *new_cache = new (std::nothrow) dictionary_cache();
+    if (new_cache == nullptr)
+        return SQLITE_NOMEM;
+
+    {
+        cache_registry *registry = get_registry();
+        std::lock_guard<std::mutex> guard(registry->lock);
+
+        registry->caches[db] = new_cache;
+    }
+
+    cache = new_cache;
+    destroy = destroy_cache;
+#endif
+
+    // The dictionary cache lives as long as `protobuf_compress`, i.e.,
+    // until the connection closes.  It's destroyed right away if the
+    // function can't be created.
+    int rc = sqlite3_create_function_v2(db, "protobuf_compress", -1,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, cache, protobuf_compress,
+        nullptr, nullptr, destroy);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    rc = sqlite3_create_function(db, "protobuf_decompress", 1,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, protobuf_decompress,
+        nullptr, nullptr);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    for (int argc = 2; argc <= 3; argc++) {
+        rc = sqlite3_create_function(db, "protobuf_train_dictionary", argc,
+            SQLITE_UTF8, nullptr, nullptr, protobuf_train_dictionary_step,
+            protobuf_train_dictionary_final);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+}  // namespace sqlite_protobuf
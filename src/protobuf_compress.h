@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+struct sqlite3_api_routines;
+
+namespace sqlite_protobuf {
+
+// Compressed messages start with this byte, followed by a zstd frame.
+// It can't start an encoded message: it's the tag for field number 0,
+// with the invalid wire type 7.
+const uint8_t COMPRESSED_MESSAGE_MARKER = 0x07;
+
+// Name of the table with the dictionaries for compressed messages:
+//
+//     CREATE TABLE proto_dictionaries (
+//       id INTEGER PRIMARY KEY NOT NULL,
+//       table_name TEXT NOT NULL,
+//       dictionary BLOB NOT NULL
+//     );
+//
+// `id` is the zstd dictionary id, which compressed frames refer to.
+// Rows must never change once a message was compressed with them.
+#define PROTOBUF_DICTIONARIES_TABLE "proto_dictionaries"
+
+inline bool is_compressed_message(const void *data, size_t size)
+{
+    return size > 0 && *static_cast<const uint8_t *>(data) ==
+        COMPRESSED_MESSAGE_MARKER;
+}
+
+// If `*data` is a compressed message, replaces `*data` and `*size`
+// with the decompressed message, looking up its dictionary in `db`.
+// The decompressed bytes live in a per-thread buffer, and stay valid
+// until the thread decompresses a different message.
+//
+// Returns nullptr on success, and an error message on failure.
+const char *decompress_message(sqlite3 *db, const void **data,
+                               size_t *size);
+
+// Sets `*data` and `*size` to the encoded message in `value`, like
+// `decompress_message`.  Returns false and sets `context` into an
+// error state on failure.
+bool get_message_data(sqlite3_context *context, sqlite3_value *value,
+                      const void **data, size_t *size);
+
+int register_protobuf_compress(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi);
+
+}  // namespace sqlite_protobuf
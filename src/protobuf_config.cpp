@@ -0,0 +1,96 @@
+#include "protobuf_config.h"
+
+#include <atomic>
+#include <string>
+
+#include "sqlite3ext.h"
+
+#include "utilities.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+
+struct setting_info {
+    const char *name;
+    int64_t min_value;
+    int64_t max_value;
+    std::atomic<int64_t> value;
+};
+
+// Indexed by `config_setting`.
+setting_info settings[] = {
+    { "message_cache_capacity", 1, 1024, { 8 } },
+    { "message_arena_max_bytes", 0, 1 << 30, { 0 } },
+    { "stats_timing", 0, 1, { 0 } },
+    { "compression_level", 1, 19, { 3 } },
+};
+
+setting_info *find_setting(const std::string& name)
+{
+    for (setting_info& s : settings) {
+        if (name == s.name)
+            return &s;
+    }
+
+    return nullptr;
+}
+
+/// Returns the current value of a setting, after updating it to `value` if
+/// provided.
+///
+///     SELECT protobuf_config("message_cache_capacity", 16);
+///
+/// @returns the value of the setting, as an integer.
+static void protobuf_config(sqlite3_context *context,
+                            int argc,
+                            sqlite3_value **argv)
+{
+    setting_info *s = find_setting(string_from_sqlite3_value(argv[0]));
+    if (!s) {
+        sqlite3_result_error(context, "Unknown setting", -1);
+        return;
+    }
+
+    if (argc >= 2) {
+        if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+            sqlite3_result_error(context, "Expected an integer value", -1);
+            return;
+        }
+
+        int64_t value = sqlite3_value_int64(argv[1]);
+        if (value < s->min_value || value > s->max_value) {
+            sqlite3_result_error(context, "Value out of range", -1);
+            return;
+        }
+
+        s->value.store(value, std::memory_order_relaxed);
+    }
+
+    sqlite3_result_int64(context, s->value.load(std::memory_order_relaxed));
+}
+
+}  // namespace
+
+int64_t get_config(config_setting setting)
+{
+    return settings[static_cast<size_t>(setting)].value.load(
+        std::memory_order_relaxed);
+}
+
+int
+register_protobuf_config(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    for (int argc = 1; argc <= 2; argc++) {
+        int rc = sqlite3_create_function(db, "protobuf_config", argc,
+            SQLITE_UTF8, 0, protobuf_config, 0, 0);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+}  // namespace sqlite_protobuf
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+
+struct sqlite3;
+struct sqlite3_api_routines;
+
+namespace sqlite_protobuf {
+
+// Tuning knobs that can be read and changed at runtime with
+//
+//     SELECT protobuf_config(name [, value]);
+//
+// Settings are global: changes apply to all connections and threads.
+enum class config_setting {
+    // "message_cache_capacity": the number of parsed messages that
+    // `parse_message` caches in each thread.
+    MESSAGE_CACHE_CAPACITY,
+
+    // "message_arena_max_bytes": if non-zero, `parse_message` parses
+    // into an arena, and keeps at most this many bytes of arena memory
+    // for each cached message between parses, i.e., up to
+    // "message_cache_capacity" times this much per thread, e.g.,
+    // 2 MB per thread for 262144.  Zero, the default, disables arenas
+    // and reuses cleared messages instead.
+    MESSAGE_ARENA_MAX_BYTES,
+
+    // "stats_timing": if non-zero, `protobuf_stats` also measures the
+    // time spent parsing, in reflection, and serializing.  Off by
+    // default, since reading the clock costs more than most field
+    // extractions.
+    STATS_TIMING,
+
+    // "compression_level": the zstd level for `protobuf_compress`.
+    COMPRESSION_LEVEL,
+};
+
+// Returns the current value of `setting`.
+int64_t get_config(config_setting setting);
+
+int register_protobuf_config(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi);
+
+}  // namespace sqlite_protobuf
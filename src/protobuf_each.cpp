@@ -0,0 +1,608 @@
+#include "protobuf_each.h"
+
+#include <limits.h>
+#include <math.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <string>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3ext.h"
+
+#include "protobuf_compress.h"
+#include "protobuf_extract.h"
+#include "protobuf_stats.h"
+#include "protopath.h"
+#include "utilities.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+
+/// Iterates over the elements of a repeated field, like json_each:
+///
+///     SELECT key, value FROM protobuf_each(data, "Person", "$.phones");
+///
+/// Each row has the index of an element in `key`, its value (as returned by
+/// protobuf_extract) in `value`, and the path to that element, e.g.,
+/// "$.phones[3]", in `fullkey`.  The message is parsed once per call.
+///
+/// Constraints on `key` narrow the range of elements we visit.
+
+
+// The column indexes, corresponding to the order of the columns in the CREATE
+// TABLE statement in xConnect
+enum {
+    COLUMN_KEY,
+    COLUMN_VALUE,
+    COLUMN_FULLKEY,
+    COLUMN_MESSAGE,
+    COLUMN_TYPE,
+    COLUMN_PATH,
+};
+
+// The indexing strategies used by MODULE_FUNC(xBestIndex) and
+// MODULE_FUNC(xFilter), as a bitmask of the constraints on `key` that follow
+// the message, type and path in argv.  KEY_EQ is passed once, as both bounds.
+enum {
+    KEY_GT = 1,
+    KEY_GE = 2,
+    KEY_LT = 4,
+    KEY_LE = 8,
+    KEY_EQ = 16,
+};
+
+
+#define MODULE_FUNC(func) protobuf_each ## _ ## func
+
+
+// each_cursor is a subclass of sqlite3_vtab_cursor which holds the parsed
+// message and iterates over the elements of the repeated field.
+// each_vtab remembers its connection, where compressed messages find
+// their dictionaries.
+struct each_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+};
+
+typedef struct each_cursor each_cursor;
+struct each_cursor {
+    sqlite3_vtab_cursor base;
+
+    // Message type, its prototype, and the path, from the last call to
+    // xFilter.  These usually stay the same for the whole statement.
+    std::string message_name;
+    const Message *prototype;
+    std::string path_text;
+    protopath path;
+
+    // The path to the current element, i.e., `path` with the index of the
+    // element on the last step.
+    protopath element_path;
+
+    // `path_text` without its .name/.number suffix, if any.
+    std::string fullkey_prefix;
+    std::string fullkey_suffix;
+
+    // Copy of the encoded message, and the result of parsing it.
+    std::string message_data;
+    std::unique_ptr<Message> message;
+
+    sqlite3_int64 index;
+    sqlite3_int64 stopIndex;
+};
+
+
+/// Connect to the eponymous virtual table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = sqlite3_declare_vtab(db,
+        "CREATE TABLE tbl("
+        "    key INTEGER,"
+        "    value,"
+        "    fullkey TEXT,"
+        "    message BLOB HIDDEN,"
+        "    type TEXT HIDDEN,"
+        "    path TEXT HIDDEN"
+        ")");
+    if (err != SQLITE_OK) return err;
+
+    each_vtab *vtab = (each_vtab *)sqlite3_malloc(sizeof(*vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    bzero(vtab, sizeof(*vtab));
+    vtab->db = db;
+    *ppVtab = &vtab->base;
+
+    return SQLITE_OK;
+}
+
+
+/// Undoes xOpen
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor each_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    each_cursor *cursor = new (std::nothrow) each_cursor();
+    if (!cursor)
+        return SQLITE_NOMEM;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor each_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    delete (each_cursor *)cur;
+    return SQLITE_OK;
+}
+
+/// Advance the index to the next element
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    each_cursor *cursor = (each_cursor *)cur;
+    cursor->index += 1;
+    return SQLITE_OK;
+}
+
+
+/// Returns the current index
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    each_cursor *cursor = (each_cursor *)cur;
+    *pRowid = cursor->index;
+    return SQLITE_OK;
+}
+
+
+/// Returns true if the cursor is past the last element we want
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    each_cursor *cursor = (each_cursor *)cur;
+    return cursor->index >= cursor->stopIndex;
+}
+
+
+/// Return the fields in a given cell of the table
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    each_cursor *cursor = (each_cursor *)cur;
+    switch (i) {
+    case COLUMN_KEY:
+        sqlite3_result_int64(ctx, cursor->index);
+        break;
+    case COLUMN_VALUE:
+        cursor->element_path.steps.back().index =
+            static_cast<int>(cursor->index);
+        extract_from_message(ctx, cursor->element_path, *cursor->message,
+            cursor->message_data.data(), cursor->message_data.size(),
+            nullptr, false);
+        break;
+    case COLUMN_FULLKEY:
+    {
+        std::string fullkey = cursor->fullkey_prefix + "[" +
+            std::to_string(cursor->index) + "]" + cursor->fullkey_suffix;
+        sqlite3_result_text(ctx, fullkey.c_str(), fullkey.size(),
+            SQLITE_TRANSIENT);
+        break;
+    }
+    case COLUMN_MESSAGE:
+        sqlite3_result_blob(ctx, cursor->message_data.data(),
+            cursor->message_data.size(), SQLITE_TRANSIENT);
+        break;
+    case COLUMN_TYPE:
+        sqlite3_result_text(ctx, cursor->message_name.c_str(),
+            cursor->message_name.size(), SQLITE_TRANSIENT);
+        break;
+    case COLUMN_PATH:
+        sqlite3_result_text(ctx, cursor->path_text.c_str(),
+            cursor->path_text.size(), SQLITE_TRANSIENT);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+
+///
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    // Loop over the constraints to find useful ones -- namely, ones that pin
+    // the function arguments, and bounds on the key
+    int messageEqConstraintIdx = -1;
+    int typeEqConstraintIdx = -1;
+    int pathEqConstraintIdx = -1;
+    int eqConstraintIdx = -1;
+    int lowerConstraintIdx = -1;
+    int upperConstraintIdx = -1;
+    int lowerOp = 0;
+    int upperOp = 0;
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for(int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+
+        if (constraint->iColumn == COLUMN_KEY) {
+            switch (constraint->op) {
+            case SQLITE_INDEX_CONSTRAINT_EQ:
+                eqConstraintIdx = i;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_GT:
+                lowerConstraintIdx = i;
+                lowerOp = KEY_GT;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_GE:
+                lowerConstraintIdx = i;
+                lowerOp = KEY_GE;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LT:
+                upperConstraintIdx = i;
+                upperOp = KEY_LT;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LE:
+                upperConstraintIdx = i;
+                upperOp = KEY_LE;
+                break;
+            }
+            continue;
+        }
+
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        switch(constraint->iColumn) {
+        case COLUMN_MESSAGE:
+            messageEqConstraintIdx = i;
+            break;
+        case COLUMN_TYPE:
+            typeEqConstraintIdx = i;
+            break;
+        case COLUMN_PATH:
+            pathEqConstraintIdx = i;
+            break;
+        }
+    }
+
+    // If we did not get all the function arguments, we cannot continue
+    if (messageEqConstraintIdx == -1 || typeEqConstraintIdx == -1 ||
+        pathEqConstraintIdx == -1) {
+        return SQLITE_CONSTRAINT;
+    }
+
+    // Copy the values of our constraints into the arguments that will be
+    // passed to MODULE_FUNC(xFilter).
+    //     argv[0] = message
+    //     argv[1] = message type name
+    //     argv[2] = path
+    //     argv[3...] = the key, or its lower and/or upper bound
+    int argIdx = 1;
+    for (int constraintIdx : { messageEqConstraintIdx, typeEqConstraintIdx,
+                               pathEqConstraintIdx }) {
+        pIdxInfo->aConstraintUsage[constraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[constraintIdx].omit = 1;
+    }
+
+    // The bounds only narrow the scan, SQLite still double checks them: that
+    // way, we don't have to replicate SQLite's comparison rules for
+    // non-integer values.
+    pIdxInfo->idxNum = 0;
+    if (eqConstraintIdx >= 0) {
+        pIdxInfo->idxNum = KEY_EQ;
+        pIdxInfo->aConstraintUsage[eqConstraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->estimatedCost = 1;
+        pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    } else {
+        pIdxInfo->estimatedCost = 100;
+        if (lowerConstraintIdx >= 0) {
+            pIdxInfo->idxNum |= lowerOp;
+            pIdxInfo->aConstraintUsage[lowerConstraintIdx].argvIndex =
+                argIdx ++;
+            pIdxInfo->estimatedCost /= 4;
+        }
+        if (upperConstraintIdx >= 0) {
+            pIdxInfo->idxNum |= upperOp;
+            pIdxInfo->aConstraintUsage[upperConstraintIdx].argvIndex =
+                argIdx ++;
+            pIdxInfo->estimatedCost /= 4;
+        }
+    }
+
+    // Elements come out in key order
+    if (pIdxInfo->nOrderBy == 1 &&
+        pIdxInfo->aOrderBy[0].iColumn == COLUMN_KEY &&
+        !pIdxInfo->aOrderBy[0].desc) {
+        pIdxInfo->orderByConsumed = 1;
+    }
+
+    return SQLITE_OK;
+}
+
+
+/// Returns the first index that may satisfy `key > value` (`op` is KEY_GT),
+/// `key >= value` (KEY_GE) or `key == value` (KEY_EQ), if `lower`.  Otherwise,
+/// returns one past the last index that may satisfy `key < value` (KEY_LT),
+/// `key <= value` (KEY_LE) or `key == value`.  Returns `dflt` if `value`
+/// isn't a number.
+static sqlite3_int64 key_bound(sqlite3_value *value, int op, bool lower,
+                               sqlite3_int64 dflt)
+{
+    switch (sqlite3_value_type(value)) {
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT:
+        break;
+    default:
+        return dflt;
+    }
+
+    double x = sqlite3_value_double(value);
+    double bound;
+    if (lower) {
+        bound = (op == KEY_GT) ? floor(x) + 1 : ceil(x);
+    } else {
+        bound = (op == KEY_LT) ? ceil(x) : floor(x) + 1;
+    }
+
+    // Repeated fields can't have more than INT_MAX elements
+    if (bound < 0)
+        return 0;
+    if (bound > INT_MAX)
+        return INT_MAX;
+    return static_cast<sqlite3_int64>(bound);
+}
+
+
+/// Walks all but the last step of the path, and returns the message that
+/// contains the repeated field, or `nullptr` if the path does not exist in
+/// `root`.  Sets `*error` if the path is invalid.
+static const Message *find_container(const protopath& path,
+                                     const Message& root,
+                                     const char **error)
+{
+    const Message *message = &root;
+    for (size_t i = 0; i + 1 < path.steps.size(); i++) {
+        const protopath_step& step = path.steps[i];
+        const Reflection *reflection = message->GetReflection();
+
+        if (!step.field->is_repeated()) {
+            if (!reflection->HasField(*message, step.field))
+                return nullptr;
+            message = &reflection->GetMessage(*message, step.field);
+            continue;
+        }
+
+        if (!step.has_index) {
+            *error = "Expected index into repeated field";
+            return nullptr;
+        }
+
+        int field_size = reflection->FieldSize(*message, step.field);
+        int field_index = step.index;
+        if (field_index < 0) {
+            field_index = field_size + field_index;
+        }
+
+        if (field_index < 0 || field_index >= field_size)
+            return nullptr;
+        message = &reflection->GetRepeatedMessage(*message, step.field,
+            field_index);
+    }
+
+    return message;
+}
+
+
+/// Checks that `path` leads to a repeated field that we can iterate over, and
+/// returns an error message otherwise.
+static const char *check_each_path(const protopath& path,
+                                   const std::string& path_text)
+{
+    if (!protopath_has_root(path_text.data(), path_text.size()))
+        return "Invalid path";
+    if (path.error != nullptr)
+        return path.error;
+    if (path.tail == protopath_tail::INVALID)
+        return "Path traverses non-message elements";
+
+    if (path.steps.empty() || !path.steps.back().field->is_repeated() ||
+        path.steps.back().has_index)
+        return "Path does not end with a repeated field";
+
+    return nullptr;
+}
+
+
+/// Parse the message and position the cursor at the start of the relevant
+/// elements.
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    each_cursor *cursor = (each_cursor *)pVtabCursor;
+    const char *error = nullptr;
+    cursor->index = 0;
+    cursor->stopIndex = 0;
+
+    count_stat(stat::EACH_CALLS);
+
+    // Find the prototype for this message type
+    const std::string message_name = string_from_sqlite3_value(argv[1]);
+    if (!cursor->prototype || cursor->message_name != message_name) {
+        cursor->message_name = message_name;
+        cursor->prototype = find_prototype(cursor->message_name);
+        cursor->message.reset();
+        cursor->path_text.clear();
+        cursor->path.steps.clear();
+
+        if (!cursor->prototype) {
+            error = "Could not find message descriptor";
+            goto fail;
+        }
+    }
+
+    // Compile the path, unless it's the same as last time
+    {
+        const std::string path_text = string_from_sqlite3_value(argv[2]);
+        if (cursor->path.steps.empty() || cursor->path_text != path_text) {
+            cursor->path_text = path_text;
+            cursor->path = compile_protopath(
+                cursor->prototype->GetDescriptor(), cursor->path_text);
+
+            error = check_each_path(cursor->path, cursor->path_text);
+            if (error) {
+                cursor->path.steps.clear();
+                goto fail;
+            }
+
+            cursor->element_path = cursor->path;
+            cursor->element_path.steps.back().has_index = true;
+
+            size_t suffix_size = 0;
+            switch (cursor->path.tail) {
+            case protopath_tail::NUMBER:
+                suffix_size = sizeof(".number") - 1;
+                break;
+            case protopath_tail::NAME:
+                suffix_size = sizeof(".name") - 1;
+                break;
+            default:
+                break;
+            }
+
+            size_t prefix_size = cursor->path_text.size() - suffix_size;
+            cursor->fullkey_prefix = cursor->path_text.substr(0, prefix_size);
+            cursor->fullkey_suffix = cursor->path_text.substr(prefix_size);
+        }
+    }
+
+    // Parse the message.  The argument may not outlive this call, so we
+    // parse a copy that the cursor owns.
+    {
+        const void *data = sqlite3_value_blob(argv[0]);
+        size_t size = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+        error = decompress_message(
+            reinterpret_cast<each_vtab *>(pVtabCursor->pVtab)->db, &data,
+            &size);
+        if (error != nullptr)
+            goto fail;
+
+        cursor->message_data.assign(
+            data ? static_cast<const char *>(data) : "", size);
+        if (cursor->message) {
+            cursor->message->Clear();
+        } else {
+            cursor->message.reset(cursor->prototype->New());
+        }
+
+        bool parsed;
+        {
+            stat_timer timer(stat::PARSE_NS);
+            parsed = cursor->message->ParseFromString(cursor->message_data);
+        }
+
+        count_stat(stat::BYTES_PARSED, cursor->message_data.size());
+        if (!parsed) {
+            count_stat(stat::PARSE_FAILURES);
+            error = "Failed to parse message";
+            goto fail;
+        }
+    }
+
+    // Find the number of elements in the repeated field
+    {
+        const Message *container =
+            find_container(cursor->path, *cursor->message, &error);
+        if (error)
+            goto fail;
+        if (!container)
+            return SQLITE_OK;
+
+        const FieldDescriptor *field = cursor->path.steps.back().field;
+        cursor->stopIndex =
+            container->GetReflection()->FieldSize(*container, field);
+    }
+
+    // Narrow the range of elements with the constraints on the key
+    {
+        sqlite3_value **bound = &argv[3];
+        if (idxNum & KEY_EQ) {
+            cursor->index = key_bound(*bound, KEY_EQ, true, cursor->index);
+            cursor->stopIndex = std::min(cursor->stopIndex,
+                key_bound(*bound, KEY_EQ, false, cursor->stopIndex));
+        }
+        if (idxNum & (KEY_GT | KEY_GE)) {
+            cursor->index = key_bound(*bound++, idxNum & (KEY_GT | KEY_GE),
+                true, cursor->index);
+        }
+        if (idxNum & (KEY_LT | KEY_LE)) {
+            cursor->stopIndex = std::min(cursor->stopIndex,
+                key_bound(*bound++, idxNum & (KEY_LT | KEY_LE), false,
+                    cursor->stopIndex));
+        }
+    }
+
+    return SQLITE_OK;
+
+fail:
+    cursor->stopIndex = 0;
+    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", error);
+    return SQLITE_ERROR;
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  0,                         /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+}  // namespace
+
+int
+register_protobuf_each(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    return sqlite3_create_module(db, "protobuf_each", &module, 0);
+}
+
+}  // namespace sqlite_protobuf
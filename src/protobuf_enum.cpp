@@ -9,13 +9,13 @@
 
 #include "sqlite3ext.h"
 
+#include "descriptor_pool.h"
 #include "utilities.h"
 
 namespace sqlite_protobuf {
 SQLITE_EXTENSION_INIT3
 
 namespace {
-using google::protobuf::DescriptorPool;
 using google::protobuf::EnumDescriptor;
 using google::protobuf::EnumValueDescriptor;
 
@@ -247,8 +247,7 @@ static int MODULE_FUNC(xFilter) (
     
     // Find the descriptor for this enum type
     std::string enum_name = string_from_sqlite3_value(argv[0]);
-    cursor->descriptor =
-        DescriptorPool::generated_pool()->FindEnumTypeByName(enum_name);
+    cursor->descriptor = find_enum_descriptor(enum_name);
     if (!cursor->descriptor) {
         // TODO: Better way to report this error message?
         sqlite3_log(SQLITE_WARNING, "Could not find enum type \"%s\"",
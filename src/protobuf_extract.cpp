@@ -1,6 +1,5 @@
 #include "protobuf_extract.h"
 
-#include <regex>
 #include <string>
 
 #include <google/protobuf/descriptor_database.h>
@@ -8,7 +7,11 @@
 
 #include "sqlite3ext.h"
 
+#include "protobuf_compress.h"
+#include "protobuf_stats.h"
+#include "protopath.h"
 #include "utilities.h"
+#include "wire_format.h"
 
 namespace sqlite_protobuf {
 SQLITE_EXTENSION_INIT3
@@ -27,18 +30,14 @@ using google::protobuf::Reflection;
 static bool handle_special_enum_path(sqlite3_context *context,
                                      const EnumDescriptor *enum_descriptor,
                                      int value,
-                                     const std::string& path,
-                                     std::string::const_iterator& it)
+                                     protopath_tail tail)
 {
-    // Get the remainder of the path
-    std::string rest = path.substr(std::distance(path.begin(), it));
-    
-    if (rest == "" || rest == ".number")
-    {
+    switch (tail) {
+    case protopath_tail::NONE:
+    case protopath_tail::NUMBER:
         sqlite3_result_int64(context, value);
         return true;
-    } 
-    else if (rest == ".name")
+    case protopath_tail::NAME:
     {
         const EnumValueDescriptor *value_descriptor =
             enum_descriptor->FindValueByNumber(value);
@@ -48,12 +47,16 @@ static bool handle_special_enum_path(sqlite3_context *context,
             return false;
         }
         
+        // Descriptors outlive any statement
         sqlite3_result_text(context,
             value_descriptor->name().c_str(),
             value_descriptor->name().length(),
-            SQLITE_TRANSIENT);
+            SQLITE_STATIC);
         return true;
     }
+    case protopath_tail::INVALID:
+        break;
+    }
     
     // This error message should match what happens for non-enums also
     sqlite3_result_error(context, "Path traverses non-message elements", -1);
@@ -61,172 +64,317 @@ static bool handle_special_enum_path(sqlite3_context *context,
 }
 
 
-/// Return the element (or elements) 
-///
-///     SELECT protobuf_extract(data, "Person", "$.phones[0].number", default?);
-///
-/// @returns a Protobuf-encoded BLOB or the appropriate SQL datatype
-///
-/// If `default` is provided, it is returned instead of the protobuf field's
-/// default value.
-static void protobuf_extract(sqlite3_context *context,
-                             int argc,
-                             sqlite3_value **argv)
+/// Returns the contents of a string or bytes `field`, with SQLite's
+/// `destructor` semantics for `data`.
+static void result_string(sqlite3_context *context,
+                          const FieldDescriptor *field,
+                          const void *data, size_t size,
+                          void (*destructor)(void *))
+{
+    switch(field->type()) {
+    default:
+        // fall through, but log
+        sqlite3_log(SQLITE_WARNING,
+            "Protobuf field \"%s\" is an unexpected string type",
+            field->full_name().c_str());
+    case FieldDescriptor::Type::TYPE_STRING:
+        sqlite3_result_text64(context, static_cast<const char *>(data), size,
+            destructor, SQLITE_UTF8);
+        break;
+    case FieldDescriptor::Type::TYPE_BYTES:
+        sqlite3_result_blob64(context, data, size, destructor);
+        break;
+    }
+}
+
+
+/// Returns the value for an optional field that's missing at step `i` of
+/// `path`: `default_value` if provided, NULL if `null_default`, and the
+/// field's default otherwise.
+static void result_missing_field(sqlite3_context *context,
+                                 const protopath& path,
+                                 size_t i,
+                                 sqlite3_value *default_value,
+                                 bool null_default)
 {
-    if (argc < 3 || argc > 4) {
-        sqlite3_result_error(
-            context,
-            "wrong number of arguments to function protobuf_extract (expected 3 or 4)",
-            SQLITE_CONSTRAINT_FUNCTION);
+    const FieldDescriptor *const field = path.steps[i].field;
+
+    // Is there anything left in the path?
+    if (path.has_remainder(i)) {
+        switch (field->type())
+        {
+           case FieldDescriptor::Type::TYPE_ENUM:
+           case FieldDescriptor::Type::TYPE_MESSAGE:
+               // Both of these are handled in the switch below
+               break;
+           default:
+               sqlite3_result_error(context, "Invalid path", -1);
+               return;
+        }
+    }
+
+    if (default_value != nullptr) {
+        sqlite3_result_value(context, default_value);
         return;
     }
 
-    sqlite3_value *message_data = argv[0];
-    sqlite3_value *message_name = argv[1];
-    const std::string path = string_from_sqlite3_value(argv[2]);
-    sqlite3_value *const default_value = (argc >= 4) ? argv[3] : nullptr;
+    if (null_default) {
+        sqlite3_result_null(context);
+        return;
+    }
     
-    // Check that the path begins with $, representing the root of the tree
-    if (path.length() == 0 || path[0] != '$') {
-        sqlite3_result_error(context, "Invalid path", -1);
+    switch(field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+        sqlite3_result_int64(context, field->default_value_int32());
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+        sqlite3_result_int64(context, field->default_value_int64());
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        sqlite3_result_int64(context, field->default_value_uint32());
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+        sqlite3_log(SQLITE_WARNING,
+            "Protobuf field \"%s\" is unsigned, but SQLite does not "
+            "support unsigned types", field->full_name().c_str());
+        sqlite3_result_int64(context, field->default_value_uint64());
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+        sqlite3_result_double(context, field->default_value_double());
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        sqlite3_result_double(context, field->default_value_float());
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        sqlite3_result_int64(context,
+            field->default_value_bool() ? 0 : 1);
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        handle_special_enum_path(context,
+            field->default_value_enum()->type(),
+            field->default_value_enum()->number(),
+            path.tail);
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        // Descriptors outlive any statement
+        result_string(context, field, field->default_value_string().data(),
+            field->default_value_string().size(), SQLITE_STATIC);
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        sqlite3_result_null(context);
         return;
     }
+}
 
-    // Deserialize the message
-    auto root_message = parse_message(context, message_data, message_name);
-    if (!root_message) {
+
+/// Returns the value of the last field in `path`, as found by
+/// `wire_extract`.
+static void result_wire_value(sqlite3_context *context,
+                              const protopath& path,
+                              const wire_value& value)
+{
+    const FieldDescriptor *const field = path.steps.back().field;
+
+    switch(field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        sqlite3_result_int64(context,
+            wire_decode_int64(field->type(), value.bits));
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+        sqlite3_log(SQLITE_WARNING,
+            "Protobuf field \"%s\" is unsigned, but SQLite does not "
+            "support unsigned types", field->full_name().c_str());
+        sqlite3_result_int64(context,
+            wire_decode_int64(field->type(), value.bits));
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        sqlite3_result_double(context,
+            wire_decode_double(field->type(), value.bits));
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        // Same convention as the reflection path below
+        sqlite3_result_int64(context, value.bits != 0 ? 0 : 1);
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        handle_special_enum_path(context, field->enum_type(),
+            static_cast<int>(wire_decode_int64(field->type(), value.bits)),
+            path.tail);
+        return;
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        // The slice points into the encoded message, which may not
+        // outlive this call: this is the only copy.
+        result_string(context, field, value.data, value.size,
+            SQLITE_TRANSIENT);
         return;
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        // Not supported by wire_extract
+        break;
+    }
+
+    sqlite3_result_error(context, "Path traverses non-message elements", -1);
+}
+
+
+
+/// Returns the value found by the accessor of `path`, or false to fall
+/// back to reflection.
+static bool extract_with_accessor(sqlite3_context *context,
+                                  const protopath& path,
+                                  const Message& root_message,
+                                  sqlite3_value *default_value,
+                                  bool null_default)
+{
+    accessor_value value;
+    switch (path.accessor(root_message, &value)) {
+    case accessor_status::FOUND:
+        break;
+    case accessor_status::MISSING:
+        if (value.step >= path.steps.size())
+            return false;
+        result_missing_field(context, path, value.step, default_value,
+            null_default);
+        return true;
+    case accessor_status::OUT_OF_RANGE:
+        sqlite3_result_null(context);
+        return true;
+    case accessor_status::FALLBACK:
+        return false;
     }
 
+    // Convert like the reflection path below.  Values of the wrong kind
+    // mean the accessor disagrees with the descriptor: let reflection
+    // decide.
+    const FieldDescriptor *const field = path.steps.back().field;
+    typedef accessor_value::value_kind kind;
+
+    switch(field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        if (value.kind != kind::INTEGER)
+            return false;
+        sqlite3_result_int64(context, value.integer);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+        if (value.kind != kind::INTEGER)
+            return false;
+        sqlite3_log(SQLITE_WARNING,
+            "Protobuf field \"%s\" is unsigned, but SQLite does not "
+            "support unsigned types", field->full_name().c_str());
+        sqlite3_result_int64(context, value.integer);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        if (value.kind != kind::REAL)
+            return false;
+        sqlite3_result_double(context, value.real);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        if (value.kind != kind::BOOL)
+            return false;
+        sqlite3_result_int64(context, value.integer != 0 ? 0 : 1);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        if (value.kind != kind::INTEGER)
+            return false;
+        handle_special_enum_path(context, field->enum_type(),
+            static_cast<int>(value.integer), path.tail);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        if (value.kind != kind::STRING)
+            return false;
+        // Same as reflection: the cached message may be reused by the
+        // next call.
+        result_string(context, field, value.data, value.size,
+            SQLITE_TRANSIENT);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        // Not supported by accessors
+        break;
+    }
+
+    return false;
+}
+
+}  // namespace
+
+bool extract_from_wire(sqlite3_context *context,
+                       const protopath& path,
+                       const void *data, size_t size,
+                       sqlite3_value *default_value, bool null_default)
+{
+    if (!path.wire_supported)
+        return false;
+
+    wire_value value;
+    switch (wire_extract(path, data, size, &value)) {
+    case wire_status::FOUND:
+        result_wire_value(context, path, value);
+        return true;
+    case wire_status::MISSING:
+        result_missing_field(context, path, value.step, default_value,
+            null_default);
+        return true;
+    case wire_status::OUT_OF_RANGE:
+        sqlite3_result_null(context);
+        return true;
+    case wire_status::FALLBACK:
+        break;
+    }
+
+    return false;
+}
+
+void extract_from_message(sqlite3_context *context,
+                          const protopath& path,
+                          const Message& root_message,
+                          const void *data, size_t size,
+                          sqlite3_value *default_value, bool null_default)
+{
     // Special case: just return the root object
-    if (path == "$") {
-        const void *data = sqlite3_value_blob(message_data);
-        int len = sqlite3_value_bytes(message_data);
-        sqlite3_result_blob(context, data, len, SQLITE_TRANSIENT);
+    if (path.is_root()) {
+        sqlite3_result_blob(context, data, size, SQLITE_TRANSIENT);
+        return;
+    }
+
+    // Generated code for this exact path, if a library registered one
+    if (path.accessor != nullptr &&
+        extract_with_accessor(context, path, root_message, default_value,
+            null_default)) {
+        count_stat(stat::EXTRACT_ACCESSOR_HITS);
         return;
     }
-    
-    // Get the Descrptor interface for the message type
-    const Descriptor* descriptor = root_message->GetDescriptor();
 
+    stat_timer timer(stat::REFLECTION_NS);
+    
     // Get the Reflection interface for the message
-    const Reflection *reflection = root_message->GetReflection();
+    const Reflection *reflection = root_message.GetReflection();
     
     // As we traverse the tree, this is the "current" message we are looking at.
     // We only want the overall message to be managed by std::unique_ptr,
     // and this variable will always point into the overall structure.
-    const Message *message = root_message;
+    const Message *message = &root_message;
     
-    // Parse the rest
-    static const auto& path_element_regex =
-        *new std::regex("^\\.([^\\.\\[]+)(?:\\[(-?[0-9]+)\\])?");
-    std::string::const_iterator it = ++ path.cbegin();  // skip $
-    while (it != path.end()) {
-        std::smatch m;
-        if (!std::regex_search(it, path.cend(), m, path_element_regex)) {
-            sqlite3_result_error(context, "Invalid path", -1);
-            return;
-        }
-        
-        // Advance the iterator to the start of the next path component
-        it += m.length();
-        
-        const std::string field_name = m.str(1);
-        const std::string field_index_str = m.str(2);
-        
-        // Get the descriptor for this field by its name
-        const FieldDescriptor *const field =
-            descriptor->FindFieldByName(field_name);
-        if (!field) {
-            sqlite3_result_error(context, "Invalid field name", -1);
-            return;
-        }
+    // Walk the resolved path
+    for (size_t i = 0; i < path.steps.size(); i++) {
+        const protopath_step& step = path.steps[i];
+        const FieldDescriptor *const field = step.field;
 
         // If the field is optional, and it is not provided, return the default
         if (field->is_optional() && !reflection->HasField(*message, field)) {
-            // Is there anything left in the path?
-            if (it != path.end()) {
-                switch (field->type())
-                {
-                   case FieldDescriptor::Type::TYPE_ENUM:
-                   case FieldDescriptor::Type::TYPE_MESSAGE:
-                       // Both of these are handled in the main switch below
-                       break;
-                   default:
-                       sqlite3_result_error(context, "Invalid path", -1);
-                       return;
-                }
-            }
-
-            if (default_value != nullptr) {
-                sqlite3_result_value(context, default_value);
-                return;
-            }
-            
-            switch(field->cpp_type()) {
-            case FieldDescriptor::CppType::CPPTYPE_INT32:
-                sqlite3_result_int64(context, field->default_value_int32());
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_INT64:
-                sqlite3_result_int64(context, field->default_value_int64());
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_UINT32:
-                sqlite3_result_int64(context, field->default_value_uint32());
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_UINT64:
-                sqlite3_log(SQLITE_WARNING,
-                    "Protobuf field \"%s\" is unsigned, but SQLite does not "
-                    "support unsigned types", field->full_name().c_str());
-                sqlite3_result_int64(context, field->default_value_uint64());
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
-                sqlite3_result_double(context, field->default_value_double());
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_FLOAT:
-                sqlite3_result_double(context, field->default_value_float());
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_BOOL:
-                sqlite3_result_int64(context,
-                    field->default_value_bool() ? 0 : 1);
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_ENUM:
-                handle_special_enum_path(context,
-                    field->default_value_enum()->type(),
-                    field->default_value_enum()->number(),
-                    path, it);
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_STRING:
-                switch(field->type()) {
-                default:
-                    // fall through, but log
-                    sqlite3_log(SQLITE_WARNING,
-                        "Protobuf field \"%s\" is an unexpected string type",
-                        field->full_name().c_str());
-                case FieldDescriptor::Type::TYPE_STRING:
-                    sqlite3_result_text(context,
-                        field->default_value_string().c_str(),
-                        field->default_value_string().length(),
-                        SQLITE_TRANSIENT);
-                    break;
-                case FieldDescriptor::Type::TYPE_BYTES:
-                    sqlite3_result_blob(context,
-                        field->default_value_string().c_str(),
-                        field->default_value_string().length(),
-                        SQLITE_TRANSIENT);
-                    break;
-                }
-                return;
-            case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
-                sqlite3_result_null(context);
-                return;
-            }
+            result_missing_field(context, path, i, default_value,
+                null_default);
+            return;
         }
 
         int field_index = 0;
         const bool is_repeated = field->is_repeated();
         // If the field is repeated, validate the index into it
         if (is_repeated) {
-            if (field_index_str.empty()) {
+            if (!step.has_index) {
                 sqlite3_result_error(context,
                     "Expected index into repeated field", -1);
                 return;
@@ -234,7 +382,7 @@ static void protobuf_extract(sqlite3_context *context,
 
             // Wrap around for negative indexing
             int field_size = reflection->FieldSize(*message, field);
-            field_index = std::stoi(field_index_str);
+            field_index = step.index;
 
             if (field_index < 0) {
                 field_index = field_size + field_index;
@@ -254,13 +402,12 @@ static void protobuf_extract(sqlite3_context *context,
             message = is_repeated
                 ? &reflection->GetRepeatedMessage(*message, field, field_index)
                 : &reflection->GetMessage(*message, field);
-            descriptor = message->GetDescriptor();
             reflection = message->GetReflection();
             continue;
         }
         
         // Any other type should be the end of the path
-        if (it != path.cend()
+        if (path.tail != protopath_tail::NONE
             && field->type() != FieldDescriptor::Type::TYPE_ENUM)
         {
             sqlite3_result_error(context, "Path traverses non-message elements",
@@ -298,7 +445,7 @@ static void protobuf_extract(sqlite3_context *context,
             {
                 sqlite3_log(SQLITE_WARNING,
                     "Protobuf field \"%s\" is unsigned, but SQLite does not "
-                    "support unsigned types");
+                    "support unsigned types", field->full_name().c_str());
                 uint64_t value = is_repeated
                     ? reflection->GetRepeatedUInt64(*message, field, field_index)
                     : reflection->GetUInt64(*message, field);
@@ -335,29 +482,22 @@ static void protobuf_extract(sqlite3_context *context,
                     ? reflection->GetRepeatedEnumValue(*message, field, field_index)
                     : reflection->GetEnumValue(*message, field);
                 handle_special_enum_path(context, field->enum_type(), value,
-                    path, it);
+                    path.tail);
                 return;
             }
             case FieldDescriptor::CppType::CPPTYPE_STRING:
             {
-                std::string value = is_repeated
-                    ? reflection->GetRepeatedString(*message, field, field_index)
-                    : reflection->GetString(*message, field);
-                switch(field->type()) {
-                default:
-                    // fall through, but log
-                    sqlite3_log(SQLITE_WARNING,
-                        "Protobuf field \"%s\" is an unexpected string type",
-                        field->full_name().c_str());
-                case FieldDescriptor::Type::TYPE_STRING:
-                    sqlite3_result_text(context, value.c_str(), value.length(),
-                        SQLITE_TRANSIENT);
-                    break;
-                case FieldDescriptor::Type::TYPE_BYTES:
-                    sqlite3_result_blob(context, value.c_str(), value.length(),
-                        SQLITE_TRANSIENT);
-                    break;
-                }
+                // Avoid copying the string out of the message: the cached
+                // message may be reused by the next call, so SQLite makes
+                // the only copy.
+                std::string scratch;
+                const std::string& value = is_repeated
+                    ? reflection->GetRepeatedStringReference(*message, field,
+                        field_index, &scratch)
+                    : reflection->GetStringReference(*message, field,
+                        &scratch);
+                result_string(context, field, value.data(), value.size(),
+                    SQLITE_TRANSIENT);
                 return;
             }
             case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
@@ -366,15 +506,78 @@ static void protobuf_extract(sqlite3_context *context,
         }
     }
     
+    // The path went bad after the last submessage we found
+    if (path.error != nullptr) {
+        sqlite3_result_error(context, path.error, -1);
+        return;
+    }
+
     // We made it to the end of the path. This means the user selected for a
     // message, which we should return the Protobuf-encoded message we landed on
-    std::string serialized;
-    if (!message->SerializeToString(&serialized)) {
-        sqlite3_result_error(context, "Could not serialize message", -1);
+    result_serialized_message(context, *message);
+}
+
+namespace {
+
+/// Return the element (or elements) 
+///
+///     SELECT protobuf_extract(data, "Person", "$.phones[0].number", default?);
+///
+/// @returns a Protobuf-encoded BLOB or the appropriate SQL datatype
+///
+/// If `default` is provided, it is returned instead of the protobuf field's
+/// default value.
+static void protobuf_extract(sqlite3_context *context,
+                             int argc,
+                             sqlite3_value **argv)
+{
+    sqlite3_value *message_data = argv[0];
+    sqlite3_value *message_name = argv[1];
+    sqlite3_value *const default_value = (argc >= 4) ? argv[3] : nullptr;
+
+    count_stat(stat::EXTRACT_CALLS);
+    
+    // Check that the path begins with $, representing the root of the tree
+    if (!protopath_has_root(
+            reinterpret_cast<const char *>(sqlite3_value_text(argv[2])),
+            static_cast<size_t>(sqlite3_value_bytes(argv[2])))) {
+        sqlite3_result_error(context, "Invalid path", -1);
+        return;
+    }
+
+    // Find the message type before parsing: we may not have to.
+    const Message *prototype = get_prototype(context, message_name);
+    if (!prototype) {
         return;
     }
-    sqlite3_result_blob(context, serialized.c_str(), serialized.length(),
-        SQLITE_TRANSIENT);
+
+    // Get the Descrptor interface for the message type
+    const Descriptor* descriptor = prototype->GetDescriptor();
+
+    // Resolve the path once per statement, rather than for each row
+    const protopath *path = get_protopath(context, 2, argv[2], descriptor);
+
+    const void *data;
+    size_t size;
+    if (!get_message_data(context, message_data, &data, &size))
+        return;
+
+    // Fast path: find scalar fields directly in the encoded message.
+    // Invalid UTF-8 in proto3 strings takes the slow path, and fails
+    // to parse there.
+    if (extract_from_wire(context, *path, data, size, default_value, false)) {
+        count_stat(stat::EXTRACT_WIRE_HITS);
+        return;
+    }
+
+    // Deserialize the message
+    auto root_message = parse_message(context, message_data, message_name);
+    if (!root_message) {
+        return;
+    }
+
+    extract_from_message(context, *path, *root_message, data, size,
+        default_value, false);
 }
 }  // namespace
 
@@ -382,8 +585,14 @@ int
 register_protobuf_extract(sqlite3 *db, char **pzErrMsg,
     const sqlite3_api_routines *pApi)
 {
-    return sqlite3_create_function(db, "protobuf_extract", -1,
-        SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, protobuf_extract, 0, 0);
+    for (int argc = 3; argc <= 4; argc++) {
+        int rc = sqlite3_create_function(db, "protobuf_extract", argc,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, protobuf_extract, 0, 0);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    return SQLITE_OK;
 }
 
 }  // namespace sqlite_protobuf
@@ -1,11 +1,40 @@
 #pragma once
+#include <stddef.h>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3.h"
 
-struct sqlite3;
 struct sqlite3_api_routines;
 
 namespace sqlite_protobuf {
 
+struct protopath;
+
 int register_protobuf_extract(sqlite3 *db, char **pzErrMsg,
     const sqlite3_api_routines *pApi);
 
+// The two halves of `protobuf_extract`, for other functions that
+// evaluate compiled protopaths on encoded messages of `size` bytes at
+// `data`.
+//
+// Fields that are not set return `default_value` if non-null, NULL if
+// `null_default` is true, and the field's default value otherwise.
+
+// Tries to evaluate `path` on the wire format.  Returns true and sets
+// the result of `context` on success, and returns false if the caller
+// must instead parse the message and call `extract_from_message`.
+bool extract_from_wire(sqlite3_context *context,
+                       const protopath& path,
+                       const void *data, size_t size,
+                       sqlite3_value *default_value, bool null_default);
+
+// Evaluates `path` on `root_message`, the result of parsing `data`,
+// and sets the result of `context`.
+void extract_from_message(sqlite3_context *context,
+                          const protopath& path,
+                          const google::protobuf::Message& root_message,
+                          const void *data, size_t size,
+                          sqlite3_value *default_value, bool null_default);
+
 }  // namespace sqlite_protobuf
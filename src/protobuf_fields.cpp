@@ -0,0 +1,426 @@
+#include "protobuf_fields.h"
+
+#include <strings.h>
+#include <string.h>
+
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3ext.h"
+
+#include "protobuf_compress.h"
+#include "protobuf_extract.h"
+#include "protobuf_stats.h"
+#include "protopath.h"
+#include "utilities.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+using google::protobuf::Message;
+
+
+/// Extracts several paths from a message at once, as a single row:
+///
+///     SELECT value0, value1
+///     FROM protobuf_fields(data, "Person", "$.name", "$.phones[0].number");
+///
+/// Each `valueN` column is the result of `protobuf_extract(data, type,
+/// pathN, NULL)`, for up to 63 paths.  The message is copied once per row,
+/// and parsed at most once, however many columns we read; the paths are only
+/// compiled once per statement.
+
+// The maximum number of paths in one call.  This also bounds the width of
+// the `colUsed` bitmask, which is why we stop at 63.
+const int MAX_PATHS = 63;
+
+// The column indexes, corresponding to the order of the columns in the CREATE
+// TABLE statement in xConnect: MAX_PATHS value columns come first, then the
+// hidden arguments, with one path for each value column.
+enum {
+    COLUMN_VALUE,
+    COLUMN_MESSAGE = COLUMN_VALUE + MAX_PATHS,
+    COLUMN_TYPE,
+    COLUMN_PATH,
+};
+
+
+#define MODULE_FUNC(func) protobuf_fields ## _ ## func
+
+
+// fields_cursor is a subclass of sqlite3_vtab_cursor which holds the single
+// row for the current message.  Values are extracted lazily, in xColumn, so
+// we only pay for the columns the query actually reads.
+// fields_vtab remembers its connection, where compressed messages find
+// their dictionaries.
+struct fields_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+};
+
+typedef struct fields_cursor fields_cursor;
+struct fields_cursor {
+    sqlite3_vtab_cursor base;
+
+    // Message type, its prototype, and the compiled paths, from the last call
+    // to xFilter.  These usually stay the same for the whole statement.
+    std::string message_name;
+    const Message *prototype;
+    std::vector<std::string> path_texts;
+    std::vector<protopath> paths;
+
+    // Copy of the encoded message for the current row.
+    std::string message_data;
+
+    // The parsed message_data, for paths we can't evaluate on the wire.
+    // Only valid if `parsed` is true.
+    std::unique_ptr<Message> message;
+    bool parsed;
+    bool parse_failed;
+
+    bool eof;
+};
+
+
+/// Connect to the eponymous virtual table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    std::string schema = "CREATE TABLE tbl(";
+    for (int i = 0; i < MAX_PATHS; i++) {
+        schema += "value" + std::to_string(i) + ", ";
+    }
+    schema += "message BLOB HIDDEN, type TEXT HIDDEN";
+    for (int i = 0; i < MAX_PATHS; i++) {
+        schema += ", path" + std::to_string(i) + " TEXT HIDDEN";
+    }
+    schema += ")";
+
+    int err = sqlite3_declare_vtab(db, schema.c_str());
+    if (err != SQLITE_OK) return err;
+
+    fields_vtab *vtab = (fields_vtab *)sqlite3_malloc(sizeof(*vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    bzero(vtab, sizeof(*vtab));
+    vtab->db = db;
+    *ppVtab = &vtab->base;
+
+    return SQLITE_OK;
+}
+
+
+/// Undoes xOpen
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor fields_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    fields_cursor *cursor = new (std::nothrow) fields_cursor();
+    if (!cursor)
+        return SQLITE_NOMEM;
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor fields_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    delete (fields_cursor *)cur;
+    return SQLITE_OK;
+}
+
+/// There is only one row for each message
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    fields_cursor *cursor = (fields_cursor *)cur;
+    cursor->eof = true;
+    return SQLITE_OK;
+}
+
+
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    *pRowid = 0;
+    return SQLITE_OK;
+}
+
+
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    fields_cursor *cursor = (fields_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Extracts the value of path `i` from the current message
+static void extract_column(fields_cursor *cursor, sqlite3_context *ctx, int i)
+{
+    if (i >= (int)cursor->paths.size()) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    const std::string& path_text = cursor->path_texts[i];
+    if (!protopath_has_root(path_text.data(), path_text.size())) {
+        sqlite3_result_error(ctx, "Invalid path", -1);
+        return;
+    }
+
+    const protopath& path = cursor->paths[i];
+    const void *data = cursor->message_data.data();
+    size_t size = cursor->message_data.size();
+
+    // Missing fields are NULL, like protobuf_extract(..., NULL)
+    if (extract_from_wire(ctx, path, data, size, nullptr, true))
+        return;
+
+    // Parse the message at most once per row
+    if (!cursor->parsed) {
+        if (cursor->message) {
+            cursor->message->Clear();
+        } else {
+            cursor->message.reset(cursor->prototype->New());
+        }
+
+        {
+            stat_timer timer(stat::PARSE_NS);
+            cursor->parse_failed =
+                !cursor->message->ParseFromString(cursor->message_data);
+        }
+        cursor->parsed = true;
+
+        count_stat(stat::BYTES_PARSED, size);
+        if (cursor->parse_failed)
+            count_stat(stat::PARSE_FAILURES);
+    }
+
+    if (cursor->parse_failed) {
+        sqlite3_result_error(ctx, "Failed to parse message", -1);
+        return;
+    }
+
+    extract_from_message(ctx, path, *cursor->message, data, size,
+        nullptr, true);
+}
+
+
+/// Return the fields in a given cell of the table
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    fields_cursor *cursor = (fields_cursor *)cur;
+    if (i < COLUMN_MESSAGE) {
+        extract_column(cursor, ctx, i - COLUMN_VALUE);
+        return SQLITE_OK;
+    }
+
+    switch (i) {
+    case COLUMN_MESSAGE:
+        sqlite3_result_blob(ctx, cursor->message_data.data(),
+            cursor->message_data.size(), SQLITE_TRANSIENT);
+        break;
+    case COLUMN_TYPE:
+        sqlite3_result_text(ctx, cursor->message_name.c_str(),
+            cursor->message_name.size(), SQLITE_TRANSIENT);
+        break;
+    default:
+        if (i - COLUMN_PATH < (int)cursor->path_texts.size()) {
+            const std::string& text = cursor->path_texts[i - COLUMN_PATH];
+            sqlite3_result_text(ctx, text.c_str(), text.size(),
+                SQLITE_TRANSIENT);
+        } else {
+            sqlite3_result_null(ctx);
+        }
+        break;
+    }
+    return SQLITE_OK;
+}
+
+
+///
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    // Find the constraints that pin the hidden columns to the function
+    // arguments
+    int messageEqConstraintIdx = -1;
+    int typeEqConstraintIdx = -1;
+    int pathEqConstraintIdx[MAX_PATHS];
+    for (int i = 0; i < MAX_PATHS; i ++) {
+        pathEqConstraintIdx[i] = -1;
+    }
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for(int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+
+        if (constraint->iColumn == COLUMN_MESSAGE) {
+            messageEqConstraintIdx = i;
+        } else if (constraint->iColumn == COLUMN_TYPE) {
+            typeEqConstraintIdx = i;
+        } else if (constraint->iColumn >= COLUMN_PATH &&
+                   constraint->iColumn < COLUMN_PATH + MAX_PATHS) {
+            pathEqConstraintIdx[constraint->iColumn - COLUMN_PATH] = i;
+        }
+    }
+
+    // We need at least the message and its type
+    if (messageEqConstraintIdx == -1 || typeEqConstraintIdx == -1) {
+        return SQLITE_CONSTRAINT;
+    }
+
+    // Paths are positional arguments, so we only take a prefix of them.  Any
+    // other path constraint is left for SQLite to check.
+    //     argv[0] = message
+    //     argv[1] = message type name
+    //     argv[2...] = paths
+    int argIdx = 1;
+    for (int constraintIdx : { messageEqConstraintIdx, typeEqConstraintIdx }) {
+        pIdxInfo->aConstraintUsage[constraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[constraintIdx].omit = 1;
+    }
+
+    int numPaths = 0;
+    while (numPaths < MAX_PATHS && pathEqConstraintIdx[numPaths] >= 0) {
+        int constraintIdx = pathEqConstraintIdx[numPaths ++];
+        pIdxInfo->aConstraintUsage[constraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[constraintIdx].omit = 1;
+    }
+
+    pIdxInfo->idxNum = numPaths;
+    pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    pIdxInfo->estimatedCost = 1;
+    pIdxInfo->estimatedRows = 1;
+    return SQLITE_OK;
+}
+
+
+/// Load the message for the next row, and compile the paths if they changed
+/// since the last call.
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    fields_cursor *cursor = (fields_cursor *)pVtabCursor;
+    cursor->eof = true;
+    cursor->parsed = false;
+
+    count_stat(stat::FIELDS_ROWS);
+
+    // Find the prototype for this message type
+    const char *message_name =
+        reinterpret_cast<const char *>(sqlite3_value_text(argv[1]));
+    if (!cursor->prototype || !message_name ||
+        cursor->message_name != message_name) {
+        cursor->message_name = message_name ? message_name : "";
+        cursor->prototype = find_prototype(cursor->message_name);
+        cursor->message.reset();
+        cursor->paths.clear();
+        cursor->path_texts.clear();
+
+        if (!cursor->prototype) {
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg =
+                sqlite3_mprintf("Could not find message descriptor");
+            return SQLITE_ERROR;
+        }
+    }
+
+    // Compile the paths, unless they're the same as last time
+    const int numPaths = idxNum;
+    bool same_paths = (size_t)numPaths == cursor->paths.size();
+    for (int i = 0; same_paths && i < numPaths; i ++) {
+        sqlite3_value *path = argv[2 + i];
+        const std::string& text = cursor->path_texts[i];
+        same_paths = sqlite3_value_type(path) != SQLITE_NULL &&
+            (size_t)sqlite3_value_bytes(path) == text.size() &&
+            memcmp(sqlite3_value_text(path), text.data(), text.size()) == 0;
+    }
+
+    if (!same_paths) {
+        const auto *descriptor = cursor->prototype->GetDescriptor();
+
+        cursor->paths.clear();
+        cursor->path_texts.clear();
+        for (int i = 0; i < numPaths; i ++) {
+            const char *text =
+                reinterpret_cast<const char *>(sqlite3_value_text(argv[2 + i]));
+            cursor->path_texts.push_back(text ? text : "");
+            cursor->paths.push_back(
+                compile_protopath(descriptor, cursor->path_texts.back()));
+        }
+    }
+
+    // The argument may not outlive this call, so copy it
+    const void *data = sqlite3_value_blob(argv[0]);
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+    const char *error = decompress_message(
+        reinterpret_cast<fields_vtab *>(pVtabCursor->pVtab)->db, &data, &size);
+    if (error != nullptr) {
+        sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", error);
+        return SQLITE_ERROR;
+    }
+
+    cursor->message_data.assign(data ? static_cast<const char *>(data) : "",
+        size);
+
+    cursor->eof = false;
+    return SQLITE_OK;
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  0,                         /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+}  // namespace
+
+int
+register_protobuf_fields(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    return sqlite3_create_module(db, "protobuf_fields", &module, 0);
+}
+
+}  // namespace sqlite_protobuf
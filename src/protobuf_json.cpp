@@ -1,44 +1,147 @@
 #include "protobuf_json.h"
 
+#include <limits.h>
+
+#include <algorithm>
+#include <memory>
 #include <regex>
 #include <string>
+#include <unordered_map>
 
 #include <google/protobuf/descriptor_database.h>
 #include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/field_mask.pb.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/struct.pb.h>
+#include <google/protobuf/util/field_mask_util.h>
 #include <google/protobuf/util/json_util.h>
+#include <google/protobuf/util/type_resolver.h>
+#include <google/protobuf/util/type_resolver_util.h>
 
 #include "sqlite3ext.h"
 
+#include "protobuf_compress.h"
+#include "protobuf_stats.h"
 #include "utilities.h"
+#include "wire_format.h"
 
 namespace sqlite_protobuf {
 SQLITE_EXTENSION_INIT3
 
 namespace {
 
+using google::protobuf::DescriptorPool;
+using google::protobuf::FieldMask;
 using google::protobuf::Message;
+using google::protobuf::Struct;
+using google::protobuf::Value;
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::ZeroCopyOutputStream;
+using google::protobuf::util::FieldMaskUtil;
 using google::protobuf::util::JsonParseOptions;
 using google::protobuf::util::JsonPrintOptions;
 using google::protobuf::util::JsonStringToMessage;
-using google::protobuf::util::MessageToJsonString;
+using google::protobuf::util::TypeResolver;
 
+const char TYPE_URL_PREFIX[] = "type.googleapis.com";
 
-/// Converts a binary blob of protobuf bytes to a JSON representation of the message.
-///
-///     SELECT protobuf_to_json(data, "Person");
-///
-/// @returns a JSON string.
-void
-protobuf_to_json(sqlite3_context *context, int argc, sqlite3_value **argv)
+// Initial capacity of JSON output buffers.
+const size_t MIN_JSON_CAPACITY = 256;
+
+
+// A ZeroCopyOutputStream into a buffer from sqlite3_malloc, which we
+// can then hand over to SQLite without copying.
+class sqlite3_output_stream : public ZeroCopyOutputStream {
+public:
+    explicit sqlite3_output_stream(size_t capacity_hint)
+        : capacity_hint_(std::max(capacity_hint, MIN_JSON_CAPACITY))
+    {
+    }
+
+    ~sqlite3_output_stream() override
+    {
+        sqlite3_free(buf_);
+    }
+
+    bool Next(void **data, int *size) override
+    {
+        if (used_ == capacity_) {
+            size_t capacity = (capacity_ == 0) ? capacity_hint_ : 2 * capacity_;
+            // Protobuf streams count in ints.
+            capacity = std::min<size_t>(capacity, used_ + INT_MAX);
+
+            char *buf = static_cast<char *>(sqlite3_realloc64(buf_, capacity));
+            if (buf == nullptr)
+                return false;
+
+            buf_ = buf;
+            capacity_ = capacity;
+        }
+
+        *data = buf_ + used_;
+        *size = static_cast<int>(capacity_ - used_);
+        used_ = capacity_;
+        return true;
+    }
+
+    void BackUp(int count) override
+    {
+        used_ -= count;
+    }
+
+    int64_t ByteCount() const override
+    {
+        return used_;
+    }
+
+    /// Releases the buffer, which must then be freed with sqlite3_free.
+    char *release(size_t *size)
+    {
+        char *ret = buf_;
+
+        *size = used_;
+        buf_ = nullptr;
+        capacity_ = used_ = 0;
+        return ret;
+    }
+
+private:
+    size_t capacity_hint_;
+    char *buf_ = nullptr;
+    size_t capacity_ = 0;
+    size_t used_ = 0;
+};
+
+
+/// Returns a type resolver for the messages in `pool`.
+/// MessageToJsonString creates one on each call for pools other than
+/// the generated pool, and that's a large part of its runtime.
+TypeResolver *get_type_resolver(const DescriptorPool *pool)
 {
-    sqlite3_value *message_data = argv[0];
-    sqlite3_value *message_name = argv[1];
+    static thread_local std::unordered_map<const DescriptorPool *,
+        std::unique_ptr<TypeResolver>> resolvers;
 
-    auto message = parse_message(context, message_data, message_name);
-    if (!message) {
-        return;
+    std::unique_ptr<TypeResolver>& resolver = resolvers[pool];
+    if (!resolver) {
+        resolver.reset(google::protobuf::util::NewTypeResolverForDescriptorPool(
+            TYPE_URL_PREFIX, pool));
     }
 
+    return resolver.get();
+}
+
+
+// Print options for protobuf_to_json, from its optional argument.
+struct json_print_config {
+    JsonPrintOptions options;
+    // Only print these fields, if not empty.
+    FieldMask fields;
+};
+
+
+/// Returns our default print options.
+JsonPrintOptions default_print_options()
+{
     JsonPrintOptions options;
     // The JSON format is unfortunately tied to proto3 semantics,
     // where there is no difference between unpopulated primitive
@@ -47,14 +150,219 @@ protobuf_to_json(sqlite3_context *context, int argc, sqlite3_value **argv)
     // easy to miss a null check, so we prefer to always populate
     // fields we know about.
     options.always_print_primitive_fields = true;
+    return options;
+}
+
+
+/// Parses the JSON object `text` into `out`.  Returns false on failure.
+bool parse_print_config(const std::string& text, json_print_config *out)
+{
+    Struct fields;
+    bool has_always_print = false;
+
+    if (!JsonStringToMessage(text, &fields).ok())
+        return false;
+
+    out->options = default_print_options();
+    out->fields.Clear();
+    for (const auto& entry : fields.fields()) {
+        const std::string& key = entry.first;
+        const Value& value = entry.second;
+        bool *flag = nullptr;
+
+        if (key == "fields") {
+            if (value.has_list_value()) {
+                for (const Value& path : value.list_value().values()) {
+                    if (!path.has_string_value())
+                        return false;
+                    out->fields.add_paths(path.string_value());
+                }
+            } else if (value.has_string_value()) {
+                FieldMaskUtil::FromString(value.string_value(), &out->fields);
+            } else {
+                return false;
+            }
+
+            continue;
+        }
+
+        if (key == "always_print_primitive_fields") {
+            flag = &out->options.always_print_primitive_fields;
+            has_always_print = true;
+        } else if (key == "always_print_enums_as_ints") {
+            flag = &out->options.always_print_enums_as_ints;
+        } else if (key == "preserve_proto_field_names") {
+            flag = &out->options.preserve_proto_field_names;
+        } else if (key == "add_whitespace") {
+            flag = &out->options.add_whitespace;
+        }
+
+        if (flag == nullptr || !value.has_bool_value())
+            return false;
+        *flag = value.bool_value();
+    }
+
+    // Printing defaults for all the fields we dropped would defeat
+    // the purpose of the field mask.
+    if (out->fields.paths_size() > 0 && !has_always_print)
+        out->options.always_print_primitive_fields = false;
+
+    return true;
+}
+
 
-    std::string json;
-    if (!MessageToJsonString(*message, &json, options).ok()) {
+/// Returns the print config for the options argument `options_value`,
+/// or sets an error and returns nullptr if it's invalid.
+const json_print_config *get_print_config(sqlite3_context *context,
+                                          sqlite3_value *options_value)
+{
+    // Queries normally pass the same options for every row.
+    static thread_local std::string cached_text;
+    static thread_local json_print_config cached_config;
+    static thread_local bool cached_valid = false;
+
+    if (cached_valid && string_equal_to_sqlite3_value(cached_text,
+            options_value))
+        return &cached_config;
+
+    cached_valid = false;
+    cached_text = string_from_sqlite3_value(options_value);
+    if (!parse_print_config(cached_text, &cached_config)) {
+        sqlite3_result_error(context, "Invalid JSON options", -1);
+        return nullptr;
+    }
+
+    cached_valid = true;
+    return &cached_config;
+}
+
+
+/// Returns a copy of `message` with only the fields in `fields`, or
+/// nullptr if a path isn't valid for that message type.  The copy is
+/// only valid until the next call.
+const Message *mask_message(const Message& message, const FieldMask& fields)
+{
+    static thread_local std::unique_ptr<Message> masked;
+
+    for (const std::string& path : fields.paths()) {
+        if (!FieldMaskUtil::GetFieldDescriptors(message.GetDescriptor(), path,
+                nullptr))
+            return nullptr;
+    }
+
+    if (!masked || masked->GetDescriptor() != message.GetDescriptor())
+        masked.reset(message.New());
+
+    // Unlike MergeMessageTo, TrimMessage doesn't create the parents
+    // of missing fields.
+    masked->CopyFrom(message);
+    FieldMaskUtil::TrimMessage(fields, masked.get());
+    return masked.get();
+}
+
+
+/// Converts a binary blob of protobuf bytes to a JSON representation of the message.
+///
+///     SELECT protobuf_to_json(data, "Person", options?);
+///
+/// `options` is a JSON object with any of the boolean flags
+/// "always_print_primitive_fields" (true by default),
+/// "always_print_enums_as_ints", "preserve_proto_field_names" and
+/// "add_whitespace", and "fields": a field mask, as a list of paths or
+/// a comma-separated string, e.g., '{"fields": ["name", "phones"]}'.
+/// Unless explicitly enabled, "always_print_primitive_fields" is
+/// disabled with "fields", to only print the selected fields.
+///
+/// @returns a JSON string.
+void
+protobuf_to_json(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    sqlite3_value *message_data = argv[0];
+    sqlite3_value *message_name = argv[1];
+    // The JSON for the last row is a good estimate for the next one.
+    static thread_local size_t capacity_hint;
+    static thread_local std::string binary;
+    static const json_print_config default_config = {
+        default_print_options(),
+        FieldMask(),
+    };
+
+    count_stat(stat::TO_JSON_CALLS);
+
+    const json_print_config *config = &default_config;
+    if (argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL) {
+        config = get_print_config(context, argv[2]);
+        if (config == nullptr)
+            return;
+    }
+
+    // Without a field mask, a canonical encoded argument is already
+    // what we would convert; other messages go through a parse.
+    const google::protobuf::Descriptor *descriptor = nullptr;
+    const void *data = nullptr;
+    size_t size = 0;
+    if (config->fields.paths_size() == 0) {
+        const Message *prototype = get_prototype(context, message_name);
+        if (!prototype)
+            return;
+
+        if (!get_message_data(context, message_data, &data, &size))
+            return;
+
+        descriptor = prototype->GetDescriptor();
+    }
+
+    if (config->fields.paths_size() > 0 ||
+        !wire_is_canonical(descriptor, data, size)) {
+        const Message *message = parse_message(context, message_data,
+            message_name);
+        if (!message)
+            return;
+
+        if (config->fields.paths_size() > 0) {
+            message = mask_message(*message, config->fields);
+            if (message == nullptr) {
+                sqlite3_result_error(context, "Invalid field mask", -1);
+                return;
+            }
+        }
+
+        binary.clear();
+        if (!message->AppendToString(&binary)) {
+            sqlite3_result_error(context, "Could not convert message to JSON",
+                -1);
+            return;
+        }
+
+        descriptor = message->GetDescriptor();
+        data = binary.data();
+        size = binary.size();
+    }
+
+    // This is what MessageToJsonString does, but with a long-lived
+    // type resolver and buffers, and output straight to memory we can
+    // pass to SQLite.
+    ArrayInputStream input(data, static_cast<int>(size));
+    sqlite3_output_stream output(capacity_hint);
+    if (!google::protobuf::util::BinaryToJsonStream(
+            get_type_resolver(descriptor->file()->pool()),
+            std::string(TYPE_URL_PREFIX) + "/" + descriptor->full_name(),
+            &input, &output, config->options).ok()) {
         sqlite3_result_error(context, "Could not convert message to JSON", -1);
         return;
     }
 
-    sqlite3_result_text(context, json.c_str(), json.length(), SQLITE_TRANSIENT);
+    size_t json_size;
+    char *json = output.release(&json_size);
+    if (json == nullptr) {
+        // Empty output: we never asked for a buffer.
+        sqlite3_result_text(context, "", 0, SQLITE_STATIC);
+        return;
+    }
+
+    capacity_hint = json_size + json_size / 8;
+    sqlite3_result_text64(context, json, json_size, sqlite3_free,
+        SQLITE_UTF8);
     return;
 }
 
@@ -66,31 +374,42 @@ protobuf_to_json(sqlite3_context *context, int argc, sqlite3_value **argv)
 void
 protobuf_of_json(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
-    const std::string json_data = string_from_sqlite3_value(argv[0]);
+    sqlite3_value *json_data = argv[0];
     sqlite3_value *message_name = argv[1];
+    static thread_local std::string binary;
+    static const JsonParseOptions options = [] {
+        JsonParseOptions ret;
+        ret.ignore_unknown_fields = true;
+        return ret;
+    }();
+
+    count_stat(stat::OF_JSON_CALLS);
 
     const Message *prototype = get_prototype(context, message_name);
     if (!prototype) {
         return;
     }
 
-    std::unique_ptr<Message> message(prototype->New());
+    const char *json = static_cast<const char *>(sqlite3_value_blob(json_data));
+    size_t json_size = static_cast<size_t>(sqlite3_value_bytes(json_data));
+    const google::protobuf::Descriptor *descriptor = prototype->GetDescriptor();
 
-    JsonParseOptions options;
-    options.ignore_unknown_fields = true;
-
-    if (!JsonStringToMessage(json_data, message.get(), options).ok()) {
+    // This is what JsonStringToMessage does, but with a long-lived
+    // type resolver, without copying the input, and with a message
+    // we reuse for the next rows.
+    binary.clear();
+    Message *message = get_scratch_message(prototype, json_size);
+    if (!google::protobuf::util::JsonToBinaryString(
+            get_type_resolver(descriptor->file()->pool()),
+            std::string(TYPE_URL_PREFIX) + "/" + descriptor->full_name(),
+            google::protobuf::StringPiece(json ? json : "", json_size),
+            &binary, options).ok() ||
+        !message->ParseFromString(binary)) {
         sqlite3_result_error(context, "Could not parse JSON message", -1);
         return;
     }
 
-    std::string proto;
-    if (!message->SerializeToString(&proto)) {
-        sqlite3_result_error(context, "Could not serialize message", -1);
-        return;
-    }
-
-    sqlite3_result_blob(context, proto.c_str(), proto.length(), SQLITE_TRANSIENT);
+    result_serialized_message(context, *message);
     return;
 }
 
@@ -108,6 +427,12 @@ register_protobuf_json(sqlite3 *db, char **pzErrMsg,
     if (rc != SQLITE_OK)
         return rc;
 
+    rc = sqlite3_create_function(db, "protobuf_to_json", 3,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+        nullptr, protobuf_to_json, nullptr, nullptr);
+    if (rc != SQLITE_OK)
+        return rc;
+
     return sqlite3_create_function(db, "protobuf_of_json", 2,
         SQLITE_UTF8 | SQLITE_DETERMINISTIC,
         nullptr, protobuf_of_json, nullptr, nullptr);
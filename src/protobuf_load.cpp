@@ -6,6 +6,8 @@
 
 #include "sqlite3ext.h"
 
+#include "accessors.h"
+#include "descriptor_pool.h"
 #include "utilities.h"
 
 namespace sqlite_protobuf {
@@ -17,12 +19,13 @@ namespace {
 ///
 ///     SELECT protobuf_load("example/libaddressbook.dylib");
 ///
+/// Loading a library that is already loaded does nothing.  Libraries may
+/// also register specialised accessors for their generated message
+/// classes (see `sqlite_protobuf_accessor.h`).
 static void protobuf_load(sqlite3_context *context,
                           int argc,
                           sqlite3_value **argv)
 {
-    invalidate_all_caches();
-
     // Confirm that we have permission to load extensions
     int enabled, err;
     err = sqlite3_db_config(sqlite3_context_db_handle(context),
@@ -37,8 +40,15 @@ static void protobuf_load(sqlite3_context *context,
         return;
     }
     
-    // Load the library
+    // Don't flush every thread's caches if we already have the library.
+    // We leak the reference, like the one we get by loading it below.
     const std::string path = string_from_sqlite3_value(argv[0]);
+    if (dlopen(path.c_str(), RTLD_LAZY | RTLD_GLOBAL | RTLD_NOLOAD)) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    // Load the library
     void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_GLOBAL);
     if (!handle) {
         auto error_msg = std::string("Could not load library: ") + dlerror();
@@ -46,17 +56,49 @@ static void protobuf_load(sqlite3_context *context,
         return;
     }
 
+    load_accessors(handle);
+    invalidate_all_caches();
     sqlite3_result_null(context);
 }
 
+/// Loads the message and enum types in a serialized FileDescriptorSet, e.g.,
+/// the output of `protoc --include_imports --descriptor_set_out`, without
+/// compiling or loading any code.  Returns the number of new files on
+/// success or throws an error on failure.
+///
+///     SELECT protobuf_load_descriptor_set(readfile("addressbook.pb"));
+///
+/// Loading the same files again does nothing and returns 0.
+static void protobuf_load_descriptor_set(sqlite3_context *context,
+                                         int argc,
+                                         sqlite3_value **argv)
+{
+    std::string error;
+    int added = load_descriptor_set(sqlite3_value_blob(argv[0]),
+        static_cast<size_t>(sqlite3_value_bytes(argv[0])), &error);
+    if (added < 0) {
+        sqlite3_result_error(context, error.c_str(), -1);
+        return;
+    }
+
+    sqlite3_result_int(context, added);
+}
+
 }  // namespace
 
 int
 register_protobuf_load(sqlite3 *db, char **pzErrMsg,
     const sqlite3_api_routines *pApi)
 {
-    return sqlite3_create_function(db, "protobuf_load", 1, SQLITE_UTF8, 0,
+    int rc;
+
+    rc = sqlite3_create_function(db, "protobuf_load", 1, SQLITE_UTF8, 0,
         protobuf_load, 0, 0);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    return sqlite3_create_function(db, "protobuf_load_descriptor_set", 1,
+        SQLITE_UTF8, 0, protobuf_load_descriptor_set, 0, 0);
 }
 
 }  // namespace sqlite_protobuf
@@ -0,0 +1,331 @@
+#include "protobuf_presence.h"
+
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3ext.h"
+
+#include "field_value.h"
+#include "protobuf_compress.h"
+#include "protobuf_stats.h"
+#include "protopath.h"
+#include "utilities.h"
+#include "varint.h"
+#include "wire_format.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+
+// Presence summaries only cover field numbers below this limit, so a
+// section is at most 128 bytes.  Fields with larger numbers can't be
+// ruled out by a summary.
+const uint32_t PRESENCE_MAX_FIELD = 1024;
+
+
+void append_varint(std::string *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+
+    out->push_back(static_cast<char>(value));
+}
+
+
+/// Returns true if `summary` (built by `protobuf_presence` for the
+/// message type of `path`) shows that one of the fields in `path` does
+/// not occur in the encoded message.  Malformed summaries rule nothing
+/// out.
+bool summary_rules_out(const protopath& path, const void *summary,
+                       size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(summary);
+    const uint8_t *const end = p + size;
+
+    while (p < end) {
+        uint64_t depth, bytes;
+
+        if (!varint_read(&p, end, &depth))
+            return false;
+
+        // Does the section's chain of field numbers match the first
+        // `depth` steps of the path?
+        bool match = depth < path.steps.size();
+        for (uint64_t i = 0; i < depth; i++) {
+            uint64_t number;
+
+            if (!varint_read(&p, end, &number))
+                return false;
+            match = match && number ==
+                static_cast<uint64_t>(path.steps[i].field->number());
+        }
+
+        if (!varint_read(&p, end, &bytes) ||
+            bytes > static_cast<uint64_t>(end - p))
+            return false;
+
+        if (match) {
+            const uint32_t number = path.steps[depth].field->number();
+
+            if (number < PRESENCE_MAX_FIELD &&
+                (number / 8 >= bytes || (p[number / 8] & (1 << (number % 8))) == 0))
+                return true;
+        }
+
+        p += bytes;
+    }
+
+    return false;
+}
+
+
+/// Summarises which fields occur in a message, and in some of its
+/// submessages, for `protobuf_has`
+///
+///     UPDATE people_raw SET presence =
+///         protobuf_presence(proto, "Person", "$.address", "$.phones");
+///
+/// @returns a BLOB, or NULL if the message is malformed.
+///
+/// The summary has a section for the top-level fields, followed by one
+/// section for each submessage path argument.  Each section is the
+/// number of steps in the path, the field numbers along the path, and
+/// the size of a bitset, as varints, followed by the bitset itself:
+/// bit `n % 8` of byte `n / 8` is set if field number `n` occurs on the
+/// wire (in any element, for repeated submessages).  Bitsets stop at
+/// the last byte with a bit set, so absent fields cost nothing, and
+/// only cover field numbers below PRESENCE_MAX_FIELD.
+void protobuf_presence(sqlite3_context *context,
+                       int argc,
+                       sqlite3_value **argv)
+{
+    if (argc < 2) {
+        sqlite3_result_error(
+            context,
+            "wrong number of arguments to function protobuf_presence (expected at least 2)",
+            -1);
+        return;
+    }
+
+    const Message *prototype = get_prototype(context, argv[1]);
+    if (!prototype)
+        return;
+
+    const Descriptor *descriptor = prototype->GetDescriptor();
+    const void *data;
+    size_t size;
+    if (!get_message_data(context, argv[0], &data, &size))
+        return;
+
+    std::vector<uint32_t> chain;
+    std::string summary;
+    std::string bits;
+
+    for (int i = 1; i < argc; i++) {
+        chain.clear();
+
+        // The first section is for the top-level fields.
+        if (i > 1) {
+            if (!protopath_has_root(
+                    reinterpret_cast<const char *>(sqlite3_value_text(argv[i])),
+                    static_cast<size_t>(sqlite3_value_bytes(argv[i])))) {
+                sqlite3_result_error(context, "Invalid path", -1);
+                return;
+            }
+
+            const protopath *path = get_protopath(context, i, argv[i],
+                descriptor);
+            if (path->error != nullptr) {
+                sqlite3_result_error(context, path->error, -1);
+                return;
+            }
+
+            for (const protopath_step& step : path->steps) {
+                if (step.field->type() != FieldDescriptor::Type::TYPE_MESSAGE ||
+                    step.has_index) {
+                    sqlite3_result_error(context,
+                        "Presence paths must only go through submessages", -1);
+                    return;
+                }
+
+                chain.push_back(step.field->number());
+            }
+
+            if (chain.empty() || path->tail != protopath_tail::NONE) {
+                sqlite3_result_error(context,
+                    "Presence paths must only go through submessages", -1);
+                return;
+            }
+        }
+
+        bits.clear();
+        if (!wire_field_numbers(data, size, chain, PRESENCE_MAX_FIELD, &bits)) {
+            sqlite3_result_null(context);
+            return;
+        }
+
+        append_varint(&summary, chain.size());
+        for (uint32_t number : chain)
+            append_varint(&summary, number);
+        append_varint(&summary, bits.size());
+        summary += bits;
+    }
+
+    sqlite3_result_blob64(context, summary.data(), summary.size(),
+        SQLITE_TRANSIENT);
+}
+
+
+/// Checks whether a field is set
+///
+///     SELECT protobuf_has(data, "Person", "$.address.zip", presence);
+///
+/// @returns 1 if every field along the path is set (and indexes are in
+///          range), 0 otherwise.  A path that ends with a repeated field,
+///          without an index, checks that it has at least one element.
+///
+/// Like `HasField`, proto3 fields without presence (not `optional`) are
+/// not set when they hold their default value, zero or empty, even if
+/// the encoded message spells it out.
+///
+/// The optional fourth argument is the message's `protobuf_presence`
+/// summary.  When the summary shows that a field along the path does not
+/// occur in the message, we return 0 without looking at the message;
+/// otherwise, we check the message like without a summary.
+void protobuf_has(sqlite3_context *context,
+                  int argc,
+                  sqlite3_value **argv)
+{
+    if (!protopath_has_root(
+            reinterpret_cast<const char *>(sqlite3_value_text(argv[2])),
+            static_cast<size_t>(sqlite3_value_bytes(argv[2])))) {
+        sqlite3_result_error(context, "Invalid path", -1);
+        return;
+    }
+
+    const Message *prototype = get_prototype(context, argv[1]);
+    if (!prototype)
+        return;
+
+    const protopath *path = get_protopath(context, 2, argv[2],
+        prototype->GetDescriptor());
+
+    if (argc > 3 && sqlite3_value_type(argv[3]) == SQLITE_BLOB &&
+        summary_rules_out(*path, sqlite3_value_blob(argv[3]),
+            static_cast<size_t>(sqlite3_value_bytes(argv[3])))) {
+        count_stat(stat::HAS_SUMMARY_HITS);
+        sqlite3_result_int(context, 0);
+        return;
+    }
+
+    // Fast path: look for scalar fields directly in the encoded message
+    if (path->wire_supported) {
+        const void *data;
+        size_t size;
+        wire_value value;
+
+        if (!get_message_data(context, argv[0], &data, &size))
+            return;
+
+        switch (wire_extract(*path, data, size, &value)) {
+        case wire_status::FOUND:
+            sqlite3_result_int(context, 1);
+            return;
+        case wire_status::MISSING:
+        case wire_status::OUT_OF_RANGE:
+            sqlite3_result_int(context, 0);
+            return;
+        case wire_status::FALLBACK:
+            break;
+        }
+    }
+
+    const Message *message = parse_message(context, argv[0], argv[1]);
+    if (!message)
+        return;
+
+    for (size_t i = 0; i < path->steps.size(); i++) {
+        const protopath_step& step = path->steps[i];
+        const FieldDescriptor *const field = step.field;
+        const Reflection *reflection = message->GetReflection();
+        int index = 0;
+
+        if (!field->is_repeated()) {
+            if (!reflection->HasField(*message, field)) {
+                sqlite3_result_int(context, 0);
+                return;
+            }
+        } else if (!step.has_index) {
+            if (path->has_remainder(i)) {
+                sqlite3_result_error(context,
+                    "Expected index into repeated field", -1);
+                return;
+            }
+
+            sqlite3_result_int(context,
+                reflection->FieldSize(*message, field) > 0);
+            return;
+        } else if (!normalize_index(step.index,
+                       reflection->FieldSize(*message, field), &index)) {
+            sqlite3_result_int(context, 0);
+            return;
+        }
+
+        if (field->cpp_type() != FieldDescriptor::CppType::CPPTYPE_MESSAGE)
+            break;
+
+        if (i + 1 < path->steps.size()) {
+            message = field->is_repeated()
+                ? &reflection->GetRepeatedMessage(*message, field, index)
+                : &reflection->GetMessage(*message, field);
+        }
+    }
+
+    // The path went bad after the last field we found
+    if (path->error != nullptr) {
+        sqlite3_result_error(context, path->error, -1);
+        return;
+    }
+
+    if (path->tail == protopath_tail::INVALID) {
+        sqlite3_result_error(context, "Path traverses non-message elements",
+            -1);
+        return;
+    }
+
+    sqlite3_result_int(context, 1);
+}
+
+}  // namespace
+
+int
+register_protobuf_presence(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    int rc = sqlite3_create_function(db, "protobuf_presence", -1,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, protobuf_presence, 0, 0);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    for (int argc = 3; argc <= 4; argc++) {
+        rc = sqlite3_create_function(db, "protobuf_has", argc,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, protobuf_has, 0, 0);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+}  // namespace sqlite_protobuf
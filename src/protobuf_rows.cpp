@@ -0,0 +1,351 @@
+#include "protobuf_rows.h"
+
+#include <strings.h>
+
+#include <new>
+#include <string>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3ext.h"
+
+#include "protobuf_stats.h"
+#include "utilities.h"
+#include "varint.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+using google::protobuf::Message;
+
+
+/// Splits a stream of length-delimited messages (each message prefixed with
+/// its size as a varint, as written by `writeDelimitedTo` or
+/// `SerializeDelimitedToOstream`) into one row per message:
+///
+///     INSERT INTO people_raw(proto)
+///         SELECT message FROM protobuf_rows(:batch, "Person");
+///
+/// Each row has the index of the message in `key`, the offset and size of the
+/// encoded message (after its length prefix) in the stream in `offset` and
+/// `length`, and the encoded message itself in `message`.  Messages are not
+/// parsed, only checked for their type to exist.
+///
+/// The cursor copies the current stream once, reusing its buffer across
+/// calls, so memory use is bounded by the largest stream rather than the sum
+/// over a statement.
+
+
+// The column indexes, corresponding to the order of the columns in the CREATE
+// TABLE statement in xConnect
+enum {
+    COLUMN_KEY,
+    COLUMN_OFFSET,
+    COLUMN_LENGTH,
+    COLUMN_MESSAGE,
+    COLUMN_DATA,
+    COLUMN_TYPE,
+};
+
+
+#define MODULE_FUNC(func) protobuf_rows ## _ ## func
+
+
+// rows_cursor is a subclass of sqlite3_vtab_cursor which walks a copy of the
+// delimited stream, one length prefix at a time.
+typedef struct rows_cursor rows_cursor;
+struct rows_cursor {
+    sqlite3_vtab_cursor base;
+
+    // Message type from the last call to xFilter, and whether it exists.
+    std::string message_name;
+    const Message *prototype;
+
+    // Copy of the stream passed to the last xFilter.  SQLite may hold on to
+    // column values (e.g., for min() or max()) after we move to the next
+    // stream, so columns that point into it are SQLITE_TRANSIENT.
+    std::string stream;
+
+    // Index, offset and length of the current message, and offset of the
+    // length prefix of the next one.
+    sqlite3_int64 index;
+    size_t offset;
+    size_t length;
+    size_t next;
+    bool eof;
+};
+
+
+/// Connect to the eponymous virtual table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = sqlite3_declare_vtab(db,
+        "CREATE TABLE tbl("
+        "    key INTEGER,"
+        "    offset INTEGER,"
+        "    length INTEGER,"
+        "    message BLOB,"
+        "    data BLOB HIDDEN,"
+        "    type TEXT HIDDEN"
+        ")");
+    if (err != SQLITE_OK) return err;
+
+    *ppVtab = (sqlite3_vtab *)sqlite3_malloc(sizeof(**ppVtab));
+    if (!*ppVtab) return SQLITE_NOMEM;
+    bzero(*ppVtab, sizeof(**ppVtab));
+
+    return SQLITE_OK;
+}
+
+
+/// Undoes xOpen
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor rows_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    rows_cursor *cursor = new (std::nothrow) rows_cursor();
+    if (!cursor)
+        return SQLITE_NOMEM;
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor rows_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    delete (rows_cursor *)cur;
+    return SQLITE_OK;
+}
+
+
+/// Sets the error message of the cursor's table to `error`
+static int set_error(rows_cursor *cursor, const char *error)
+{
+    cursor->eof = true;
+    sqlite3_free(cursor->base.pVtab->zErrMsg);
+    cursor->base.pVtab->zErrMsg = sqlite3_mprintf("%s", error);
+    return SQLITE_ERROR;
+}
+
+
+/// Reads the length prefix at `cursor->next` and moves the cursor to that
+/// message, or to EOF at the end of the stream.
+static int read_message(rows_cursor *cursor)
+{
+    const std::string& stream = cursor->stream;
+    const uint8_t *begin = reinterpret_cast<const uint8_t *>(stream.data());
+    const uint8_t *end = begin + stream.size();
+    const uint8_t *p = begin + cursor->next;
+    uint64_t length;
+
+    if (p == end) {
+        cursor->eof = true;
+        return SQLITE_OK;
+    }
+
+    if (!varint_read(&p, end, &length) ||
+        length > static_cast<uint64_t>(end - p))
+        return set_error(cursor, "Malformed delimited message stream");
+
+    cursor->offset = static_cast<size_t>(p - begin);
+    cursor->length = static_cast<size_t>(length);
+    cursor->next = cursor->offset + cursor->length;
+    count_stat(stat::ROWS_MESSAGES);
+    return SQLITE_OK;
+}
+
+
+/// Advance to the next message
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    rows_cursor *cursor = (rows_cursor *)cur;
+    cursor->index += 1;
+    return read_message(cursor);
+}
+
+
+/// Returns the current index
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    rows_cursor *cursor = (rows_cursor *)cur;
+    *pRowid = cursor->index;
+    return SQLITE_OK;
+}
+
+
+/// Returns true if the cursor is past the last message
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    rows_cursor *cursor = (rows_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Return the fields in a given cell of the table
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    rows_cursor *cursor = (rows_cursor *)cur;
+    const std::string& stream = cursor->stream;
+
+    switch (i) {
+    case COLUMN_KEY:
+        sqlite3_result_int64(ctx, cursor->index);
+        break;
+    case COLUMN_OFFSET:
+        sqlite3_result_int64(ctx, cursor->offset);
+        break;
+    case COLUMN_LENGTH:
+        sqlite3_result_int64(ctx, cursor->length);
+        break;
+    case COLUMN_MESSAGE:
+        sqlite3_result_blob64(ctx, stream.data() + cursor->offset,
+            cursor->length, SQLITE_TRANSIENT);
+        break;
+    case COLUMN_DATA:
+        sqlite3_result_blob64(ctx, stream.data(), stream.size(),
+            SQLITE_TRANSIENT);
+        break;
+    case COLUMN_TYPE:
+        sqlite3_result_text(ctx, cursor->message_name.c_str(),
+            cursor->message_name.size(), SQLITE_TRANSIENT);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+
+///
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    // Loop over the constraints to find the ones that pin the function
+    // arguments
+    int dataEqConstraintIdx = -1;
+    int typeEqConstraintIdx = -1;
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for(int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        switch(constraint->iColumn) {
+        case COLUMN_DATA:
+            dataEqConstraintIdx = i;
+            break;
+        case COLUMN_TYPE:
+            typeEqConstraintIdx = i;
+            break;
+        }
+    }
+
+    // If we did not get all the function arguments, we cannot continue
+    if (dataEqConstraintIdx == -1 || typeEqConstraintIdx == -1) {
+        return SQLITE_CONSTRAINT;
+    }
+
+    // Copy the values of our constraints into the arguments that will be
+    // passed to MODULE_FUNC(xFilter).
+    //     argv[0] = stream
+    //     argv[1] = message type name
+    int argIdx = 1;
+    for (int constraintIdx : { dataEqConstraintIdx, typeEqConstraintIdx }) {
+        pIdxInfo->aConstraintUsage[constraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[constraintIdx].omit = 1;
+    }
+
+    pIdxInfo->estimatedCost = 1000;
+
+    // Messages come out in stream order
+    if (pIdxInfo->nOrderBy == 1 &&
+        pIdxInfo->aOrderBy[0].iColumn == COLUMN_KEY &&
+        !pIdxInfo->aOrderBy[0].desc) {
+        pIdxInfo->orderByConsumed = 1;
+    }
+
+    return SQLITE_OK;
+}
+
+
+/// Copy the stream and position the cursor on its first message.
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    rows_cursor *cursor = (rows_cursor *)pVtabCursor;
+    cursor->index = 0;
+    cursor->offset = 0;
+    cursor->length = 0;
+    cursor->next = 0;
+    cursor->eof = true;
+
+    // Check that the message type exists, once per type
+    const std::string message_name = string_from_sqlite3_value(argv[1]);
+    if (!cursor->prototype || cursor->message_name != message_name) {
+        cursor->message_name = message_name;
+        cursor->prototype = find_prototype(cursor->message_name);
+        if (!cursor->prototype)
+            return set_error(cursor, "Could not find message descriptor");
+    }
+
+    // The argument may not outlive this call, so we walk a copy that the
+    // cursor owns, in place of the previous stream.
+    const void *data = sqlite3_value_blob(argv[0]);
+    cursor->stream.assign(static_cast<const char *>(data ? data : ""),
+        static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+
+    cursor->eof = false;
+    return read_message(cursor);
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  0,                         /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+}  // namespace
+
+int
+register_protobuf_rows(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    return sqlite3_create_module(db, "protobuf_rows", &module, 0);
+}
+
+}  // namespace sqlite_protobuf
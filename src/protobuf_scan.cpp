@@ -0,0 +1,782 @@
+#include "protobuf_scan.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include "sqlite3ext.h"
+
+#include "field_value.h"
+#include "protobuf_compress.h"
+#include "protobuf_stats.h"
+#include "protopath.h"
+#include "utilities.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+using google::protobuf::Message;
+
+
+/// Scans a raw table of encoded messages, with one column per protopath,
+/// and evaluates comparisons on these columns as it reads each row:
+///
+///     CREATE VIRTUAL TABLE people_scan USING protobuf_scan(
+///         people_raw, 'Person', name '$.name', age '$.age');
+///
+///     SELECT id, name FROM people_scan WHERE age >= 18 AND age < 30;
+///
+/// The raw table must have an `id` and a `proto` column, like the ones
+/// created by proto_table.  Each row has the raw table's `id` and `proto`,
+/// followed by the declared columns, with the same values as
+/// `protobuf_extract(proto, type, path)`.
+///
+/// A view over `protobuf_extract` calls evaluates its WHERE clause after
+/// extracting the columns it needs, one function call (and potentially one
+/// parse) at a time.  Here, xBestIndex accepts the equality and range
+/// constraints on the declared columns, and xFilter evaluates them directly
+/// on the encoded messages, stopping at the first one that fails, so rows
+/// that don't match are skipped without materialising any column; columns
+/// are only computed when SQLite reads them, at most once per row.
+/// Constraints on `id` become part of the query on the raw table.
+///
+/// Only comparisons with numbers are evaluated during the scan.  They err on
+/// the side of letting rows through (e.g., for text values that an affinity
+/// conversion could turn into numbers), and SQLite still checks every
+/// constraint on the rows we return.
+
+
+// The fixed columns, followed by the declared columns
+enum {
+    COLUMN_ID,
+    COLUMN_PROTO,
+    COLUMN_FIRST_FIELD,
+};
+
+
+#define MODULE_FUNC(func) protobuf_scan ## _ ## func
+
+
+// A column declared as `name 'path'`.
+struct scan_column {
+    std::string name;
+    std::string path_text;
+};
+
+
+// scan_vtab is a subclass of sqlite3_vtab with the arguments of the CREATE
+// VIRTUAL TABLE statement.
+typedef struct scan_vtab scan_vtab;
+struct scan_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+
+    std::string schema;
+    std::string raw_table;
+    std::string message_name;
+    std::vector<scan_column> columns;
+};
+
+
+// A constraint that xFilter evaluates on each row.
+struct scan_predicate {
+    // Index of the column in `scan_vtab::columns`.
+    size_t column;
+    // SQLITE_INDEX_CONSTRAINT_{EQ,GT,LE,LT,GE}
+    unsigned char op;
+    // Right-hand side: SQLITE_INTEGER or SQLITE_FLOAT.
+    int type;
+    sqlite3_int64 integer;
+    double real;
+};
+
+
+// scan_cursor is a subclass of sqlite3_vtab_cursor which steps through a
+// query on the raw table, and skips the rows that fail its predicates.
+typedef struct scan_cursor scan_cursor;
+struct scan_cursor {
+    sqlite3_vtab_cursor base;
+
+    // The query on the raw table, and the idxStr it was prepared for.
+    sqlite3_stmt *stmt;
+    std::string stmt_idx;
+
+    // The message type when we compiled `paths`, one per declared column.
+    const Message *prototype;
+    std::vector<protopath> paths;
+
+    std::vector<scan_predicate> predicates;
+
+    // Value of each declared column for the current row, if
+    // `value_rows[i] == row`.
+    std::vector<field_value> values;
+    std::vector<uint64_t> value_rows;
+    std::vector<std::string> scratch;
+    uint64_t row;
+
+    // The current row's message, if `message_row == row`, for paths that
+    // can't be evaluated on the encoded message.
+    std::unique_ptr<Message> message;
+    uint64_t message_row;
+
+    bool eof;
+};
+
+
+/// Returns the identifier or quoted string at `*p`, without quotes, and
+/// advances `*p` past it and any whitespace that follows.
+std::string next_token(const char **p)
+{
+    const char *cur = *p;
+    std::string ret;
+    char close = '\0';
+
+    while (isspace(static_cast<unsigned char>(*cur)))
+        cur++;
+
+    switch (*cur) {
+    case '\'':
+    case '"':
+    case '`':
+        close = *cur;
+        break;
+    case '[':
+        close = ']';
+        break;
+    }
+
+    if (close != '\0') {
+        for (cur++; *cur != '\0'; cur++) {
+            if (*cur != close) {
+                ret += *cur;
+                continue;
+            }
+
+            // Quotes are escaped by doubling them
+            if (close != ']' && cur[1] == close) {
+                ret += close;
+                cur++;
+                continue;
+            }
+
+            cur++;
+            break;
+        }
+    } else {
+        for (; *cur != '\0' && !isspace(static_cast<unsigned char>(*cur)); cur++)
+            ret += *cur;
+    }
+
+    while (isspace(static_cast<unsigned char>(*cur)))
+        cur++;
+
+    *p = cur;
+    return ret;
+}
+
+
+/// Compiles the path of each column in `columns` for `prototype` into
+/// `paths`.  Returns nullptr on success, and an error message allocated
+/// with sqlite3_mprintf on failure.
+char *compile_columns(const Message *prototype,
+                      const std::vector<scan_column>& columns,
+                      std::vector<protopath> *paths)
+{
+    paths->clear();
+    for (const scan_column& column : columns) {
+        paths->push_back(compile_protopath(prototype->GetDescriptor(),
+            column.path_text));
+
+        const char *error = row_path_error(paths->back(), false);
+        if (error != nullptr)
+            return sqlite3_mprintf("%s: %s", error, column.path_text.c_str());
+    }
+
+    return nullptr;
+}
+
+
+/// Creates or connects to a protobuf_scan table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    // argv[0] is the module name, argv[1] the database name and argv[2]
+    // the name of the new table.
+    if (argc < 5) {
+        *pzErr = sqlite3_mprintf(
+            "protobuf_scan expects a raw table and a message type");
+        return SQLITE_ERROR;
+    }
+
+    std::unique_ptr<scan_vtab> vtab(new (std::nothrow) scan_vtab());
+    if (!vtab)
+        return SQLITE_NOMEM;
+
+    const char *arg = argv[3];
+    vtab->db = db;
+    vtab->schema = argv[1];
+    vtab->raw_table = next_token(&arg);
+    arg = argv[4];
+    vtab->message_name = next_token(&arg);
+
+    std::string schema = "CREATE TABLE tbl(id INTEGER, proto BLOB";
+    for (int i = 5; i < argc; i++) {
+        scan_column column;
+
+        arg = argv[i];
+        column.name = next_token(&arg);
+        column.path_text = next_token(&arg);
+        if (column.name.empty() || column.path_text.empty() || *arg != '\0') {
+            *pzErr = sqlite3_mprintf(
+                "Expected a column name and a protopath: %s", argv[i]);
+            return SQLITE_ERROR;
+        }
+
+        if (!protopath_has_root(column.path_text.data(),
+                column.path_text.size())) {
+            *pzErr = sqlite3_mprintf("Invalid path: %s",
+                column.path_text.c_str());
+            return SQLITE_ERROR;
+        }
+
+        bool duplicate = strcasecmp(column.name.c_str(), "id") == 0 ||
+            strcasecmp(column.name.c_str(), "proto") == 0;
+        for (const scan_column& other : vtab->columns)
+            duplicate |= strcasecmp(column.name.c_str(), other.name.c_str()) == 0;
+        if (duplicate) {
+            *pzErr = sqlite3_mprintf("Duplicate column name: %s",
+                column.name.c_str());
+            return SQLITE_ERROR;
+        }
+
+        char *declaration = sqlite3_mprintf(", \"%w\"", column.name.c_str());
+        if (!declaration)
+            return SQLITE_NOMEM;
+        schema += declaration;
+        sqlite3_free(declaration);
+
+        vtab->columns.push_back(std::move(column));
+    }
+    schema += ")";
+
+    // Check the paths now if we can, but the message type may only be
+    // loaded after the database is opened.
+    const Message *prototype = find_prototype(vtab->message_name);
+    if (prototype) {
+        std::vector<protopath> paths;
+        *pzErr = compile_columns(prototype, vtab->columns, &paths);
+        if (*pzErr != nullptr)
+            return SQLITE_ERROR;
+    }
+
+    int err = sqlite3_declare_vtab(db, schema.c_str());
+    if (err != SQLITE_OK) return err;
+
+    *ppVtab = &vtab.release()->base;
+    return SQLITE_OK;
+}
+
+
+/// Undoes xConnect
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    delete (scan_vtab *)pVtab;
+    return SQLITE_OK;
+}
+
+
+/// Constructor scan_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    scan_cursor *cursor = new (std::nothrow) scan_cursor();
+    if (!cursor)
+        return SQLITE_NOMEM;
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor scan_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    scan_cursor *cursor = (scan_cursor *)cur;
+    sqlite3_finalize(cursor->stmt);
+    delete cursor;
+    return SQLITE_OK;
+}
+
+
+/// Sets the error message of the cursor's table to `error`
+static int set_error(scan_cursor *cursor, const char *error)
+{
+    cursor->eof = true;
+    sqlite3_free(cursor->base.pVtab->zErrMsg);
+    cursor->base.pVtab->zErrMsg = sqlite3_mprintf("%s", error);
+    return SQLITE_ERROR;
+}
+
+
+/// Sets `*out` to the value of declared column `i` for the current row,
+/// and only evaluates its path once per row.  Returns an error message on
+/// failure, and nullptr on success.
+static const char *get_value(scan_cursor *cursor, size_t i,
+                             const field_value **out)
+{
+    field_value *value = &cursor->values[i];
+    *out = value;
+    if (cursor->value_rows[i] == cursor->row)
+        return nullptr;
+
+    const protopath& path = cursor->paths[i];
+    const void *data = sqlite3_column_blob(cursor->stmt, COLUMN_PROTO);
+    size_t size = static_cast<size_t>(
+        sqlite3_column_bytes(cursor->stmt, COLUMN_PROTO));
+    const char *error = decompress_message(sqlite3_db_handle(cursor->stmt),
+        &data, &size);
+    if (error != nullptr)
+        return error;
+
+    if (!wire_field_value(path, data, size, value, &error)) {
+        if (cursor->message_row != cursor->row) {
+            bool parsed;
+
+            cursor->message->Clear();
+            {
+                stat_timer timer(stat::PARSE_NS);
+                parsed = cursor->message->ParseFromArray(data,
+                    static_cast<int>(size));
+            }
+
+            count_stat(stat::BYTES_PARSED, size);
+            if (!parsed) {
+                count_stat(stat::PARSE_FAILURES);
+                return "Failed to parse message";
+            }
+
+            cursor->message_row = cursor->row;
+        }
+
+        error = message_field_value(path, *cursor->message,
+            &cursor->scratch[i], value);
+    }
+
+    if (error == nullptr)
+        cursor->value_rows[i] = cursor->row;
+    return error;
+}
+
+
+/// Returns the sign of `x - y`, like SQLite's comparison of an integer
+/// with a float.
+static int compare_integer_real(sqlite3_int64 x, double y)
+{
+    if (y < -9223372036854775808.0) return 1;
+    if (y >= 9223372036854775808.0) return -1;
+
+    sqlite3_int64 truncated = static_cast<sqlite3_int64>(y);
+    if (x != truncated) return (x < truncated) ? -1 : 1;
+
+    double widened = static_cast<double>(x);
+    if (widened != y) return (widened < y) ? -1 : 1;
+    return 0;
+}
+
+
+/// Returns true if `op` holds for a comparison result of `cmp`.
+static bool test_comparison(unsigned char op, int cmp)
+{
+    switch (op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ: return cmp == 0;
+    case SQLITE_INDEX_CONSTRAINT_GT: return cmp > 0;
+    case SQLITE_INDEX_CONSTRAINT_LE: return cmp <= 0;
+    case SQLITE_INDEX_CONSTRAINT_LT: return cmp < 0;
+    case SQLITE_INDEX_CONSTRAINT_GE: return cmp >= 0;
+    }
+
+    return true;
+}
+
+
+/// Returns false if `value` definitely fails `predicate`.
+static bool may_match(const field_value& value, const scan_predicate& predicate)
+{
+    const unsigned char op = predicate.op;
+
+    switch (value.type) {
+    case SQLITE_INTEGER:
+        if (predicate.type == SQLITE_INTEGER) {
+            return test_comparison(op, (value.integer > predicate.integer) -
+                (value.integer < predicate.integer));
+        }
+
+        // Older versions of SQLite compare integers and floats as
+        // doubles: accept the row if either comparison matches.
+        return test_comparison(op,
+                compare_integer_real(value.integer, predicate.real)) ||
+            test_comparison(op,
+                (static_cast<double>(value.integer) > predicate.real) -
+                (static_cast<double>(value.integer) < predicate.real));
+    case SQLITE_FLOAT:
+        // SQLite turns NaNs into NULLs
+        if (isnan(value.real))
+            return false;
+
+        if (predicate.type == SQLITE_INTEGER) {
+            return test_comparison(op,
+                    -compare_integer_real(predicate.integer, value.real)) ||
+                test_comparison(op,
+                    (value.real > static_cast<double>(predicate.integer)) -
+                    (value.real < static_cast<double>(predicate.integer)));
+        }
+
+        return test_comparison(op, (value.real > predicate.real) -
+            (value.real < predicate.real));
+    case SQLITE_TEXT:
+        // The other side's affinity may turn the text into a number.
+        return true;
+    case SQLITE_BLOB:
+        // Blobs sort after all numbers.
+        return test_comparison(op, 1);
+    default:
+        // Comparisons with NULL are never true.
+        return false;
+    }
+}
+
+
+/// Steps the raw table query to the next row that may satisfy all the
+/// predicates, or to EOF.
+static int find_row(scan_cursor *cursor)
+{
+    for (;;) {
+        int rc = sqlite3_step(cursor->stmt);
+        if (rc == SQLITE_DONE) {
+            cursor->eof = true;
+            return SQLITE_OK;
+        }
+
+        if (rc != SQLITE_ROW) {
+            scan_vtab *vtab = (scan_vtab *)cursor->base.pVtab;
+            return set_error(cursor, sqlite3_errmsg(vtab->db));
+        }
+
+        cursor->row++;
+        count_stat(stat::SCAN_ROWS);
+
+        bool match = true;
+        for (const scan_predicate& predicate : cursor->predicates) {
+            const field_value *value;
+            const char *error = get_value(cursor, predicate.column, &value);
+            if (error != nullptr)
+                return set_error(cursor, error);
+
+            if (!may_match(*value, predicate)) {
+                match = false;
+                break;
+            }
+        }
+
+        if (match)
+            return SQLITE_OK;
+        count_stat(stat::SCAN_ROWS_SKIPPED);
+    }
+}
+
+
+/// Advance to the next matching row
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    return find_row((scan_cursor *)cur);
+}
+
+
+/// Returns the raw table's id for the current row
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    scan_cursor *cursor = (scan_cursor *)cur;
+    *pRowid = sqlite3_column_int64(cursor->stmt, COLUMN_ID);
+    return SQLITE_OK;
+}
+
+
+/// Returns true if the cursor is past the last row
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    scan_cursor *cursor = (scan_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Return the fields in a given cell of the table
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    scan_cursor *cursor = (scan_cursor *)cur;
+
+    if (i == COLUMN_ID || i == COLUMN_PROTO) {
+        sqlite3_value *stored = sqlite3_column_value(cursor->stmt, i);
+        const void *data = sqlite3_value_blob(stored);
+        size_t size = static_cast<size_t>(sqlite3_value_bytes(stored));
+
+        // Like the view, hide compression.
+        if (i == COLUMN_PROTO && is_compressed_message(data, size)) {
+            if (get_message_data(ctx, stored, &data, &size))
+                sqlite3_result_blob64(ctx, data, size, SQLITE_TRANSIENT);
+            return SQLITE_OK;
+        }
+
+        sqlite3_result_value(ctx, stored);
+        return SQLITE_OK;
+    }
+
+    const field_value *value;
+    const char *error = get_value(cursor, i - COLUMN_FIRST_FIELD, &value);
+    if (error != nullptr) {
+        sqlite3_result_error(ctx, error, -1);
+        return SQLITE_OK;
+    }
+
+    result_field_value(ctx, *value);
+    return SQLITE_OK;
+}
+
+
+/// Picks the constraints that xFilter evaluates.  idxStr lists them, in
+/// argv order, as "column:op;" entries, and idxNum is 1 for a descending
+/// scan.
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    std::string constraints;
+    double cost = 1000000;
+    double rows = 1000000;
+    int argIdx = 1;
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for(int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+        if (constraint->iColumn != COLUMN_ID &&
+            constraint->iColumn < COLUMN_FIRST_FIELD) continue;
+
+        switch (constraint->op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+        case SQLITE_INDEX_CONSTRAINT_GT:
+        case SQLITE_INDEX_CONSTRAINT_LE:
+        case SQLITE_INDEX_CONSTRAINT_LT:
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            break;
+        default:
+            continue;
+        }
+
+        // SQLite checks the constraints again: we may let rows through.
+        pIdxInfo->aConstraintUsage[i].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[i].omit = 0;
+        constraints += std::to_string(constraint->iColumn) + ":" +
+            std::to_string(constraint->op) + ";";
+
+        // Constraints on `id` use the raw table's primary key; the others
+        // still read every row, but skip the work of returning the rows
+        // that fail.
+        if (constraint->iColumn == COLUMN_ID) {
+            bool eq = constraint->op == SQLITE_INDEX_CONSTRAINT_EQ;
+            cost /= eq ? 100000 : 4;
+            rows /= eq ? 1000000 : 4;
+        } else {
+            cost *= 0.9;
+            rows /= (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) ? 10 : 4;
+        }
+    }
+
+    if (!constraints.empty()) {
+        pIdxInfo->idxStr = sqlite3_mprintf("%s", constraints.c_str());
+        if (!pIdxInfo->idxStr)
+            return SQLITE_NOMEM;
+        pIdxInfo->needToFreeIdxStr = 1;
+    }
+
+    // Rows come out in id order, in either direction
+    if (pIdxInfo->nOrderBy == 1 &&
+        (pIdxInfo->aOrderBy[0].iColumn == COLUMN_ID ||
+         pIdxInfo->aOrderBy[0].iColumn == -1)) {
+        pIdxInfo->idxNum = pIdxInfo->aOrderBy[0].desc ? 1 : 0;
+        pIdxInfo->orderByConsumed = 1;
+    }
+
+    pIdxInfo->estimatedCost = cost;
+    pIdxInfo->estimatedRows = rows < 1 ? 1 : static_cast<sqlite3_int64>(rows);
+    return SQLITE_OK;
+}
+
+
+/// Prepares the query on the raw table and positions the cursor on the
+/// first row that may match.
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    scan_cursor *cursor = (scan_cursor *)pVtabCursor;
+    scan_vtab *vtab = (scan_vtab *)cursor->base.pVtab;
+    cursor->eof = true;
+
+    // Compile the paths once per message type
+    const Message *prototype = find_prototype(vtab->message_name);
+    if (!prototype)
+        return set_error(cursor, "Could not find message descriptor");
+    if (prototype != cursor->prototype) {
+        char *error = compile_columns(prototype, vtab->columns,
+            &cursor->paths);
+        if (error != nullptr) {
+            cursor->prototype = nullptr;
+            cursor->eof = true;
+            sqlite3_free(vtab->base.zErrMsg);
+            vtab->base.zErrMsg = error;
+            return SQLITE_ERROR;
+        }
+
+        cursor->message.reset(prototype->New());
+        if (!cursor->message)
+            return SQLITE_NOMEM;
+
+        size_t num_columns = vtab->columns.size();
+        cursor->values.assign(num_columns, field_value());
+        cursor->value_rows.assign(num_columns, 0);
+        cursor->scratch.assign(num_columns, std::string());
+        cursor->prototype = prototype;
+    }
+
+    // Split the constraints between the query and the predicates
+    std::string where;
+    std::vector<sqlite3_value *> id_values;
+    bool none = false;
+    int argi = 0;
+    cursor->predicates.clear();
+    for (const char *p = idxStr ? idxStr : ""; *p != '\0' && argi < argc; ) {
+        char *end;
+        int column = static_cast<int>(strtol(p, &end, 10));
+        unsigned char op = static_cast<unsigned char>(strtol(end + 1, &end, 10));
+        sqlite3_value *arg = argv[argi++];
+        p = end + 1;
+
+        if (column == COLUMN_ID) {
+            const char *sql_op = "=";
+            switch (op) {
+            case SQLITE_INDEX_CONSTRAINT_GT: sql_op = ">"; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: sql_op = "<="; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: sql_op = "<"; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: sql_op = ">="; break;
+            }
+
+            where += where.empty() ? " WHERE " : " AND ";
+            where += std::string("id ") + sql_op + " ?";
+            id_values.push_back(arg);
+            continue;
+        }
+
+        // Don't filter on text or blobs: we'd need the collation and the
+        // affinity that SQLite uses to compare them.  Nothing compares
+        // true to NULL, though.
+        int type = sqlite3_value_type(arg);
+        none |= type == SQLITE_NULL;
+        if (type != SQLITE_INTEGER && type != SQLITE_FLOAT)
+            continue;
+
+        scan_predicate predicate;
+        predicate.column = static_cast<size_t>(column - COLUMN_FIRST_FIELD);
+        predicate.op = op;
+        predicate.type = type;
+        predicate.integer = sqlite3_value_int64(arg);
+        predicate.real = sqlite3_value_double(arg);
+        cursor->predicates.push_back(predicate);
+    }
+
+    if (none)
+        return SQLITE_OK;
+
+    // Reuse the query on the raw table across calls with the same plan.
+    std::string stmt_idx = std::to_string(idxNum) + where;
+    if (cursor->stmt && cursor->stmt_idx == stmt_idx) {
+        sqlite3_reset(cursor->stmt);
+        sqlite3_clear_bindings(cursor->stmt);
+    } else {
+        sqlite3_finalize(cursor->stmt);
+        cursor->stmt = nullptr;
+        cursor->stmt_idx.clear();
+
+        char *sql = sqlite3_mprintf(
+            "SELECT id, proto FROM \"%w\".\"%w\"%s ORDER BY id%s",
+            vtab->schema.c_str(), vtab->raw_table.c_str(), where.c_str(),
+            (idxNum & 1) ? " DESC" : "");
+        if (!sql)
+            return SQLITE_NOMEM;
+
+        int rc = sqlite3_prepare_v2(vtab->db, sql, -1, &cursor->stmt, nullptr);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return set_error(cursor, sqlite3_errmsg(vtab->db));
+        cursor->stmt_idx = stmt_idx;
+    }
+
+    for (size_t i = 0; i < id_values.size(); i++) {
+        int rc = sqlite3_bind_value(cursor->stmt, static_cast<int>(i + 1),
+            id_values[i]);
+        if (rc != SQLITE_OK)
+            return set_error(cursor, sqlite3_errmsg(vtab->db));
+    }
+
+    cursor->eof = false;
+    return find_row(cursor);
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  MODULE_FUNC(xConnect),     /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  MODULE_FUNC(xDisconnect),  /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+}  // namespace
+
+int
+register_protobuf_scan(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    return sqlite3_create_module(db, "protobuf_scan", &module, 0);
+}
+
+}  // namespace sqlite_protobuf
@@ -0,0 +1,345 @@
+#include "protobuf_stats.h"
+
+#include <strings.h>
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "sqlite3ext.h"
+
+#include "protobuf_config.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+namespace {
+
+const size_t NUM_STATS = static_cast<size_t>(stat::COUNT);
+
+// Indexed by `stat`.
+const char *const stat_names[] = {
+    "extract_calls",
+    "extract_wire_hits",
+    "extract_accessor_hits",
+    "fields_rows",
+    "each_calls",
+    "rows_messages",
+    "scan_rows",
+    "scan_rows_skipped",
+    "has_summary_hits",
+    "to_json_calls",
+    "of_json_calls",
+    "to_text_calls",
+    "of_text_calls",
+    "prototype_cache_misses",
+    "message_cache_hits",
+    "message_cache_misses",
+    "message_reallocations",
+    "arena_reallocations",
+    "parse_failures",
+    "bytes_parsed",
+    "bytes_serialized",
+    "bytes_compressed",
+    "bytes_decompressed",
+    "parse_ns",
+    "reflection_ns",
+    "serialize_ns",
+    "decompress_ns",
+};
+
+static_assert(sizeof(stat_names) / sizeof(stat_names[0]) == NUM_STATS,
+              "stat_names must have one entry per stat");
+
+/*
+ * Every `thread_stats` registers itself here, so we can sum the
+ * counters of all live threads.  Exiting threads add their counters
+ * to `retired`.  Resetting only updates `baseline`, since we can't
+ * write to other threads' counters.
+ */
+struct stats_registry {
+    std::mutex lock;
+    std::vector<thread_stats *> threads;
+    uint64_t retired[NUM_STATS];
+    uint64_t baseline[NUM_STATS];
+};
+
+stats_registry *get_registry()
+{
+    // Never destroyed: the main thread's `thread_stats` may be
+    // destroyed after static objects at exit.
+    static stats_registry *registry = new stats_registry();
+    return registry;
+}
+
+/// Stores the sum of the counters across all threads, since the last reset,
+/// in `out`.  The caller must hold the registry lock.
+void sum_stats(stats_registry *registry, uint64_t out[NUM_STATS])
+{
+    for (size_t i = 0; i < NUM_STATS; i++) {
+        out[i] = registry->retired[i] - registry->baseline[i];
+    }
+
+    for (const thread_stats *stats : registry->threads) {
+        for (size_t i = 0; i < NUM_STATS; i++) {
+            out[i] += stats->values[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// The column indexes, corresponding to the order of the columns in the CREATE
+// TABLE statement in xConnect
+enum {
+    COLUMN_NAME,
+    COLUMN_VALUE,
+};
+
+
+#define MODULE_FUNC(func) protobuf_stats ## _ ## func
+
+
+// stats_cursor is a subclass of sqlite3_vtab_cursor which holds a snapshot
+// of the counters, taken by xFilter
+typedef struct stats_cursor stats_cursor;
+struct stats_cursor {
+    sqlite3_vtab_cursor base;
+    uint64_t values[NUM_STATS];
+    sqlite3_int64 index;
+};
+
+
+/// Connect to the eponymous virtual table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = sqlite3_declare_vtab(db,
+        "CREATE TABLE tbl("
+        "    name TEXT,"
+        "    value INTEGER"
+        ")");
+    if (err != SQLITE_OK) return err;
+
+    *ppVtab = (sqlite3_vtab *)sqlite3_malloc(sizeof(**ppVtab));
+    if (!*ppVtab) return SQLITE_NOMEM;
+    bzero(*ppVtab, sizeof(**ppVtab));
+
+    return SQLITE_OK;
+}
+
+
+/// Undoes xOpen
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor stats_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    stats_cursor *cursor = (stats_cursor *)sqlite3_malloc(sizeof(*cursor));
+    if (!cursor)
+        return SQLITE_NOMEM;
+    bzero(cursor, sizeof(*cursor));
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor stats_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+/// Advance the index to the next counter
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    stats_cursor *cursor = (stats_cursor *)cur;
+    cursor->index += 1;
+    return SQLITE_OK;
+}
+
+
+/// Returns the current index
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    stats_cursor *cursor = (stats_cursor *)cur;
+    *pRowid = cursor->index;
+    return SQLITE_OK;
+}
+
+
+/// Returns true if the cursor is past the last counter
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    stats_cursor *cursor = (stats_cursor *)cur;
+    return cursor->index >= static_cast<sqlite3_int64>(NUM_STATS);
+}
+
+
+/// Return the fields in a given cell of the table
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    stats_cursor *cursor = (stats_cursor *)cur;
+    switch (i) {
+    case COLUMN_NAME:
+        sqlite3_result_text(ctx, stat_names[cursor->index], -1, SQLITE_STATIC);
+        break;
+    case COLUMN_VALUE:
+        sqlite3_result_int64(ctx,
+            static_cast<sqlite3_int64>(cursor->values[cursor->index]));
+        break;
+    }
+    return SQLITE_OK;
+}
+
+
+/// There are few counters, so we always scan all of them
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    pIdxInfo->estimatedCost = NUM_STATS;
+    return SQLITE_OK;
+}
+
+
+/// Snapshot the counters and position the cursor at the first one
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    stats_cursor *cursor = (stats_cursor *)pVtabCursor;
+    stats_registry *registry = get_registry();
+
+    {
+        std::lock_guard<std::mutex> guard(registry->lock);
+        sum_stats(registry, cursor->values);
+    }
+
+    cursor->index = 0;
+    return SQLITE_OK;
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  0,                         /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+/// Resets all the counters in protobuf_stats to zero.
+///
+///     SELECT protobuf_stats_reset();
+///
+/// @returns NULL.
+static void protobuf_stats_reset(sqlite3_context *context,
+                                 int argc,
+                                 sqlite3_value **argv)
+{
+    stats_registry *registry = get_registry();
+    uint64_t values[NUM_STATS];
+
+    std::lock_guard<std::mutex> guard(registry->lock);
+    sum_stats(registry, values);
+    for (size_t i = 0; i < NUM_STATS; i++) {
+        registry->baseline[i] += values[i];
+    }
+
+    sqlite3_result_null(context);
+}
+
+}  // namespace
+
+thread_stats::thread_stats()
+{
+    for (std::atomic<uint64_t>& value : values) {
+        value.store(0, std::memory_order_relaxed);
+    }
+
+    stats_registry *registry = get_registry();
+    std::lock_guard<std::mutex> guard(registry->lock);
+    registry->threads.push_back(this);
+}
+
+thread_stats::~thread_stats()
+{
+    stats_registry *registry = get_registry();
+    std::lock_guard<std::mutex> guard(registry->lock);
+
+    for (size_t i = 0; i < NUM_STATS; i++) {
+        registry->retired[i] += values[i].load(std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < registry->threads.size(); i++) {
+        if (registry->threads[i] == this) {
+            registry->threads[i] = registry->threads.back();
+            registry->threads.pop_back();
+            break;
+        }
+    }
+}
+
+stat_timer::stat_timer(stat counter)
+    : counter_(counter),
+      begin_(get_config(config_setting::STATS_TIMING) ? now_ns() : 0)
+{
+}
+
+stat_timer::~stat_timer()
+{
+    if (begin_ != 0)
+        count_stat(counter_, now_ns() - begin_);
+}
+
+int
+register_protobuf_stats(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi)
+{
+    int rc;
+
+    rc = sqlite3_create_module(db, "protobuf_stats", &module, 0);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    return sqlite3_create_function(db, "protobuf_stats_reset", 0, SQLITE_UTF8,
+        nullptr, protobuf_stats_reset, nullptr, nullptr);
+}
+
+}  // namespace sqlite_protobuf
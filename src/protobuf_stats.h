@@ -0,0 +1,109 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+struct sqlite3;
+struct sqlite3_api_routines;
+
+namespace sqlite_protobuf {
+
+// Profiling counters, summed over all threads and exposed as
+//
+//     SELECT name, value FROM protobuf_stats;
+//
+// and reset with `SELECT protobuf_stats_reset();`.  The counters
+// themselves are always on; the "*_ns" timers are only updated when
+// the "stats_timing" setting is non-zero.
+enum class stat {
+    EXTRACT_CALLS,
+    // protobuf_extract calls answered from the wire format, without
+    // parsing the message.
+    EXTRACT_WIRE_HITS,
+    // protobuf_extract calls answered by a registered accessor.
+    EXTRACT_ACCESSOR_HITS,
+    // One protobuf_fields row is one parse (at most) of one message.
+    FIELDS_ROWS,
+    EACH_CALLS,
+    // Messages split out of delimited streams by protobuf_rows.
+    ROWS_MESSAGES,
+    // Raw table rows read by protobuf_scan, and the ones it skipped
+    // because they failed a pushed-down constraint.
+    SCAN_ROWS,
+    SCAN_ROWS_SKIPPED,
+    // protobuf_has calls answered by a presence summary alone.
+    HAS_SUMMARY_HITS,
+    TO_JSON_CALLS,
+    OF_JSON_CALLS,
+    TO_TEXT_CALLS,
+    OF_TEXT_CALLS,
+
+    PROTOTYPE_CACHE_MISSES,
+    MESSAGE_CACHE_HITS,
+    MESSAGE_CACHE_MISSES,
+    // `new_heap_message` could not reuse the cached message object.
+    MESSAGE_REALLOCATIONS,
+    // `new_arena_message` had to allocate a new initial block.
+    ARENA_REALLOCATIONS,
+
+    PARSE_FAILURES,
+    BYTES_PARSED,
+    BYTES_SERIALIZED,
+    // Input of protobuf_compress, and output of decompression.
+    BYTES_COMPRESSED,
+    BYTES_DECOMPRESSED,
+
+    PARSE_NS,
+    REFLECTION_NS,
+    SERIALIZE_NS,
+    DECOMPRESS_NS,
+
+    COUNT,
+};
+
+// Per-thread counters.  Only the owning thread writes to them, so
+// increments don't need atomic read-modify-writes; the atomics only
+// make concurrent reads by `protobuf_stats` well defined.
+struct thread_stats {
+    thread_stats();
+    ~thread_stats();
+
+    std::atomic<uint64_t> values[static_cast<size_t>(stat::COUNT)];
+};
+
+inline thread_stats *get_thread_stats()
+{
+    static thread_local thread_stats stats;
+    return &stats;
+}
+
+// Adds `n` to the current thread's `counter`.
+inline void count_stat(stat counter, uint64_t n = 1)
+{
+    std::atomic<uint64_t> &value =
+        get_thread_stats()->values[static_cast<size_t>(counter)];
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+// Adds the time between its construction and destruction to a "*_ns"
+// counter, if "stats_timing" is enabled.
+class stat_timer {
+public:
+    explicit stat_timer(stat counter);
+    ~stat_timer();
+
+    stat_timer(const stat_timer&) = delete;
+    stat_timer& operator=(const stat_timer&) = delete;
+
+private:
+    stat counter_;
+    // 0 if timing is disabled.
+    uint64_t begin_;
+};
+
+int register_protobuf_stats(sqlite3 *db, char **pzErrMsg,
+    const sqlite3_api_routines *pApi);
+
+}  // namespace sqlite_protobuf
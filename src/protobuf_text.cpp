@@ -5,10 +5,12 @@
 
 #include <google/protobuf/descriptor_database.h>
 #include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/text_format.h>
 
 #include "sqlite3ext.h"
 
+#include "protobuf_stats.h"
 #include "utilities.h"
 
 namespace sqlite_protobuf {
@@ -18,6 +20,7 @@ namespace {
 
 using google::protobuf::Message;
 using google::protobuf::TextFormat;
+using google::protobuf::io::ArrayInputStream;
 
 
 /// Converts a binary blob of protobuf bytes to text proto.
@@ -31,6 +34,8 @@ protobuf_to_text(sqlite3_context *context, int argc, sqlite3_value **argv)
     sqlite3_value *message_data = argv[0];
     sqlite3_value *message_name = argv[1];
 
+    count_stat(stat::TO_TEXT_CALLS);
+
     auto message = parse_message(context, message_data, message_name);
     if (!message) {
         return;
@@ -54,27 +59,30 @@ protobuf_to_text(sqlite3_context *context, int argc, sqlite3_value **argv)
 void
 protobuf_of_text(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
-    const std::string text_data = string_from_sqlite3_value(argv[0]);
+    sqlite3_value *text_data = argv[0];
     sqlite3_value *message_name = argv[1];
+    static thread_local TextFormat::Parser parser;
+
+    count_stat(stat::OF_TEXT_CALLS);
 
     const Message *prototype = get_prototype(context, message_name);
     if (!prototype) {
         return;
     }
 
-    std::unique_ptr<Message> message(prototype->New());
-    if (!TextFormat::ParseFromString(text_data, message.get())) {
-        sqlite3_result_error(context, "Could not parse text proto", -1);
-        return;
-    }
+    const char *text = static_cast<const char *>(sqlite3_value_blob(text_data));
+    int text_size = sqlite3_value_bytes(text_data);
+    ArrayInputStream input(text, text_size);
 
-    std::string proto;
-    if (!message->SerializeToString(&proto)) {
-        sqlite3_result_error(context, "Could not serialize message", -1);
+    // Parsing clears the message, which we reuse for the next rows.
+    Message *message = get_scratch_message(prototype,
+        static_cast<size_t>(text_size));
+    if (!parser.Parse(&input, message)) {
+        sqlite3_result_error(context, "Could not parse text proto", -1);
         return;
     }
 
-    sqlite3_result_blob(context, proto.c_str(), proto.length(), SQLITE_TRANSIENT);
+    result_serialized_message(context, *message);
     return;
 }
 
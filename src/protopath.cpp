@@ -0,0 +1,180 @@
+#include "protopath.h"
+
+#include <climits>
+#include <cstdlib>
+#include <memory>
+
+#include "sqlite3ext.h"
+
+#include "accessors.h"
+#include "wire_format.h"
+
+namespace sqlite_protobuf {
+SQLITE_EXTENSION_INIT3
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+
+namespace {
+
+/// Parses the optional "[-?[0-9]+]" suffix of a path component
+/// starting at `pos`.  On success, stores the index, advances `pos`
+/// past the closing bracket and returns true.  Leaves `pos` alone on
+/// failure.
+bool parse_index(const std::string& path, size_t *pos, int *index)
+{
+    size_t i = *pos;
+    if (i >= path.size() || path[i] != '[')
+        return false;
+    i++;
+
+    size_t digits_begin = i;
+    if (i < path.size() && path[i] == '-')
+        digits_begin = ++i;
+
+    while (i < path.size() && path[i] >= '0' && path[i] <= '9')
+        i++;
+
+    if (i == digits_begin || i >= path.size() || path[i] != ']')
+        return false;
+
+    // Clamp out-of-range indexes: they will never match an element.
+    long long value = strtoll(path.c_str() + *pos + 1, nullptr, 10);
+    if (value < INT_MIN)
+        value = INT_MIN;
+    if (value > INT_MAX)
+        value = INT_MAX;
+
+    *index = static_cast<int>(value);
+    *pos = i + 1;
+    return true;
+}
+
+void delete_protopath(void *path)
+{
+    delete static_cast<protopath *>(path);
+}
+
+protopath compile_steps(const Descriptor *descriptor, const std::string& path)
+{
+    protopath ret;
+    ret.descriptor = descriptor;
+    ret.tail = protopath_tail::NONE;
+    ret.error = nullptr;
+    ret.wire_supported = false;
+    ret.wire_repeated_supported = false;
+    ret.accessor = nullptr;
+
+    if (!protopath_has_root(path.data(), path.size())) {
+        ret.error = "Invalid path";
+        return ret;
+    }
+
+    size_t pos = 1;  // skip $
+    while (pos < path.size()) {
+        // Each component looks like `.name` or `.name[index]`.
+        if (path[pos] != '.') {
+            ret.error = "Invalid path";
+            return ret;
+        }
+
+        size_t name_begin = ++pos;
+        while (pos < path.size() && path[pos] != '.' && path[pos] != '[')
+            pos++;
+
+        if (pos == name_begin) {
+            ret.error = "Invalid path";
+            return ret;
+        }
+
+        const std::string field_name =
+            path.substr(name_begin, pos - name_begin);
+
+        protopath_step step;
+        step.has_index = parse_index(path, &pos, &step.index);
+        if (!step.has_index)
+            step.index = 0;
+
+        step.field = descriptor->FindFieldByName(field_name);
+        if (!step.field) {
+            ret.error = "Invalid field name";
+            return ret;
+        }
+
+        ret.steps.push_back(step);
+
+        // Submessages may be followed by more components.
+        if (step.field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE) {
+            descriptor = step.field->message_type();
+            continue;
+        }
+
+        // Anything else must be the end of the path, except for the
+        // special .name and .number suffixes of enums.
+        const std::string rest = path.substr(pos);
+        if (rest.empty()) {
+            ret.tail = protopath_tail::NONE;
+        } else if (step.field->type() != FieldDescriptor::Type::TYPE_ENUM) {
+            ret.tail = protopath_tail::INVALID;
+        } else if (rest == ".number") {
+            ret.tail = protopath_tail::NUMBER;
+        } else if (rest == ".name") {
+            ret.tail = protopath_tail::NAME;
+        } else {
+            ret.tail = protopath_tail::INVALID;
+        }
+
+        return ret;
+    }
+
+    return ret;
+}
+
+}  // namespace
+
+bool protopath_has_root(const char *path, size_t size)
+{
+    return path != nullptr && size > 0 && path[0] == '$';
+}
+
+protopath compile_protopath(const Descriptor *descriptor,
+                            const std::string& path)
+{
+    protopath ret = compile_steps(descriptor, path);
+
+    ret.wire_supported = wire_path_supported(ret);
+    ret.wire_repeated_supported = wire_repeated_path_supported(ret);
+    ret.accessor = find_accessor(ret, path);
+    return ret;
+}
+
+const protopath *get_protopath(sqlite3_context *context,
+                               int argno,
+                               sqlite3_value *path,
+                               const Descriptor *descriptor)
+{
+    auto *cached = static_cast<const protopath *>(
+        sqlite3_get_auxdata(context, argno));
+    if (cached != nullptr && cached->descriptor == descriptor)
+        return cached;
+
+    const char *text = reinterpret_cast<const char *>(sqlite3_value_text(path));
+    size_t text_size = static_cast<size_t>(sqlite3_value_bytes(path));
+    const std::string path_string = text ? std::string(text, text_size) : "";
+
+    sqlite3_set_auxdata(context, argno,
+        new protopath(compile_protopath(descriptor, path_string)),
+        delete_protopath);
+
+    cached = static_cast<const protopath *>(sqlite3_get_auxdata(context, argno));
+    if (cached != nullptr)
+        return cached;
+
+    // SQLite may drop the auxdata immediately (e.g., on allocation
+    // failure).  Fall back to a thread-local copy in that case.
+    static thread_local std::unique_ptr<protopath> fallback;
+    fallback.reset(new protopath(compile_protopath(descriptor, path_string)));
+    return fallback.get();
+}
+
+}  // namespace sqlite_protobuf
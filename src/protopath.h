@@ -0,0 +1,102 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+#include "sqlite3.h"
+#include "sqlite_protobuf_accessor.h"
+
+namespace sqlite_protobuf {
+
+// One `.field` or `.field[index]` component of a protopath, resolved
+// against the message type that contains it.
+struct protopath_step {
+    const google::protobuf::FieldDescriptor *field;
+
+    // Whether the component had an `[index]` suffix, and its value.
+    // Negative indexes count from the end of the repeated field.
+    bool has_index;
+    int index;
+};
+
+// What follows the last step of a protopath.
+enum class protopath_tail {
+    // Nothing: the path ends with the last step.
+    NONE,
+    // ".number" after an enum field.
+    NUMBER,
+    // ".name" after an enum field.
+    NAME,
+    // Anything else after a scalar or enum field.
+    INVALID,
+};
+
+// A protopath like "$.phones[0].number", resolved against a root
+// message type.
+//
+// Compilation never fails: if the path goes bad after a few valid
+// components, we keep the valid prefix in `steps` and remember the
+// `error` that must be reported once the walk gets past that prefix.
+// This way, compiled paths return exactly the same results as
+// interpreting the path component by component, e.g., evaluating
+// "$.missing_submessage.typo" still returns a default value.
+struct protopath {
+    // The root message type for `steps`.
+    const google::protobuf::Descriptor *descriptor;
+
+    // Resolved components.  All but the last step are message fields.
+    std::vector<protopath_step> steps;
+
+    // What remains after the last step, if that step is a scalar.
+    protopath_tail tail;
+
+    // Error message to report when a walk reaches the end of
+    // `steps`, or `nullptr` if the path is valid.
+    const char *error;
+
+    // Whether the path can be evaluated on the encoded message,
+    // without parsing it (see `wire_extract`).
+    bool wire_supported;
+
+    // Whether the path ends with a repeated numeric field whose
+    // elements can be collected on the encoded message (see
+    // `wire_extract_repeated`).
+    bool wire_repeated_supported;
+
+    // Accessor registered for the generated class of `descriptor`, or
+    // nullptr (see `sqlite_protobuf_accessor.h`).
+    accessor_fn *accessor;
+
+    // True if the path is the root object, "$".
+    bool is_root() const { return steps.empty() && error == nullptr; }
+
+    // True if anything follows the `i`th step in the path text.
+    bool has_remainder(size_t i) const {
+        return i + 1 < steps.size() || tail != protopath_tail::NONE ||
+            error != nullptr;
+    }
+};
+
+// Returns true if `path` can be a valid protopath, i.e., starts with
+// the root "$".  Paths that fail this check are rejected before even
+// parsing the message.
+bool protopath_has_root(const char *path, size_t size);
+
+// Compiles the protopath `path` for messages of type `descriptor`.
+protopath compile_protopath(const google::protobuf::Descriptor *descriptor,
+                            const std::string& path);
+
+// Returns the compiled protopath for function argument `argno` of
+// `context`, for messages of type `descriptor`.
+//
+// Compiled paths are attached to the argument with
+// `sqlite3_set_auxdata`, so a literal protopath is only compiled once
+// per statement.  The returned path is only valid until the function
+// returns.
+const protopath *get_protopath(sqlite3_context *context,
+                               int argno,
+                               sqlite3_value *path,
+                               const google::protobuf::Descriptor *descriptor);
+
+}  // namespace sqlite_protobuf
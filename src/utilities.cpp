@@ -1,10 +1,21 @@
+#include <algorithm>
 #include <atomic>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <umash.h>
+
 #include "sqlite3ext.h"
+#include "descriptor_pool.h"
+#include "protobuf_compress.h"
+#include "protobuf_config.h"
+#include "protobuf_stats.h"
 #include "utilities.h"
 
-using google::protobuf::Descriptor;
-using google::protobuf::DescriptorPool;
-using google::protobuf::MessageFactory;
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
 using google::protobuf::Message;
 
 namespace sqlite_protobuf {
@@ -17,8 +28,6 @@ std::string string_from_sqlite3_value(sqlite3_value *value)
     return std::string(text, text_size);
 }
 
-namespace {
-
 bool string_equal_to_sqlite3_value(const std::string& str, sqlite3_value *val)
 {
     // Allow any conversion to take place first.
@@ -34,6 +43,8 @@ bool string_equal_to_sqlite3_value(const std::string& str, sqlite3_value *val)
     return memcmp(text, str.data(), text_size) == 0;
 }
 
+namespace {
+
 /*
  * Whenever `protobuf_load` completes loading a shared object we
  * need to invalidate the prototype and message caches of all threads.
@@ -52,24 +63,64 @@ std::atomic<uint64_t> global_prototype_generation;
  */
 const size_t MIN_MESSAGE_DATA_REUSE_SIZE = 256;
 
-struct cache {
-    // Message type name or "".
-    std::string message_name;
+/*
+ * In arena mode, each cached message owns an arena whose initial
+ * block survives `Arena::Reset`.  We size that block to fit the last
+ * message, in multiples of this granularity, up to the
+ * `message_arena_max_bytes` setting.
+ */
+const size_t ARENA_BLOCK_GRANULARITY = 4096;
 
-    // Cached prototype for the message type or `nullptr`.
+/*
+ * Arena-allocated messages are freed with their arena.
+ */
+struct message_deleter {
+    void operator()(Message *message) const {
+        if (message->GetArena() == nullptr)
+            delete message;
+    }
+};
+
+struct cached_message {
+    // Message type of `message`.
     const Message *prototype;
 
-    // Encoded message data of cached message or "".
-    std::string message_data;
+    // Size and fingerprint of the encoded message.
+    size_t message_data_size;
+    struct umash_fp message_data_fp;
+
+    // In arena mode, the arena for `message` and its initial block.
+    // Declared before `message`, which must be destroyed first.
+    std::unique_ptr<char[]> arena_block;
+    size_t arena_block_size;
+    std::unique_ptr<Arena> arena;
 
-    // The cached result of parsing of the `message_data` or `nullptr`.
-    std::unique_ptr<Message> message;
+    // The result of parsing the encoded message.
+    std::unique_ptr<Message, message_deleter> message;
 
     // The maximum size of the encoded message we have parsed
     // using `message`. Used to reset `message` if the size of
-    // the encoded messages drops suddenly.
+    // the encoded messages drops suddenly.  Only used outside
+    // arena mode.
     size_t max_message_data_size;
 
+    // Value of `cache::clock` on the last hit, for LRU replacement.
+    uint64_t last_use;
+};
+
+struct cache {
+    // Message type name or "".
+    std::string message_name;
+
+    // Cached prototype for the message type or `nullptr`.
+    const Message *prototype;
+
+    // Recently parsed messages, at most `message_cache_capacity`.
+    std::vector<cached_message> messages;
+
+    // Incremented on every call to `parse_message`.
+    uint64_t clock;
+
     // This is compared to the global counter before checking
     // for a match against `message_name`.
     uint64_t prototype_generation;
@@ -83,9 +134,7 @@ inline struct cache *get_cache() {
 void invalidate_message_cache()
 {
     struct cache *cached = get_cache();
-    cached->message_data.clear();
-    cached->message.reset();
-    cached->max_message_data_size = 0;
+    cached->messages.clear();
 }
 
 void invalidate_prototype_cache()
@@ -97,13 +146,141 @@ void invalidate_prototype_cache()
     invalidate_message_cache();
 }
 
+/// Returns the least recently used entry in the non-empty cache.
+cached_message *least_recently_used(struct cache *cached)
+{
+    cached_message *victim = &cached->messages[0];
+    for (cached_message& entry : cached->messages) {
+        if (entry.last_use < victim->last_use)
+            victim = &entry;
+    }
+
+    return victim;
+}
+
+/// Returns the cache entry to overwrite with a new message, i.e., a new
+/// entry if the cache isn't full, or the least recently used one.
+cached_message *evict_message(struct cache *cached)
+{
+    size_t capacity = static_cast<size_t>(
+        get_config(config_setting::MESSAGE_CACHE_CAPACITY));
+
+    // The capacity may have shrunk since the last call: drop the
+    // least recently used entries, and move the last entry in their
+    // slot.  Free the message before its arena, and the arena before
+    // its block: moving into the slot would free the block first.
+    while (cached->messages.size() > capacity) {
+        cached_message *victim = least_recently_used(cached);
+
+        victim->message.reset();
+        victim->arena.reset();
+        if (victim != &cached->messages.back())
+            *victim = std::move(cached->messages.back());
+        cached->messages.pop_back();
+    }
+
+    if (cached->messages.size() < capacity) {
+        cached->messages.emplace_back();
+        return &cached->messages.back();
+    }
+
+    return least_recently_used(cached);
+}
+
+/// Returns an empty message of type `prototype` on the arena of `entry`.
+/// Frees everything the arena allocated for the previous message, except for
+/// its initial block, which we grow to fit that previous message within
+/// `max_bytes`.
+Message *new_arena_message(cached_message *entry, const Message *prototype,
+                           size_t max_bytes)
+{
+    entry->message.reset();
+
+    size_t wanted = entry->arena ? entry->arena->SpaceAllocated() : 0;
+    wanted = (wanted + ARENA_BLOCK_GRANULARITY - 1) /
+        ARENA_BLOCK_GRANULARITY * ARENA_BLOCK_GRANULARITY;
+    wanted = std::min(wanted, max_bytes);
+
+    // Only reallocate the initial block to grow it, or to respect a lower
+    // `max_bytes`.
+    if (entry->arena && wanted <= entry->arena_block_size &&
+        entry->arena_block_size <= max_bytes) {
+        entry->arena->Reset();
+    } else {
+        count_stat(stat::ARENA_REALLOCATIONS);
+        entry->arena.reset();
+        entry->arena_block.reset(wanted > 0 ? new char[wanted] : nullptr);
+        entry->arena_block_size = wanted;
+
+        ArenaOptions options;
+        options.initial_block = entry->arena_block.get();
+        options.initial_block_size = entry->arena_block_size;
+        entry->arena.reset(new Arena(options));
+    }
+
+    entry->message.reset(prototype->New(entry->arena.get()));
+    return entry->message.get();
+}
+
+/// Returns an empty heap-allocated message of type `prototype`, for
+/// an encoded message of `size` bytes.  Reuses the previous message in
+/// `entry` if the size of the message to parse doesn't shrink too much.
+Message *new_heap_message(cached_message *entry, const Message *prototype,
+                          size_t size)
+{
+    size_t cmp_size = std::max(size, MIN_MESSAGE_DATA_REUSE_SIZE);
+    if (entry->message && entry->prototype == prototype &&
+        entry->message->GetArena() == nullptr &&
+        cmp_size >= entry->max_message_data_size/2) {
+        entry->message->Clear();
+    } else {
+        count_stat(stat::MESSAGE_REALLOCATIONS);
+        entry->message.reset(prototype->New());
+        entry->max_message_data_size = 0;
+
+        // We may have been in arena mode.
+        entry->arena.reset();
+        entry->arena_block.reset();
+        entry->arena_block_size = 0;
+    }
+
+    entry->max_message_data_size = std::max(entry->max_message_data_size,
+                                            size);
+    return entry->message.get();
+}
+
 } // namespace
 
+/*
+ * Parsed messages are identified by their type, size, and the UMASH
+ * fingerprint of their encoded bytes, so we never have to copy or
+ * compare the bytes themselves.  The parameters are derived from a
+ * random seed, so collisions can't be engineered on purpose.
+ */
+const struct umash_params *get_message_fp_params()
+{
+    static const struct umash_params *params = [] {
+        static struct umash_params ret;
+        std::random_device random;
+        uint64_t seed = (static_cast<uint64_t>(random()) << 32) | random();
+
+        umash_params_derive(&ret, seed, nullptr);
+        return &ret;
+    }();
+
+    return params;
+}
+
 void invalidate_all_caches()
 {
     global_prototype_generation.fetch_add(1, std::memory_order_acq_rel);
 }
 
+const Message *find_prototype(const std::string& message_name)
+{
+    return find_message_prototype(message_name);
+}
+
 const Message *get_prototype(sqlite3_context *context,
                              sqlite3_value *message_name)
 {
@@ -115,15 +292,14 @@ const Message *get_prototype(sqlite3_context *context,
         cached->prototype == nullptr ||
         !string_equal_to_sqlite3_value(cached->message_name, message_name)) {
 
+        count_stat(stat::PROTOTYPE_CACHE_MISSES);
         cached->message_name = string_from_sqlite3_value(message_name);
 
-        const DescriptorPool *pool = DescriptorPool::generated_pool();
-        const Descriptor *descriptor = pool->FindMessageTypeByName(cached->message_name);
-        if (descriptor) {
-            MessageFactory *factory = MessageFactory::generated_factory();
-            cached->prototype = factory->GetPrototype(descriptor);
+        cached->prototype = find_prototype(cached->message_name);
+        if (cached->prototype) {
+            if (global_gen != cached->prototype_generation)
+                invalidate_message_cache();
             cached->prototype_generation = global_gen;
-            invalidate_message_cache();
         } else {
             sqlite3_result_error(context, "Could not find message descriptor", -1);
             invalidate_prototype_cache();
@@ -133,6 +309,36 @@ const Message *get_prototype(sqlite3_context *context,
     return cached->prototype;
 }
 
+Message *get_scratch_message(const Message *prototype, size_t input_size)
+{
+    static thread_local cached_message scratch;
+
+    Message *message = new_heap_message(&scratch, prototype, input_size);
+    scratch.prototype = prototype;
+    return message;
+}
+
+void result_serialized_message(sqlite3_context *context,
+                               const Message& message)
+{
+    if (!message.IsInitialized()) {
+        sqlite3_result_error(context, "Could not serialize message", -1);
+        return;
+    }
+
+    stat_timer timer(stat::SERIALIZE_NS);
+    size_t size = message.ByteSizeLong();
+    uint8_t *buf = static_cast<uint8_t *>(sqlite3_malloc64(size > 0 ? size : 1));
+    if (!buf) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    message.SerializeWithCachedSizesToArray(buf);
+    count_stat(stat::BYTES_SERIALIZED, size);
+    sqlite3_result_blob64(context, buf, size, sqlite3_free);
+}
+
 Message *parse_message(sqlite3_context* context,
                        sqlite3_value *message_data,
                        sqlite3_value *message_name)
@@ -143,36 +349,69 @@ Message *parse_message(sqlite3_context* context,
         return nullptr;
 
     struct cache *cached = get_cache();
+    const void *data = sqlite3_value_blob(message_data);
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(message_data));
+    struct umash_fp fp = umash_fprint(get_message_fp_params(), 0, data, size);
+
+    cached->clock++;
 
     // Parse the message if we haven't already.
-    if (cached->message != nullptr &&
-        string_equal_to_sqlite3_value(cached->message_data,message_data)) {
-        return cached->message.get();
+    for (cached_message& entry : cached->messages) {
+        if (entry.prototype == prototype &&
+            entry.message_data_size == size &&
+            entry.message_data_fp.hash[0] == fp.hash[0] &&
+            entry.message_data_fp.hash[1] == fp.hash[1]) {
+            entry.last_use = cached->clock;
+            count_stat(stat::MESSAGE_CACHE_HITS);
+            return entry.message.get();
+        }
     }
 
-    cached->message_data = string_from_sqlite3_value(message_data);
+    count_stat(stat::MESSAGE_CACHE_MISSES);
 
-    // Make sure we have an empty Message object to parse with.  Reuse
-    // an existing Message object if the size of the message to parse
-    // doesn't shrink too much.
-    size_t cmp_size = std::max(cached->message_data.size(),
-                               MIN_MESSAGE_DATA_REUSE_SIZE);
-    if (cached->message && cmp_size >= cached->max_message_data_size/2) {
-        cached->message->Clear();
-    } else {
-        cached->message.reset(prototype->New());
-        cached->max_message_data_size = 0;
+    // Compressed messages are cached under their compressed bytes, so
+    // cache hits don't decompress anything.
+    const size_t stored_size = size;
+    const char *error = decompress_message(sqlite3_context_db_handle(context),
+        &data, &size);
+    if (error != nullptr) {
+        sqlite3_result_error(context, error, -1);
+        return nullptr;
     }
 
-    cached->max_message_data_size = std::max(cached->max_message_data_size,
-                                             cached->message_data.size());
+    cached_message *entry = evict_message(cached);
+
+    // Make sure we have an empty Message object to parse with.  With
+    // arenas, that's a bump-pointer allocation, and freeing the
+    // previous message is O(1).
+    size_t arena_max_bytes = static_cast<size_t>(
+        get_config(config_setting::MESSAGE_ARENA_MAX_BYTES));
+    Message *message = (arena_max_bytes > 0)
+        ? new_arena_message(entry, prototype, arena_max_bytes)
+        : new_heap_message(entry, prototype, size);
+
+    entry->prototype = prototype;
+    entry->message_data_size = stored_size;
+    entry->message_data_fp = fp;
+    entry->last_use = cached->clock;
+
+    bool parsed;
+    {
+        stat_timer timer(stat::PARSE_NS);
+        parsed = message->ParseFromArray(data, static_cast<int>(size));
+    }
 
-    if (!cached->message->ParseFromString(cached->message_data)) {
+    count_stat(stat::BYTES_PARSED, size);
+    if (!parsed) {
+        count_stat(stat::PARSE_FAILURES);
         sqlite3_result_error(context, "Failed to parse message", -1);
-        invalidate_message_cache();
+
+        // Don't leave a half-parsed message in the cache.
+        entry->prototype = nullptr;
+        return nullptr;
     }
 
-    return cached->message.get();
+    return message;
 }
 
 }  // namespace sqlite_protobuf
@@ -5,11 +5,16 @@
 
 #include "sqlite3.h"
 
+struct umash_params;
+
 namespace sqlite_protobuf {
 
 /// Convenience method for constructing a std::string from sqlite3_value
 std::string string_from_sqlite3_value(sqlite3_value *value);
 
+/// Returns true if `val` holds the same bytes as `str`
+bool string_equal_to_sqlite3_value(const std::string& str, sqlite3_value *val);
+
 // Looks up a prototype message for the given `message_name`.  Returns
 // the message on success and `nullptr` on failure.  The `context` is
 // set into an error state on failure using `sqlite3_result_error`.
@@ -20,6 +25,12 @@ std::string string_from_sqlite3_value(sqlite3_value *value);
 const google::protobuf::Message* get_prototype(sqlite3_context *context,
                                                sqlite3_value *message_name);
 
+// Looks up a prototype message for the given `message_name`, like
+// `get_prototype`, but without any caching or error reporting.
+// Returns `nullptr` if there is no such message type.
+const google::protobuf::Message* find_prototype(
+    const std::string& message_name);
+
 // Parse a protobuf encoded message `message_data` of type
 // `message_name`.  Returns a `Message` object on success and
 // `nullptr` on failure.  The `context` is set into an error state on
@@ -32,6 +43,22 @@ google::protobuf::Message *parse_message(sqlite3_context *context,
                                          sqlite3_value *message_data,
                                          sqlite3_value *message_name);
 
+// Returns an empty message of type `prototype`, to build from an
+// input (e.g., JSON) of `input_size` bytes.  The message is reused
+// across calls in the same thread, with the same heuristic as
+// `parse_message`, so it's only valid until the next call.
+google::protobuf::Message *get_scratch_message(
+    const google::protobuf::Message *prototype, size_t input_size);
+
+// Sets the result of `context` to the encoded `message`, serialized
+// directly into a buffer that SQLite takes ownership of.  Fails with
+// "Could not serialize message", e.g., if required fields are missing.
+void result_serialized_message(sqlite3_context *context,
+                               const google::protobuf::Message& message);
+
+// Returns the UMASH parameters for fingerprints of encoded messages.
+const struct umash_params *get_message_fp_params();
+
 // Invalidates all caches used by `get_prototype` and `parse_message`.
 void invalidate_all_caches(void);
 
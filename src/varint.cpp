@@ -0,0 +1,268 @@
+#include "varint.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace sqlite_protobuf {
+
+namespace {
+
+// Varints have at most 10 bytes, so at most 9 continuation bytes in a
+// row.
+const int MAX_CONTINUATION_RUN = 9;
+
+const size_t BLOCK_SIZE = 64;
+
+// Returns a mask with bit `i` set iff byte `i` of the 64-byte `block`
+// has its continuation (high) bit set.
+typedef uint64_t continuation_mask_fn(const uint8_t *block);
+
+#if defined(__x86_64__)
+uint64_t continuation_mask_sse2(const uint8_t *block)
+{
+    uint64_t ret = 0;
+
+    for (size_t i = 0; i < BLOCK_SIZE; i += 16) {
+        __m128i bytes = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(block + i));
+        ret |= static_cast<uint64_t>(
+            static_cast<uint16_t>(_mm_movemask_epi8(bytes))) << i;
+    }
+
+    return ret;
+}
+
+__attribute__((target("avx2")))
+uint64_t continuation_mask_avx2(const uint8_t *block)
+{
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+    __m256i hi = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(block + 32));
+
+    return static_cast<uint32_t>(_mm256_movemask_epi8(lo)) |
+        (static_cast<uint64_t>(
+            static_cast<uint32_t>(_mm256_movemask_epi8(hi))) << 32);
+}
+#elif defined(__aarch64__)
+uint64_t continuation_mask_neon(const uint8_t *block)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+    };
+    const uint8x16_t weight = vld1q_u8(weights);
+    const uint8x16_t high_bit = vdupq_n_u8(0x80);
+    uint8x16_t bits[4];
+
+    for (size_t i = 0; i < 4; i++) {
+        uint8x16_t bytes = vld1q_u8(block + 16 * i);
+        bits[i] = vandq_u8(vtstq_u8(bytes, high_bit), weight);
+    }
+
+    // Each pairwise add halves the number of bytes per 16-byte chunk,
+    // until we're left with one byte for each group of 8 input bytes.
+    uint8x16_t sum = vpaddq_u8(vpaddq_u8(bits[0], bits[1]),
+        vpaddq_u8(bits[2], bits[3]));
+    sum = vpaddq_u8(sum, sum);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+}
+#else
+uint64_t continuation_mask_scalar(const uint8_t *block)
+{
+    uint64_t ret = 0;
+
+    for (size_t i = 0; i < BLOCK_SIZE; i += 8) {
+        uint64_t word;
+
+        memcpy(&word, block + i, sizeof(word));
+        // Gather the high bit of each byte in the top byte.
+        word = ((word >> 7) & 0x0101010101010101ULL) * 0x0102040810204080ULL;
+        ret |= (word >> 56) << i;
+    }
+
+    return ret;
+}
+#endif
+
+struct varint_kernel {
+    const char *name;
+    continuation_mask_fn *continuation_mask;
+};
+
+const varint_kernel& get_kernel()
+{
+    static const varint_kernel kernel = []() -> varint_kernel {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2"))
+            return { "avx2", continuation_mask_avx2 };
+        return { "sse2", continuation_mask_sse2 };
+#elif defined(__aarch64__)
+        return { "neon", continuation_mask_neon };
+#else
+        return { "scalar", continuation_mask_scalar };
+#endif
+    }();
+
+    return kernel;
+}
+
+/// Checks a block with `continuation` bits for varints longer than 10
+/// bytes, given the number of continuation bytes at the end of the
+/// previous blocks in `*run`, and updates `*run` for the next block.
+bool check_block(uint64_t continuation, int *run)
+{
+    if (continuation == 0) {
+        *run = 0;
+        return true;
+    }
+
+    const uint64_t stops = ~continuation;
+    const int leading = (stops == 0) ? 64 : __builtin_ctzll(stops);
+    if (*run + leading > MAX_CONTINUATION_RUN)
+        return false;
+
+    // Bit `i` of `long_runs` is set iff bytes [i, i + 9] are all
+    // continuation bytes.
+    uint64_t long_runs = continuation;
+    for (int i = 1; i <= MAX_CONTINUATION_RUN; i++)
+        long_runs &= continuation >> i;
+    if (long_runs != 0)
+        return false;
+
+    *run = __builtin_clzll(stops);
+    return true;
+}
+
+}  // namespace
+
+bool varint_read_slow(const uint8_t **p, const uint8_t *end, uint64_t *out)
+{
+    uint64_t result = 0;
+    const uint8_t *cur = *p;
+
+    for (int shift = 0; shift < 64 && cur < end; shift += 7) {
+        uint8_t byte = *cur++;
+
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *out = result;
+            *p = cur;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *varint_kernel_name()
+{
+    return get_kernel().name;
+}
+
+size_t varint_count(const uint8_t *begin, const uint8_t *end)
+{
+    continuation_mask_fn *const continuation_mask =
+        get_kernel().continuation_mask;
+    const uint8_t *p = begin;
+    size_t count = 0;
+    int run = 0;
+
+    for (; static_cast<size_t>(end - p) >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        uint64_t continuation = continuation_mask(p);
+
+        if (!check_block(continuation, &run))
+            return SIZE_MAX;
+
+        count += BLOCK_SIZE - __builtin_popcountll(continuation);
+    }
+
+    for (; p < end; p++) {
+        if ((*p & 0x80) == 0) {
+            run = 0;
+            count++;
+        } else if (++run > MAX_CONTINUATION_RUN) {
+            return SIZE_MAX;
+        }
+    }
+
+    return (run == 0) ? count : SIZE_MAX;
+}
+
+const uint8_t *varint_skip(const uint8_t *begin, const uint8_t *end,
+                           size_t index)
+{
+    continuation_mask_fn *const continuation_mask =
+        get_kernel().continuation_mask;
+    const uint8_t *p = begin;
+
+    if (index == 0)
+        return begin;
+
+    for (; static_cast<size_t>(end - p) >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        uint64_t stops = ~continuation_mask(p);
+        size_t n_stops = __builtin_popcountll(stops);
+
+        if (n_stops < index) {
+            index -= n_stops;
+            continue;
+        }
+
+        // The varint we want starts right after the `index`th stop.
+        while (--index > 0)
+            stops &= stops - 1;
+        return p + __builtin_ctzll(stops) + 1;
+    }
+
+    for (; p < end; p++) {
+        if ((*p & 0x80) == 0 && --index == 0)
+            return p + 1;
+    }
+
+    return end;
+}
+
+bool varint_decode(const uint8_t *begin, const uint8_t *end,
+                   std::vector<uint64_t> *out)
+{
+    continuation_mask_fn *const continuation_mask =
+        get_kernel().continuation_mask;
+    const uint8_t *p = begin;
+
+    while (static_cast<size_t>(end - p) >= BLOCK_SIZE) {
+        if (continuation_mask(p) == 0) {
+            // 64 single-byte varints: just widen them.
+            size_t size = out->size();
+
+            out->resize(size + BLOCK_SIZE);
+            uint64_t *dst = out->data() + size;
+            for (size_t i = 0; i < BLOCK_SIZE; i++)
+                dst[i] = p[i];
+
+            p += BLOCK_SIZE;
+            continue;
+        }
+
+        // Decode the varints that start in this block one at a time.
+        for (const uint8_t *stop = p + BLOCK_SIZE; p < stop; ) {
+            uint64_t value;
+
+            if (!varint_read(&p, end, &value))
+                return false;
+            out->push_back(value);
+        }
+    }
+
+    while (p < end) {
+        uint64_t value;
+
+        if (!varint_read(&p, end, &value))
+            return false;
+        out->push_back(value);
+    }
+
+    return true;
+}
+
+}  // namespace sqlite_protobuf
@@ -0,0 +1,88 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+namespace sqlite_protobuf {
+
+// Decodes the varint at `*p`, byte by byte, and advances `*p` past it.
+// Returns false if the varint is truncated or longer than 10 bytes.
+bool varint_read_slow(const uint8_t **p, const uint8_t *end, uint64_t *out);
+
+// Decodes the varint at `*p` and advances `*p` past it, like
+// `varint_read_slow`.
+//
+// Single-byte varints (most tags and lengths) take one branch, and
+// varints of up to 8 bytes are decoded from one 64-bit load, without
+// a loop.
+inline bool varint_read(const uint8_t **p, const uint8_t *end, uint64_t *out)
+{
+    const uint8_t *cur = *p;
+
+    if (cur < end && *cur < 0x80) {
+        *out = *cur;
+        *p = cur + 1;
+        return true;
+    }
+
+    if (end - cur >= 8) {
+        // The wire format is little-endian, like every platform we
+        // run on.
+        uint64_t word;
+        memcpy(&word, cur, sizeof(word));
+
+        const uint64_t stops = ~word & 0x8080808080808080ULL;
+        if (stops != 0) {
+            // 8 bits for each byte in the varint.
+            const unsigned bits = __builtin_ctzll(stops) + 1;
+
+            if (bits < 64)
+                word &= (1ULL << bits) - 1;
+
+            // Drop the continuation bits and pack the 7-bit groups.
+            word &= 0x7f7f7f7f7f7f7f7fULL;
+            word = (word & 0x007f007f007f007fULL) |
+                ((word & 0x7f007f007f007f00ULL) >> 1);
+            word = (word & 0x00003fff00003fffULL) |
+                ((word & 0x3fff00003fff0000ULL) >> 2);
+            word = (word & 0x000000000fffffffULL) |
+                ((word & 0x0fffffff00000000ULL) >> 4);
+
+            *out = word;
+            *p = cur + bits / 8;
+            return true;
+        }
+    }
+
+    return varint_read_slow(p, end, out);
+}
+
+// The following functions work on runs of back-to-back varints, like
+// the payload of packed repeated fields.  They classify 64 bytes at a
+// time with SIMD instructions (AVX2 or SSE2 on x86-64, NEON on
+// AArch64, picked at runtime), and fall back to portable code
+// elsewhere.
+
+// Returns the name of the SIMD kernel used on this machine: "avx2",
+// "sse2", "neon" or "scalar".
+const char *varint_kernel_name();
+
+// Returns the number of varints in [begin, end), or SIZE_MAX if the
+// run ends in the middle of a varint or has a varint longer than 10
+// bytes.
+size_t varint_count(const uint8_t *begin, const uint8_t *end);
+
+// Returns a pointer to varint number `index` in the valid run
+// [begin, end), or `end` if there are fewer varints.
+const uint8_t *varint_skip(const uint8_t *begin, const uint8_t *end,
+                           size_t index);
+
+// Decodes the varints in [begin, end) and appends them to `out`.
+// Returns false (with some of the values appended) if the run is
+// malformed.
+bool varint_decode(const uint8_t *begin, const uint8_t *end,
+                   std::vector<uint64_t> *out);
+
+}  // namespace sqlite_protobuf
@@ -0,0 +1,881 @@
+#include "wire_format.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/stubs/common.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "varint.h"
+
+namespace sqlite_protobuf {
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::OneofDescriptor;
+using google::protobuf::internal::WireFormatLite;
+
+namespace {
+
+// Submessages nested deeper than this are left to the regular parser.
+const int MAX_GROUP_DEPTH = 100;
+
+// A byte range in an encoded message.
+struct wire_span {
+    const uint8_t *begin;
+    const uint8_t *end;
+};
+
+// One occurrence of a field in an encoded message.
+struct wire_field {
+    uint32_t wire_type;
+    // Varint or fixed payload.
+    uint64_t bits;
+    // Length-delimited payload.
+    const uint8_t *data;
+    size_t size;
+};
+
+enum class scan_status {
+    // We went through all the spans.
+    DONE,
+    // The callback asked to stop.
+    STOPPED,
+    // The encoded message is invalid.
+    MALFORMED,
+};
+
+inline bool read_varint(const uint8_t **p, const uint8_t *end, uint64_t *out)
+{
+    return varint_read(p, end, out);
+}
+
+inline bool read_fixed(const uint8_t **p, const uint8_t *end, size_t width,
+                       uint64_t *out)
+{
+    if (static_cast<size_t>(end - *p) < width)
+        return false;
+
+    // The wire format is little-endian, like every platform we run on.
+    uint64_t value = 0;
+    memcpy(&value, *p, width);
+    *out = value;
+    *p += width;
+    return true;
+}
+
+inline bool read_tag(const uint8_t **p, const uint8_t *end,
+                     uint32_t *number, uint32_t *wire_type)
+{
+    uint64_t tag;
+
+    if (!read_varint(p, end, &tag) || tag > UINT32_MAX)
+        return false;
+
+    *number = static_cast<uint32_t>(tag >> 3);
+    *wire_type = static_cast<uint32_t>(tag & 7);
+    return *number != 0;
+}
+
+/// Decodes the value of a field with `wire_type` at `*p`, and
+/// advances `*p` past it.  Groups are skipped.
+bool read_field(const uint8_t **p, const uint8_t *end, uint32_t number,
+                uint32_t wire_type, wire_field *out)
+{
+    out->wire_type = wire_type;
+    out->bits = 0;
+    out->data = nullptr;
+    out->size = 0;
+
+    switch (wire_type) {
+    case WireFormatLite::WIRETYPE_VARINT:
+        return read_varint(p, end, &out->bits);
+
+    case WireFormatLite::WIRETYPE_FIXED64:
+        return read_fixed(p, end, 8, &out->bits);
+
+    case WireFormatLite::WIRETYPE_FIXED32:
+        return read_fixed(p, end, 4, &out->bits);
+
+    case WireFormatLite::WIRETYPE_LENGTH_DELIMITED:
+    {
+        uint64_t size;
+        if (!read_varint(p, end, &size) ||
+            size > static_cast<uint64_t>(end - *p))
+            return false;
+
+        out->data = *p;
+        out->size = static_cast<size_t>(size);
+        *p += size;
+        return true;
+    }
+
+    case WireFormatLite::WIRETYPE_START_GROUP:
+    {
+        // Skip to the matching END_GROUP, through any nested group.
+        uint32_t open_groups[MAX_GROUP_DEPTH];
+        int depth = 0;
+
+        open_groups[depth++] = number;
+        while (depth > 0) {
+            uint32_t inner_number, inner_type;
+            wire_field ignored;
+
+            if (!read_tag(p, end, &inner_number, &inner_type))
+                return false;
+
+            if (inner_type == WireFormatLite::WIRETYPE_END_GROUP) {
+                if (open_groups[--depth] != inner_number)
+                    return false;
+            } else if (inner_type == WireFormatLite::WIRETYPE_START_GROUP) {
+                if (depth >= MAX_GROUP_DEPTH)
+                    return false;
+                open_groups[depth++] = inner_number;
+            } else if (!read_field(p, end, inner_number, inner_type,
+                                   &ignored)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    default:
+        // Unbalanced END_GROUP or invalid wire type.
+        return false;
+    }
+}
+
+/// Calls `fn(const wire_field&)` for each occurrence of field
+/// `number` in `spans`, in order, until `fn` returns false.
+template <typename Fn>
+scan_status scan_field(const std::vector<wire_span>& spans, uint32_t number,
+                       Fn&& fn)
+{
+    for (const wire_span& span : spans) {
+        const uint8_t *p = span.begin;
+
+        while (p < span.end) {
+            uint32_t field_number, wire_type;
+            wire_field field;
+
+            if (!read_tag(&p, span.end, &field_number, &wire_type) ||
+                !read_field(&p, span.end, field_number, wire_type, &field))
+                return scan_status::MALFORMED;
+
+            if (field_number == number && !fn(field))
+                return scan_status::STOPPED;
+        }
+    }
+
+    return scan_status::DONE;
+}
+
+/// Returns the wire type for (unpacked) values of `field`.
+uint32_t expected_wire_type(const FieldDescriptor *field)
+{
+    return WireFormatLite::WireTypeForFieldType(
+        static_cast<WireFormatLite::FieldType>(field->type()));
+}
+
+/// Unknown values of closed (proto2) enums are stored as unknown
+/// fields by the parser, so we must skip them as well.
+bool is_closed_enum(const FieldDescriptor *field)
+{
+    return field->type() == FieldDescriptor::Type::TYPE_ENUM &&
+        field->file()->syntax() == FileDescriptor::SYNTAX_PROTO2;
+}
+
+bool is_known_enum_value(const FieldDescriptor *field, uint64_t bits)
+{
+    int value = static_cast<int32_t>(bits);
+    return field->enum_type()->FindValueByNumber(value) != nullptr;
+}
+
+/// Calls `fn(uint64_t bits)` or `fn(const uint8_t *, size_t)` for
+/// each element of the repeated scalar `field` in `occurrence`, until
+/// `fn` returns false.  Returns false if the packed payload is
+/// malformed.
+template <typename Fn>
+bool for_each_element(const FieldDescriptor *field,
+                      const wire_field& occurrence, bool *stopped, Fn&& fn)
+{
+    const uint32_t wire_type = expected_wire_type(field);
+    const bool closed_enum = is_closed_enum(field);
+
+    *stopped = false;
+    if (occurrence.wire_type == wire_type) {
+        if (closed_enum && !is_known_enum_value(field, occurrence.bits))
+            return true;
+
+        *stopped = !fn(occurrence);
+        return true;
+    }
+
+    // Packed encoding of numeric fields.
+    if (occurrence.wire_type != WireFormatLite::WIRETYPE_LENGTH_DELIMITED ||
+        !field->is_packable())
+        return true;
+
+    const uint8_t *p = occurrence.data;
+    const uint8_t *end = p + occurrence.size;
+    while (p < end) {
+        wire_field element;
+
+        if (!read_field(&p, end, 0, wire_type, &element))
+            return false;
+
+        if (closed_enum && !is_known_enum_value(field, element.bits))
+            continue;
+
+        if (!fn(element)) {
+            *stopped = true;
+            return true;
+        }
+    }
+
+    return true;
+}
+
+/// Returns true if `occurrence` is a packed run of varints for
+/// `field` that we can decode as a whole, without filtering out
+/// unknown enum values.
+bool is_varint_run(const FieldDescriptor *field, const wire_field& occurrence)
+{
+    return occurrence.wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED &&
+        field->is_packable() &&
+        expected_wire_type(field) == WireFormatLite::WIRETYPE_VARINT &&
+        !is_closed_enum(field);
+}
+
+/// Returns true if `value` holds the default value of a field without
+/// presence (e.g., a proto3 scalar).  Reflection reports these fields
+/// as absent.
+bool is_implicit_default(const FieldDescriptor *field, const wire_field& value)
+{
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        return value.size == 0;
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        return static_cast<uint32_t>(value.bits) == 0;
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        // Compare bit patterns: -0.0 is not the default.
+        return static_cast<uint32_t>(value.bits) == 0;
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+        return value.bits == 0;
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        break;
+    }
+
+    return false;
+}
+
+/// Returns false if `size` bytes at `data` are the value of a proto3
+/// string `field`, and aren't valid UTF-8.  Parsing rejects these
+/// messages, so we must not return such strings either.
+bool is_valid_string(const FieldDescriptor *field, const uint8_t *data,
+                     size_t size)
+{
+    return field->type() != FieldDescriptor::Type::TYPE_STRING ||
+        field->file()->syntax() != FileDescriptor::SYNTAX_PROTO3 ||
+        google::protobuf::internal::IsStructurallyValidUTF8(
+            reinterpret_cast<const char *>(data), static_cast<int>(size));
+}
+
+bool has_required_fields(const Descriptor *descriptor,
+                         std::unordered_set<const Descriptor *> *visited)
+{
+    if (!visited->insert(descriptor).second)
+        return false;
+
+    for (int i = 0; i < descriptor->field_count(); i++) {
+        const FieldDescriptor *field = descriptor->field(i);
+
+        if (field->is_required())
+            return true;
+
+        if (field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE &&
+            has_required_fields(field->message_type(), visited))
+            return true;
+    }
+
+    return false;
+}
+
+/// Normalises a (possibly negative) index into a repeated field with
+/// `count` elements.  Returns false if the index is out of range.
+bool normalize_index(int index, size_t count, size_t *out)
+{
+    int64_t normalized = index;
+
+    if (normalized < 0)
+        normalized += static_cast<int64_t>(count);
+
+    if (normalized < 0 || static_cast<uint64_t>(normalized) >= count)
+        return false;
+
+    *out = static_cast<size_t>(normalized);
+    return true;
+}
+
+/// Checks the conditions shared by `wire_path_supported` and
+/// `wire_repeated_path_supported`.  If `repeated_leaf` is true, the
+/// last step must be a repeated field without an index.
+bool wire_steps_supported(const protopath& path, bool repeated_leaf)
+{
+    if (path.error != nullptr || path.steps.empty() ||
+        path.tail == protopath_tail::INVALID)
+        return false;
+
+    // Parsing fails when required fields are missing anywhere in the
+    // message, and we don't want to decode everything to find out.
+    std::unordered_set<const Descriptor *> visited;
+    if (path.descriptor->options().message_set_wire_format() ||
+        has_required_fields(path.descriptor, &visited))
+        return false;
+
+    for (size_t i = 0; i < path.steps.size(); i++) {
+        const protopath_step& step = path.steps[i];
+        const FieldDescriptor *field = step.field;
+        const bool last = (i + 1 == path.steps.size());
+
+        // Later members of a oneof clear earlier ones, and map
+        // entries may be reordered by reflection.
+        if (field->real_containing_oneof() != nullptr || field->is_map() ||
+            field->is_extension())
+            return false;
+
+        if (last && repeated_leaf) {
+            if (!field->is_repeated() || step.has_index)
+                return false;
+        } else if (field->is_repeated() && !step.has_index) {
+            return false;
+        }
+
+        if (field->type() == FieldDescriptor::Type::TYPE_GROUP)
+            return false;
+
+        // We return submessages re-serialized.
+        if (last && field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE)
+            return false;
+
+        if (field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE &&
+            field->message_type()->options().message_set_wire_format())
+            return false;
+    }
+
+    return true;
+}
+
+/// Finds the spans of the message that contains the last field in
+/// `path`, and stores them in `*OUT_spans`, which is only valid until
+/// the next call.  Returns `wire_status::FOUND` on success.
+wire_status find_leaf_message(const protopath& path, const void *data,
+                              size_t size, wire_value *out,
+                              const std::vector<wire_span> **OUT_spans)
+{
+    // Submessages may appear multiple times, in which case they are
+    // merged: walk a list of spans that, once concatenated, make up
+    // the current message.
+    static thread_local std::vector<wire_span> spans;
+    static thread_local std::vector<wire_span> next_spans;
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+    spans.clear();
+    if (bytes != nullptr)
+        spans.push_back(wire_span{ bytes, bytes + size });
+
+    out->bits = 0;
+    out->data = nullptr;
+    out->size = 0;
+    out->step = 0;
+
+    // Descend into submessages.
+    for (size_t i = 0; i + 1 < path.steps.size(); i++) {
+        const protopath_step& step = path.steps[i];
+        const uint32_t number = step.field->number();
+        scan_status status;
+
+        next_spans.clear();
+        if (!step.field->is_repeated()) {
+            status = scan_field(spans, number, [&](const wire_field& field) {
+                if (field.wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED)
+                    next_spans.push_back(
+                        wire_span{ field.data, field.data + field.size });
+                return true;
+            });
+            if (status == scan_status::MALFORMED)
+                return wire_status::FALLBACK;
+
+            if (next_spans.empty()) {
+                out->step = i;
+                return wire_status::MISSING;
+            }
+        } else {
+            size_t count = 0;
+            size_t index;
+
+            if (step.index < 0) {
+                status = scan_field(spans, number, [&](const wire_field& field) {
+                    count += (field.wire_type ==
+                              WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+                    return true;
+                });
+                if (status == scan_status::MALFORMED)
+                    return wire_status::FALLBACK;
+            } else {
+                count = SIZE_MAX;
+            }
+
+            if (!normalize_index(step.index, count, &index))
+                return wire_status::OUT_OF_RANGE;
+
+            status = scan_field(spans, number, [&](const wire_field& field) {
+                if (field.wire_type != WireFormatLite::WIRETYPE_LENGTH_DELIMITED)
+                    return true;
+
+                if (index-- > 0)
+                    return true;
+
+                next_spans.push_back(
+                    wire_span{ field.data, field.data + field.size });
+                return false;
+            });
+            if (status == scan_status::MALFORMED)
+                return wire_status::FALLBACK;
+
+            if (next_spans.empty())
+                return wire_status::OUT_OF_RANGE;
+        }
+
+        spans.swap(next_spans);
+    }
+
+    *OUT_spans = &spans;
+    return wire_status::FOUND;
+}
+
+
+/// Adds the field numbers at `depth` in `chain` to `bits`, for
+/// `wire_field_numbers`.
+bool collect_field_numbers(const uint8_t *p, const uint8_t *end,
+                           const std::vector<uint32_t>& chain, size_t depth,
+                           uint32_t limit, std::string *bits)
+{
+    while (p < end) {
+        uint32_t number, wire_type;
+        wire_field field;
+
+        if (!read_tag(&p, end, &number, &wire_type) ||
+            !read_field(&p, end, number, wire_type, &field))
+            return false;
+
+        if (depth == chain.size()) {
+            if (number >= limit)
+                continue;
+
+            size_t byte = number / 8;
+            if (bits->size() <= byte)
+                bits->resize(byte + 1, '\0');
+            (*bits)[byte] |= static_cast<char>(1 << (number % 8));
+        } else if (number == chain[depth] &&
+                   wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            if (!collect_field_numbers(field.data, field.data + field.size,
+                    chain, depth + 1, limit, bits))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/// Returns true if the packed or unpacked `occurrence` of the repeated
+/// closed enum `field` only has known values.
+bool known_enum_values(const FieldDescriptor *field,
+                       const wire_field& occurrence)
+{
+    bool known = true, stopped;
+
+    if (!for_each_element(field, occurrence, &stopped,
+            [&](const wire_field& element) {
+                known = is_known_enum_value(field, element.bits);
+                return known;
+            }))
+        return false;
+
+    return known;
+}
+
+bool is_canonical_message(const Descriptor *descriptor, const uint8_t *p,
+                          const uint8_t *end, int depth);
+
+/// Checks that `occurrence` of `field` would encode the same after a
+/// parse, for `wire_is_canonical`.
+bool is_canonical_field(const FieldDescriptor *field,
+                        const wire_field& occurrence, int depth)
+{
+    const uint32_t wire_type = expected_wire_type(field);
+
+    if (occurrence.wire_type != wire_type &&
+        !(field->is_packable() &&
+          occurrence.wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED))
+        return false;
+
+    if (!field->is_repeated() && !field->has_presence() &&
+        is_implicit_default(field, occurrence))
+        return false;
+
+    switch (field->type()) {
+    case FieldDescriptor::Type::TYPE_MESSAGE:
+        return is_canonical_message(field->message_type(), occurrence.data,
+            occurrence.data + occurrence.size, depth + 1);
+    case FieldDescriptor::Type::TYPE_STRING:
+        return is_valid_string(field, occurrence.data, occurrence.size);
+    case FieldDescriptor::Type::TYPE_ENUM:
+        return !is_closed_enum(field) || known_enum_values(field, occurrence);
+    default:
+        return true;
+    }
+}
+
+/// Checks the fields of the encoded `descriptor` message in
+/// `[p, end)`, for `wire_is_canonical`.
+bool is_canonical_message(const Descriptor *descriptor, const uint8_t *p,
+                          const uint8_t *end, int depth)
+{
+    const FieldDescriptor *last = nullptr;
+    std::vector<const OneofDescriptor *> oneofs;
+
+    if (depth > MAX_GROUP_DEPTH)
+        return false;
+
+    while (p < end) {
+        uint32_t number, wire_type;
+        wire_field occurrence;
+
+        if (!read_tag(&p, end, &number, &wire_type) ||
+            wire_type == WireFormatLite::WIRETYPE_START_GROUP ||
+            !read_field(&p, end, number, wire_type, &occurrence))
+            return false;
+
+        const FieldDescriptor *field = descriptor->FindFieldByNumber(number);
+        if (field == nullptr || field->is_map() ||
+            field->type() == FieldDescriptor::Type::TYPE_GROUP)
+            return false;
+
+        if (field == last) {
+            if (!field->is_repeated())
+                return false;
+        } else if (last != nullptr && number < static_cast<uint32_t>(
+                       last->number())) {
+            return false;
+        }
+
+        // Parsing keeps the last member of a oneof.
+        const OneofDescriptor *oneof = field->containing_oneof();
+        if (oneof != nullptr) {
+            if (std::find(oneofs.begin(), oneofs.end(), oneof) !=
+                oneofs.end())
+                return false;
+            oneofs.push_back(oneof);
+        }
+
+        if (!is_canonical_field(field, occurrence, depth))
+            return false;
+
+        last = field;
+    }
+
+    return true;
+}
+
+}  // namespace
+
+bool wire_path_supported(const protopath& path)
+{
+    return wire_steps_supported(path, false);
+}
+
+bool wire_repeated_path_supported(const protopath& path)
+{
+    if (path.tail != protopath_tail::NONE ||
+        !wire_steps_supported(path, true))
+        return false;
+
+    switch (path.steps.back().field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        return false;
+    default:
+        return true;
+    }
+}
+
+wire_status wire_extract(const protopath& path, const void *data, size_t size,
+                         wire_value *out)
+{
+    const std::vector<wire_span> *leaf_spans;
+    wire_status leaf_status = find_leaf_message(path, data, size, out,
+        &leaf_spans);
+    if (leaf_status != wire_status::FOUND)
+        return leaf_status;
+
+    const std::vector<wire_span>& spans = *leaf_spans;
+
+    // And now find the scalar value.
+    const size_t last = path.steps.size() - 1;
+    const protopath_step& step = path.steps[last];
+    const FieldDescriptor *field = step.field;
+    const uint32_t number = field->number();
+    bool malformed = false;
+    bool found = false;
+    scan_status status;
+
+    auto found_value = [&](const wire_field& value) {
+        out->bits = value.bits;
+        out->data = value.data;
+        out->size = value.size;
+        found = true;
+    };
+
+    if (!field->is_repeated()) {
+        const uint32_t wire_type = expected_wire_type(field);
+        const bool closed_enum = is_closed_enum(field);
+        wire_field latest = {};
+
+        status = scan_field(spans, number, [&](const wire_field& value) {
+            if (value.wire_type != wire_type)
+                return true;
+
+            if (closed_enum && !is_known_enum_value(field, value.bits))
+                return true;
+
+            latest = value;
+            found = true;
+            return true;
+        });
+        if (status == scan_status::MALFORMED)
+            return wire_status::FALLBACK;
+
+        if (!found ||
+            (!field->has_presence() && is_implicit_default(field, latest))) {
+            out->step = last;
+            return wire_status::MISSING;
+        }
+
+        if (!is_valid_string(field, latest.data, latest.size))
+            return wire_status::FALLBACK;
+
+        found_value(latest);
+        return wire_status::FOUND;
+    }
+
+    size_t count = 0;
+    size_t index;
+
+    if (step.index < 0) {
+        status = scan_field(spans, number, [&](const wire_field& occurrence) {
+            bool stopped;
+
+            if (is_varint_run(field, occurrence)) {
+                size_t n = varint_count(occurrence.data,
+                    occurrence.data + occurrence.size);
+                if (n == SIZE_MAX) {
+                    malformed = true;
+                    return false;
+                }
+
+                count += n;
+                return true;
+            }
+
+            if (!for_each_element(field, occurrence, &stopped,
+                    [&](const wire_field&) { count++; return true; })) {
+                malformed = true;
+                return false;
+            }
+
+            return true;
+        });
+        if (status == scan_status::MALFORMED || malformed)
+            return wire_status::FALLBACK;
+    } else {
+        count = SIZE_MAX;
+    }
+
+    if (!normalize_index(step.index, count, &index))
+        return wire_status::OUT_OF_RANGE;
+
+    status = scan_field(spans, number, [&](const wire_field& occurrence) {
+        bool stopped;
+
+        if (is_varint_run(field, occurrence)) {
+            const uint8_t *begin = occurrence.data;
+            const uint8_t *end = begin + occurrence.size;
+            size_t n = varint_count(begin, end);
+            if (n == SIZE_MAX) {
+                malformed = true;
+                return false;
+            }
+
+            if (index >= n) {
+                index -= n;
+                return true;
+            }
+
+            const uint8_t *p = varint_skip(begin, end, index);
+            wire_field value = {};
+            value.wire_type = WireFormatLite::WIRETYPE_VARINT;
+            if (!read_varint(&p, end, &value.bits)) {
+                malformed = true;
+                return false;
+            }
+
+            found_value(value);
+            return false;
+        }
+
+        if (!for_each_element(field, occurrence, &stopped,
+                [&](const wire_field& value) {
+                    if (index-- > 0)
+                        return true;
+
+                    found_value(value);
+                    return false;
+                })) {
+            malformed = true;
+            return false;
+        }
+
+        return !stopped;
+    });
+    if (status == scan_status::MALFORMED || malformed ||
+        (found && !is_valid_string(field, out->data, out->size)))
+        return wire_status::FALLBACK;
+
+    return found ? wire_status::FOUND : wire_status::OUT_OF_RANGE;
+}
+
+wire_status wire_extract_repeated(const protopath& path, const void *data,
+                                  size_t size, std::vector<uint64_t> *out)
+{
+    const std::vector<wire_span> *spans;
+    wire_value ignored;
+
+    out->clear();
+    wire_status found = find_leaf_message(path, data, size, &ignored, &spans);
+    if (found != wire_status::FOUND)
+        return found;
+
+    const FieldDescriptor *field = path.steps.back().field;
+    bool malformed = false;
+    scan_status status;
+
+    // Packed runs are decoded in one pass, without going back to
+    // `scan_field` for each element.
+    status = scan_field(*spans, field->number(),
+        [&](const wire_field& occurrence) {
+            bool stopped;
+
+            if (is_varint_run(field, occurrence)) {
+                if (!varint_decode(occurrence.data,
+                        occurrence.data + occurrence.size, out)) {
+                    malformed = true;
+                    return false;
+                }
+
+                return true;
+            }
+
+            if (!for_each_element(field, occurrence, &stopped,
+                    [&](const wire_field& value) {
+                        out->push_back(value.bits);
+                        return true;
+                    })) {
+                malformed = true;
+                return false;
+            }
+
+            return true;
+        });
+    if (status == scan_status::MALFORMED || malformed)
+        return wire_status::FALLBACK;
+
+    return wire_status::FOUND;
+}
+
+bool wire_field_numbers(const void *data, size_t size,
+                        const std::vector<uint32_t>& chain, uint32_t limit,
+                        std::string *bits)
+{
+    const uint8_t *begin = static_cast<const uint8_t *>(data);
+
+    return collect_field_numbers(begin, begin + size, chain, 0, limit, bits);
+}
+
+bool wire_is_canonical(const Descriptor *descriptor, const void *data,
+                       size_t size)
+{
+    const uint8_t *begin = static_cast<const uint8_t *>(data);
+
+    // Parsing fails when required fields are missing.
+    static thread_local const Descriptor *cached_descriptor;
+    static thread_local bool cached_required;
+    if (descriptor != cached_descriptor) {
+        std::unordered_set<const Descriptor *> visited;
+
+        cached_required = has_required_fields(descriptor, &visited);
+        cached_descriptor = descriptor;
+    }
+
+    return !cached_required &&
+        is_canonical_message(descriptor, begin, begin + size, 0);
+}
+
+int64_t wire_decode_int64(FieldDescriptor::Type type, uint64_t bits)
+{
+    switch (type) {
+    case FieldDescriptor::Type::TYPE_INT32:
+    case FieldDescriptor::Type::TYPE_SFIXED32:
+    case FieldDescriptor::Type::TYPE_ENUM:
+        return static_cast<int32_t>(bits);
+    case FieldDescriptor::Type::TYPE_UINT32:
+    case FieldDescriptor::Type::TYPE_FIXED32:
+        return static_cast<uint32_t>(bits);
+    case FieldDescriptor::Type::TYPE_SINT32:
+        return WireFormatLite::ZigZagDecode32(static_cast<uint32_t>(bits));
+    case FieldDescriptor::Type::TYPE_SINT64:
+        return WireFormatLite::ZigZagDecode64(bits);
+    case FieldDescriptor::Type::TYPE_BOOL:
+        return bits != 0;
+    default:
+        return static_cast<int64_t>(bits);
+    }
+}
+
+double wire_decode_double(FieldDescriptor::Type type, uint64_t bits)
+{
+    if (type == FieldDescriptor::Type::TYPE_FLOAT) {
+        uint32_t raw = static_cast<uint32_t>(bits);
+        float value;
+
+        memcpy(&value, &raw, sizeof(value));
+        return value;
+    }
+
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+}  // namespace sqlite_protobuf
@@ -0,0 +1,110 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+#include "protopath.h"
+
+namespace sqlite_protobuf {
+
+// Returns true if `path` can be evaluated directly on the encoded
+// message with `wire_extract`, without parsing it into a `Message`.
+//
+// We only handle paths that end with a scalar or enum field and only
+// go through plain (non-oneof, non-map, non-group) fields, in message
+// types that have no required field.  Anything else must go through
+// reflection.
+bool wire_path_supported(const protopath& path);
+
+// Returns true if `path` ends with a repeated numeric (including bool
+// and enum) field, without an index, and can otherwise be evaluated
+// on the wire, like `wire_path_supported` paths.
+bool wire_repeated_path_supported(const protopath& path);
+
+// The outcome of looking up a protopath on the wire.
+enum class wire_status {
+    // The field was found; see `wire_value`.
+    FOUND,
+    // Step `wire_value::step` of the path is absent.
+    MISSING,
+    // A repeated field index is out of range.
+    OUT_OF_RANGE,
+    // We can't tell; parse the message and use reflection instead.
+    // This happens when the encoded message is malformed, or when the
+    // value is a proto3 string that isn't valid UTF-8 (parsing fails).
+    FALLBACK,
+};
+
+// A (raw) protobuf field value found on the wire.
+struct wire_value {
+    // The varint, fixed32 or fixed64 payload of numeric fields.
+    uint64_t bits;
+
+    // The payload of length-delimited (string or bytes) fields.
+    // Points into the encoded message.
+    const uint8_t *data;
+    size_t size;
+
+    // Index of the missing step, for `wire_status::MISSING`.
+    size_t step;
+};
+
+// Evaluates the protopath `path` (which must be `wire_path_supported`)
+// directly on the encoded message `data` of `size` bytes, with the
+// same semantics as parsing the message and walking the path with
+// reflection: the last occurrence of a singular field wins,
+// occurrences of singular submessages are merged, packed and unpacked
+// repeated fields are equivalent, and unknown values of closed enums
+// are ignored.  Like parsing, we reject proto3 strings that aren't
+// valid UTF-8: they fall back to reflection, which fails to parse.
+//
+// The message is only decoded along the path, so corruption in
+// unrelated fields may go unnoticed.
+wire_status wire_extract(const protopath& path, const void *data, size_t size,
+                         wire_value *out);
+
+// Evaluates the protopath `path` (which must be
+// `wire_repeated_path_supported`) on the encoded message `data` of
+// `size` bytes, and stores the raw value of each element of the
+// repeated field in `out`, in order.  Returns `wire_status::FOUND`
+// (even when there is no element), or the status for a missing
+// submessage or out of range index on the way to the field.
+wire_status wire_extract_repeated(const protopath& path, const void *data,
+                                  size_t size, std::vector<uint64_t> *out);
+
+// Sets bit `n % 8` of byte `n / 8` in `*bits`, which grows as needed,
+// for each field number `n` below `limit` that occurs in the encoded
+// message `data` of `size` bytes.  With a non-empty `chain` of field
+// numbers, looks at the submessages found by following `chain` from
+// the message instead, through every occurrence of each field on the
+// way (i.e., all elements of repeated fields, and all the occurrences
+// that make up a singular submessage).  Returns false if the message
+// is malformed along the way.
+bool wire_field_numbers(const void *data, size_t size,
+                        const std::vector<uint32_t>& chain, uint32_t limit,
+                        std::string *bits);
+
+// Returns true if the encoded message `data` of `size` bytes, of type
+// `descriptor`, is well formed and already what parsing and encoding
+// it again would produce, up to packing: every field is known, fields
+// come in increasing number order, singular fields and oneofs occur
+// at most once, there is no group, map or required field, and proto3
+// strings are valid UTF-8.  Encoders usually write such messages, and
+// they can be converted without parsing them first.
+bool wire_is_canonical(const google::protobuf::Descriptor *descriptor,
+                       const void *data, size_t size);
+
+// Decodes the raw value of an integral (including bool and enum)
+// field of `type`.
+int64_t wire_decode_int64(google::protobuf::FieldDescriptor::Type type,
+                          uint64_t bits);
+
+// Decodes the raw value of a float or double field of `type`.
+double wire_decode_double(google::protobuf::FieldDescriptor::Type type,
+                          uint64_t bits);
+
+}  // namespace sqlite_protobuf
@@ -0,0 +1,1051 @@
+/*
+ * SQL-level regression tests for sqlite_protobuf.
+ *
+ * Each test case opens a fresh in-memory database with the extension
+ * loaded, runs queries, and compares their results with the expected
+ * output.  Results are rendered like the sqlite3 shell's list mode,
+ * with `;` between rows: columns are separated by `|`, NULL is
+ * "NULL", blobs are hex literals, and a failed query is "error: "
+ * followed by sqlite's error message, e.g.,
+ *
+ *     expect(db, "SELECT key, value FROM protobuf_each(?, ...)",
+ *         "0|10;1|20", { message });
+ *
+ * binds each string in the last argument to the next `?` as a blob.
+ *
+ * Test cases for `proto_table` set up a proto table of `Item`s, and
+ * check its contents and schema the same way.
+ *
+ * Usage: sqlite_protobuf_test [NAME]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/text_format.h>
+#include <sqlite3.h>
+
+extern "C" {
+#include "proto_table.h"
+}
+#include "sqlite_protobuf.h"
+
+#include "test.pb.h"
+
+namespace {
+
+namespace test = sqlite_protobuf::test;
+
+const char *current_test;
+int failures;
+
+/*
+ * Returns the result of `sql`, rendered as described above, after
+ * binding `blobs` to its parameters.
+ */
+std::string query(sqlite3 *db, const std::string &sql,
+    const std::vector<std::string> &blobs = {})
+{
+    std::string ret;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+        return std::string("error: ") + sqlite3_errmsg(db);
+
+    for (size_t i = 0; i < blobs.size(); i++) {
+        sqlite3_bind_blob(stmt, i + 1, blobs[i].data(), blobs[i].size(),
+            SQLITE_STATIC);
+    }
+
+    for (size_t row = 0; (rc = sqlite3_step(stmt)) == SQLITE_ROW; row++) {
+        ret += (row == 0) ? "" : ";";
+        for (int i = 0; i < sqlite3_column_count(stmt); i++) {
+            ret += (i == 0) ? "" : "|";
+            switch (sqlite3_column_type(stmt, i)) {
+            case SQLITE_NULL:
+                ret += "NULL";
+                break;
+            case SQLITE_BLOB:
+            {
+                const unsigned char *data = static_cast<const unsigned char *>(
+                    sqlite3_column_blob(stmt, i));
+                char hex[3];
+
+                ret += "X'";
+                for (int j = 0; j < sqlite3_column_bytes(stmt, i); j++) {
+                    snprintf(hex, sizeof(hex), "%02X", data[j]);
+                    ret += hex;
+                }
+                ret += "'";
+                break;
+            }
+            default:
+                ret += reinterpret_cast<const char *>(
+                    sqlite3_column_text(stmt, i));
+                break;
+            }
+        }
+    }
+
+    if (rc != SQLITE_DONE)
+        ret = std::string("error: ") + sqlite3_errmsg(db);
+
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * Checks that `actual`, the result of `what`, is `expected`, and
+ * reports a failure otherwise.
+ */
+void expect_value(const std::string &what, const std::string &actual,
+    const std::string &expected)
+{
+    if (actual == expected)
+        return;
+
+    fprintf(stderr, "%s: %s\n  expected: %s\n  actual:   %s\n",
+        current_test, what.c_str(), expected.c_str(), actual.c_str());
+    failures++;
+}
+
+/*
+ * Checks that `sql` returns `expected`.
+ */
+void expect(sqlite3 *db, const std::string &sql, const std::string &expected,
+    const std::vector<std::string> &blobs = {})
+{
+    expect_value(sql, query(db, sql, blobs), expected);
+}
+
+/*
+ * Checks that the query plan of `sql` mentions `detail`, e.g., the
+ * idxNum and idxStr a virtual table picked.
+ */
+void expect_plan(sqlite3 *db, const std::string &sql, const std::string &detail)
+{
+    const std::string plan = query(db, "EXPLAIN QUERY PLAN " + sql);
+
+    if (plan.find(detail) != std::string::npos)
+        return;
+
+    fprintf(stderr, "%s: %s\n  expected plan with: %s\n  actual plan: %s\n",
+        current_test, sql.c_str(), detail.c_str(), plan.c_str());
+    failures++;
+}
+
+/*
+ * Checks that the C API call `what` returned `expected`.
+ */
+void expect_rc(sqlite3 *db, const char *what, int actual, int expected)
+{
+    if (actual == expected)
+        return;
+
+    fprintf(stderr, "%s: %s\n  expected: rc=%d\n  actual:   rc=%d (%s)\n",
+        current_test, what, expected, actual, sqlite3_errmsg(db));
+    failures++;
+}
+
+void exec(sqlite3 *db, const std::string &sql)
+{
+    char *error = NULL;
+
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error) == SQLITE_OK)
+        return;
+
+    fprintf(stderr, "%s: %s failed: %s\n", current_test, sql.c_str(), error);
+    sqlite3_free(error);
+    exit(1);
+}
+
+/*
+ * Creates the table `name`, with an integer primary key `id` and a
+ * `proto` blob column, and fills it with `messages`, with ids
+ * starting at 1.
+ */
+void create_table(sqlite3 *db, const std::string &name,
+    const std::vector<std::string> &messages)
+{
+    exec(db, "CREATE TABLE " + name +
+        "(id INTEGER PRIMARY KEY, proto BLOB NOT NULL);");
+    for (const std::string &message : messages) {
+        const std::string sql = "INSERT INTO " + name + "(proto) VALUES (?);";
+        const std::string result = query(db, sql, { message });
+
+        if (!result.empty()) {
+            fprintf(stderr, "%s: %s failed: %s\n", current_test,
+                sql.c_str(), result.c_str());
+            exit(1);
+        }
+    }
+}
+
+std::string encode(const test::Item &item)
+{
+    return item.SerializeAsString();
+}
+
+/*
+ * An item with five values, two tags, and two places, the last one
+ * with two address lines.
+ */
+std::string sample_item(void)
+{
+    test::Item item;
+
+    item.set_id(1);
+    item.set_name("sample");
+    for (int64_t value : { 10, 20, 30, 40, 50 })
+        item.add_values(value);
+    item.add_tags("x");
+    item.add_tags("y");
+    item.add_places()->set_city("paris");
+    test::Address *last = item.add_places();
+    last->set_city("rome");
+    last->add_lines("via appia");
+    last->add_lines("1");
+    return encode(item);
+}
+
+void test_each(sqlite3 *db)
+{
+    const std::string item = sample_item();
+    const std::string each =
+        "FROM protobuf_each(?, 'sqlite_protobuf.test.Item', '$.values')";
+
+    expect(db, "SELECT key, value, fullkey " + each + ";",
+        "0|10|$.values[0];1|20|$.values[1];2|30|$.values[2];"
+        "3|40|$.values[3];4|50|$.values[4]", { item });
+    expect(db, "SELECT key, value FROM protobuf_each(?,"
+        " 'sqlite_protobuf.test.Item', '$.places[-1].lines');",
+        "0|via appia;1|1", { item });
+    expect(db, "SELECT value FROM protobuf_each(?,"
+        " 'sqlite_protobuf.test.Item', '$.places[5].lines');", "", { item });
+    expect(db, "SELECT value FROM protobuf_each(?,"
+        " 'sqlite_protobuf.test.Item', '$.name');",
+        "error: Path does not end with a repeated field", { item });
+
+    // Constraints on the key narrow the range of elements, and sqlite
+    // double checks them.
+    expect(db, "SELECT value " + each + " WHERE key = 2;", "30", { item });
+    expect(db, "SELECT value " + each + " WHERE key = 2.5;", "", { item });
+    expect(db, "SELECT value " + each + " WHERE key = '2';", "30", { item });
+    expect(db, "SELECT value " + each + " WHERE key > 1 AND key <= 3;",
+        "30;40", { item });
+    expect(db, "SELECT value " + each + " WHERE key > 1.5 AND key < 3.5;",
+        "30;40", { item });
+    expect(db, "SELECT value " + each + " WHERE key >= -10 AND key < 2;",
+        "10;20", { item });
+    expect(db, "SELECT value " + each + " WHERE key < -1;", "", { item });
+    expect(db, "SELECT value " + each + " WHERE key >= 100;", "", { item });
+    expect(db, "SELECT value " + each + " WHERE key > 2 ORDER BY key DESC;",
+        "50;40", { item });
+
+    expect_plan(db, "SELECT value " + each + " WHERE key = 2;", "INDEX 16:");
+    expect_plan(db, "SELECT value " + each + " WHERE key > 1 AND key <= 3;",
+        "INDEX 9:");
+
+    // Correlated with a table of messages
+    test::Item other;
+    other.add_values(7);
+    create_table(db, "items", { item, encode(other), encode(test::Item()) });
+    expect(db, "SELECT items.id, each.key, each.value FROM items,"
+        " protobuf_each(items.proto, 'sqlite_protobuf.test.Item', '$.values')"
+        " AS each WHERE each.key >= 4 OR items.id > 1;",
+        "1|4|50;2|0|7");
+}
+
+/*
+ * Returns a serialized FileDescriptorSet with the files in `files`,
+ * in text format.
+ */
+std::string descriptor_set(const std::vector<std::string> &files)
+{
+    google::protobuf::FileDescriptorSet set;
+
+    for (const std::string &file : files) {
+        if (!google::protobuf::TextFormat::ParseFromString(file,
+            set.add_file())) {
+            fprintf(stderr, "%s: bad file descriptor: %s\n", current_test,
+                file.c_str());
+            exit(1);
+        }
+    }
+
+    return set.SerializeAsString();
+}
+
+void test_descriptor_set(sqlite3 *db)
+{
+    const std::string load = "SELECT protobuf_load_descriptor_set(?);";
+    const std::string point =
+        "name: 'dynamic_point.proto' package: 'sqlite_protobuf.dynamic'"
+        " syntax: 'proto3' message_type { name: 'Point'"
+        "   field { name: 'x' number: 1 type: TYPE_INT64"
+        "     label: LABEL_OPTIONAL json_name: 'x' } }";
+    const std::string conflicting_point =
+        "name: 'dynamic_point.proto' package: 'sqlite_protobuf.dynamic'"
+        " syntax: 'proto3' message_type { name: 'Point'"
+        "   field { name: 'x' number: 1 type: TYPE_STRING"
+        "     label: LABEL_OPTIONAL json_name: 'x' } }";
+    const std::string line =
+        "name: 'dynamic_line.proto' package: 'sqlite_protobuf.dynamic'"
+        " dependency: 'dynamic_point.proto' syntax: 'proto3'"
+        " message_type { name: 'Line'"
+        "   field { name: 'points' number: 1 type: TYPE_MESSAGE"
+        "     label: LABEL_REPEATED"
+        "     type_name: '.sqlite_protobuf.dynamic.Point' } }";
+    const std::string conflicting_line =
+        "name: 'dynamic_line.proto' package: 'sqlite_protobuf.dynamic'"
+        " syntax: 'proto3' message_type { name: 'Line' }";
+    const std::string lines_json =
+        "'{\"points\": [{\"x\": 1}, {\"x\": 2}]}'";
+    const std::string find_line = "SELECT protobuf_extract("
+        "protobuf_of_json(" + lines_json + ", 'sqlite_protobuf.dynamic.Line'),"
+        " 'sqlite_protobuf.dynamic.Line', '$.points[1].x');";
+
+    expect(db, load, "error: Could not parse FileDescriptorSet",
+        { std::string("\xff") });
+
+    // Loading the same files again does nothing.
+    expect(db, load, "1", { descriptor_set({ point }) });
+    expect(db, load, "0", { descriptor_set({ point }) });
+    expect(db, "SELECT protobuf_to_json(protobuf_of_json('{\"x\": 3}',"
+        " 'sqlite_protobuf.dynamic.Point'), 'sqlite_protobuf.dynamic.Point');",
+        "{\"x\":\"3\"}");
+
+    // A load that fails adds none of its files, even the valid ones.
+    expect(db, load, "error: Conflicting definition for dynamic_point.proto",
+        { descriptor_set({ line, conflicting_point }) });
+    expect(db, load, "error: Conflicting definition for dynamic_line.proto",
+        { descriptor_set({ line, conflicting_line }) });
+    expect(db, find_line, "error: Could not find message descriptor");
+    expect(db, "SELECT protobuf_to_json(protobuf_of_json('{\"x\": 4}',"
+        " 'sqlite_protobuf.dynamic.Point'), 'sqlite_protobuf.dynamic.Point');",
+        "{\"x\":\"4\"}");
+
+    // Files may come before their dependencies, and twice in a set.
+    expect(db, load, "1", { descriptor_set({ line, point, line }) });
+    expect(db, find_line, "2");
+    expect(db, load, "0", { descriptor_set({ point, line }) });
+
+    // Generated files are skipped, and may be imported.
+    google::protobuf::FileDescriptorProto generated;
+    test::Item::descriptor()->file()->CopyTo(&generated);
+    google::protobuf::FileDescriptorSet generated_set;
+    *generated_set.add_file() = generated;
+    expect(db, load, "0", { generated_set.SerializeAsString() });
+
+    const std::string order =
+        "name: 'dynamic_order.proto' package: 'sqlite_protobuf.dynamic'"
+        " dependency: '" + generated.name() + "' syntax: 'proto3'"
+        " message_type { name: 'Order'"
+        "   field { name: 'item' number: 1 type: TYPE_MESSAGE"
+        "     label: LABEL_OPTIONAL json_name: 'item'"
+        "     type_name: '.sqlite_protobuf.test.Item' } }";
+    expect(db, load, "1", { descriptor_set({ order }) });
+    expect(db, "SELECT protobuf_extract(protobuf_of_json("
+        "'{\"item\": {\"name\": \"a\"}}', 'sqlite_protobuf.dynamic.Order'),"
+        " 'sqlite_protobuf.dynamic.Order', '$.item.name');", "a");
+
+    expect(db, load, "error: Missing dependencies for dynamic_missing.proto",
+        { descriptor_set({ "name: 'dynamic_missing.proto'"
+            " dependency: 'nowhere.proto'" }) });
+}
+
+const struct proto_column item_columns[] = {
+    { .name = "item_id", .type = "INTEGER", .path = "$.id" },
+    { .name = "name", .type = "TEXT", .path = "$.name" },
+    {},
+};
+
+/*
+ * Sets up the proto table for `spec`, which defaults to the `items`
+ * table of `Item`s with `item_columns`.
+ */
+void setup_table(sqlite3 *db, const struct proto_table &spec)
+{
+    char *command_cache = NULL;
+    int rc;
+
+    rc = proto_table_setup(&command_cache, db, &spec);
+    free(command_cache);
+    if (rc == SQLITE_OK)
+        return;
+
+    fprintf(stderr, "%s: proto_table_setup(%s) failed: %s (%d)\n",
+        current_test, spec.name, sqlite3_errmsg(db), rc);
+    exit(1);
+}
+
+struct proto_table items_spec(void)
+{
+    struct proto_table ret = {};
+
+    ret.name = "items";
+    ret.message_name = "sqlite_protobuf.test.Item";
+    ret.columns = item_columns;
+    return ret;
+}
+
+std::string named_item(int64_t id, const char *name)
+{
+    test::Item item;
+
+    item.set_id(id);
+    item.set_name(name);
+    return encode(item);
+}
+
+void test_bulk_insert(sqlite3 *db)
+{
+    const std::string count_rows = "SELECT COUNT(*) FROM items_raw;";
+    const std::string count_indexes = "SELECT COUNT(*) FROM sqlite_master"
+        " WHERE type = 'index' AND name GLOB 'proto_*index__items__*';";
+    struct proto_db proto_db = {};
+    const std::string first = named_item(1, "a");
+    const std::string second = named_item(2, "b");
+    const struct proto_bind_blob good[] = {
+        { first.data(), first.size() },
+        { second.data(), second.size() },
+    };
+    const struct proto_bind_blob bad[] = {
+        { first.data(), first.size() },
+        { "", 0 },
+    };
+
+    proto_db.db = db;
+    setup_table(db, items_spec());
+    const std::string indexes = query(db, count_indexes);
+
+    expect_rc(db, "proto_db_bulk_insert",
+        proto_db_bulk_insert(&proto_db, "items", good, 2, true), SQLITE_OK);
+    expect(db, "SELECT item_id, name FROM items ORDER BY id;", "1|a;2|b");
+    expect(db, count_indexes, indexes);
+
+    // A failed load rolls back, and leaves the indexes in place.
+    exec(db, "CREATE TEMP TRIGGER reject_empty BEFORE INSERT ON main.items_raw"
+        " WHEN LENGTH(NEW.proto) = 0 BEGIN SELECT RAISE(ABORT, 'empty'); END;");
+    expect_rc(db, "proto_db_bulk_insert",
+        proto_db_bulk_insert(&proto_db, "items", bad, 2, true),
+        SQLITE_CONSTRAINT);
+    expect(db, count_rows, "2");
+    expect(db, count_indexes, indexes);
+
+    // ... without rolling back the caller's own writes.
+    expect_rc(db, "proto_db_transaction_begin",
+        proto_db_transaction_begin(&proto_db), SQLITE_OK);
+    exec(db, "INSERT INTO items(proto) VALUES (X'0803');");
+    expect_rc(db, "proto_db_bulk_insert",
+        proto_db_bulk_insert(&proto_db, "items", bad, 2, true),
+        SQLITE_CONSTRAINT);
+    proto_db_transaction_end(&proto_db);
+    expect(db, "SELECT item_id FROM items ORDER BY id;", "1;2;3");
+    expect(db, count_indexes, indexes);
+
+    // Errors that roll back the whole transaction fail the load, but
+    // must not abort the process.
+    exec(db, "DROP TRIGGER reject_empty;");
+    exec(db, "CREATE TEMP TRIGGER reject_empty BEFORE INSERT ON main.items_raw"
+        " WHEN LENGTH(NEW.proto) = 0 BEGIN SELECT RAISE(ROLLBACK, 'empty');"
+        " END;");
+    for (bool rebuild_indexes : { true, false }) {
+        expect_rc(db, "proto_db_bulk_insert",
+            proto_db_bulk_insert(&proto_db, "items", bad, 2, rebuild_indexes),
+            SQLITE_CONSTRAINT);
+        expect_rc(db, "sqlite3_get_autocommit", sqlite3_get_autocommit(db), 1);
+        expect(db, count_rows, "3");
+        expect(db, count_indexes, indexes);
+    }
+
+    expect_rc(db, "proto_db_bulk_insert",
+        proto_db_bulk_insert(&proto_db, "items", good, 2, false), SQLITE_OK);
+    expect(db, count_rows, "5");
+    proto_db_finalize_statements(&proto_db);
+}
+
+/*
+ * Returns the values of the raw columns for the stored view column
+ * `column` of the `items` table, by row id, with `;` between raw
+ * columns.
+ */
+std::string stored_values(sqlite3 *db, const std::string &column)
+{
+    const std::string names = query(db, "SELECT name FROM"
+        " pragma_table_info('items_raw') WHERE name GLOB 'proto_stored__" +
+        column + "__*' ORDER BY cid;");
+    std::string ret;
+    size_t begin = 0;
+
+    while (begin < names.size()) {
+        size_t end = names.find(';', begin);
+        if (end == std::string::npos)
+            end = names.size();
+
+        ret += (begin == 0) ? "" : ";";
+        ret += query(db, "SELECT group_concat(quote(\"" +
+            names.substr(begin, end - begin) + "\"), ',') FROM"
+            " (SELECT * FROM items_raw ORDER BY id);");
+        begin = end + 1;
+    }
+
+    return ret;
+}
+
+/*
+ * Returns the definition of every schema object, to check that a
+ * setup did nothing.
+ */
+std::string schema(sqlite3 *db)
+{
+    return query(db, "SELECT type, name, sql FROM sqlite_master"
+        " WHERE name NOT GLOB 'sqlite_*' ORDER BY type, name;");
+}
+
+void test_stored_columns(sqlite3 *db)
+{
+    struct proto_column columns[] = {
+        { .name = "item_id", .type = "INTEGER", .path = "$.id" },
+        { .name = "name", .type = "TEXT", .path = "$.name", .stored = true },
+        {},
+    };
+    struct proto_table spec = items_spec();
+    const std::string insert = "INSERT INTO items(proto) VALUES (?);";
+    const std::string count_triggers = "SELECT COUNT(*) FROM sqlite_master"
+        " WHERE type = 'trigger' AND name GLOB 'items_raw_stored_*';";
+
+    spec.columns = columns;
+    setup_table(db, spec);
+    expect(db, insert, "", { named_item(1, "a") });
+    expect(db, insert, "", { named_item(2, "b") });
+    expect(db, "SELECT item_id, name FROM items ORDER BY id;", "1|a;2|b");
+    expect(db, "SELECT name FROM items WHERE name = 'b';", "b");
+    expect_value("stored name", stored_values(db, "name"),
+        "'a','b'");
+
+    // Running the same setup again changes nothing, and the triggers
+    // still maintain the stored column.
+    const std::string before = schema(db);
+    setup_table(db, spec);
+    expect_value("schema", schema(db), before);
+    expect(db, insert, "", { named_item(3, "c") });
+    expect(db, "UPDATE items SET proto = ? WHERE id = 1;", "",
+        { named_item(1, "z") });
+    expect_value("stored name", stored_values(db, "name"),
+        "'z','b','c'");
+
+    // ... unless someone dropped part of the schema.
+    exec(db, "DROP TRIGGER items_raw_stored_update;");
+    setup_table(db, spec);
+    expect_value("schema", schema(db), before);
+
+    // New stored columns are backfilled, and maintained along with the
+    // others.
+    columns[0].stored = true;
+    setup_table(db, spec);
+    expect_value("stored item_id", stored_values(db, "item_id"),
+        "1,2,3");
+    expect(db, insert, "", { named_item(4, "d") });
+    expect(db, "UPDATE items SET proto = ? WHERE id = 2;", "",
+        { named_item(5, "e") });
+    expect_value("stored item_id", stored_values(db, "item_id"),
+        "1,5,3,4");
+    expect_value("stored name", stored_values(db, "name"),
+        "'z','e','c','d'");
+    expect(db, "SELECT item_id, name FROM items ORDER BY id;",
+        "1|z;5|e;3|c;4|d");
+
+    // Changing a stored column's path adds a new raw column, and
+    // leaves the old one behind.
+    columns[1].path = "$.tags[0]";
+    setup_table(db, spec);
+    test::Item tagged;
+    tagged.add_tags("t");
+    expect(db, insert, "", { encode(tagged) });
+    expect_value("stored name", stored_values(db, "name"),
+        "'z','e','c','d',NULL;NULL,NULL,NULL,NULL,'t'");
+    expect(db, "SELECT name FROM items ORDER BY id;", "NULL;NULL;NULL;NULL;t");
+
+    // Without stored columns, the view extracts values again, and the
+    // triggers are gone.
+    columns[0].stored = false;
+    columns[1].stored = false;
+    setup_table(db, spec);
+    expect(db, count_triggers, "0");
+    expect(db, "UPDATE items SET proto = ? WHERE id = 1;", "",
+        { named_item(6, "f") });
+    expect(db, "SELECT item_id, name FROM items ORDER BY id;",
+        "6|NULL;5|NULL;3|NULL;4|NULL;NULL|t");
+
+    columns[1].stored = true;
+    setup_table(db, spec);
+    expect(db, count_triggers, "2");
+    expect_value("stored name", stored_values(db, "name"),
+        "'z','e','c','d',NULL;NULL,NULL,NULL,NULL,'t'");
+}
+
+/*
+ * Returns the contents of the `items` table's shadow tables, by row
+ * id, with `;` between tables.
+ */
+std::string shadow_contents(sqlite3 *db)
+{
+    const std::string names = query(db, "SELECT name FROM sqlite_master"
+        " WHERE type = 'table' AND name GLOB 'proto_shadow__items__*'"
+        " ORDER BY name;");
+    std::string ret;
+    size_t begin = 0;
+
+    while (begin < names.size()) {
+        size_t end = names.find(';', begin);
+        if (end == std::string::npos)
+            end = names.size();
+
+        ret += (begin == 0) ? "[" : ";[";
+        ret += query(db, "SELECT * FROM \"" +
+            names.substr(begin, end - begin) + "\" ORDER BY id;");
+        ret += "]";
+        begin = end + 1;
+    }
+
+    return ret;
+}
+
+void test_shadow_table(sqlite3 *db)
+{
+    struct proto_column columns[] = {
+        { .name = "item_id", .type = "INTEGER", .path = "$.id" },
+        { .name = "name", .type = "TEXT", .path = "$.name" },
+        {},
+        {},
+    };
+    struct proto_table spec = items_spec();
+    const std::string insert = "INSERT INTO items(proto) VALUES (?);";
+
+    spec.columns = columns;
+    spec.use_shadow_table = true;
+    setup_table(db, spec);
+    expect(db, insert, "", { named_item(1, "a") });
+    expect(db, insert, "", { named_item(2, "b") });
+    expect_value("shadow", shadow_contents(db), "[1|1|a;2|2|b]");
+    expect(db, "SELECT item_id, name FROM items WHERE name = 'b';", "2|b");
+
+    // Running the same setup again changes nothing, and the triggers
+    // still maintain the shadow table.
+    const std::string before = schema(db);
+    setup_table(db, spec);
+    expect_value("schema", schema(db), before);
+    expect(db, "UPDATE items SET proto = ? WHERE id = 1;", "",
+        { named_item(3, "c") });
+    expect(db, "DELETE FROM items WHERE id = 2;", "");
+    expect(db, insert, "", { named_item(4, "d") });
+    expect_value("shadow", shadow_contents(db), "[1|3|c;2|4|d]");
+
+    // Writes that bypass the view are maintained as well.
+    struct proto_db proto_db = {};
+    const std::string bulk = named_item(5, "e");
+    const struct proto_bind_blob rows[] = { { bulk.data(), bulk.size() } };
+
+    proto_db.db = db;
+    expect_rc(db, "proto_db_bulk_insert",
+        proto_db_bulk_insert(&proto_db, "items", rows, 1, true), SQLITE_OK);
+    proto_db_finalize_statements(&proto_db);
+    expect_value("shadow", shadow_contents(db), "[1|3|c;2|4|d;3|5|e]");
+
+    // New column definitions rebuild the shadow table from scratch,
+    // and drop the old one.
+    columns[2] = { .name = "tag", .type = "TEXT", .path = "$.tags[0]" };
+    setup_table(db, spec);
+    expect_value("shadow", shadow_contents(db),
+        "[1|3|c|NULL;2|4|d|NULL;3|5|e|NULL]");
+    expect(db, "SELECT item_id, name, tag FROM items ORDER BY id;",
+        "3|c|NULL;4|d|NULL;5|e|NULL");
+
+    // Without a shadow table, the view extracts values again.
+    spec.use_shadow_table = false;
+    setup_table(db, spec);
+    expect_value("shadow", shadow_contents(db), "");
+    expect(db, insert, "", { named_item(6, "f") });
+    expect(db, "SELECT item_id, name FROM items ORDER BY id;",
+        "3|c;4|d;5|e;6|f");
+
+    spec.use_shadow_table = true;
+    setup_table(db, spec);
+    expect_value("shadow", shadow_contents(db),
+        "[1|3|c|NULL;2|4|d|NULL;3|5|e|NULL;4|6|f|NULL]");
+}
+
+void test_aggregates(sqlite3 *db)
+{
+    std::vector<std::string> messages;
+    const char *const names[] = {
+        "12", " 7 ", "1.5x", "abc", "", "-3e2", "0x10", "9223372036854775808",
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        test::Item item;
+
+        item.set_id(i + 1);
+        item.set_name(names[i]);
+        item.set_score(i * 0.5);
+        item.set_color(static_cast<test::Color>(i % 3));
+        if (i % 2 == 0)
+            item.set_rank(i);
+        for (size_t j = 0; j < i; j++)
+            item.add_values(j * 10);
+        messages.push_back(encode(item));
+    }
+
+    test::Item big;
+    big.set_id(INT64_MAX);
+    messages.push_back(encode(big));
+    messages.push_back(encode(big));
+    create_table(db, "items", messages);
+
+    // protobuf_sum must agree with SUM, including its coercion of text,
+    // missing values, empty sets and overflows.
+    const char *const paths[] = {
+        "$.id", "$.score", "$.name", "$.color", "$.color.name", "$.rank",
+        "$.values[1]", "$.address.zip",
+    };
+    for (const char *path : paths) {
+        for (const char *where : { "id <= 8", "id > 8", "id > 100",
+                 "id IN (1, 9)" }) {
+            const std::string args =
+                "proto, 'sqlite_protobuf.test.Item', '" + std::string(path) +
+                "'";
+            const std::string sum = "SELECT typeof(x), x FROM (SELECT"
+                " protobuf_sum(" + args + ") AS x FROM items WHERE " + where +
+                ");";
+            const std::string reference = "SELECT typeof(x), x FROM (SELECT"
+                " SUM(protobuf_extract(" + args + ")) AS x FROM items"
+                " WHERE " + where + ");";
+
+            expect_value(sum, query(db, sum), query(db, reference));
+        }
+    }
+
+    expect(db, "SELECT protobuf_sum(proto, 'sqlite_protobuf.test.Item',"
+        " '$.name') FROM items WHERE id <= 7;", "-279.5");
+    expect(db, "SELECT protobuf_sum(proto, 'sqlite_protobuf.test.Item',"
+        " '$.id') FROM items;", "error: integer overflow");
+    expect(db, "SELECT protobuf_sum(proto, 'sqlite_protobuf.test.Item',"
+        " '$.values') FROM items;",
+        "error: Expected index into repeated field");
+
+    expect(db, "SELECT protobuf_count_present(proto,"
+        " 'sqlite_protobuf.test.Item', '$.rank'),"
+        " protobuf_count_present(proto, 'sqlite_protobuf.test.Item',"
+        " '$.values[2]') FROM items;", "4|5");
+    expect(db, "SELECT protobuf_group_concat(proto,"
+        " 'sqlite_protobuf.test.Item', '$.color.name', '/') FROM items"
+        " WHERE id <= 4;", "NONE/RED/GREEN/NONE");
+
+    // Per-row summaries of repeated fields
+    expect(db, "SELECT id, protobuf_array_count(proto,"
+        " 'sqlite_protobuf.test.Item', '$.values'),"
+        " protobuf_array_sum(proto, 'sqlite_protobuf.test.Item', '$.values'),"
+        " protobuf_array_max(proto, 'sqlite_protobuf.test.Item', '$.values')"
+        " FROM items WHERE id IN (1, 2, 5);",
+        "1|0|NULL|NULL;2|1|0|0;5|4|60|30");
+}
+
+/*
+ * Returns `messages` as a stream of length-delimited messages.
+ */
+std::string delimited(const std::vector<std::string> &messages)
+{
+    std::string ret;
+
+    for (const std::string &message : messages) {
+        for (uint64_t size = message.size(); ; size >>= 7) {
+            if (size < 0x80) {
+                ret.push_back(static_cast<char>(size));
+                break;
+            }
+
+            ret.push_back(static_cast<char>((size & 0x7f) | 0x80));
+        }
+
+        ret += message;
+    }
+
+    return ret;
+}
+
+void test_rows(sqlite3 *db)
+{
+    test::Item large;
+    large.set_name(std::string(200, 'x'));
+    const std::string stream = delimited({ named_item(1, "a"), "",
+        encode(large), named_item(2, "b") });
+    const std::string rows =
+        "FROM protobuf_rows(?, 'sqlite_protobuf.test.Item')";
+
+    expect(db, "SELECT key, offset, length, protobuf_extract(message,"
+        " 'sqlite_protobuf.test.Item', '$.id') " + rows + ";",
+        "0|1|5|1;1|7|0|0;2|9|203|0;3|213|5|2", { stream });
+    expect(db, "SELECT message " + rows + " WHERE key = 0;", "X'0801120161'",
+        { stream });
+    expect(db, "SELECT COUNT(*) " + rows + ";", "0", { "" });
+    expect(db, "SELECT key " + rows + ";",
+        "error: Malformed delimited message stream",
+        { stream.substr(0, stream.size() - 1) });
+    expect(db, "SELECT key FROM protobuf_rows(?, 'sqlite_protobuf.test.Nope');",
+        "error: Could not find message descriptor", { stream });
+
+    // One stream per row of a table, and loading the messages in another.
+    exec(db, "CREATE TABLE streams(id INTEGER PRIMARY KEY, data BLOB);");
+    expect(db, "INSERT INTO streams(data) VALUES (?), (?), (?);", "",
+        { stream, delimited({ named_item(3, "c") }), "" });
+    expect(db, "SELECT streams.id, rows.key FROM streams,"
+        " protobuf_rows(streams.data, 'sqlite_protobuf.test.Item') AS rows"
+        " ORDER BY streams.id, rows.key;", "1|0;1|1;1|2;1|3;2|0");
+    create_table(db, "items", {});
+    exec(db, "INSERT INTO items(proto) SELECT rows.message FROM streams,"
+        " protobuf_rows(streams.data, 'sqlite_protobuf.test.Item') AS rows;");
+    expect(db, "SELECT group_concat(protobuf_extract(proto,"
+        " 'sqlite_protobuf.test.Item', '$.name'), ',') FROM items;",
+        "a,," + std::string(200, 'x') + ",b,c");
+}
+
+void test_scan(sqlite3 *db)
+{
+    std::vector<std::string> messages;
+    const std::string counters = "SELECT group_concat(value, ',') FROM"
+        " (SELECT value FROM protobuf_stats WHERE name IN"
+        " ('scan_rows', 'scan_rows_skipped') ORDER BY name);";
+
+    for (int i = 1; i <= 10; i++) {
+        test::Item item;
+
+        item.set_id(i);
+        item.set_score(i * 1.5);
+        item.set_name("n" + std::to_string(i));
+        if (i % 2 == 0)
+            item.set_rank(i);
+        messages.push_back(encode(item));
+    }
+
+    create_table(db, "items", messages);
+    exec(db, "CREATE VIRTUAL TABLE items_scan USING protobuf_scan(items,"
+        " 'sqlite_protobuf.test.Item', item_id '$.id', score '$.score',"
+        " name '$.name', rank '$.rank');");
+    exec(db, "CREATE VIEW items_reference AS SELECT id,"
+        " protobuf_extract(proto, 'sqlite_protobuf.test.Item', '$.id')"
+        "     AS item_id,"
+        " protobuf_extract(proto, 'sqlite_protobuf.test.Item', '$.score')"
+        "     AS score,"
+        " protobuf_extract(proto, 'sqlite_protobuf.test.Item', '$.name')"
+        "     AS name,"
+        " protobuf_extract(proto, 'sqlite_protobuf.test.Item', '$.rank')"
+        "     AS rank"
+        " FROM items;");
+
+    // The scan returns the same rows as filtering extracted values,
+    // whether or not it evaluates the constraints itself.
+    const char *const filters[] = {
+        "1", "item_id = 3", "item_id > 7", "item_id > 2.5", "item_id <= 2",
+        "score >= 4.5 AND score < 9", "score = 3", "score > 3",
+        "score < 9223372036854775807", "rank < 5", "rank IS NULL",
+        "rank = 0", "name = 'n3'", "name > 'n5'", "item_id = '3'",
+        "item_id = NULL", "item_id > x'00'", "id BETWEEN 2 AND 4",
+        "id = 5 AND score > 1", "id > 8 OR item_id < 2",
+        "item_id >= 5 ORDER BY id DESC",
+    };
+    for (const char *filter : filters) {
+        const std::string scan = std::string("SELECT id, item_id, score, name,"
+            " rank FROM items_scan WHERE ") + filter + ";";
+        const std::string reference = std::string("SELECT id, item_id,"
+            " score, name, rank FROM items_reference WHERE ") + filter + ";";
+
+        expect_value(scan, query(db, scan), query(db, reference));
+    }
+
+    // Comparisons with numbers skip rows without returning them;
+    // comparisons on `id` only read the matching rows.
+    expect(db, "SELECT protobuf_stats_reset();", "NULL");
+    expect(db, "SELECT id FROM items_scan WHERE item_id > 7;", "8;9;10");
+    expect_value(counters, query(db, counters), "10,7");
+    expect(db, "SELECT protobuf_stats_reset();", "NULL");
+    expect(db, "SELECT id FROM items_scan WHERE id BETWEEN 2 AND 4"
+        " AND score > 4;", "3;4");
+    expect_value(counters, query(db, counters), "3,1");
+    expect_plan(db, "SELECT id FROM items_scan WHERE item_id > 7;", "2:4;");
+    expect_plan(db, "SELECT id FROM items_scan WHERE id = 3 AND score <= 1;",
+        "INDEX 0:");
+
+    expect(db, "CREATE VIRTUAL TABLE bad_scan USING protobuf_scan(items,"
+        " 'sqlite_protobuf.test.Item', nope '$.nope');",
+        "error: Invalid field name: $.nope");
+    expect(db, "CREATE VIRTUAL TABLE bad_scan USING protobuf_scan(items,"
+        " 'sqlite_protobuf.test.Item', name '$.name', name '$.id');",
+        "error: Duplicate column name: name");
+}
+
+void test_has(sqlite3 *db)
+{
+    const std::string item = sample_item();
+    // id = 0, name = "", rank = 0 and address.zip = 0, all encoded.
+    const std::string zeros("\x08\x00\x12\x00\x38\x00\x2a\x02\x10\x00", 10);
+    // id = 5, then overwritten with 0.
+    const std::string overwritten("\x08\x05\x08\x00", 4);
+    const std::string hits = "SELECT value FROM protobuf_stats"
+        " WHERE name = 'has_summary_hits';";
+    const struct {
+        const char *path;
+        const char *item;
+        const char *zeros;
+    } cases[] = {
+        { "$.id", "1", "0" },
+        { "$.name", "1", "0" },
+        { "$.rank", "0", "1" },
+        { "$.color", "0", "0" },
+        { "$.address", "0", "1" },
+        { "$.address.zip", "0", "0" },
+        { "$.address.city", "0", "0" },
+        { "$.values", "1", "0" },
+        { "$.values[4]", "1", "0" },
+        { "$.values[-1]", "1", "0" },
+        { "$.values[5]", "0", "0" },
+        { "$.tags[1]", "1", "0" },
+        { "$.places[1].lines[1]", "1", "0" },
+        { "$.places[0].lines", "0", "0" },
+        { "$.places[2].city", "0", "0" },
+    };
+
+    // Summaries only rule out fields that are really absent, so the
+    // answers are the same with and without them.  proto3 fields
+    // without presence are absent when they hold their default value,
+    // even if it's on the wire.
+    for (const auto &c : cases) {
+        const std::string path = std::string("'") + c.path + "'";
+        const std::string has = "SELECT protobuf_has(?1,"
+            " 'sqlite_protobuf.test.Item', " + path;
+        const std::string summary = ", protobuf_presence(?1,"
+            " 'sqlite_protobuf.test.Item', '$.address', '$.places'));";
+
+        expect(db, has + ");", c.item, { item });
+        expect(db, has + summary, c.item, { item });
+        expect(db, has + ", NULL);", c.item, { item });
+        expect(db, has + ");", c.zeros, { zeros });
+        expect(db, has + summary, c.zeros, { zeros });
+    }
+
+    expect(db, "SELECT protobuf_has(?, 'sqlite_protobuf.test.Item',"
+        " '$.id');", "0", { overwritten });
+    expect(db, "SELECT protobuf_has(?, 'sqlite_protobuf.test.Item',"
+        " 'id');", "error: Invalid path", { item });
+    expect(db, "SELECT protobuf_has(?, 'sqlite_protobuf.test.Item',"
+        " '$.places.city');", "error: Expected index into repeated field",
+        { item });
+
+    // The summary answers for absent fields without parsing the
+    // message.  Bits for repeated submessages cover all elements, and
+    // malformed summaries rule nothing out.
+    expect(db, "SELECT protobuf_stats_reset();", "NULL");
+    expect(db, "SELECT protobuf_has(?1, 'sqlite_protobuf.test.Item',"
+        " '$.address.city', protobuf_presence(?1,"
+        " 'sqlite_protobuf.test.Item'));", "0", { item });
+    expect(db, "SELECT protobuf_has(?1, 'sqlite_protobuf.test.Item',"
+        " '$.places[0].zip', protobuf_presence(?1,"
+        " 'sqlite_protobuf.test.Item', '$.places'));", "0", { item });
+    expect(db, "SELECT protobuf_has(?1, 'sqlite_protobuf.test.Item',"
+        " '$.places[0].lines', protobuf_presence(?1,"
+        " 'sqlite_protobuf.test.Item', '$.places'));", "0", { item });
+    expect(db, "SELECT protobuf_has(?1, 'sqlite_protobuf.test.Item',"
+        " '$.name', protobuf_presence(?1,"
+        " 'sqlite_protobuf.test.Item'));", "1", { item });
+    expect(db, "SELECT protobuf_has(?1, 'sqlite_protobuf.test.Item',"
+        " '$.name', x'ff');", "1", { item });
+    expect_value(hits, query(db, hits), "2");
+
+    // With a proto table, the summary follows the rows and changes
+    // in `presence_paths`.
+    const char *const addresses[] = { "$.address", NULL };
+    const char *const places[] = { "$.address", "$.places", NULL };
+    const std::string insert = "INSERT INTO items(proto) VALUES (?);";
+    const std::string has_city = "SELECT id FROM items WHERE"
+        " protobuf_has(proto, 'sqlite_protobuf.test.Item',"
+        " '$.address.city', proto_presence);";
+    const std::string has_lines = "SELECT id FROM items WHERE"
+        " protobuf_has(proto, 'sqlite_protobuf.test.Item',"
+        " '$.places[-1].lines', proto_presence);";
+    struct proto_table spec = items_spec();
+    test::Item city;
+
+    city.mutable_address()->set_city("oslo");
+    spec.use_presence_summary = true;
+    spec.presence_paths = addresses;
+    setup_table(db, spec);
+    expect(db, insert, "", { item });
+    expect(db, insert, "", { encode(city) });
+    expect(db, insert, "", { zeros });
+
+    expect(db, "SELECT protobuf_stats_reset();", "NULL");
+    expect(db, has_city, "2");
+    expect_value(hits, query(db, hits), "2");
+    expect(db, has_lines, "1");
+
+    spec.presence_paths = places;
+    setup_table(db, spec);
+    expect(db, "UPDATE items SET proto = ? WHERE id = 3;", "",
+        { encode(city) });
+    expect(db, "SELECT protobuf_stats_reset();", "NULL");
+    expect(db, has_city, "2;3");
+    expect(db, has_lines, "1");
+    expect_value(hits, query(db, hits), "3");
+}
+
+const struct test_case {
+    const char *name;
+    void (*run)(sqlite3 *);
+} test_cases[] = {
+    { "each", test_each },
+    { "descriptor_set", test_descriptor_set },
+    { "bulk_insert", test_bulk_insert },
+    { "stored_columns", test_stored_columns },
+    { "shadow_table", test_shadow_table },
+    { "aggregates", test_aggregates },
+    { "rows", test_rows },
+    { "scan", test_scan },
+    { "has", test_has },
+};
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+    const char *only = (argc > 1) ? argv[1] : NULL;
+
+    sqlite3_auto_extension(reinterpret_cast<void (*)(void)>(
+        sqlite_protobuf::sqlite3_sqliteprotobuf_init));
+
+    for (const struct test_case &test_case : test_cases) {
+        sqlite3 *db;
+        int before = failures;
+
+        if (only != NULL && strcmp(only, test_case.name) != 0)
+            continue;
+
+        current_test = test_case.name;
+        if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+            fprintf(stderr, "sqlite3_open failed\n");
+            return 1;
+        }
+
+        test_case.run(db);
+        sqlite3_close(db);
+        printf("%s %s\n", (failures == before) ? "ok" : "FAIL",
+            test_case.name);
+    }
+
+    return (failures == 0) ? 0 : 1;
+}